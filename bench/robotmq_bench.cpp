@@ -0,0 +1,379 @@
+/**
+ * Copyright (c) 2024 Yihuai Gao
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+// Microbenchmarks of the core data path. Prints one JSON document with the results to stdout (or --out), so that
+// runs can be compared by scripts.
+//
+// Usage: robotmq_bench [--filter SUBSTRING] [--min-time-s 0.2] [--repetitions 5] [--out results.json]
+
+#include "common.h"
+#include "data_topic.h"
+#include "rmq_message.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <sys/mman.h>
+#include <vector>
+
+namespace
+{
+
+template <typename T> inline void do_not_optimize(const T &value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct BenchmarkOptions
+{
+    std::string filter;
+    double min_time_s = 0.2;
+    int repetitions = 5;
+    std::string out = "-";
+};
+
+struct BenchmarkResult
+{
+    std::string name;
+    std::vector<std::pair<std::string, std::string>> params;
+    uint64_t iterations;
+    double ns_per_op;     // Median over the repetitions
+    double min_ns_per_op; // Fastest repetition
+    double bytes_per_second;
+};
+
+class BenchmarkRunner
+{
+  public:
+    explicit BenchmarkRunner(const BenchmarkOptions &options) : options_(options)
+    {
+    }
+
+    // body(iterations) runs the operation `iterations` times. bytes_per_op is used for the throughput.
+    void run(const std::string &name, const std::vector<std::pair<std::string, std::string>> &params,
+             uint64_t bytes_per_op, const std::function<void(uint64_t)> &body)
+    {
+        std::string full_name = name;
+        for (const auto &param : params)
+        {
+            full_name += "/" + param.first + ":" + param.second;
+        }
+        if (!options_.filter.empty() && full_name.find(options_.filter) == std::string::npos)
+        {
+            return;
+        }
+
+        // Grow the iteration count until one repetition takes at least min_time_s
+        uint64_t iterations = 1;
+        while (true)
+        {
+            double elapsed_s = time_s_(body, iterations);
+            if (elapsed_s >= options_.min_time_s || iterations >= (1ull << 40))
+            {
+                break;
+            }
+            double scale = elapsed_s > 0 ? 1.4 * options_.min_time_s / elapsed_s : 100.0;
+            iterations = std::max<uint64_t>(iterations + 1, static_cast<uint64_t>(iterations * std::min(scale, 100.0)));
+        }
+
+        std::vector<double> ns_per_op;
+        for (int i = 0; i < options_.repetitions; i++)
+        {
+            ns_per_op.push_back(time_s_(body, iterations) * 1e9 / iterations);
+        }
+        std::sort(ns_per_op.begin(), ns_per_op.end());
+        double median = ns_per_op[ns_per_op.size() / 2];
+        results_.push_back({name, params, iterations, median, ns_per_op.front(),
+                            bytes_per_op > 0 ? bytes_per_op * 1e9 / median : 0.0});
+        std::cerr << full_name << ": " << median << " ns/op" << std::endl;
+    }
+
+    std::string to_json() const
+    {
+        std::ostringstream json;
+        json << "{\n  \"min_time_s\": " << options_.min_time_s << ",\n  \"repetitions\": " << options_.repetitions
+             << ",\n  \"benchmarks\": [";
+        for (size_t i = 0; i < results_.size(); i++)
+        {
+            const BenchmarkResult &result = results_[i];
+            json << (i == 0 ? "\n" : ",\n") << "    {\"name\": \"" << result.name << "\", \"params\": {";
+            for (size_t j = 0; j < result.params.size(); j++)
+            {
+                json << (j == 0 ? "" : ", ") << "\"" << result.params[j].first << "\": " << result.params[j].second;
+            }
+            json << "}, \"iterations\": " << result.iterations << ", \"ns_per_op\": " << result.ns_per_op
+                 << ", \"min_ns_per_op\": " << result.min_ns_per_op
+                 << ", \"bytes_per_second\": " << result.bytes_per_second << "}";
+        }
+        json << "\n  ]\n}\n";
+        return json.str();
+    }
+
+  private:
+    static double time_s_(const std::function<void(uint64_t)> &body, uint64_t iterations)
+    {
+        auto start = std::chrono::steady_clock::now();
+        body(iterations);
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    BenchmarkOptions options_;
+    std::vector<BenchmarkResult> results_;
+};
+
+std::string param(uint64_t value)
+{
+    return std::to_string(value);
+}
+
+std::string param(bool value)
+{
+    return value ? "true" : "false";
+}
+
+BytesPtr make_payload(uint64_t size)
+{
+    BytesPtr payload = std::make_shared<Bytes>(size, '\0');
+    for (uint64_t i = 0; i < size; i++)
+    {
+        (*payload)[i] = static_cast<char>(i * 131 + 7);
+    }
+    return payload;
+}
+
+// Shared memory topics are normally removed by the server. delete_shm() also logs to stdout, which would mix with
+// the JSON output, so the benchmark unlinks the segments itself.
+void unlink_shm_topic(DataTopic &topic)
+{
+    shm_unlink(topic.shm_name().c_str());
+    shm_unlink((topic.shm_name() + "_mutex").c_str());
+}
+
+constexpr double GB = 1024.0 * 1024.0 * 1024.0;
+
+void bench_message(BenchmarkRunner &runner)
+{
+    for (uint64_t num_blocks : {1, 16, 256})
+    {
+        for (uint64_t payload_size : {64, 4096, 1 << 20})
+        {
+            if (num_blocks * payload_size > (64ull << 20))
+            {
+                continue;
+            }
+            std::vector<TimedPtr> ptrs;
+            for (uint64_t i = 0; i < num_blocks; i++)
+            {
+                ptrs.push_back({make_payload(payload_size), static_cast<double>(i)});
+            }
+            std::vector<std::pair<std::string, std::string>> params{{"blocks", param(num_blocks)},
+                                                                    {"payload_bytes", param(payload_size)}};
+            runner.run("rmq_message/encode", params, num_blocks * payload_size, [&](uint64_t iterations) {
+                for (uint64_t i = 0; i < iterations; i++)
+                {
+                    RMQMessage message("camera", CmdType::PUT_DATA, 1.0, ptrs);
+                    std::string serialized = message.serialize();
+                    do_not_optimize(serialized.data());
+                }
+            });
+
+            std::string serialized = RMQMessage("camera", CmdType::PUT_DATA, 1.0, ptrs).serialize();
+            runner.run("rmq_message/decode", params, num_blocks * payload_size, [&](uint64_t iterations) {
+                for (uint64_t i = 0; i < iterations; i++)
+                {
+                    RMQMessage message(serialized);
+                    std::vector<TimedPtr> decoded = message.data_ptrs();
+                    do_not_optimize(decoded.data());
+                }
+            });
+        }
+    }
+}
+
+void bench_data_topic(BenchmarkRunner &runner)
+{
+    BytesPtr payload = make_payload(64);
+    for (uint64_t window : {16, 1024, 65536})
+    {
+        // Every put advances the timestamp by 1, so the expiry keeps `window` items in the topic.
+        {
+            DataTopic topic("state", static_cast<double>(window) - 0.5);
+            double timestamp = 0;
+            runner.run("data_topic/add_data_ptr", {{"window", param(window)}}, 0, [&](uint64_t iterations) {
+                for (uint64_t i = 0; i < iterations; i++)
+                {
+                    topic.add_data_ptr(payload, timestamp);
+                    timestamp += 1.0;
+                }
+            });
+        }
+
+        DataTopic topic("state", std::numeric_limits<double>::infinity());
+        for (uint64_t i = 0; i < window; i++)
+        {
+            topic.add_data_ptr(payload, static_cast<double>(i));
+        }
+        for (int32_t n : {-1, 0})
+        {
+            runner.run("data_topic/peek_data_ptrs", {{"window", param(window)}, {"n", std::to_string(n)}}, 0,
+                       [&](uint64_t iterations) {
+                           for (uint64_t i = 0; i < iterations; i++)
+                           {
+                               std::vector<TimedPtr> ptrs = topic.peek_data_ptrs(n);
+                               do_not_optimize(ptrs.data());
+                           }
+                       });
+        }
+        // Pops the newest item and puts it back, so that the window stays the same
+        runner.run("data_topic/pop_data_ptrs", {{"window", param(window)}, {"n", "-1"}}, 0, [&](uint64_t iterations) {
+            for (uint64_t i = 0; i < iterations; i++)
+            {
+                std::vector<TimedPtr> ptrs = topic.pop_data_ptrs(-1);
+                topic.add_data_ptr(std::get<0>(ptrs[0]), std::get<1>(ptrs[0]));
+            }
+        });
+    }
+}
+
+void bench_shm(BenchmarkRunner &runner)
+{
+    uint32_t segment_id = 0;
+    for (uint64_t payload_size : {4096, 1 << 20, 16 << 20})
+    {
+        BytesPtr payload = make_payload(payload_size);
+        for (bool wrap : {false, true})
+        {
+            std::vector<std::pair<std::string, std::string>> params{{"payload_bytes", param(payload_size)},
+                                                                    {"wraparound", param(wrap)}};
+            // A ring of a whole number of payloads never splits a write. With half a payload more, every other
+            // write around the ring is split at its end.
+            double ring_size = payload_size * (wrap ? 4.5 : 4.0);
+            {
+                DataTopic topic("bench_write", std::numeric_limits<double>::infinity(), "bench", ring_size / GB,
+                                segment_id++, 0);
+                runner.run("shm/copy_data_to_shm", params, payload_size, [&](uint64_t iterations) {
+                    for (uint64_t i = 0; i < iterations; i++)
+                    {
+                        topic.copy_data_to_shm(payload->data(), payload_size, 0.0);
+                    }
+                });
+                unlink_shm_topic(topic);
+            }
+
+            // The second item of a ring of 1.5 payloads is split at the end of the ring.
+            DataTopic topic("bench_read", std::numeric_limits<double>::infinity(), "bench",
+                            payload_size * (wrap ? 1.5 : 2.0) / GB, segment_id++, 0);
+            topic.copy_data_to_shm(payload->data(), payload_size, 0.0);
+            topic.copy_data_to_shm(payload->data(), payload_size, 1.0);
+            ShmDescriptor descriptor = ShmDescriptor::parse(*std::get<0>(topic.peek_data_ptrs(-1)[0]));
+            runner.run("shm/read", params, payload_size, [&](uint64_t iterations) {
+                for (uint64_t i = 0; i < iterations; i++)
+                {
+                    BytesPtr data = topic.copy_shared_memory_data(descriptor);
+                    do_not_optimize(data->data());
+                }
+            });
+            unlink_shm_topic(topic);
+        }
+    }
+}
+
+void bench_shm_info(BenchmarkRunner &runner)
+{
+    SharedMemoryDataInfo info("rmq_user_1234_server_camera", 1ull << 30, 123456, 6220800);
+    std::string serialized_info = info.serialize();
+    runner.run("shm_data_info/serialize", {}, 0, [&](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; i++)
+        {
+            std::string serialized = info.serialize();
+            do_not_optimize(serialized.data());
+        }
+    });
+    runner.run("shm_data_info/parse", {}, 0, [&](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; i++)
+        {
+            bool valid = SharedMemoryDataInfo::is_shm_data_info(serialized_info);
+            SharedMemoryDataInfo parsed(serialized_info);
+            uint64_t size = parsed.data_size_bytes();
+            do_not_optimize(valid);
+            do_not_optimize(size);
+        }
+    });
+
+    ShmDescriptor descriptor{ShmDescriptor::MAGIC, 3, 42, 0, 1ull << 30, 123456, 6220800};
+    std::string serialized_descriptor = descriptor.serialize();
+    runner.run("shm_descriptor/serialize", {}, 0, [&](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; i++)
+        {
+            std::string serialized = descriptor.serialize();
+            do_not_optimize(serialized.data());
+        }
+    });
+    runner.run("shm_descriptor/parse", {}, 0, [&](uint64_t iterations) {
+        for (uint64_t i = 0; i < iterations; i++)
+        {
+            bool valid = ShmDescriptor::is_shm_descriptor(serialized_descriptor);
+            ShmDescriptor parsed = ShmDescriptor::parse(serialized_descriptor);
+            do_not_optimize(valid);
+            do_not_optimize(parsed.data_size_bytes);
+        }
+    });
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    BenchmarkOptions options;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (i + 1 < argc && arg == "--filter")
+        {
+            options.filter = argv[++i];
+        }
+        else if (i + 1 < argc && arg == "--min-time-s")
+        {
+            options.min_time_s = std::stod(argv[++i]);
+        }
+        else if (i + 1 < argc && arg == "--repetitions")
+        {
+            options.repetitions = std::max(1, std::stoi(argv[++i]));
+        }
+        else if (i + 1 < argc && arg == "--out")
+        {
+            options.out = argv[++i];
+        }
+        else
+        {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--filter SUBSTRING] [--min-time-s 0.2] [--repetitions 5] [--out results.json]"
+                      << std::endl;
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+
+    BenchmarkRunner runner(options);
+    bench_message(runner);
+    bench_data_topic(runner);
+    bench_shm(runner);
+    bench_shm_info(runner);
+
+    if (options.out == "-")
+    {
+        std::cout << runner.to_json();
+    }
+    else
+    {
+        std::ofstream(options.out) << runner.to_json();
+    }
+    return 0;
+}
@@ -0,0 +1,99 @@
+"""
+Copyright (c) 2024 Yihuai Gao
+
+This software is released under the MIT License.
+https://opensource.org/licenses/MIT
+"""
+
+import time
+import numpy as np
+import robotmq as rmq
+from robotmq.utils import clear_shared_memory
+
+
+def make_frames(num_frames: int):
+    """Depth and color frames with smooth structure, sensor noise and motion between frames."""
+    y, x = np.mgrid[0:480, 0:640]
+    frames = {"depth": [], "color": []}
+    rng = np.random.default_rng(0)
+    for i in range(num_frames):
+        depth = 800 + 400 * np.sin((x + 4 * i) / 90.0) * np.cos(y / 70.0) + rng.normal(0, 2, x.shape)
+        frames["depth"].append(depth.astype(np.uint16).tobytes())
+        color = np.stack([(x + i) % 256, (y + 2 * i) % 256, (x + y) % 256], axis=-1)
+        color = color + rng.integers(0, 8, color.shape)
+        frames["color"].append(color.astype(np.uint8).tobytes())
+    return frames
+
+
+def benchmark_compression():
+    """Throughput and CPU cost of reading frames over tcp with each available codec.
+
+    The client pretends to be on another host so that the server applies compression. Server and client run in
+    this process, so the CPU time includes both compression and decompression.
+    """
+    clear_shared_memory()
+    endpoint = "tcp://127.0.0.1:18765"
+    server = rmq.RMQServer("benchmark_server", endpoint, rmq.RMQLogLevel.WARNING)
+    client = rmq.RMQClient("benchmark_client", endpoint, rmq.RMQLogLevel.WARNING)
+    client.set_inline_payloads(True)
+    frames = make_frames(30)
+
+    print(
+        f"{'data':>6} | {'codec':>8} | {'ratio':>6} | {'cold MB/s':>9} | {'cached MB/s':>11} | {'cold CPU ms/frame':>17}"
+    )
+    for kind, kind_frames in frames.items():
+        total_mb = sum(len(frame) for frame in kind_frames) / 1e6
+        for compression, level in [("none", 0), ("lz4", 0), ("lz4", 8), ("zstd", 1), ("zstd", 3)]:
+            if compression not in rmq.get_available_compressions():
+                continue
+            topic = f"{kind}_{compression}_{level}"
+            server.add_topic(topic, 100.0)
+            server.set_topic_compression(topic, compression, level)
+            for frame in kind_frames:
+                server.put_data(topic, frame)
+
+            # The first read compresses every frame, later reads are served from the compressed cache.
+            start_time = time.perf_counter()
+            start_cpu = time.process_time()
+            data, _ = client.peek_data(topic, 0, timeout_s=10)
+            cold_time = time.perf_counter() - start_time
+            cold_cpu = time.process_time() - start_cpu
+            assert data == kind_frames
+
+            repeats = 3
+            start_time = time.perf_counter()
+            for _ in range(repeats):
+                client.peek_data(topic, 0, timeout_s=10)
+            cached_time = (time.perf_counter() - start_time) / repeats
+
+            label = f"{compression}:{level}" if level else compression
+            ratio = compression_ratio(kind_frames, compression, level)
+            ratio_str = f"{ratio:>6.2f}" if ratio is not None else f"{'n/a':>6}"
+            print(
+                f"{kind:>6} | {label:>8} | {ratio_str} | {total_mb / cold_time:>9.1f} | {total_mb / cached_time:>11.1f} | "
+                f"{1000 * cold_cpu / len(kind_frames):>17.2f}"
+            )
+    print("Frames per second on a link of L MB/s is roughly L * ratio / frame size (MB).")
+
+
+def compression_ratio(frames: list[bytes], compression: str, level: int):
+    """Compression ratio measured with the Python bindings of the codec (optional), None if they are missing."""
+    try:
+        if compression == "none":
+            return 1.0
+        if compression == "lz4":
+            import lz4.block
+
+            compressed = [lz4.block.compress(f, mode="fast", acceleration=max(level, 1), store_size=False) for f in frames]
+        else:
+            import zstandard
+
+            compressor = zstandard.ZstdCompressor(level=max(level, 1))
+            compressed = [compressor.compress(f) for f in frames]
+    except ImportError:
+        return None
+    return sum(len(f) for f in frames) / sum(len(c) for c in compressed)
+
+
+if __name__ == "__main__":
+    benchmark_compression()
@@ -0,0 +1,53 @@
+"""
+Copyright (c) 2024 Yihuai Gao
+
+This software is released under the MIT License.
+https://opensource.org/licenses/MIT
+"""
+
+import time
+import numpy as np
+import robotmq as rmq
+from robotmq.utils import clear_shared_memory
+
+
+def benchmark_shm_copy():
+    """Measures shared memory write (put_data) and read (peek_data) throughput across payload sizes.
+
+    Payloads above the copy engine threshold (8 MB) are split across its worker threads; writes into the ring use
+    streaming stores.
+    """
+    clear_shared_memory()
+    server = rmq.RMQServer("benchmark_server", "ipc:///tmp/feeds/benchmark", rmq.RMQLogLevel.WARNING)
+    client = rmq.RMQClient("benchmark_client", "ipc:///tmp/feeds/benchmark", rmq.RMQLogLevel.WARNING)
+    server.add_shared_memory_topic("frames", 10.0, 2.0)
+
+    repeats = 10
+    print(f"{'size':>10} | {'put GB/s':>9} | {'server peek GB/s':>16} | {'client peek GB/s':>16}")
+    for size_mb in [0.0625, 0.25, 1, 4, 8, 16, 32, 76, 128, 256]:
+        data = np.random.randint(0, 255, int(size_mb * 1024**2), dtype=np.uint8).tobytes()
+
+        start_time = time.time()
+        for _ in range(repeats):
+            server.put_data("frames", data)
+        put_time = (time.time() - start_time) / repeats
+
+        start_time = time.time()
+        for _ in range(repeats):
+            server.peek_data("frames", -1)
+        server_peek_time = (time.time() - start_time) / repeats
+
+        start_time = time.time()
+        for _ in range(repeats):
+            retrieved, _ = client.peek_data("frames", -1, timeout_s=10)
+        client_peek_time = (time.time() - start_time) / repeats
+        assert retrieved[0] == data
+
+        gb = len(data) / 1024**3
+        print(
+            f"{size_mb:>8.4g}MB | {gb / put_time:>9.2f} | {gb / server_peek_time:>16.2f} | {gb / client_peek_time:>16.2f}"
+        )
+
+
+if __name__ == "__main__":
+    benchmark_shm_copy()
@@ -0,0 +1,104 @@
+"""
+Copyright (c) 2024 Yihuai Gao
+
+This software is released under the MIT License.
+https://opensource.org/licenses/MIT
+"""
+
+import argparse
+import multiprocessing as mp
+import os
+import statistics
+import subprocess
+import threading
+import time
+import robotmq as rmq
+
+ENDPOINT = "tcp://127.0.0.1:18766"
+
+
+def run_server(ready, stop):
+    server = rmq.RMQServer("benchmark_server", ENDPOINT, rmq.RMQLogLevel.WARNING)
+    server.add_topic("bulk", 100.0)
+    ready.set()
+    stop.wait()
+
+
+def add_loopback_latency(delay_ms: float):
+    """Delay every packet on loopback with netem (needs root). Round-trip latency is twice the delay."""
+    subprocess.run(["tc", "qdisc", "add", "dev", "lo", "root", "netem", "delay", f"{delay_ms}ms"], check=True)
+
+
+def remove_loopback_latency():
+    subprocess.run(["tc", "qdisc", "del", "dev", "lo", "root"], check=False)
+
+
+def benchmark_striping(size_mb: int, chunk_mb: float, connections: list[int], repeats: int):
+    """Upload and download throughput of a large payload with a growing number of data connections, and the round
+    trip of control requests sent from another thread during the uploads."""
+    ready, stop = mp.Event(), mp.Event()
+    server_process = mp.Process(target=run_server, args=(ready, stop))
+    server_process.start()
+    ready.wait()
+    client = rmq.RMQClient("benchmark_client", ENDPOINT, rmq.RMQLogLevel.WARNING)
+    client.set_inline_payloads(True)  # Downloads are only chunked for clients on another host
+    client.set_chunk_size(int(chunk_mb * 1024 * 1024))
+    payload = os.urandom(size_mb * 1024 * 1024)
+
+    print(
+        f"{'connections':>11} | {'upload MB/s':>11} | {'download MB/s':>13} | {'control RTT ms':>14} | "
+        f"{'max RTT ms':>10}"
+    )
+    try:
+        for num_connections in connections:
+            client.set_data_connections(num_connections)
+            upload_time = 0.0
+
+            def upload():
+                nonlocal upload_time
+                start_time = time.perf_counter()
+                for _ in range(repeats):
+                    client.put_data("bulk", payload, timeout_s=30)
+                upload_time = (time.perf_counter() - start_time) / repeats
+
+            # Control requests share the client with the uploads, as a control loop would
+            upload_thread = threading.Thread(target=upload)
+            upload_thread.start()
+            control_rtts = []
+            while upload_thread.is_alive():
+                start_time = time.perf_counter()
+                client.get_topic_status("bulk", 10)
+                control_rtts.append(time.perf_counter() - start_time)
+                time.sleep(0.001)
+            upload_thread.join()
+
+            start_time = time.perf_counter()
+            for _ in range(repeats):
+                data, _ = client.peek_data("bulk", -1, timeout_s=30)
+            download_time = (time.perf_counter() - start_time) / repeats
+            assert data[0] == payload
+            client.pop_data("bulk", 0, timeout_s=30)
+            print(
+                f"{num_connections:>11} | {size_mb / upload_time:>11.1f} | {size_mb / download_time:>13.1f} | "
+                f"{1000 * statistics.median(control_rtts):>14.2f} | {1000 * max(control_rtts):>10.2f}"
+            )
+    finally:
+        stop.set()
+        server_process.join()
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description="Throughput of chunked transfers striped across data connections")
+    parser.add_argument("--size-mb", type=int, default=200)
+    parser.add_argument("--chunk-mb", type=float, default=4.0)
+    parser.add_argument("--connections", type=int, nargs="+", default=[0, 1, 2, 4, 8])
+    parser.add_argument("--repeats", type=int, default=3)
+    parser.add_argument("--delay-ms", type=float, default=0.0, help="Artificial loopback delay (requires root)")
+    args = parser.parse_args()
+    if args.delay_ms > 0:
+        add_loopback_latency(args.delay_ms)
+    try:
+        benchmark_striping(args.size_mb, args.chunk_mb, args.connections, args.repeats)
+    finally:
+        if args.delay_ms > 0:
+            remove_loopback_latency()
@@ -0,0 +1,235 @@
+"""
+Copyright (c) 2024 Yihuai Gao
+
+This software is released under the MIT License.
+https://opensource.org/licenses/MIT
+"""
+
+import argparse
+import json
+import math
+import multiprocessing as mp
+import os
+import time
+import robotmq as rmq
+
+ROLES = ["producer", "peeker", "popper", "requester"]
+
+
+class LatencyHistogram:
+    """Log-bucketed latency histogram. Percentiles are accurate to the bucket width of about 2%."""
+
+    BUCKETS_PER_DOUBLING = 32
+
+    def __init__(self):
+        self.counts: dict[int, int] = {}
+        self.count = 0
+        self.max_ns = 0
+        self.total_ns = 0
+
+    def record(self, latency_ns: int):
+        bucket = int(math.log2(max(latency_ns, 1)) * self.BUCKETS_PER_DOUBLING)
+        self.counts[bucket] = self.counts.get(bucket, 0) + 1
+        self.count += 1
+        self.max_ns = max(self.max_ns, latency_ns)
+        self.total_ns += latency_ns
+
+    def merge(self, other: "LatencyHistogram"):
+        for bucket, count in other.counts.items():
+            self.counts[bucket] = self.counts.get(bucket, 0) + count
+        self.count += other.count
+        self.max_ns = max(self.max_ns, other.max_ns)
+        self.total_ns += other.total_ns
+
+    def percentile_ns(self, percentile: float) -> float:
+        """Upper bound of the bucket that holds the given percentile."""
+        if self.count == 0:
+            return 0.0
+        rank = math.ceil(self.count * percentile / 100.0)
+        seen = 0
+        for bucket in sorted(self.counts):
+            seen += self.counts[bucket]
+            if seen >= rank:
+                return min(2 ** ((bucket + 1) / self.BUCKETS_PER_DOUBLING), self.max_ns)
+        return float(self.max_ns)
+
+
+def make_endpoint(transport: str, port: int) -> str:
+    if transport == "tcp":
+        return f"tcp://127.0.0.1:{port}"
+    return f"ipc:///tmp/rmq_load_generator_{os.getpid()}_{port}"
+
+
+def topic_name(kind: str) -> str:
+    return f"load_{kind}"
+
+
+def request_topic_name(worker_index: int) -> str:
+    return f"load_request_{worker_index}"
+
+
+def run_server(endpoint: str, args, ready, stop):
+    """Serves the topics and replies to requests until stop is set."""
+    server = rmq.RMQServer("load_server", endpoint, rmq.RMQLogLevel.WARNING)
+    server.add_topic(topic_name("regular"), args.remaining_time_s)
+    server.add_shared_memory_topic(topic_name("shm"), args.remaining_time_s, args.shm_size_gb)
+    for i in range(args.requesters):
+        server.add_topic(request_topic_name(i), args.remaining_time_s)
+    # Peekers and poppers should find data from the start
+    for kind in args.topics:
+        server.put_data(topic_name(kind), os.urandom(args.payload_bytes))
+    reply = os.urandom(args.reply_bytes)
+    ready.set()
+    while not stop.is_set():
+        _, request_topic = server.wait_for_request(0.1)
+        if request_topic:
+            server.reply_request(request_topic, reply)
+
+
+def run_worker(endpoint: str, role: str, worker_index: int, args, start, results):
+    """Runs one operation in a loop for the configured duration and sends back a histogram per topic kind."""
+    client = rmq.RMQClient(f"load_{role}_{worker_index}", endpoint, rmq.RMQLogLevel.ERROR)
+    payload = os.urandom(args.payload_bytes)
+    histograms = {}
+    bytes_moved = {}
+    failures = {}
+    period_s = 1.0 / args.rate if role == "producer" and args.rate > 0 else 0.0
+    kinds = ["request"] if role == "requester" else args.topics
+    start.wait()
+    start_ns = time.perf_counter_ns()
+    start_time = start_ns / 1e9
+    end_time = start_time + args.duration_s
+    iteration = 0
+    while True:
+        now = time.perf_counter()
+        if now >= end_time:
+            break
+        scheduled_ns = None
+        if period_s > 0:
+            next_time = start_time + iteration * period_s
+            if next_time > now:
+                time.sleep(next_time - now)
+            # With a fixed rate, latency counts from when the operation was due. An operation held up by a slow
+            # predecessor would otherwise hide the wait (coordinated omission).
+            scheduled_ns = start_ns + round(iteration * period_s * 1e9)
+        kind = kinds[(worker_index + iteration) % len(kinds)]
+        iteration += 1
+        op_start = time.perf_counter_ns() if scheduled_ns is None else scheduled_ns
+        try:
+            if role == "producer":
+                client.put_data(topic_name(kind), payload, timeout_s=args.timeout_s)
+                moved = len(payload)
+            elif role == "peeker":
+                data, _ = client.peek_data(topic_name(kind), -1, timeout_s=args.timeout_s)
+                moved = sum(len(item) for item in data)
+            elif role == "popper":
+                data, _ = client.pop_data(topic_name(kind), 1, timeout_s=args.timeout_s)
+                moved = sum(len(item) for item in data)
+            else:
+                reply = client.request_with_data(request_topic_name(worker_index), payload, timeout_s=args.timeout_s)
+                moved = len(payload) + len(reply)
+        except RuntimeError:
+            failures[kind] = failures.get(kind, 0) + 1
+            continue
+        latency_ns = time.perf_counter_ns() - op_start
+        histograms.setdefault(kind, LatencyHistogram()).record(latency_ns)
+        bytes_moved[kind] = bytes_moved.get(kind, 0) + moved
+    results.put((role, histograms, bytes_moved, failures, time.perf_counter() - start_time))
+
+
+def summarize(worker_results, duration_s: float):
+    """Merges the histograms of all workers of an operation and topic kind."""
+    merged = {}
+    for role, histograms, bytes_moved, failures, _ in worker_results:
+        for kind in set(histograms) | set(failures):
+            entry = merged.setdefault((role, kind), {"histogram": LatencyHistogram(), "bytes": 0, "failures": 0})
+            if kind in histograms:
+                entry["histogram"].merge(histograms[kind])
+            entry["bytes"] += bytes_moved.get(kind, 0)
+            entry["failures"] += failures.get(kind, 0)
+    rows = []
+    for (role, kind), entry in sorted(merged.items()):
+        histogram = entry["histogram"]
+        rows.append(
+            {
+                "operation": role,
+                "topic": kind,
+                "count": histogram.count,
+                "failures": entry["failures"],
+                "ops_per_s": histogram.count / duration_s,
+                "mb_per_s": entry["bytes"] / duration_s / 1e6,
+                "mean_us": histogram.total_ns / max(histogram.count, 1) / 1e3,
+                "p50_us": histogram.percentile_ns(50) / 1e3,
+                "p99_us": histogram.percentile_ns(99) / 1e3,
+                "p999_us": histogram.percentile_ns(99.9) / 1e3,
+                "max_us": histogram.max_ns / 1e3,
+            }
+        )
+    return rows
+
+
+def print_rows(rows):
+    print(
+        f"{'operation':>10} | {'topic':>8} | {'count':>8} | {'failed':>6} | {'ops/s':>9} | {'MB/s':>8} | "
+        f"{'p50 us':>9} | {'p99 us':>9} | {'p99.9 us':>9} | {'max us':>9}"
+    )
+    for row in rows:
+        print(
+            f"{row['operation']:>10} | {row['topic']:>8} | {row['count']:>8} | {row['failures']:>6} | "
+            f"{row['ops_per_s']:>9.1f} | {row['mb_per_s']:>8.2f} | {row['p50_us']:>9.1f} | {row['p99_us']:>9.1f} | "
+            f"{row['p999_us']:>9.1f} | {row['max_us']:>9.1f}"
+        )
+
+
+def run_load(args):
+    endpoint = make_endpoint(args.transport, args.port)
+    ready, stop, start = mp.Event(), mp.Event(), mp.Event()
+    server_process = mp.Process(target=run_server, args=(endpoint, args, ready, stop))
+    server_process.start()
+    ready.wait()
+
+    results = mp.Queue()
+    workers = []
+    for role in ROLES:
+        for i in range(getattr(args, f"{role}s")):
+            worker = mp.Process(target=run_worker, args=(endpoint, role, i, args, start, results))
+            worker.start()
+            workers.append(worker)
+    start.set()
+    worker_results = [results.get() for _ in workers]
+    for worker in workers:
+        worker.join()
+    stop.set()
+    server_process.join()
+
+    rows = summarize(worker_results, args.duration_s)
+    print(
+        f"{args.transport} endpoint, {args.payload_bytes} byte payloads, {args.duration_s:.1f}s, "
+        f"{args.producers} producers, {args.peekers} peekers, {args.poppers} poppers, {args.requesters} requesters"
+    )
+    print_rows(rows)
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump({"config": vars(args), "results": rows}, f, indent=2)
+
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(
+        description="Multi-process load generator reporting throughput and tail latency per operation"
+    )
+    parser.add_argument("--transport", choices=["ipc", "tcp"], default="ipc")
+    parser.add_argument("--port", type=int, default=18767, help="Port of the tcp endpoint")
+    parser.add_argument("--topics", nargs="+", choices=["regular", "shm"], default=["regular", "shm"])
+    parser.add_argument("--producers", type=int, default=2)
+    parser.add_argument("--peekers", type=int, default=2)
+    parser.add_argument("--poppers", type=int, default=1)
+    parser.add_argument("--requesters", type=int, default=1)
+    parser.add_argument("--payload-bytes", type=int, default=64 * 1024)
+    parser.add_argument("--reply-bytes", type=int, default=1024)
+    parser.add_argument("--rate", type=float, default=0.0, help="Puts per second per producer (0: as fast as possible)")
+    parser.add_argument("--duration-s", type=float, default=10.0)
+    parser.add_argument("--timeout-s", type=float, default=1.0)
+    parser.add_argument("--remaining-time-s", type=float, default=1.0)
+    parser.add_argument("--shm-size-gb", type=float, default=0.5)
+    parser.add_argument("--json", type=str, default="", help="Also write the results to this file")
+    run_load(parser.parse_args())
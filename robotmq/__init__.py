@@ -8,9 +8,16 @@
 from .core.robotmq_core import (
     RMQClient,
     RMQServer,
+    RMQLogReader,
     steady_clock_us,
     system_clock_us,
     RMQLogLevel,
+    RMQBytesView,
+    get_available_compressions,
+    serialize_object,
+    serialized_object_size,
+    serialize_object_into,
+    deserialize_object,
 )
 from .utils import serialize, deserialize
 
@@ -18,9 +25,16 @@ from .utils import serialize, deserialize
 __all__ = [
     "RMQClient",
     "RMQServer",
+    "RMQLogReader",
     "steady_clock_us",
     "system_clock_us",
     "serialize",
     "deserialize",
     "RMQLogLevel",
+    "RMQBytesView",
+    "get_available_compressions",
+    "serialize_object",
+    "serialized_object_size",
+    "serialize_object_into",
+    "deserialize_object",
 ]
@@ -11,6 +11,7 @@
 #include <pybind11/pybind11.h>
 #include <string>
 #include <tuple>
+#include <type_traits>
 #include <vector>
 
 #include <iomanip>
@@ -27,13 +28,77 @@ std::string uint32_to_bytes(uint32_t value);
 uint32_t bytes_to_uint32(const std::string &bytes);
 std::string int32_to_bytes(int32_t value);
 int32_t bytes_to_int32(const std::string &bytes);
+std::string uint64_to_bytes(uint64_t value);
+uint64_t bytes_to_uint64(const std::string &bytes);
 std::string double_to_bytes(double value);
 double bytes_to_double(const std::string &bytes);
 std::string bytes_to_hex(const std::string &bytes);
 
 std::string get_user_name();
 std::string get_pid();
+// Identifies the host and the /dev/shm mount of this process. Two processes can exchange shared memory segments
+// only if their tokens are equal.
+std::string get_shm_host_token();
 
+// Fixed-layout descriptor of a message stored in a topic's shared memory ring. Unlike SharedMemoryDataInfo, it refers
+// to the ring by a compact segment id; clients learn the segment name when they resolve the topic. The session is
+// the one of the server that owns the segment, so descriptors from a restarted server are never misread.
+struct ShmDescriptor
+{
+    static constexpr uint32_t MAGIC = 0x0c0d0a0d; // "\x0d\x0a\x0d\x0c"
+    uint32_t magic;
+    uint32_t segment_id;
+    uint32_t session;
+    uint32_t reserved;
+    uint64_t shm_size_bytes;
+    uint64_t shm_start_idx;
+    uint64_t data_size_bytes;
+
+    static bool is_shm_descriptor(const std::string &bytes);
+    static ShmDescriptor parse(const std::string &bytes);
+    std::string serialize() const;
+};
+static_assert(std::is_trivially_copyable<ShmDescriptor>::value && sizeof(ShmDescriptor) == 40,
+              "ShmDescriptor must keep a fixed binary layout");
+
+// Placeholder for a large item in a reply. The client fetches the item in chunks with FETCH_CHUNK, so that a
+// timeout only resends one chunk and other requests are served in between.
+struct ChunkedItemStub
+{
+    static constexpr uint32_t MAGIC = 0x0f0d0a0d; // "\x0d\x0a\x0d\x0f"
+    uint32_t magic;
+    uint32_t reserved;
+    uint64_t transfer_id;
+    uint64_t total_size_bytes;
+
+    static bool is_chunked_item_stub(const std::string &bytes);
+    static ChunkedItemStub parse(const std::string &bytes);
+    std::string serialize() const;
+};
+static_assert(std::is_trivially_copyable<ChunkedItemStub>::value && sizeof(ChunkedItemStub) == 24,
+              "ChunkedItemStub must keep a fixed binary layout");
+
+// Stage timestamps of one request_with_data on the server, in microseconds of the server's steady clock. A client
+// that traces its requests sets REQUEST_TRACE_FLAG, and the server appends the trace to the reply as the last item.
+struct RequestTrace
+{
+    static constexpr uint32_t MAGIC = 0x110d0a0d; // "\x0d\x0a\x0d\x11"
+    uint32_t magic;
+    uint32_t reserved;
+    int64_t received_us;   // The background thread received the request
+    int64_t dispatched_us; // wait_for_request handed the request to the caller
+    int64_t replied_us;    // reply_request was called
+    int64_t encoded_us;    // The reply was read back from the topic and is about to be sent
+
+    static bool is_request_trace(const std::string &bytes);
+    static RequestTrace parse(const std::string &bytes);
+    std::string serialize() const;
+};
+static_assert(std::is_trivially_copyable<RequestTrace>::value && sizeof(RequestTrace) == 40,
+              "RequestTrace must keep a fixed binary layout");
+
+// Legacy shared memory descriptor that refers to the segment by name. Used for the one-off segments clients create
+// for request_with_data.
 class SharedMemoryDataInfo
 {
   public:
@@ -62,4 +127,14 @@ class SharedMemoryDataInfo
     uint64_t data_size_bytes_;
 };
 
+// Read-only view of a stored message that is exposed to Python through the buffer protocol. It shares ownership of
+// the message instead of copying it into a new bytes object.
+struct BytesView
+{
+    BytesPtr data_ptr;
+};
+
+pybind11::bytes copy_to_pybytes(const char *data, size_t len);
+// Copies a message out of a ring buffer. The message may wrap around the end of the ring.
+pybind11::bytes copy_ring_to_pybytes(const char *ring, uint64_t ring_size, uint64_t start, uint64_t size);
 pybind11::bytes concat_to_pybytes(const char *a, size_t a_len, const char *b, size_t b_len);
@@ -0,0 +1,41 @@
+/**
+ * Copyright (c) 2024 Yihuai Gao
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#pragma once
+#include "common.h"
+#include <string>
+#include <vector>
+
+// Codecs are optional and only available if the library was found at build time (RMQ_WITH_LZ4 / RMQ_WITH_ZSTD).
+enum class CompressionType : uint8_t
+{
+    NONE = 0,
+    LZ4 = 1,  // Fast, moderate ratio
+    ZSTD = 2, // Slower, better ratio
+};
+
+CompressionType compression_type_from_string(const std::string &name);
+std::string compression_type_to_string(CompressionType type);
+bool is_compression_available(CompressionType type);
+std::vector<std::string> get_available_compressions();
+// Request flags (see rmq_message.h) advertising the codecs this build can decode
+uint8_t compression_accept_flags();
+bool is_compression_accepted(CompressionType type, uint8_t request_flags);
+// True if the request accepts any codec. Only then may items of the reply be compressed, and only then are they decoded.
+bool is_compression_negotiated(uint8_t request_flags);
+
+// Compressed payloads start with a magic header, like shared memory descriptors:
+// [4-byte header][uint8 type][uint64 decompressed size][compressed data]
+// Returns nullptr if the data is too small to be worth compressing or does not get smaller.
+BytesPtr compress_data(const char *data, uint64_t size, CompressionType type, int level);
+// In replies with negotiated compression, items that are not compressed but start with the header are marked with
+// CompressionType::NONE, so every item with the header is one the server encoded.
+BytesPtr mark_uncompressed_data(const BytesPtr &data);
+bool is_compressed_data(const Bytes &bytes);
+// Throws if the decompressed size does not fit the compressed data
+uint64_t get_decompressed_size(const Bytes &bytes);
+void decompress_data(const Bytes &bytes, char *dst, uint64_t dst_size);
@@ -0,0 +1,66 @@
+/**
+ * Copyright (c) 2024 Yihuai Gao
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Copies large buffers with a small pool of worker threads. Copies below the parallel threshold run on the calling
+// thread. Streaming copies use non-temporal stores so that a frame written into shared memory for another process
+// does not evict the writer's cache.
+class CopyEngine
+{
+  public:
+    static CopyEngine &instance();
+
+    CopyEngine(size_t num_threads, size_t parallel_threshold_bytes);
+    ~CopyEngine();
+    CopyEngine(const CopyEngine &) = delete;
+    CopyEngine &operator=(const CopyEngine &) = delete;
+
+    // `streaming` should be true when the destination will not be read by this core soon (e.g. shm ring writes).
+    void copy(void *dst, const void *src, size_t size, bool streaming);
+
+    size_t num_threads() const;
+    size_t parallel_threshold_bytes() const;
+
+  private:
+    struct Job
+    {
+        char *dst;
+        const char *src;
+        size_t size;
+        size_t chunk_size;
+        size_t num_chunks;
+        bool streaming;
+        std::atomic<size_t> next_chunk{0};
+        std::atomic<size_t> remaining_chunks{0};
+    };
+
+    static void copy_chunk_(char *dst, const char *src, size_t size, bool streaming);
+    static void run_job_(Job &job);
+    void worker_loop_();
+
+    const size_t parallel_threshold_bytes_;
+    std::vector<std::thread> workers_;
+    std::mutex job_mutex_; // Only one parallel copy at a time. Concurrent callers fall back to a single thread.
+    std::mutex worker_mutex_;
+    std::condition_variable worker_cv_;
+    std::condition_variable done_cv_;
+    std::shared_ptr<Job> current_job_;
+    uint64_t job_generation_;
+    bool stopping_;
+};
+
+// Convenience wrapper around CopyEngine::instance().copy().
+void engine_memcpy(void *dst, const void *src, size_t size, bool streaming);
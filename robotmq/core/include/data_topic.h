@@ -7,48 +7,252 @@
 
 #pragma once
 #include "common.h"
+#include "compression.h"
+#include "topic_log.h"
 #include <deque>
+#include <memory>
+#include <mutex>
 #include <pthread.h>
 #include <string>
+#include <unordered_map>
 #include <vector>
+// All public methods are thread-safe. Each topic has its own lock, so traffic on one topic never waits for another.
+// Counters of a topic since it was added. Items are counted once per put, peek or pop.
+struct TopicStats
+{
+    uint64_t messages_put = 0;
+    uint64_t bytes_put = 0;
+    uint64_t messages_expired = 0; // Older than message_remaining_time_s
+    uint64_t messages_evicted = 0; // Overwritten to make room in the shared memory ring or slot ring
+    uint64_t messages_dropped = 0; // Larger than the shared memory ring
+    uint64_t messages_peeked = 0;
+    uint64_t messages_popped = 0;
+    uint64_t messages_consumed = 0; // Returned by consumes of consumer groups
+};
+
+// Shared memory topics of a persistent server keep everything needed to reattach to their ring in a second segment
+// (shm_name + "_index"): a ShmTopicIndexHeader followed by num_entries ShmIndexEntries. The live items are the
+// entries first .. end - 1, each stored at entries[i % num_entries]. Tensor topics have one entry per slot, with
+// first and end being the put counters of the oldest and the next item.
+struct ShmTopicIndexHeader
+{
+    static constexpr uint64_t MAGIC = 0x01584449514d52; // "RMQIDX\x01\0"
+    static constexpr uint64_t NOT_IN_RING = UINT64_MAX; // Entry size of items that are not stored in the ring
+    uint64_t magic;
+    uint64_t shm_size;
+    uint64_t slot_size; // 0 for rings
+    uint64_t num_entries;
+    int64_t clock_origin_us; // Steady clock time of timestamp 0 for the entry timestamps
+    uint64_t write_offset;   // Write head of the ring
+    uint64_t first;
+    uint64_t end;
+};
+static_assert(std::is_trivially_copyable<ShmTopicIndexHeader>::value && sizeof(ShmTopicIndexHeader) == 64,
+              "ShmTopicIndexHeader must keep a fixed binary layout");
+
+struct ShmIndexEntry
+{
+    uint64_t start;
+    uint64_t size;
+    double timestamp;
+};
+
 class DataTopic
 {
   public:
     DataTopic(const std::string &topic_name, double message_remaining_time_s);
 
+    // Ring items are stored as ShmDescriptors tagged with segment_id and the session of the owning server.
+    // A persistent topic names its segments after the server and topic only, and reattaches to the ring and the items
+    // left by a previous server of the same name if the layout matches. Their timestamps are converted from that
+    // server's clock origin to clock_origin_us.
     DataTopic(const std::string &topic_name, double message_remaining_time_s, const std::string server_name,
-              double shared_memory_size_gb);
+              double shared_memory_size_gb, uint32_t segment_id, uint32_t session, bool persistent = false,
+              int64_t clock_origin_us = 0);
+
+    // Tensor topic: a preallocated ring of `capacity` slots of slot_size_bytes each, holding items of a fixed dtype
+    // and shape. The slots live in shared memory if server_name is not empty, otherwise on the heap. Puts copy into
+    // the next slot without allocating, and the oldest item is overwritten when all slots are in use.
+    DataTopic(const std::string &topic_name, double message_remaining_time_s, const std::string &dtype,
+              const std::vector<int64_t> &shape, uint64_t slot_size_bytes, uint64_t capacity,
+              const std::string &server_name, uint32_t segment_id, uint32_t session, bool persistent = false,
+              int64_t clock_origin_us = 0);
 
     void add_data_ptr(const BytesPtr data_ptr, double timestamp);
 
     std::vector<TimedPtr> peek_data_ptrs(int32_t n);
+    // Every stored item has a put sequence, assigned by this topic in put order and never reused. Same as
+    // peek_data_ptrs, among the items with a sequence after `sequence`. `cursor` is set to the sequence of the newest
+    // returned item, or to `sequence` if none is returned, so that a poller (e.g. a relay) receives every item once.
+    std::vector<TimedPtr> peek_data_ptrs_after(uint64_t sequence, int32_t n, uint64_t &cursor);
     std::vector<TimedPtr> pop_data_ptrs(int32_t n);
+    // Consumer groups share one stored copy of the items. Every group has a cursor, and a consume returns items after
+    // the cursor of the group and moves the cursor past them. n > 0 returns up to n items, 0 all of them, and n < 0
+    // the newest -n, skipping the older ones. The consumers of one group thus split the items between them, while
+    // every group sees every item. A group is created by its first consume, with the cursor at the oldest stored
+    // item. Items are released once all groups have consumed them, or when they expire or are evicted before that.
+    std::vector<TimedPtr> consume_data_ptrs(const std::string &group, int32_t n);
+    void remove_consumer_group(const std::string &group);
+    // Group name -> number of stored items the group has not consumed yet
+    std::unordered_map<std::string, uint64_t> consumer_groups() const;
 
     void clear_data();
     int size() const;
+    TopicStats stats() const;
 
     void copy_data_to_shm(const pybind11::bytes &data, double timestamp);
-    pybind11::bytes get_shared_memory_data(const SharedMemoryDataInfo &shm_data_info);
+    void copy_data_to_shm(const char *data, uint64_t size, double timestamp);
+    // Reserve/commit lets a producer write a message directly into the ring. The reserved region is always
+    // contiguous. Only one reservation can be pending per topic, and other puts are rejected until it is committed
+    // or cancelled.
+    uint64_t reserve_shm(uint64_t size);
+    void commit_shm(double timestamp);
+    void cancel_shm_reservation();
+    char *shm_buffer(uint64_t offset) const;
+    // Keeps the ring mapped for views handed out to Python, even after delete_shm
+    std::shared_ptr<char> shm_mapping() const;
+    pybind11::bytes get_shared_memory_data(const ShmDescriptor &descriptor);
+    // Same as get_shared_memory_data, but does not need the GIL. Used to inline ring data for remote clients.
+    BytesPtr copy_shared_memory_data(const ShmDescriptor &descriptor);
+    // Compression applied to items sent to remote clients that accept the codec.
+    void set_compression(CompressionType type, int level);
+    // Prepares items for a client on another host according to its request flags: ring data is inlined and, if
+    // enabled, compressed. Compressed items are cached, so every item is compressed once for all remote readers.
+    std::vector<TimedPtr> prepare_remote_ptrs(const std::vector<TimedPtr> &ptrs, uint8_t request_flags);
     bool is_shm_topic() const;
-    void delete_shm();
+    bool is_tensor_topic() const;
+    // Whether an item of this size can be stored. Tensor topics only store items of exactly one slot.
+    bool accepts_item_size(uint64_t size) const;
+    void put_tensor(const char *data, uint64_t size, double timestamp);
+    // Returns (list of arrays, list of timestamps) of a tensor topic. With copy=false, the arrays are read-only views
+    // of the slots that keep `base` alive. A slot is overwritten `capacity` puts after it was written.
+    pybind11::tuple peek_tensors(int32_t n, bool copy, const pybind11::handle &base);
+    // Returns (array of shape (count, *shape), list of timestamps) with the newest min(k, size) items of a tensor
+    // topic. With copy=false, the array is a read-only view of the slots if they are contiguous in the ring (keeping
+    // `base` alive), otherwise the items are gathered into one new array.
+    pybind11::tuple peek_window(int32_t k, bool copy, const pybind11::handle &base);
+    const std::string &tensor_dtype() const;
+    const std::vector<int64_t> &tensor_shape() const;
+    uint32_t shm_segment_id() const;
+    const std::string &shm_name() const;
+    // Unmaps the shared memory. The segments are also removed if unlink is true, otherwise a persistent topic of the
+    // next server with the same name reattaches to them.
+    void delete_shm(bool unlink = true);
+    // Whether the topic took over the items of a previous server's segments
+    bool reattached() const;
+    // Called after the server's start time was reset
+    void set_clock_origin_us(int64_t clock_origin_us);
+    // Describes the topic for a log, from which it can be added to a server again
+    LogTopicInfo log_topic_info() const;
+    // Items put after this call are also handed to the recorder (as stream stream_id), which writes them to disk on
+    // its own thread. nullptr stops recording.
+    void set_recorder(LogWriter *recorder, uint32_t stream_id);
 
   private:
+    mutable std::mutex mutex_;
     std::string topic_name_;
     double message_remaining_time_s_;
     std::deque<TimedPtr> data_;
+    // Put sequence of the newest item, and of every item of data_ (see peek_data_ptrs_after)
+    uint64_t put_sequence_ = 0;
+    std::deque<uint64_t> item_sequences_;
+
+    BytesPtr make_shm_descriptor_(uint64_t start, uint64_t size) const;
+    bool ring_item_extent_(const TimedPtr &item, uint64_t &start, uint64_t &size) const;
+    uint64_t allocate_shm_(uint64_t size, bool contiguous);
+    void write_shm_(uint64_t start, const char *data, uint64_t size);
+    void remove_expired_data_(double timestamp);
+    std::vector<TimedPtr> peek_data_ptrs_(int32_t n);
+    void create_shm_();
+    // Every change of data_ goes through these, so that the index of a persistent topic mirrors it
+    void push_item_(const TimedPtr &item);
+    void pop_front_item_();
+    // Removes the item at position without renumbering the items after it
+    void erase_item_(size_t position);
+    void pop_back_item_();
+    void clear_items_();
+
+    // Items are numbered in put order for the cursors of consumer groups. Items of data_ are numbered from
+    // front_sequence_, tensor items by their put index.
+    uint64_t front_sequence_ = 0;
+    std::unordered_map<std::string, uint64_t> consumer_cursors_;
+    // Sequence numbers of the oldest and one past the newest stored item
+    void sequence_range_(uint64_t &first, uint64_t &end) const;
+    // Releases the items that all consumer groups have consumed
+    void release_consumed_();
 
-    std::string get_shm_name_() const;
-    std::string get_shm_mutex_name_() const;
+    // Tensor topics. The live items are the slots of the puts written_count_ - live_count_ .. written_count_ - 1,
+    // each stored at slot (put index % capacity_).
+    TopicStats stats_; // Guarded by mutex_
+    // Drops of items larger than the ring are logged at most once per interval, so a misconfigured producer does
+    // not flood the log
+    static constexpr int64_t DROP_WARNING_INTERVAL_US_ = 1000000;
+    int64_t last_drop_warning_us_ = 0;
+    // Counts a stored item and passes it to the recorder. data_ptr is shared with the recorder if given, otherwise
+    // the size bytes at data are copied.
+    void count_put_(uint64_t size, double timestamp, const char *data, const BytesPtr &data_ptr = nullptr);
+    LogWriter *recorder_ = nullptr;
+    uint32_t recorder_stream_id_ = 0;
+
+    bool is_tensor_topic_ = false;
+    std::string tensor_dtype_;
+    std::vector<int64_t> tensor_shape_;
+    uint64_t slot_size_ = 0;
+    uint64_t capacity_ = 0;
+    uint64_t written_count_ = 0;
+    uint64_t live_count_ = 0;
+    std::vector<double> slot_timestamps_;
+    std::vector<uint64_t> slot_sequences_;
+    std::unique_ptr<char[]> heap_slots_;
+    char *slot_ptr_(uint64_t index) const;
+    // Range of live items selected by n, with the same semantics as peek_data_ptrs
+    void select_slots_(int32_t n, uint64_t &first, uint64_t &count) const;
+    void remove_expired_slots_(double timestamp);
+    std::vector<TimedPtr> slot_ptrs_(uint64_t first, uint64_t count) const;
+    // Copies written_count_ and live_count_ to the index of a persistent topic
+    void sync_slot_index_();
+
+    // Compression for remote clients
+    CompressionType compression_type_ = CompressionType::NONE;
+    int compression_level_ = 0;
+    struct CompressedItem
+    {
+        std::weak_ptr<Bytes> source; // Expires when the item is released, which invalidates the entry
+        CompressionType type;
+        BytesPtr compressed;
+    };
+    std::unordered_map<const Bytes *, CompressedItem> compressed_cache_;
 
     // Shared memory related
     std::string server_name_;
+    // Computed once, since building them requires looking up the user name and pid.
+    std::string shm_name_;
+    std::string shm_mutex_name_;
+    uint32_t segment_id_;
+    uint32_t session_;
     uint64_t shm_size_;
-    uint64_t occupied_shm_size_;
     uint64_t current_shm_offset_;
+    bool has_pending_reservation_;
+    uint64_t pending_reservation_start_;
+    uint64_t pending_reservation_size_;
     bool is_shm_topic_;
     double shm_size_gb_;
     void *shm_ptr_;
+    std::shared_ptr<char> shm_mapping_; // Unmaps the ring once the topic and all views of it are gone
     int shm_fd_;
     pthread_mutex_t *shm_mutex_ptr_;
     int shm_mutex_fd_;
+
+    // Persistent shared memory
+    static constexpr uint64_t MAX_RING_INDEX_ENTRIES_ = 65536; // Older items are evicted from larger rings
+    bool persistent_ = false;
+    bool reattached_ = false;
+    int64_t clock_origin_us_ = 0;
+    std::string index_name_;
+    int index_fd_ = -1;
+    uint64_t index_size_ = 0;
+    ShmTopicIndexHeader *index_ = nullptr; // nullptr unless persistent
+    ShmIndexEntry *index_entries_ = nullptr;
+    bool open_index_(uint64_t ring_size_before);
+    void restore_from_index_();
 };
\ No newline at end of file
@@ -0,0 +1,114 @@
+/**
+ * Copyright (c) 2024 Yihuai Gao
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+
+// Unbounded lock-free multi-producer single-consumer queue (Vyukov's node-based algorithm).
+// push() may be called from any thread. pop() must only be called from a single consumer thread.
+// Callers that need a bound should check size() before pushing. An idle consumer blocks in wait() instead of
+// polling; push() only takes a lock when the consumer is waiting.
+template <typename T> class MPSCQueue
+{
+  public:
+    MPSCQueue() : size_(0)
+    {
+        Node *stub = new Node();
+        head_.store(stub);
+        tail_ = stub;
+    }
+
+    ~MPSCQueue()
+    {
+        T value;
+        while (pop(value))
+        {
+        }
+        delete tail_;
+    }
+
+    MPSCQueue(const MPSCQueue &) = delete;
+    MPSCQueue &operator=(const MPSCQueue &) = delete;
+
+    void push(T value)
+    {
+        Node *node = new Node();
+        node->value = std::move(value);
+        size_.fetch_add(1, std::memory_order_relaxed);
+        Node *prev = head_.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+        // Pairs with the fence in wait(): either the consumer sees the new node, or this sees the consumer waiting.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (consumer_waiting_.load(std::memory_order_relaxed))
+        {
+            std::lock_guard<std::mutex> lock(wait_mutex_);
+            wait_cv_.notify_one();
+        }
+    }
+
+    // Blocks the consumer until an item can be popped, notify() is called or the timeout passes.
+    template <typename Rep, typename Period> void wait(const std::chrono::duration<Rep, Period> &timeout)
+    {
+        std::unique_lock<std::mutex> lock(wait_mutex_);
+        consumer_waiting_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        wait_cv_.wait_for(lock, timeout, [this]() {
+            return notified_ || tail_->next.load(std::memory_order_acquire) != nullptr;
+        });
+        consumer_waiting_.store(false, std::memory_order_relaxed);
+        notified_ = false;
+    }
+
+    // Wakes the consumer, e.g. to let it see a shutdown request.
+    void notify()
+    {
+        std::lock_guard<std::mutex> lock(wait_mutex_);
+        notified_ = true;
+        wait_cv_.notify_one();
+    }
+
+    bool pop(T &value)
+    {
+        Node *tail = tail_;
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if (next == nullptr)
+        {
+            return false;
+        }
+        value = std::move(next->value);
+        next->value = T();
+        tail_ = next;
+        delete tail;
+        size_.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Approximate number of queued items. Exact when no push or pop is in progress.
+    size_t size() const
+    {
+        return size_.load(std::memory_order_relaxed);
+    }
+
+  private:
+    struct Node
+    {
+        std::atomic<Node *> next{nullptr};
+        T value;
+    };
+    std::atomic<Node *> head_;
+    Node *tail_;
+    std::atomic<size_t> size_;
+    std::atomic<bool> consumer_waiting_{false};
+    std::mutex wait_mutex_;
+    std::condition_variable wait_cv_;
+    bool notified_ = false; // Guarded by wait_mutex_
+};
@@ -10,11 +10,19 @@
 #include <zmq.hpp>
 
 #include "common.h"
+#include "mpsc_queue.h"
 #include "rmq_message.h"
+#include <atomic>
+#include <functional>
 #include <map>
+#include <mutex>
+#include <optional>
+#include <pthread.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
 #include <spdlog/spdlog.h>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 class RMQClient
@@ -32,25 +40,204 @@ class RMQClient
     // positive number means the number of data in the topic
     pybind11::tuple peek_data(const std::string &topic, int32_t n, double timeout_s, bool automatic_resend);
     pybind11::tuple pop_data(const std::string &topic, int32_t n, double timeout_s, bool automatic_resend);
+    // Returns items the consumer group has not consumed yet and marks them consumed, see RMQServer::consume_data
+    pybind11::tuple consume_data(const std::string &topic, const std::string &group, int32_t n, double timeout_s,
+                                 bool automatic_resend);
     void put_data(const std::string &topic, const pybind11::bytes &data, double timeout_s, bool automatic_resend);
+    // Returns (array of shape (count, *shape), list of timestamps) with the newest k items of the topic, which must
+    // all hold exactly one array of this dtype and shape (e.g. a tensor topic). The items are copied straight into
+    // the returned array.
+    pybind11::tuple peek_window(const std::string &topic, int32_t k, const pybind11::object &dtype,
+                                const std::vector<int64_t> &shape, double timeout_s, bool automatic_resend);
     pybind11::tuple get_last_retrieved_data();
     pybind11::bytes request_with_data(const std::string &topic, const pybind11::bytes &data, double timeout_s, bool automatic_resend);
+    // If enabled, request_with_data asks the server for the timestamps of each stage of the request. The server must
+    // support tracing (it strips the trace item from the request).
+    void set_request_tracing(bool enabled);
+    // Durations in microseconds of the stages of the last traced request_with_data, or std::nullopt if it was not
+    // traced: client_request_us, network_us, server_queue_us, server_handler_us, server_reply_us, client_reply_us
+    // and total_us.
+    std::optional<std::map<std::string, int64_t>> get_last_request_trace();
+
+    // Statistics of the server, see RMQServer::get_stats
+    pybind11::object get_server_stats(double timeout_s);
+    std::string get_server_stats_text(double timeout_s);
 
     double get_timestamp();
     void reset_start_time(int64_t system_time_us);
 
+    // Estimates the offset of the server's timestamps relative to this client's (server time minus client time) and
+    // the round-trip time with an NTP-style exchange of num_samples SYNCHRONIZE_TIME requests. The sample with the
+    // shortest round trip gives the estimate. Returns the same dict as get_clock_offset.
+    std::map<std::string, double> synchronize_clock(int num_samples, double timeout_s);
+    // Repeats synchronize_clock every interval_s seconds on a background thread with its own connection.
+    void start_clock_sync(double interval_s, int num_samples);
+    void stop_clock_sync();
+    // offset_s, rtt_s, age_s (since the estimate was made) and num_samples of the latest estimate, or std::nullopt
+    // if the clock was never synchronized.
+    std::optional<std::map<std::string, double>> get_clock_offset();
+
+    // Whether the client can open the server's shared memory, as negotiated in a handshake on first use. Clients on
+    // another host (or in another /dev/shm namespace) receive shared memory data inline.
+    bool shares_host_with_server(double timeout_s);
+    // Overrides the negotiated transport. std::nullopt restores automatic negotiation.
+    void set_inline_payloads(std::optional<bool> enabled);
+    // Payloads larger than chunk_size_bytes are uploaded and downloaded in chunks, so that a timeout only resends the
+    // chunk in flight. 0 disables chunking.
+    void set_chunk_size(uint64_t chunk_size_bytes);
+    // callback(topic, transferred_bytes, total_bytes) is called after every chunk. None removes the callback.
+    void set_progress_callback(const pybind11::object &callback);
+    // Opens num_connections extra connections to the server and stripes the chunks of large transfers across them,
+    // one chunk in flight per connection. Other requests keep using the control connection. 0 (the default) sends
+    // chunks over the control connection.
+    void set_data_connections(int num_connections);
+
+    // Asynchronous put_data. Returns immediately; a background thread coalesces queued items of the same topic into
+    // one PUT_DATA request, which is sent when it reaches max_batch_messages or max_batch_bytes, or max_delay_s after
+    // its first item was queued. Items keep the timestamp of the put_data_async call. Returns false if the queue is
+    // full and the data was dropped.
+    bool put_data_async(const std::string &topic, const pybind11::bytes &data);
+    // Waits until all queued items are sent. Returns false on timeout.
+    bool flush_async_put(double timeout_s);
+    void set_async_put_options(uint64_t max_batch_messages, uint64_t max_batch_bytes, double max_delay_s,
+                               uint64_t max_queued_messages);
+    // callback(event, topic, num_messages, message) with event "dropped" or "error". Errors of the background thread
+    // are reported from the next put_data_async or flush_async_put call, on the calling thread.
+    void set_async_put_callback(const pybind11::object &callback);
+    std::unordered_map<std::string, uint64_t> get_async_put_stats();
+
   private:
     const int MAX_RETRIES_ = 800;
-    int retries_ = 0;
+    std::atomic<int> retries_{0};
     double default_timeout_s_ = 1.0;
     std::map<std::string, bool> topic_using_shared_memory_;
     std::vector<TimedPtr> deserialize_multiple_data_(const std::string &data);
-    std::vector<TimedPtr> send_request_(RMQMessage &message, double timeout_s, bool automatic_resend);
+    // Topic name -> (topic id, server session) as resolved by the server. Requests on resolved topics carry the id
+    // instead of the full name.
+    std::unordered_map<std::string, std::pair<uint32_t, uint32_t>> topic_ids_;
+    // Topic name -> session of the server that did not have the topic. These are addressed by name without resolving
+    // them again, until a request by name succeeds (the topic was added) or the session goes stale.
+    std::unordered_map<std::string, uint32_t> unresolved_topics_;
+    // Returns false if the topic cannot be resolved (e.g. it does not exist yet), in which case the name is used.
+    bool apply_topic_id_(RMQMessage &message, double timeout_s, bool automatic_resend);
+    RMQMessage exchange_(RMQMessage &message, double timeout_s, bool automatic_resend);
+    std::optional<bool> shares_host_;
+    std::optional<bool> inline_payloads_override_;
+    bool handshake_(double timeout_s, bool automatic_resend);
+    // format is "json" or "prometheus"
+    std::string get_server_stats_text_(double timeout_s, const std::string &format);
+    bool inline_payloads_(double timeout_s, bool automatic_resend);
+    std::string count_request_str_(int32_t n, double timeout_s, bool automatic_resend);
+
+    // Shared memory rings of the server, by segment id. Names come from RESOLVE_TOPIC; rings are mapped on first read.
+    struct ShmSegment
+    {
+        uint32_t session = 0;
+        std::string name;
+        uint64_t size = 0;
+        char *ptr = nullptr;
+        pthread_mutex_t *mutex_ptr = nullptr;
+    };
+    std::unordered_map<uint32_t, ShmSegment> shm_segments_;
+    // compressed is true if the request negotiated compression (see is_compression_negotiated)
+    pybind11::bytes read_data_(const Bytes &bytes, bool compressed);
+    pybind11::bytes read_shm_descriptor_(const ShmDescriptor &descriptor);
+    ShmSegment &map_shm_segment_(const ShmDescriptor &descriptor);
+    // Copies an item of exactly size bytes into dst
+    void read_data_into_(const Bytes &bytes, char *dst, uint64_t size, bool compressed);
+    void unmap_shm_segment_(ShmSegment &segment);
+    // Sends the request and checks that the reply matches it
+    RMQMessage send_raw_request_(RMQMessage &message, double timeout_s, bool automatic_resend);
+    // Releases lock while chunked items of the reply are fetched over the data connections
+    std::vector<TimedPtr> send_request_(RMQMessage &message, double timeout_s, bool automatic_resend,
+                                        std::unique_lock<std::recursive_mutex> &lock);
+    std::atomic<uint64_t> chunk_size_bytes_{4 * 1024 * 1024};
+    pybind11::object progress_callback_ = pybind11::none();
+    std::string server_endpoint_;
+    std::vector<zmq::socket_t> data_sockets_;
+    // Python threads may share a client. mutex_ guards the control connection and the state of the client, and
+    // data_mutex_ the data connections, so that control requests go on while a chunked transfer holds data_mutex_.
+    // data_mutex_ is never locked while holding mutex_.
+    std::recursive_mutex mutex_;
+    std::mutex data_mutex_;
+    void reconnect_(zmq::socket_t &socket);
+    // Drops topic ids and shared memory segments issued by a server session that no longer exists
+    void forget_session_(uint32_t stale_session);
+    // Sends num_requests requests over the data connections, at most one in flight per connection. on_reply returns
+    // how many requests the server accepts in flight; 0 means the request was not accepted and is sent again later.
+    // Returns false if the server was restarted during the exchange.
+    bool exchange_striped_(size_t num_requests, const std::function<RMQMessage(size_t)> &make_request,
+                           const std::function<uint32_t(size_t, RMQMessage &)> &on_reply, double timeout_s,
+                           bool automatic_resend);
+    void report_progress_(const std::string &topic, uint64_t transferred_bytes, uint64_t total_bytes);
+    void put_data_chunked_(const std::string &topic, const char *data, uint64_t size, double timestamp,
+                           double timeout_s, bool automatic_resend);
+    // Replaces the ChunkedItemStubs in ptrs with the items fetched from the server
+    void fetch_chunked_items_(const std::string &topic, std::vector<TimedPtr> &ptrs, double timeout_s,
+                              bool automatic_resend);
     pybind11::tuple ptrs_to_tuple_(const std::vector<TimedPtr> &ptrs);
+    // Asynchronous put_data
+    struct AsyncPutItem
+    {
+        std::string topic;
+        BytesPtr data_ptr;
+        double timestamp;
+    };
+    struct AsyncPutEvent
+    {
+        std::string event;
+        std::string topic;
+        uint64_t num_messages;
+        std::string message;
+    };
+    static constexpr int ASYNC_PUT_MAX_RESENDS_ = 3;
+    MPSCQueue<AsyncPutItem> async_put_queue_;
+    std::once_flag async_put_thread_started_;
+    std::thread async_put_thread_;
+    std::atomic<bool> async_put_running_{true};
+    std::atomic<uint64_t> async_put_max_batch_messages_{256};
+    std::atomic<uint64_t> async_put_max_batch_bytes_{1024 * 1024};
+    std::atomic<double> async_put_max_delay_s_{0.005};
+    std::atomic<uint64_t> async_put_capacity_{4096};
+    std::atomic<uint64_t> async_put_enqueued_{0};
+    std::atomic<uint64_t> async_put_enqueued_bytes_{0};
+    std::atomic<uint64_t> async_put_dropped_{0};
+    std::atomic<uint64_t> async_put_sent_{0};
+    std::atomic<uint64_t> async_put_sent_requests_{0};
+    std::atomic<uint64_t> async_put_failed_{0};
+    std::atomic<uint64_t> async_put_processed_{0};
+    std::atomic<uint64_t> async_put_max_queue_size_{0};
+    std::mutex async_put_events_mutex_;
+    std::vector<AsyncPutEvent> async_put_events_;
+    pybind11::object async_put_callback_ = pybind11::none();
+    void async_put_loop_();
+    void send_async_put_batch_(zmq::socket_t &socket, const std::string &topic, const std::vector<TimedPtr> &ptrs);
+    void report_async_put_events_();
+
+    // Clock synchronization. Client times are kept on the steady clock so that reset_start_time does not invalidate
+    // the estimate.
+    struct ClockEstimate
+    {
+        double offset_s; // Server timestamp minus the client's steady clock in seconds
+        double rtt_s;
+        int64_t steady_time_us;
+        int num_samples;
+    };
+    std::mutex clock_mutex_;
+    std::optional<ClockEstimate> clock_estimate_;
+    std::thread clock_sync_thread_;
+    std::atomic<bool> clock_sync_running_{false};
+    // Returns false if none of the samples got a reply
+    bool synchronize_clock_(zmq::socket_t &socket, int num_samples, double timeout_s);
+    void clock_sync_loop_(double interval_s, int num_samples);
+
     std::string client_name_;
     std::shared_ptr<spdlog::logger> logger_;
     zmq::context_t context_;
     zmq::socket_t socket_;
     std::vector<TimedPtr> last_retrieved_ptrs_;
-    int64_t steady_clock_start_time_us_;
+    bool last_retrieved_compressed_ = false;
+    bool request_tracing_ = false;
+    std::optional<std::map<std::string, int64_t>> last_request_trace_;
+    std::atomic<int64_t> steady_clock_start_time_us_;
 };
@@ -19,10 +19,55 @@ enum class CmdType : int8_t
     SYNCHRONIZE_TIME = 4,
     PUT_DATA = 5,
     GET_TOPIC_STATUS = 6,
+    RESOLVE_TOPIC = 7,
+    HANDSHAKE = 8,
+    PUT_CHUNK = 9,   // One chunk of a large put_data, see RMQClient::put_data_chunked_
+    FETCH_CHUNK = 10, // One chunk of a large item that was replaced by a ChunkedItemStub
+    GET_STATS = 11,   // Server statistics as JSON, or as Prometheus text if the request data is "prometheus"
+    CONSUME_DATA = 12, // Data is [int32 n][uint8 flags][consumer group name], see DataTopic::consume_data_ptrs
     ERROR = -1,
+    STALE_TOPIC_ID = -2, // The topic id was issued by a different server instance. The client should resolve again.
     UNKNOWN = 0,
 };
 
+// Optional flags byte after the item count of PEEK_DATA and POP_DATA requests
+constexpr uint8_t INLINE_SHM_DATA_FLAG = 1; // The client cannot open the server's shared memory
+constexpr uint8_t ACCEPT_LZ4_FLAG = 2;      // The client can decode lz4 compressed payloads
+constexpr uint8_t ACCEPT_ZSTD_FLAG = 4;     // The client can decode zstd compressed payloads
+constexpr uint8_t ACCEPT_CHUNKED_FLAG = 8;  // Large items may be replaced by stubs and fetched in chunks
+// A PEEK_DATA request may carry a uint64 put sequence after the flags byte. Only the items put after the item with
+// that sequence are then considered (see DataTopic::peek_data_ptrs_after), and the reply ends with an extra
+// [uint32 session][uint64 cursor] item. A poller (e.g. a relay) passes the cursor to its next request to receive every
+// item once; sequences are only valid within the session of the server that assigned them.
+
+// A REQUEST_WITH_DATA request carries the payload item followed by a one-byte flags item
+constexpr uint8_t REQUEST_TRACE_FLAG = 1; // The reply ends with the RequestTrace of the request
+
+// Written in place of the topic length by messages addressed by topic id: [0xFF][uint32 topic_id][uint32 session].
+// Topic names are therefore at most 254 bytes long.
+constexpr uint8_t TOPIC_ID_MARKER = 0xFF;
+
+// Data of a PUT_CHUNK request, followed by the chunk payload. The reply data is [uint32 credits][uint32 num_missing].
+// A header without payload and with chunk_index equal to the number of chunks asks which chunks the server still
+// lacks, e.g. after part of the upload expired. That reply is followed by the uint32 indices of the missing chunks.
+struct PutChunkHeader
+{
+    uint64_t transfer_id; // Chosen by the client
+    uint64_t total_size_bytes;
+    uint32_t chunk_size_bytes;
+    uint32_t chunk_index;
+    double timestamp;
+};
+// Data of a FETCH_CHUNK request. The reply data is the requested range of the item.
+struct FetchChunkRequest
+{
+    uint64_t transfer_id; // From the ChunkedItemStub
+    uint32_t chunk_size_bytes;
+    uint32_t chunk_index;
+};
+
+std::string cmd_type_to_string(CmdType cmd);
+
 class RMQMessage
 {
   public:
@@ -30,11 +75,18 @@ class RMQMessage
     RMQMessage(const std::string &topic, CmdType cmd, double timestamp, const std::string &data_str);
     RMQMessage(const std::string &serialized);
 
-    std::string topic() const;
+    // Messages either carry the full topic name or a compact topic id obtained from RESOLVE_TOPIC. The id is only
+    // valid together with the session of the server that issued it. Decoded id messages have an empty topic().
+    const std::string &topic() const;
+    bool has_topic_id() const;
+    uint32_t topic_id() const;
+    uint32_t server_session() const;
+    void set_topic_id(uint32_t topic_id, uint32_t server_session);
+    void clear_topic_id();
     CmdType cmd() const;
     double timestamp() const;
     std::vector<TimedPtr> data_ptrs();
-    std::string data_str(); // Should avoid using because it may copy a large amount of data
+    const std::string &data_str(); // Should avoid using because it may encode a large amount of data
     std::string serialize();
 
   private:
@@ -42,6 +94,9 @@ class RMQMessage
     void decode_data_blocks_();
     void check_input_validity_();
     std::string topic_;
+    bool has_topic_id_ = false;
+    uint32_t topic_id_ = 0;
+    uint32_t server_session_ = 0;
     CmdType cmd_;
     double timestamp_;
     std::vector<TimedPtr> data_ptrs_;
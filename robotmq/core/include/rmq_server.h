@@ -7,37 +7,130 @@
 
 #pragma once
 
+#include <pybind11/numpy.h>
 #include <zmq.hpp>
 
+#include <array>
+#include <atomic>
+#include <condition_variable>
 #include <deque>
+#include <fstream>
 #include <mutex>
+#include <optional>
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "common.h"
 #include "data_topic.h"
+#include "mpsc_queue.h"
+#include "stats.h"
+#include "topic_registry.h"
 #include "rmq_message.h"
 #include "spdlog/spdlog.h"
 class RMQServer
 {
   public:
     RMQServer(const std::string &server_name, const std::string &server_endpoint); // Default log level is info
-    RMQServer(const std::string &server_name, const std::string &server_endpoint, spdlog::level::level_enum log_level);
+    // With persistent_shm, shared memory segments are named after the server and topic only and are kept when the
+    // server exits. The topics are listed in a topic index (/dev/shm/rmq_<user>_<server_name>_topics), from which a
+    // restarting server with the same name adds them again and reattaches to their rings, so that the items stored in
+    // shared memory survive the restart. Only one server of a name may run with persistent_shm at a time.
+    RMQServer(const std::string &server_name, const std::string &server_endpoint, spdlog::level::level_enum log_level,
+              bool persistent_shm = false);
     ~RMQServer();
     void add_topic(const std::string &topic, double message_remaining_time_s);
     void add_shared_memory_topic(const std::string &topic, double message_remaining_time_s,
                                  double shared_memory_size_gb);
+    // Topic of numpy arrays with a fixed dtype and shape, stored in `capacity` preallocated slots (in shared memory
+    // if shared_memory is true). Puts copy into the next slot and overwrite the oldest item when all slots are used.
+    void add_tensor_topic(const std::string &topic, const pybind11::object &dtype, const std::vector<int64_t> &shape,
+                          uint64_t capacity, double message_remaining_time_s, bool shared_memory);
+    // Compress data of this topic sent to clients on other hosts. compression is "none", "lz4" or "zstd". level is
+    // the zstd level or the lz4 acceleration (0 uses the codec default).
+    void set_topic_compression(const std::string &topic, const std::string &compression, int level);
     void put_data(const std::string &topic, const pybind11::bytes &data);
-    pybind11::tuple peek_data(const std::string &topic, int n);
-    pybind11::tuple pop_data(const std::string &topic, int n);
+    // Items larger than chunk_size_bytes are sent to remote clients in chunks. Uploads in chunks are accepted as long
+    // as the incomplete ones add up to at most max_pending_upload_bytes.
+    void set_chunking(uint64_t chunk_size_bytes, uint64_t max_pending_upload_bytes);
+    // Copies the payload once and hands it to the ingestion thread without taking the topic lock. Returns false if
+    // the payload was dropped because the ingestion queue is full.
+    bool put_data_async(const std::string &topic, const pybind11::bytes &data);
+    bool flush_async_put(double timeout_s);
+    void set_async_put_capacity(uint64_t max_queued_messages);
+    std::unordered_map<std::string, uint64_t> get_async_put_stats();
+    // Returns (handle, writable uint8 numpy array). The array refers directly to the topic storage (the shm ring for
+    // shared memory topics) and must not be used after commit or cancel.
+    pybind11::tuple reserve(const std::string &topic, uint64_t nbytes);
+    void commit(uint64_t handle, std::optional<double> timestamp);
+    void cancel(uint64_t handle);
+    // Serializes obj with serialize_object directly into the topic storage (the shm ring for shared memory topics),
+    // so that arrays are copied once.
+    void put_object(const std::string &topic, const pybind11::object &obj);
+    void put_tensor(const std::string &topic, const pybind11::array &array);
+    // Returns (list of arrays, list of timestamps). If copy is false, the arrays are read-only views of the slots,
+    // which stay valid until `capacity` more items are put.
+    pybind11::tuple peek_tensor(const std::string &topic, int n, bool copy);
+    // Returns (array of shape (count, *shape), list of timestamps) with the newest k items of a tensor topic. If copy
+    // is false and the slots are contiguous in the ring, the array is a read-only strided view of them.
+    pybind11::tuple peek_window(const std::string &topic, int k, bool copy);
+    // If copy is false, items of regular topics are returned as read-only RMQBytesView objects that share the stored
+    // buffer instead of being copied into new bytes objects.
+    pybind11::tuple peek_data(const std::string &topic, int n, bool copy);
+    pybind11::tuple pop_data(const std::string &topic, int n, bool copy);
+    // Returns items of the topic that the consumer group has not consumed yet, see DataTopic::consume_data_ptrs
+    pybind11::tuple consume_data(const std::string &topic, const std::string &group, int n, bool copy);
+    // Removes the cursor of the group, so that it no longer holds back the release of items
+    void remove_consumer_group(const std::string &topic, const std::string &group);
+    // Group name -> number of stored items the group has not consumed yet
+    std::unordered_map<std::string, uint64_t> get_consumer_groups(const std::string &topic);
     pybind11::tuple wait_for_request(double timeout_s);
     void reply_request(const std::string &topic, const pybind11::bytes &data);
     double get_timestamp();
     void reset_start_time(int64_t system_time_us);
 
     std::unordered_map<std::string, int> get_all_topic_status();
+    // Counters per topic and per command, and histograms of the time the background thread spent on each request.
+    // Clients read the same statistics with a GET_STATS request.
+    pybind11::object get_stats();
+    // The statistics in the Prometheus text exposition format
+    std::string get_stats_text();
+    // Records the items put into the given topics (all topics if empty) to an append-only log at path, with an index
+    // at path + ".idx". Items are queued for a writer thread, so puts never wait for the disk; items are dropped
+    // while more than max_queued_bytes are waiting to be written. Read the log with RMQLogReader.
+    void start_recording(const std::string &path, const std::vector<std::string> &topics, uint64_t max_queued_bytes);
+    // Writes the queued items and closes the log
+    void stop_recording();
+    std::unordered_map<std::string, uint64_t> get_recording_stats();
+    // Republishes the items of a recorded log into the topics of this server from a C++ thread. Items keep their
+    // recorded spacing divided by speed (speed <= 0 replays as fast as possible), starting at the first item at or
+    // after start_timestamp, and get the server's current timestamp. Only the given topics are replayed (all if
+    // empty). Missing topics are added as they were recorded if create_topics is true, otherwise their items are
+    // skipped. With loop, the replay starts over at the end of the log until stop_replay is called.
+    void start_replay(const std::string &path, const std::vector<std::string> &topics, double speed,
+                      std::optional<double> start_timestamp, bool loop, bool create_topics);
+    void stop_replay();
+    // Waits until a replay without loop has put all items. Returns false on timeout.
+    bool wait_for_replay(double timeout_s);
+    std::unordered_map<std::string, uint64_t> get_replay_stats();
+    // Mirrors topics of the server at upstream_endpoint into the topics of the same names of this server, which must
+    // exist (e.g. as shared memory topics, so that local clients read the items from shared memory). A thread polls
+    // upstream every poll_interval_s for the items after the newest item it has relayed, so every item crosses the
+    // network once. Relayed items keep their age: their timestamps are moved to this server's clock by the offset
+    // between the upstream reply and its arrival.
+    void start_relay(const std::string &upstream_endpoint, const std::vector<std::string> &topics,
+                     double poll_interval_s, double timeout_s);
+    // Stops the relay from upstream_endpoint, or all relays if it is empty
+    void stop_relay(const std::string &upstream_endpoint);
+    std::unordered_map<std::string, uint64_t> get_relay_stats();
+    // Writes the stages of every request_with_data (waiting for wait_for_request, handling, reply) as Chrome
+    // trace-event JSON to path, which can be opened in chrome://tracing or Perfetto. An empty path stops the export.
+    void set_trace_export(const std::string &path);
+    // Removes the shared memory and the topic index of a persistent server when it exits, like a server without
+    // persistent_shm
+    void discard_persistent_state();
 
   private:
     const std::string server_name_;
@@ -48,7 +141,6 @@ class RMQServer
     zmq::pollitem_t poller_item_;
     const std::chrono::milliseconds poller_timeout_ms_;
     std::thread background_thread_;
-    std::mutex data_topic_mutex_;
     std::string get_new_request_ = "";
     std::mutex get_new_request_mutex_;
     std::string reply_topic_ = "";
@@ -57,17 +149,189 @@ class RMQServer
     // Cache for deduplicating REQUEST_WITH_DATA retries
     std::unordered_map<std::string, double> last_request_timestamp_;
     std::unordered_map<std::string, std::string> cached_reply_data_;
+    // Same for CONSUME_DATA, by topic and consumer group, so that a retry does not move the cursor again
+    std::unordered_map<std::string, double> last_consume_timestamp_;
+    std::unordered_map<std::string, std::string> cached_consume_reply_;
 
-    std::unordered_map<std::string, DataTopic> data_topics_;
+    // Topics are looked up without a server-wide lock. Each DataTopic has its own lock.
+    TopicRegistry topics_;
+    // Adds a topic as described in a log or the topic index
+    void add_topic_from_info_(const LogTopicInfo &info);
+    // Logs why an add_* call for an existing topic is ignored
+    void log_existing_topic_(const LogTopicInfo &requested);
+    uint32_t session_id_;
+    std::string shm_host_token_;
+    std::atomic<uint32_t> next_shm_segment_id_{0};
+
+    // Persistent shared memory. The topic index file stays locked while the server runs.
+    static constexpr uint32_t TOPIC_INDEX_MAGIC_ = 0x130d0a0d; // "\x0d\x0a\x0d\x13"
+    const bool persistent_shm_;
+    std::atomic<bool> discard_persistent_state_{false};
+    std::string topic_index_path_;
+    int topic_index_fd_ = -1;
+    std::mutex topic_index_mutex_;
+    bool restoring_topic_index_ = false; // The topics added while restoring are already in the index
+    void restore_topic_index_();
+    void save_topic_index_();
+
+    struct Reservation
+    {
+        std::string topic;
+        BytesPtr heap_data; // Only used by topics without shared memory
+    };
+    std::mutex reservation_mutex_;
+    uint64_t next_reservation_handle_ = 1;
+    std::unordered_map<uint64_t, Reservation> reservations_;
     std::shared_ptr<spdlog::logger> logger_;
 
     void process_request_(RMQMessage &message);
 
+    DataTopic *find_tensor_topic_(const std::string &topic);
+    pybind11::tuple ptrs_to_tuple_(const std::string &topic, const std::vector<TimedPtr> &ptrs, bool copy);
     std::vector<TimedPtr> peek_data_ptrs_(const std::string &topic, int32_t n);
     std::vector<TimedPtr> pop_data_ptrs_(const std::string &topic, int32_t n);
-    void add_data_ptrs_(const std::string &topic, const std::vector<TimedPtr> &data_ptrs);
-    bool exists_topic_(const std::string &topic);
+    DataTopic *find_topic_(const std::string &topic);
+    // Chunked transfers. Only used by the background thread.
+    struct IncomingTransfer
+    {
+        std::string topic;
+        BytesPtr data;
+        uint32_t chunk_size_bytes;
+        uint32_t num_chunks;
+        uint32_t num_missing;
+        std::vector<bool> received;
+        double timestamp;
+        double last_active_time;
+    };
+    struct OutgoingTransfer
+    {
+        BytesPtr data;
+        uint32_t chunk_size_bytes = 0;
+        uint32_t num_missing = 0;
+        std::vector<bool> served; // Dropped once every chunk has been fetched
+        double last_active_time;
+    };
+    static constexpr double TRANSFER_TIMEOUT_S_ = 30.0;
+    static constexpr uint32_t MAX_CHUNK_CREDITS_ = 8; // Chunks a client may have in flight per transfer
+    std::atomic<uint64_t> chunk_size_bytes_{4 * 1024 * 1024};
+    std::atomic<uint64_t> max_pending_upload_bytes_{4ull * 1024 * 1024 * 1024};
+    uint64_t pending_upload_bytes_ = 0;
+    std::unordered_map<uint64_t, IncomingTransfer> incoming_transfers_;
+    std::deque<uint64_t> completed_transfer_ids_;
+    std::unordered_map<uint64_t, OutgoingTransfer> outgoing_transfers_;
+    uint64_t next_outgoing_transfer_id_ = 1;
+    std::vector<TimedPtr> stub_large_items_(const std::vector<TimedPtr> &ptrs);
+    void process_put_chunk_(RMQMessage &message, DataTopic *data_topic, const std::string &topic);
+    void reply_missing_chunks_(RMQMessage &message, const PutChunkHeader &header, const std::string &topic);
+    void process_fetch_chunk_(RMQMessage &message, const std::string &topic);
+    void expire_transfers_();
+
+    // Serializes and sends the reply, addressing it the same way (by name or by id) as the request.
+    std::string send_reply_(const RMQMessage &request, RMQMessage &reply);
+
+    // Statistics of the requests served by the background thread, indexed by command type + 2
+    struct CommandStats
+    {
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> errors{0};
+        std::atomic<uint64_t> bytes_in{0};
+        std::atomic<uint64_t> bytes_out{0};
+        Log2Histogram service_time_us;
+    };
+    static constexpr int NUM_COMMAND_STATS_ = 16;
+    std::array<CommandStats, NUM_COMMAND_STATS_> command_stats_;
+    int64_t stats_start_time_us_;
+    // Of the request being processed. Only used by the background thread.
+    uint64_t reply_bytes_ = 0;
+    bool reply_is_error_ = false;
+    static int command_stats_index_(CmdType cmd);
+    void record_request_stats_(CmdType cmd, uint64_t request_bytes, int64_t service_time_us);
+    std::string stats_json_();
     std::function<TimedPtr(const TimedPtr)> request_with_data_handler_;
 
+    // When the background thread received the request being processed (also used by SYNCHRONIZE_TIME), and the
+    // stage timestamps of request_with_data set by the thread that calls wait_for_request and reply_request.
+    int64_t request_received_us_ = 0;
+    std::atomic<int64_t> request_dispatched_us_{0};
+    std::atomic<int64_t> request_replied_us_{0};
+    // Traces are queued by the background thread and written to the file by trace_export_thread_
+    struct TraceExportItem
+    {
+        std::string topic;
+        int64_t tid;
+        RequestTrace trace;
+    };
+    MPSCQueue<TraceExportItem> trace_export_queue_;
+    std::once_flag trace_export_thread_started_;
+    std::thread trace_export_thread_;
+    std::atomic<bool> trace_export_enabled_{false};
+    std::atomic<uint64_t> trace_export_enqueued_{0};
+    std::atomic<uint64_t> trace_export_processed_{0};
+    std::mutex trace_export_mutex_;
+    std::ofstream trace_export_file_;
+    bool trace_export_empty_ = true;
+    std::unordered_set<int64_t> trace_export_named_topics_;
+    void export_request_trace_(const std::string &topic, const RequestTrace &trace);
+    void trace_export_loop_();
+    void write_request_trace_(const TraceExportItem &item);
+    void close_trace_export_();
+
+    std::mutex recording_mutex_;
+    std::unique_ptr<LogWriter> recorder_;
+    std::vector<DataTopic *> recorded_topics_;
+
+    std::mutex replay_mutex_;
+    std::thread replay_thread_;
+    std::atomic<bool> replay_running_{false};
+    // Notified when replay_running_ becomes false, which wakes the pacing of replay_loop_ and wait_for_replay
+    std::mutex replay_wait_mutex_;
+    std::condition_variable replay_wait_cv_;
+    void end_replay_();
+    // Items are due within the wakeup latency of a sleep, so the replay spins for this long before each item
+    static constexpr int64_t REPLAY_SPIN_US_ = 50;
+    std::atomic<uint64_t> replay_records_{0};
+    std::atomic<uint64_t> replay_records_total_{0};
+    std::atomic<uint64_t> replay_errors_{0};
+    std::atomic<uint64_t> replay_max_lag_us_{0};
+    // stream_topics holds the topic of each stream of the log, or nullptr if the stream is not replayed
+    void replay_loop_(std::shared_ptr<LogReader> reader, std::vector<DataTopic *> stream_topics, double speed,
+                      uint64_t first_record, bool loop);
+
+    struct Relay
+    {
+        std::string upstream_endpoint;
+        std::vector<std::string> topics;
+        double poll_interval_s;
+        double timeout_s;
+        std::atomic<bool> running{true};
+        std::thread thread;
+    };
+    std::mutex relays_mutex_;
+    std::unordered_map<std::string, std::unique_ptr<Relay>> relays_; // By upstream endpoint
+    std::atomic<uint64_t> relay_items_{0};
+    std::atomic<uint64_t> relay_bytes_{0};
+    std::atomic<uint64_t> relay_requests_{0};
+    std::atomic<uint64_t> relay_timeouts_{0};
+    std::atomic<uint64_t> relay_errors_{0};
+    void relay_loop_(Relay *relay);
+
     void background_loop_();
+
+    // Asynchronous put_data
+    struct AsyncPutItem
+    {
+        std::string topic;
+        BytesPtr data_ptr;
+        double timestamp;
+    };
+    MPSCQueue<AsyncPutItem> async_put_queue_;
+    std::once_flag async_put_thread_started_;
+    std::thread async_put_thread_;
+    std::atomic<uint64_t> async_put_capacity_{4096};
+    std::atomic<uint64_t> async_put_enqueued_{0};
+    std::atomic<uint64_t> async_put_enqueued_bytes_{0};
+    std::atomic<uint64_t> async_put_dropped_{0};
+    std::atomic<uint64_t> async_put_processed_{0};
+    std::atomic<uint64_t> async_put_max_queue_size_{0};
+    void async_put_loop_();
 };
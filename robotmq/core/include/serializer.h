@@ -0,0 +1,81 @@
+/**
+ * Copyright (c) 2024 Yihuai Gao
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#pragma once
+#include <cstdint>
+#include <pybind11/numpy.h>
+#include <pybind11/pybind11.h>
+#include <string>
+#include <vector>
+
+// Binary encoding of nested dict/list/tuple/str/bytes/int/float/bool/None/ndarray objects:
+// [SerializedObjectHeader][tree][padding][array buffers, each aligned to ARRAY_ALIGNMENT bytes]
+// The tree describes the structure and refers to the array buffers by offset, so arrays are copied exactly once
+// when encoding and can be viewed in place when decoding. Other objects are pickled into the tree.
+struct SerializedObjectHeader
+{
+    static constexpr uint32_t MAGIC = 0x100d0a0d; // "\x0d\x0a\x0d\x10"
+    static constexpr uint32_t VERSION = 1;
+    static constexpr uint64_t ARRAY_ALIGNMENT = 64;
+    static constexpr int MAX_DEPTH = 512; // Nesting limit of the tree, checked when encoding and decoding
+    uint32_t magic;
+    uint32_t version;
+    uint64_t tree_size_bytes;
+    uint64_t data_offset; // Offset of the first array buffer from the start of the header
+    uint64_t total_size_bytes;
+};
+static_assert(sizeof(SerializedObjectHeader) == 32, "SerializedObjectHeader must be 32 bytes");
+
+enum class SerializedObjectTag : uint8_t
+{
+    NONE = 0,
+    FALSE = 1,
+    TRUE = 2,
+    INT = 3,
+    FLOAT = 4,
+    STR = 5,
+    BYTES = 6,
+    LIST = 7,
+    TUPLE = 8,
+    DICT = 9,
+    NDARRAY = 10,
+    PICKLE = 11,
+};
+
+bool is_serialized_object(const char *data, size_t size);
+
+// Plans the layout of an object once, then writes it into any buffer of size() bytes.
+class ObjectEncoder
+{
+  public:
+    explicit ObjectEncoder(const pybind11::handle &obj);
+    uint64_t size() const;
+    void write(char *dst) const;
+
+  private:
+    struct ArrayBlock
+    {
+        pybind11::array array;
+        uint64_t offset; // From the start of the array section
+    };
+    void encode_(PyObject *obj, int depth);
+    void encode_pickle_(PyObject *obj);
+    void append_tag_(SerializedObjectTag tag);
+    template <typename T> void append_value_(T value);
+
+    std::string tree_;
+    std::vector<ArrayBlock> arrays_;
+    uint64_t data_offset_ = 0;
+    uint64_t data_size_bytes_ = 0;
+};
+
+pybind11::bytes serialize_object(const pybind11::object &obj);
+uint64_t serialized_object_size(const pybind11::object &obj);
+// Returns the number of bytes written into the writable buffer
+uint64_t serialize_object_into(const pybind11::object &obj, const pybind11::object &buffer);
+// With copy=false, arrays are views of `data` (read-only if `data` is) and keep it alive.
+pybind11::object deserialize_object(const pybind11::object &data, bool copy);
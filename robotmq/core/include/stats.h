@@ -0,0 +1,42 @@
+/**
+ * Copyright (c) 2024 Yihuai Gao
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#pragma once
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Histogram with power-of-two buckets: bucket 0 counts the value 0 and bucket i counts values in [2^(i-1), 2^i).
+// Recording is a few relaxed atomic increments, so it can be used on the hot path and read from any thread.
+class Log2Histogram
+{
+  public:
+    static constexpr int NUM_BUCKETS = 40;
+
+    void record(uint64_t value);
+    uint64_t count() const;
+    uint64_t sum() const;
+    uint64_t max() const;
+    uint64_t bucket_count(int bucket) const;
+    // Exclusive upper bound of the values in a bucket
+    static uint64_t bucket_upper_bound(int bucket);
+    // Upper bound of the bucket that contains the given percentile (0-100), or 0 if nothing was recorded
+    uint64_t percentile(double percentile) const;
+    // {"count": ..., "sum": ..., "max": ..., "p50": ..., "p99": ..., "p999": ..., "buckets": [[upper bound, count],
+    // ...]}, listing only the non-empty buckets
+    std::string to_json() const;
+
+  private:
+    std::array<std::atomic<uint64_t>, NUM_BUCKETS> buckets_{};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> max_{0};
+};
+
+// Escapes a string for use inside a JSON string literal
+std::string json_escape(const std::string &str);
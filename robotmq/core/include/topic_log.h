@@ -0,0 +1,224 @@
+/**
+ * Copyright (c) 2024 Yihuai Gao
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#pragma once
+#include "common.h"
+#include "mpsc_queue.h"
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Recorded topics are stored in an append-only log file. The file starts with a LogFileHeader, followed by 8-byte
+// aligned records, each a LogRecordHeader and its payload. The first num_topics records describe the recorded topics;
+// the DATA records after them refer to a topic by its stream id (its position among the topic records). A sidecar
+// index file (path + ".idx") holds one LogIndexEntry per DATA record, so that readers find a record by position or
+// time without scanning the log. Both files are written through memory mappings that grow in large steps.
+
+struct LogFileHeader
+{
+    static constexpr uint64_t MAGIC = 0x01474f4c514d52; // "RMQLOG\x01\0"
+    static constexpr uint32_t VERSION = 1;
+    uint64_t magic;
+    uint32_t version;
+    uint32_t num_topics;
+    // Extent of the complete records and the number of DATA records among them. Updated by the writer every few
+    // records or milliseconds and when it runs idle, so a log that is still being recorded (or was not closed) can be
+    // read up to here.
+    uint64_t end_offset;
+    uint64_t num_records;
+};
+static_assert(std::is_trivially_copyable<LogFileHeader>::value && sizeof(LogFileHeader) == 32,
+              "LogFileHeader must keep a fixed binary layout");
+
+enum class LogRecordType : uint32_t
+{
+    TOPIC = 1,
+    DATA = 2,
+};
+
+struct LogRecordHeader
+{
+    static constexpr uint32_t MAGIC = 0x120d0a0d; // "\x0d\x0a\x0d\x12"
+    uint32_t magic;
+    LogRecordType type;
+    uint32_t stream_id;
+    uint32_t reserved;
+    uint64_t sequence; // Position of the item among all puts into the topic, starting at 1
+    double timestamp;  // Timestamp of the put on the server's clock
+    uint64_t size;     // Payload size, without the padding to 8 bytes
+};
+static_assert(std::is_trivially_copyable<LogRecordHeader>::value && sizeof(LogRecordHeader) == 40,
+              "LogRecordHeader must keep a fixed binary layout");
+
+struct LogIndexEntry
+{
+    // The largest timestamp recorded up to and including this record. Timestamps are only nearly ordered (puts from
+    // clients carry the client's timestamp), so the running maximum keeps the index sorted for binary search.
+    double timestamp;
+    uint64_t offset;
+};
+static_assert(sizeof(LogIndexEntry) == 16, "LogIndexEntry must keep a fixed binary layout");
+
+// Everything needed to add the topic to a server again
+struct LogTopicInfo
+{
+    enum Kind : uint8_t
+    {
+        REGULAR = 0,
+        SHARED_MEMORY = 1,
+        TENSOR = 2,
+    };
+    std::string name;
+    Kind kind = REGULAR;
+    double message_remaining_time_s = 0;
+    double shared_memory_size_gb = 0; // Shared memory topics
+    std::string dtype;                // Tensor topics
+    std::vector<int64_t> shape;
+    uint64_t capacity = 0;
+    bool shared_memory = false;
+
+    std::string serialize() const;
+    static LogTopicInfo parse(const std::string &bytes);
+};
+
+// File that grows by remapping, for append-only writing
+class MappedAppendFile
+{
+  public:
+    MappedAppendFile() = default;
+    ~MappedAppendFile();
+    MappedAppendFile(const MappedAppendFile &) = delete;
+    MappedAppendFile &operator=(const MappedAppendFile &) = delete;
+
+    void open(const std::string &path);
+    // Returns a pointer to size writable bytes at offset, growing the file if needed. Invalidated by the next call.
+    char *at(uint64_t offset, uint64_t size);
+    // Truncates the file to size and closes it
+    void close(uint64_t size);
+
+  private:
+    static constexpr uint64_t GROWTH_BYTES_ = 64 * 1024 * 1024;
+    std::string path_;
+    int fd_ = -1;
+    char *ptr_ = nullptr;
+    uint64_t capacity_ = 0;
+};
+
+// Writes a log on its own thread. record() only queues the item, so puts never wait for the disk. Items are dropped
+// (and counted) while the queued items exceed max_queued_bytes.
+class LogWriter
+{
+  public:
+    LogWriter(const std::string &path, const std::vector<LogTopicInfo> &topics, uint64_t max_queued_bytes);
+    ~LogWriter(); // Calls close()
+    LogWriter(const LogWriter &) = delete;
+    LogWriter &operator=(const LogWriter &) = delete;
+
+    // Shares data_ptr, which must not be modified afterwards. Returns false if the item was dropped.
+    bool record(uint32_t stream_id, uint64_t sequence, double timestamp, const BytesPtr &data_ptr);
+    // Copies the data
+    bool record(uint32_t stream_id, uint64_t sequence, double timestamp, const char *data, uint64_t size);
+    // Writes the queued items and closes the files. Idempotent.
+    void close();
+
+    uint64_t records_written() const;
+    uint64_t bytes_written() const;
+    uint64_t records_dropped() const;
+    uint64_t queued_bytes() const;
+    // Why the writer stopped writing (e.g. the disk is full), or an empty string
+    std::string error() const;
+
+  private:
+    struct Item
+    {
+        uint32_t stream_id;
+        uint64_t sequence;
+        double timestamp;
+        BytesPtr data_ptr;
+    };
+    bool reserve_queue_(uint64_t size);
+    void write_loop_();
+    void write_record_(LogRecordType type, uint32_t stream_id, uint64_t sequence, double timestamp,
+                       const char *data, uint64_t size);
+    void commit_header_();
+    // A busy writer commits the header at least this often
+    static constexpr uint64_t COMMIT_INTERVAL_RECORDS_ = 256;
+    static constexpr int64_t COMMIT_INTERVAL_US_ = 5000;
+
+    std::string path_;
+    MappedAppendFile log_file_;
+    MappedAppendFile index_file_;
+    uint32_t num_topics_;
+    uint64_t max_queued_bytes_;
+    // Only used by the writer thread after construction
+    uint64_t end_offset_ = 0;
+    uint64_t num_records_ = 0;
+    double max_timestamp_ = 0;
+
+    MPSCQueue<Item> queue_;
+    std::atomic<uint64_t> queued_bytes_{0};
+    std::atomic<uint64_t> records_written_{0};
+    std::atomic<uint64_t> bytes_written_{0};
+    std::atomic<uint64_t> records_dropped_{0};
+    std::atomic<bool> running_{true};
+    mutable std::mutex error_mutex_;
+    std::string error_;
+    std::thread thread_;
+};
+
+// Reads a log written by LogWriter through a read-only mapping. A log that is still being recorded is read up to the
+// extent its header had when the reader was opened.
+class LogReader
+{
+  public:
+    explicit LogReader(const std::string &path);
+    ~LogReader();
+    LogReader(const LogReader &) = delete;
+    LogReader &operator=(const LogReader &) = delete;
+
+    struct Record
+    {
+        uint32_t stream_id;
+        uint64_t sequence;
+        double timestamp;
+        const char *data;
+        uint64_t size;
+    };
+
+    const std::vector<LogTopicInfo> &topics() const;
+    uint64_t size() const;
+    Record record(uint64_t index) const;
+    // Index of the first record indexed at or after timestamp (see LogIndexEntry), or size() if there is none.
+    // Records with an out-of-order timestamp are indexed at the largest timestamp before them, so reading on from
+    // the returned index never skips a record at or after timestamp.
+    uint64_t seek(double timestamp) const;
+    // Timestamps of the first record and the largest timestamp in the log, or (0, 0) if it has no records
+    std::pair<double, double> time_range() const;
+
+    // Python interface
+    pybind11::dict topics_dict() const;
+    pybind11::tuple read(int64_t index) const;
+
+  private:
+    void open_(const std::string &path);
+    void unmap_();
+    const LogIndexEntry &index_entry_(uint64_t index) const;
+
+    std::string path_;
+    char *ptr_ = nullptr;
+    uint64_t mapped_size_ = 0;
+    std::vector<LogTopicInfo> topics_;
+    uint64_t num_records_ = 0;
+    char *index_ptr_ = nullptr;
+    uint64_t index_mapped_size_ = 0;
+    // Built by scanning the log if the index file is missing or incomplete
+    std::vector<LogIndexEntry> scanned_index_;
+};
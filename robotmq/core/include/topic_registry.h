@@ -0,0 +1,64 @@
+/**
+ * Copyright (c) 2024 Yihuai Gao
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#pragma once
+#include "data_topic.h"
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// Grow-only map from topic names to DataTopics. Lookups are lock-free and never wait for add(), which is expected
+// to be rare. Topics are never removed, so the returned pointers stay valid for the lifetime of the registry.
+// Every topic also gets a compact id (its insertion index) for flat-array lookups.
+class TopicRegistry
+{
+  public:
+    TopicRegistry();
+    ~TopicRegistry();
+    TopicRegistry(const TopicRegistry &) = delete;
+    TopicRegistry &operator=(const TopicRegistry &) = delete;
+
+    // Returns the id of the new topic, or -1 if a topic with the same name already exists.
+    int64_t add(const std::string &name, std::unique_ptr<DataTopic> topic);
+    // Like add(), but only calls make_topic if the name is new, under the same lock as the check. Use this when
+    // constructing a topic has side effects, such as creating its shared memory segment.
+    int64_t emplace(const std::string &name, const std::function<std::unique_ptr<DataTopic>()> &make_topic);
+
+    // Return nullptr if the topic does not exist.
+    DataTopic *find(const std::string &name) const;
+    DataTopic *find(uint32_t id) const;
+    int64_t find_id(const std::string &name) const;
+    const std::string &name(uint32_t id) const;
+
+    uint32_t size() const;
+    void for_each(const std::function<void(uint32_t id, const std::string &name, DataTopic &topic)> &fn) const;
+
+  private:
+    struct Entry
+    {
+        std::string name;
+        uint32_t id;
+        std::unique_ptr<DataTopic> topic;
+        std::atomic<Entry *> next_in_bucket;
+    };
+
+    static constexpr size_t NUM_BUCKETS = 4096;
+    static constexpr size_t CHUNK_BITS = 10;
+    static constexpr size_t CHUNK_SIZE = 1 << CHUNK_BITS;
+    static constexpr size_t MAX_CHUNKS = 4096; // Up to 4M topics
+
+    const Entry *find_entry_(const std::string &name) const;
+    const Entry *entry_(uint32_t id) const;
+
+    std::unique_ptr<std::atomic<Entry *>[]> buckets_;
+    // Entries by id, stored in fixed-size chunks so that growing never moves existing entries.
+    std::unique_ptr<std::atomic<std::atomic<Entry *> *>[]> chunks_;
+    std::atomic<uint32_t> size_;
+    std::mutex write_mutex_;
+};
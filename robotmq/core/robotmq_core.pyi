@@ -5,8 +5,38 @@ This software is released under the MIT License.
 https://opensource.org/licenses/MIT
 """
 
+from typing import Any, Callable
+
+import numpy as np
+import numpy.typing as npt
+
 def steady_clock_us() -> int: ...
 def system_clock_us() -> int: ...
+def get_available_compressions() -> list[str]:
+    """Compression codecs available in this build, e.g. ["none", "lz4", "zstd"]."""
+    ...
+def serialize_object(data: Any) -> bytes:
+    """Encode nested dict/list/tuple/str/bytes/int/float/bool/None/ndarray data.
+
+    A compact header describes the structure; array buffers follow it raw and 64-byte aligned. Other objects are
+    pickled.
+    """
+    ...
+
+def serialized_object_size(data: Any) -> int:
+    """Number of bytes `serialize_object(data)` produces."""
+    ...
+
+def serialize_object_into(data: Any, buffer: Any) -> int:
+    """Encode `data` into a writable buffer (e.g. the array from `RMQServer.reserve`). Returns the bytes written."""
+    ...
+
+def deserialize_object(data: Any, copy: bool = True) -> Any:
+    """Decode data from `serialize_object`. `data` may be any buffer (bytes, RMQBytesView, memoryview, ...).
+
+    With `copy=False`, arrays are views of `data` that keep it alive; they are read-only if `data` is.
+    """
+    ...
 
 class RMQLogLevel:
     TRACE: "RMQLogLevel"
@@ -17,20 +47,155 @@ class RMQLogLevel:
     CRITICAL: "RMQLogLevel"
     OFF: "RMQLogLevel"
 
+class RMQBytesView:
+    """Read-only view of a message stored in a server topic. Supports the buffer protocol
+    (`memoryview(view)`, `np.frombuffer(view, ...)`, `bytes(view)`) and keeps the message alive while referenced."""
+
+    def __len__(self) -> int: ...
+    def tobytes(self) -> bytes: ...
+
 class RMQServer:
-    def __init__(self, server_name: str, server_endpoint: str, log_level: RMQLogLevel=RMQLogLevel.INFO) -> None: ...
+    def __init__(
+        self,
+        server_name: str,
+        server_endpoint: str,
+        log_level: RMQLogLevel = RMQLogLevel.INFO,
+        persistent_shm: bool = False,
+    ) -> None:
+        """Args:
+            persistent_shm: Keep the shared memory of the topics when the server exits. A server started later with
+                the same name adds the topics again from a topic index in /dev/shm and reattaches to the rings
+                and tensor slots, so the items stored in shared memory are kept. Only one server of a name can run
+                with persistent_shm at a time.
+        """
+        ...
+
     def add_topic(self, topic: str, message_remaining_time_s: float) -> None: ...
     def add_shared_memory_topic(
         self, topic: str, message_remaining_time_s: float, shared_memory_size_gb: float
     ) -> None: ...
+    def add_tensor_topic(
+        self,
+        topic: str,
+        dtype: Any,
+        shape: list[int],
+        capacity: int,
+        message_remaining_time_s: float = float("inf"),
+        shared_memory: bool = True,
+    ) -> None:
+        """Add a topic of numpy arrays with a fixed dtype and shape, stored in `capacity` preallocated slots.
+
+        Args:
+            topic: The topic name
+            dtype: Anything accepted by `np.dtype`
+            shape: Shape of every item
+            capacity: Number of slots. When all slots are used, a put overwrites the oldest item.
+            message_remaining_time_s: Items older than this are dropped
+            shared_memory: Store the slots in shared memory, so that clients on the same host read them directly.
+
+        Puts copy into the next slot without allocating. Clients receive each item as raw bytes, which can be read
+        with `np.frombuffer(data, dtype).reshape(shape)`.
+        """
+        ...
+
+    def set_topic_compression(self, topic: str, compression: str, level: int = 0) -> None:
+        """Compress data of a topic sent to clients on other hosts.
+
+        Args:
+            topic: The topic name
+            compression: "none", "lz4" (fast) or "zstd" (better ratio). Must be in `get_available_compressions()`.
+            level: zstd compression level, or lz4 acceleration factor. 0 uses the codec default.
+
+        Local clients are not affected. Each item is compressed once and shared by all remote readers.
+        """
+        ...
+
+    def set_chunking(self, chunk_size_bytes: int, max_pending_upload_bytes: int = 4 * 1024**3) -> None:
+        """Configure chunked transfers of large items.
+
+        Args:
+            chunk_size_bytes: Items larger than this are sent to clients that accept chunks in several requests.
+                Defaults to 4 MB.
+            max_pending_upload_bytes: Upper bound of the incomplete chunked uploads held by the server. Further uploads
+                wait until there is room.
+        """
+        ...
+
     def put_data(self, topic: str, data: bytes) -> None: ...
-    def peek_data(self, topic: str, n: int) -> tuple[list[bytes], list[float]]:
+    def put_data_async(self, topic: str, data: bytes) -> bool:
+        """Put data without waiting for it to be stored.
+
+        The payload is copied once and handed to a server-side ingestion thread through a lock-free queue, so the
+        caller never waits for the topic lock. Returns False if the data was dropped because the queue is full
+        (see `set_async_put_capacity`).
+        """
+        ...
+
+    def flush_async_put(self, timeout_s: float = -1.0) -> bool:
+        """Wait until all queued asynchronous puts are stored. Returns False on timeout. Negative timeout waits forever."""
+        ...
+
+    def set_async_put_capacity(self, max_queued_messages: int) -> None: ...
+    def get_async_put_stats(self) -> dict[str, int]:
+        """Backpressure statistics of the asynchronous put queue: enqueued, enqueued_bytes, dropped, processed,
+        queue_size, max_queue_size and capacity."""
+        ...
+
+    def reserve(self, topic: str, nbytes: int) -> tuple[int, npt.NDArray[np.uint8]]:
+        """Reserve space for a new message so that it can be written in place.
+
+        Args:
+            topic: The topic name to write into
+            nbytes: Size of the message in bytes
+
+        Returns:
+            tuple[int, npt.NDArray[np.uint8]]: A tuple containing:
+                - int: The handle to pass to `commit` or `cancel`
+                - npt.NDArray[np.uint8]: A writable array of `nbytes` bytes. For shared memory topics it points
+                  directly into the shared memory ring. Do not use it after `commit` or `cancel`.
+        """
+        ...
+
+    def commit(self, handle: int, timestamp: float | None = None) -> None:
+        """Publish a reserved message. If timestamp is None, the current server timestamp is used."""
+        ...
+
+    def cancel(self, handle: int) -> None: ...
+    def put_object(self, topic: str, data: Any) -> None:
+        """Serialize `data` with `serialize_object` directly into the topic storage (the shared memory ring for shared
+        memory topics), copying each array once. Read it with `robotmq.deserialize`."""
+        ...
+
+    def put_tensor(self, topic: str, array: npt.NDArray[Any]) -> None:
+        """Copy an array into the next slot of a tensor topic. Its dtype and shape must match the topic."""
+        ...
+
+    def peek_tensor(self, topic: str, n: int, copy: bool = True) -> tuple[list[npt.NDArray[Any]], list[float]]:
+        """Peek at the items of a tensor topic as numpy arrays. n works like in `peek_data`.
+
+        If copy is False, the arrays are read-only views of the slots. A view shows new data once `capacity` more
+        items are put, so copy it if it is kept longer than that.
+        """
+        ...
+
+    def peek_window(self, topic: str, k: int, copy: bool = True) -> tuple[npt.NDArray[Any], list[float]]:
+        """Peek at the newest k items of a tensor topic as one array of shape (count, *shape), where count <= k.
+
+        If copy is False and the slots of the window do not wrap around the end of the ring, the array is a read-only
+        strided view of them, which shows new data (possibly half-written) once the slots are reused. Otherwise the
+        items are gathered into one new array.
+        """
+        ...
+
+    def peek_data(self, topic: str, n: int, copy: bool = True) -> tuple[list[bytes | RMQBytesView], list[float]]:
         """Peek at data from a specified topic without removing it.
 
         Args:
             topic: The topic name to peek data from
             n: Number of data items to peek. If n < 0, will peek data from from the latest position (still remaining the order)
                 If n = 0, will peek all data in the topic
+            copy: If False, items of regular topics are returned as read-only `RMQBytesView` objects that share the
+                stored buffer instead of being copied. Shared memory data is always copied.
 
         Returns:
             tuple[list[bytes], list[float]]: A tuple containing:
@@ -39,13 +204,15 @@ class RMQServer:
         """
         ...
 
-    def pop_data(self, topic: str, n: int) -> tuple[list[bytes], list[float]]:
+    def pop_data(self, topic: str, n: int, copy: bool = True) -> tuple[list[bytes | RMQBytesView], list[float]]:
         """Pop data from a specified topic.
 
         Args:
             topic: The topic name to pop data from
             n: Number of data items to pop. If n < 0, will pop data from from the latest position (still remaining the order)
                 If n = 0, will pop all data in the topic
+            copy: If False, items of regular topics are returned as read-only `RMQBytesView` objects that share the
+                stored buffer instead of being copied. Shared memory data is always copied.
 
         Returns:
             tuple[list[bytes], list[float]]: A tuple containing:
@@ -54,12 +221,153 @@ class RMQServer:
         """
         ...
 
+    def consume_data(
+        self, topic: str, group: str, n: int = 1, copy: bool = True
+    ) -> tuple[list[bytes | RMQBytesView], list[float]]:
+        """Returns items of the topic that the consumer group `group` has not consumed yet, and marks them consumed.
+
+        Every group has its own cursor over one stored copy of the items: consumers of the same group split the items
+        between them (work queue), and every group sees every item (broadcast). A group is created by its first
+        consume, starting at the oldest stored item. Items are released once all groups have consumed them, unless
+        they expire or are evicted first.
+
+        Args:
+            n: Up to n items if n > 0, all unconsumed items if n = 0, or the newest -n items if n < 0 (the older
+                unconsumed items are skipped)
+        """
+        ...
+
+    def remove_consumer_group(self, topic: str, group: str) -> None:
+        """Removes the cursor of the group, so that it no longer holds back the release of items."""
+        ...
+
+    def get_consumer_groups(self, topic: str) -> dict[str, int]:
+        """Group name -> number of stored items the group has not consumed yet."""
+        ...
+
     def get_all_topic_status(self) -> dict[str, int]: ...
+    def get_stats(self) -> dict[str, Any]:
+        """Counters per topic and per command, and service time histograms of the background thread.
+
+        Returns a dict with "server", "uptime_s", "topics" (name -> size, messages_put, bytes_put, messages_expired,
+        messages_evicted, messages_dropped, messages_peeked, messages_popped,
+        messages_consumed), "commands" (command name -> count,
+        errors, bytes_in, bytes_out, service_time_us) and "async_put". service_time_us holds count, sum, max, p50, p99,
+        p999 and the non-empty power-of-two buckets as [upper bound, count] pairs.
+        """
+        ...
+
+    def get_stats_text(self) -> str:
+        """The statistics of `get_stats` in the Prometheus text exposition format."""
+        ...
+
+    def start_recording(self, path: str, topics: list[str] = [], max_queued_bytes: int = 1 << 30) -> None:
+        """Records every item put into `topics` (all topics if empty) with its timestamp and sequence number to an
+        append-only log at `path`, indexed in `path + ".idx"`. A writer thread writes the log through a memory
+        mapping, so puts only queue the item (sharing it for regular topics, copying it for shared memory and tensor
+        topics). Items are dropped while more than `max_queued_bytes` wait to be written. Read the log with
+        RMQLogReader."""
+        ...
+
+    def stop_recording(self) -> None:
+        """Writes the queued items and closes the log."""
+        ...
+
+    def get_recording_stats(self) -> dict[str, int]:
+        """`recording`, and while recording `records_written`, `bytes_written`, `records_dropped`, `queued_bytes` and
+        `failed` (the writer stopped, e.g. because the disk is full)."""
+        ...
+
+    def start_replay(
+        self,
+        path: str,
+        topics: list[str] = [],
+        speed: float = 1.0,
+        start_timestamp: float | None = None,
+        loop: bool = False,
+        create_topics: bool = True,
+    ) -> None:
+        """Republishes the items of a recorded log into this server's topics from a C++ thread, without Python in
+        the loop. Items keep their recorded spacing divided by `speed` (`speed <= 0` replays as fast as possible),
+        starting at the first item at or after `start_timestamp`, and get the server's current timestamp. Only
+        `topics` are replayed (all if empty). Missing topics are added as recorded if `create_topics`, otherwise
+        their items are skipped. With `loop`, the replay starts over at the end until `stop_replay`, and stops if a
+        pass put no item. Raises ValueError if no topic or no record at or after `start_timestamp` is replayed."""
+        ...
+
+    def stop_replay(self) -> None: ...
+    def wait_for_replay(self, timeout_s: float = -1.0) -> bool:
+        """Waits until a replay without `loop` has put all items. Returns False on timeout."""
+        ...
+
+    def get_replay_stats(self) -> dict[str, int]:
+        """`running`, `records_replayed`, `records_total` (from the start position), `errors` (items that could
+        not be put) and `max_lag_us` (how late the most delayed item was put)."""
+        ...
+
+    def start_relay(
+        self, upstream_endpoint: str, topics: list[str], poll_interval_s: float = 0.001, timeout_s: float = 1.0
+    ) -> None:
+        """Mirrors `topics` of the server at `upstream_endpoint` into the topics of the same names of this server,
+        which must already exist. Any topic kind works locally; with shared memory topics, local clients read the
+        relayed items from shared memory.
+
+        A C++ thread polls upstream every `poll_interval_s` for the items after the newest one it relayed, so every
+        item crosses the network once however many local clients read it. Relayed items keep their age: their
+        timestamps are moved to this server's clock by the offset between the upstream reply and its arrival.
+        """
+        ...
+
+    def stop_relay(self, upstream_endpoint: str = "") -> None:
+        """Stops the relay from `upstream_endpoint`, or all relays if it is empty."""
+        ...
+
+    def get_relay_stats(self) -> dict[str, int]:
+        """`relays`, `items_relayed`, `bytes_relayed`, `requests`, `timeouts` and `errors` (replies that could not
+        be relayed, e.g. because the topic does not exist upstream) of all relays."""
+        ...
+
+    def discard_persistent_state(self) -> None:
+        """Removes the shared memory and the topic index of a server with `persistent_shm` when it exits."""
+        ...
+
+    def set_trace_export(self, path: str) -> None:
+        """Writes the stages of every request_with_data (wait_for_request, handler, reply) as Chrome trace-event
+        JSON to `path`, one track per topic. Open the file in chrome://tracing or Perfetto. An empty path stops the
+        export and closes the file."""
+        ...
+
     def get_timestamp(self) -> float: ...
     def reset_start_time(self, system_time_us: int) -> None: ...
     def wait_for_request(self, timeout_s: float) -> tuple[bytes, str]: ...
     def reply_request(self, topic: str, data: bytes) -> None: ...
 
+class RMQLogReader:
+    """Reads a log recorded with RMQServer.start_recording through a read-only memory mapping. A log that is still
+    being recorded is read up to the records written when the reader was opened."""
+
+    def __init__(self, path: str) -> None: ...
+    def topics(self) -> dict[str, dict[str, Any]]:
+        """The recorded topics with their `kind` ("regular", "shared_memory" or "tensor") and the arguments needed
+        to add them to a server again."""
+        ...
+
+    def __len__(self) -> int: ...
+    def read(self, index: int) -> tuple[str, bytes, float, int]:
+        """(topic, data, timestamp, sequence) of a record. The sequence counts the puts into the topic from 1, so a
+        gap means items were dropped or put before the recording started."""
+        ...
+
+    def seek(self, timestamp: float) -> int:
+        """Index of the first record at or after `timestamp` (binary search in the index), or len() if there is
+        none. Records with out-of-order timestamps are indexed at the largest timestamp before them, so reading on
+        from the returned index never skips a record at or after `timestamp`."""
+        ...
+
+    def time_range(self) -> tuple[float, float]:
+        """Timestamp of the first record and the largest timestamp in the log."""
+        ...
+
 class RMQClient:
     def __init__(self, client_name: str, server_endpoint: str, log_level: RMQLogLevel=RMQLogLevel.INFO) -> None: ...
     def get_topic_status(self, topic: str, timeout_s: float) -> int:
@@ -109,6 +417,13 @@ class RMQClient:
         """
         ...
 
+    def consume_data(
+        self, topic: str, group: str, n: int = 1, timeout_s: float = 1.0, automatic_resend: bool = True
+    ) -> tuple[list[bytes], list[float]]:
+        """Returns items the consumer group `group` has not consumed yet and marks them consumed on the server. See
+        `RMQServer.consume_data`."""
+        ...
+
     def put_data(self, topic: str, data: bytes, timeout_s: float = 1.0, automatic_resend: bool = True) -> None:
         """
         Put data into a specified topic.
@@ -119,7 +434,118 @@ class RMQClient:
         """
         ...
 
+    def peek_window(
+        self,
+        topic: str,
+        k: int,
+        dtype: Any,
+        shape: list[int],
+        timeout_s: float = 1.0,
+        automatic_resend: bool = True,
+    ) -> tuple[npt.NDArray[Any], list[float]]:
+        """Peek at the newest k items as one array of shape (count, *shape), where count <= k.
+
+        Every item must hold exactly one array of `dtype` and `shape`, as in a tensor topic. The items are copied
+        straight into the returned array, without intermediate bytes objects.
+        """
+        ...
+
     def get_last_retrieved_data(self) -> tuple[list[bytes], list[float]]: ...
+    def get_server_stats(self, timeout_s: float = 1.0) -> dict[str, Any]:
+        """Statistics of the server, as returned by `RMQServer.get_stats`."""
+        ...
+
+    def get_server_stats_text(self, timeout_s: float = 1.0) -> str:
+        """Statistics of the server in the Prometheus text exposition format."""
+        ...
+
+    def set_request_tracing(self, enabled: bool) -> None:
+        """If enabled, request_with_data asks the server for the timestamps of each stage of the request."""
+        ...
+
+    def get_last_request_trace(self) -> dict[str, int] | None:
+        """Durations in microseconds of the stages of the last request_with_data, or None if it was not traced.
+        Keys: client_request_us, network_us, server_queue_us (until wait_for_request returned the request),
+        server_handler_us (until reply_request), server_reply_us, client_reply_us and total_us."""
+        ...
+
     def get_timestamp(self) -> float: ...
     def reset_start_time(self, system_time_us: int) -> None: ...
+    def synchronize_clock(self, num_samples: int = 8, timeout_s: float = 1.0) -> dict[str, float]:
+        """Estimates the offset of the server's timestamps relative to this client's and the round-trip time with
+        `num_samples` NTP-style exchanges, keeping the sample with the shortest round trip. Returns the same dict as
+        `get_clock_offset`. Raises RuntimeError if the server does not reply."""
+        ...
+
+    def start_clock_sync(self, interval_s: float = 1.0, num_samples: int = 8) -> None:
+        """Repeats `synchronize_clock` every `interval_s` seconds on a background thread."""
+        ...
+
+    def stop_clock_sync(self) -> None: ...
+    def get_clock_offset(self) -> dict[str, float] | None:
+        """The latest estimate as `offset_s` (server timestamp minus client timestamp), `rtt_s`, `age_s` and
+        `num_samples`, or None if the clock was never synchronized."""
+        ...
+
+    def shares_host_with_server(self, timeout_s: float = 1.0) -> bool:
+        """Whether this client can open the server's shared memory. Negotiated once with a handshake on first use.
+        Clients on another host receive the data of shared memory topics inline over ZeroMQ."""
+        ...
+
+    def set_inline_payloads(self, enabled: bool | None) -> None:
+        """Force (True) or disable (False) inline transfer of shared memory data. None restores automatic negotiation."""
+        ...
+
+    def set_chunk_size(self, chunk_size_bytes: int) -> None:
+        """Transfer payloads larger than `chunk_size_bytes` (default 4 MB) in chunks. 0 disables chunking.
+
+        A chunk that times out is resent on its own instead of the whole payload.
+        """
+        ...
+
+    def set_progress_callback(self, callback: Callable[[str, int, int], None] | None) -> None:
+        """Call `callback(topic, transferred_bytes, total_bytes)` after every chunk of a chunked transfer."""
+        ...
+
+    def set_data_connections(self, num_connections: int) -> None:
+        """Open `num_connections` extra connections and stripe the chunks of large transfers across them.
+
+        Other requests stay on the control connection and are not queued behind bulk transfers. 0 (default) sends
+        chunks over the control connection.
+        """
+        ...
+
+    def put_data_async(self, topic: str, data: bytes) -> bool:
+        """Queue data for a background thread and return immediately.
+
+        Queued items of the same topic are sent together in one request. Each item keeps the timestamp of this call.
+        Returns False if the queue is full and the data was dropped (see `set_async_put_options`).
+        """
+        ...
+
+    def flush_async_put(self, timeout_s: float = -1.0) -> bool:
+        """Wait until all queued asynchronous puts are sent. Returns False on timeout. Negative timeout waits forever."""
+        ...
+
+    def set_async_put_options(
+        self,
+        max_batch_messages: int = 256,
+        max_batch_bytes: int = 1024 * 1024,
+        max_delay_s: float = 0.005,
+        max_queued_messages: int = 4096,
+    ) -> None:
+        """A batch is sent when it has `max_batch_messages` items or `max_batch_bytes` bytes, or `max_delay_s` after
+        its first item was queued. At most `max_queued_messages` items wait in the queue."""
+        ...
+
+    def set_async_put_callback(self, callback: Callable[[str, str, int, str], None] | None) -> None:
+        """Call `callback(event, topic, num_messages, message)` when asynchronous puts are dropped ("dropped") or fail
+        ("error"). Failures are reported from the next `put_data_async` or `flush_async_put` call."""
+        ...
+
+    def get_async_put_stats(self) -> dict[str, int]:
+        """enqueued, enqueued_bytes, dropped, sent, sent_requests, failed, processed, queue_size, max_queue_size and
+        capacity of the asynchronous put queue."""
+        ...
+
     def request_with_data(self, topic: str, data: bytes, timeout_s: float = 1.0, automatic_resend: bool = True) -> bytes: ...
@@ -6,8 +6,10 @@
  */
 
 #include "common.h"
+#include "copy_engine.h"
 #include <cstring>
 #include <fcntl.h>
+#include <fstream>
 #include <pybind11/functional.h>
 #include <pybind11/numpy.h>
 #include <pybind11/pybind11.h>
@@ -138,9 +140,13 @@ std::string bytes_to_hex(const std::string &bytes)
 
 std::string get_user_name()
 {
-    char *user_name = getlogin();
-    if (user_name == nullptr)
-    {
+    // The user does not change during the lifetime of the process, so only look it up once.
+    static const std::string user_name = []() -> std::string {
+        char *login_name = getlogin();
+        if (login_name != nullptr)
+        {
+            return std::string(login_name);
+        }
         uid_t uid = getuid();
         struct passwd *pw = getpwuid(uid);
         if (pw == nullptr)
@@ -149,8 +155,21 @@ std::string get_user_name()
             return std::to_string(uid);
         }
         return std::string(pw->pw_name);
+    }();
+    return user_name;
+}
+
+std::string get_shm_host_token()
+{
+    std::string boot_id;
+    std::ifstream boot_id_file("/proc/sys/kernel/random/boot_id");
+    std::getline(boot_id_file, boot_id);
+    struct stat shm_stat;
+    if (stat("/dev/shm", &shm_stat) != 0)
+    {
+        return boot_id;
     }
-    return std::string(user_name);
+    return boot_id + ":" + std::to_string(shm_stat.st_dev) + ":" + std::to_string(shm_stat.st_ino);
 }
 
 std::string get_pid()
@@ -168,42 +187,103 @@ SharedMemoryDataInfo::SharedMemoryDataInfo(const std::string &shm_name, uint64_t
 
 SharedMemoryDataInfo::SharedMemoryDataInfo(const std::string &serialized_data_info)
 {
-    uint64_t current_byte_idx = 0;
-    if (serialized_data_info.substr(0, HEADER.size()) != HEADER)
+    if (!is_shm_data_info(serialized_data_info))
     {
         printf("serialized_data_info: first 10 bytes: %s, total size: %zu, HEADER: %s\n",
                bytes_to_hex(serialized_data_info.substr(0, 10)).c_str(), serialized_data_info.size(),
                bytes_to_hex(HEADER).c_str());
         throw std::invalid_argument("Invalid serialized data info (beginning doesn't match with HEADER)");
     }
-    current_byte_idx += HEADER.size();
-
-    uint64_t shm_name_size = bytes_to_uint64(serialized_data_info.substr(current_byte_idx, sizeof(uint64_t)));
+    const char *data = serialized_data_info.data();
+    uint64_t current_byte_idx = HEADER.size();
+    uint64_t shm_name_size = 0;
+    if (serialized_data_info.size() >= current_byte_idx + sizeof(uint64_t))
+    {
+        std::memcpy(&shm_name_size, data + current_byte_idx, sizeof(uint64_t));
+    }
     current_byte_idx += sizeof(uint64_t);
+    if (serialized_data_info.size() != current_byte_idx + shm_name_size + 3 * sizeof(uint64_t))
+    {
+        throw std::runtime_error("Shared memory data info is not complete");
+    }
 
-    shm_name_ = serialized_data_info.substr(current_byte_idx, shm_name_size);
+    shm_name_.assign(data + current_byte_idx, shm_name_size);
     current_byte_idx += shm_name_size;
-
-    shm_size_bytes_ = bytes_to_uint64(serialized_data_info.substr(current_byte_idx, sizeof(uint64_t)));
+    std::memcpy(&shm_size_bytes_, data + current_byte_idx, sizeof(uint64_t));
     current_byte_idx += sizeof(uint64_t);
-
-    shm_start_idx_ = bytes_to_uint64(serialized_data_info.substr(current_byte_idx, sizeof(uint64_t)));
+    std::memcpy(&shm_start_idx_, data + current_byte_idx, sizeof(uint64_t));
     current_byte_idx += sizeof(uint64_t);
+    std::memcpy(&data_size_bytes_, data + current_byte_idx, sizeof(uint64_t));
+}
 
-    data_size_bytes_ = bytes_to_uint64(serialized_data_info.substr(current_byte_idx, sizeof(uint64_t)));
-    current_byte_idx += sizeof(uint64_t);
+const std::string SharedMemoryDataInfo::HEADER = "\x0d\x0a\x0d\x0b";
+
+bool SharedMemoryDataInfo::is_shm_data_info(const std::string &serialized_data_info)
+{
+    return serialized_data_info.compare(0, HEADER.size(), HEADER) == 0;
+}
+
+bool ShmDescriptor::is_shm_descriptor(const std::string &bytes)
+{
+    return bytes.size() == sizeof(ShmDescriptor) && std::memcmp(bytes.data(), &MAGIC, sizeof(MAGIC)) == 0;
+}
 
-    if (current_byte_idx != serialized_data_info.size())
+ShmDescriptor ShmDescriptor::parse(const std::string &bytes)
+{
+    if (!is_shm_descriptor(bytes))
     {
-        throw std::runtime_error("Shared memory data info is not complete");
+        throw std::invalid_argument("Invalid shared memory descriptor of size " + std::to_string(bytes.size()));
     }
+    ShmDescriptor descriptor;
+    std::memcpy(&descriptor, bytes.data(), sizeof(ShmDescriptor));
+    return descriptor;
 }
 
-const std::string SharedMemoryDataInfo::HEADER = "\x0d\x0a\x0d\x0b";
+std::string ShmDescriptor::serialize() const
+{
+    return std::string(reinterpret_cast<const char *>(this), sizeof(ShmDescriptor));
+}
 
-bool SharedMemoryDataInfo::is_shm_data_info(const std::string &serialized_data_info)
+bool ChunkedItemStub::is_chunked_item_stub(const std::string &bytes)
 {
-    return serialized_data_info.substr(0, HEADER.size()) == HEADER;
+    return bytes.size() == sizeof(ChunkedItemStub) && std::memcmp(bytes.data(), &MAGIC, sizeof(MAGIC)) == 0;
+}
+
+ChunkedItemStub ChunkedItemStub::parse(const std::string &bytes)
+{
+    if (!is_chunked_item_stub(bytes))
+    {
+        throw std::invalid_argument("Invalid chunked item stub of size " + std::to_string(bytes.size()));
+    }
+    ChunkedItemStub stub;
+    std::memcpy(&stub, bytes.data(), sizeof(ChunkedItemStub));
+    return stub;
+}
+
+std::string ChunkedItemStub::serialize() const
+{
+    return std::string(reinterpret_cast<const char *>(this), sizeof(ChunkedItemStub));
+}
+
+bool RequestTrace::is_request_trace(const std::string &bytes)
+{
+    return bytes.size() == sizeof(RequestTrace) && std::memcmp(bytes.data(), &MAGIC, sizeof(MAGIC)) == 0;
+}
+
+RequestTrace RequestTrace::parse(const std::string &bytes)
+{
+    if (!is_request_trace(bytes))
+    {
+        throw std::invalid_argument("Invalid request trace of size " + std::to_string(bytes.size()));
+    }
+    RequestTrace trace;
+    std::memcpy(&trace, bytes.data(), sizeof(RequestTrace));
+    return trace;
+}
+
+std::string RequestTrace::serialize() const
+{
+    return std::string(reinterpret_cast<const char *>(this), sizeof(RequestTrace));
 }
 
 std::string SharedMemoryDataInfo::serialize() const
@@ -243,6 +323,25 @@ uint64_t SharedMemoryDataInfo::data_size_bytes() const
     return data_size_bytes_;
 }
 
+pybind11::bytes copy_to_pybytes(const char *data, size_t len)
+{
+    PyObject *py_bytes = PyBytes_FromStringAndSize(nullptr, len);
+    if (!py_bytes)
+        throw std::runtime_error("Failed to allocate Python bytes");
+    engine_memcpy(PyBytes_AS_STRING(py_bytes), data, len, false);
+    return pybind11::reinterpret_steal<pybind11::bytes>(py_bytes);
+}
+
+pybind11::bytes copy_ring_to_pybytes(const char *ring, uint64_t ring_size, uint64_t start, uint64_t size)
+{
+    if (start + size <= ring_size)
+    {
+        return copy_to_pybytes(ring + start, size);
+    }
+    uint64_t a_len = ring_size - start;
+    return concat_to_pybytes(ring + start, a_len, ring, size - a_len);
+}
+
 pybind11::bytes concat_to_pybytes(const char *a, size_t a_len, const char *b, size_t b_len)
 {
     size_t total_len = a_len + b_len;
@@ -256,8 +355,8 @@ pybind11::bytes concat_to_pybytes(const char *a, size_t a_len, const char *b, si
     char *buffer = PyBytes_AS_STRING(py_bytes);
 
     // Copy both arrays into the buffer
-    std::memcpy(buffer, a, a_len);
-    std::memcpy(buffer + a_len, b, b_len);
+    engine_memcpy(buffer, a, a_len, false);
+    engine_memcpy(buffer + a_len, b, b_len, false);
 
     // Return py::bytes without extra copy
     return pybind11::reinterpret_steal<pybind11::bytes>(py_bytes);
@@ -277,19 +376,8 @@ pybind11::bytes SharedMemoryDataInfo::get_shm_data() const
     {
         throw std::runtime_error("Failed to map shared memory: " + shm_name_ + " " + std::string(strerror(errno)));
     }
-    pybind11::bytes data;
-    if (shm_start_idx_ + data_size_bytes_ < shm_size_bytes_)
-    {
-        data = pybind11::bytes(static_cast<char *>(shm_ptr) + shm_start_idx_, data_size_bytes_);
-    }
-    else
-    {
-        char *a = static_cast<char *>(shm_ptr) + shm_start_idx_;
-        size_t a_len = shm_size_bytes_ - shm_start_idx_;
-        char *b = static_cast<char *>(shm_ptr);
-        size_t b_len = data_size_bytes_ - a_len;
-        data = concat_to_pybytes(a, a_len, b, b_len);
-    }
+    pybind11::bytes data =
+        copy_ring_to_pybytes(static_cast<char *>(shm_ptr), shm_size_bytes_, shm_start_idx_, data_size_bytes_);
     munmap(shm_ptr, shm_size_bytes_);
     close(shm_fd);
 
@@ -0,0 +1,279 @@
+/**
+ * Copyright (c) 2024 Yihuai Gao
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "compression.h"
+#include "rmq_message.h"
+#include <cstring>
+#include <stdexcept>
+#ifdef RMQ_WITH_LZ4
+#include <lz4.h>
+#endif
+#ifdef RMQ_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+namespace
+{
+const char COMPRESSED_HEADER[4] = {'\x0d', '\x0a', '\x0d', '\x0e'};
+const uint64_t COMPRESSED_PREFIX_SIZE = sizeof(COMPRESSED_HEADER) + sizeof(uint8_t) + sizeof(uint64_t);
+// Smaller payloads are cheaper to send than to compress
+const uint64_t MIN_COMPRESSION_SIZE_BYTES = 1024;
+} // namespace
+
+CompressionType compression_type_from_string(const std::string &name)
+{
+    if (name == "none")
+    {
+        return CompressionType::NONE;
+    }
+    if (name == "lz4")
+    {
+        return CompressionType::LZ4;
+    }
+    if (name == "zstd")
+    {
+        return CompressionType::ZSTD;
+    }
+    throw std::invalid_argument("Unknown compression `" + name + "`. Supported: none, lz4, zstd");
+}
+
+std::string compression_type_to_string(CompressionType type)
+{
+    switch (type)
+    {
+    case CompressionType::LZ4:
+        return "lz4";
+    case CompressionType::ZSTD:
+        return "zstd";
+    default:
+        return "none";
+    }
+}
+
+bool is_compression_available(CompressionType type)
+{
+    switch (type)
+    {
+    case CompressionType::NONE:
+        return true;
+#ifdef RMQ_WITH_LZ4
+    case CompressionType::LZ4:
+        return true;
+#endif
+#ifdef RMQ_WITH_ZSTD
+    case CompressionType::ZSTD:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+std::vector<std::string> get_available_compressions()
+{
+    std::vector<std::string> names;
+    for (CompressionType type : {CompressionType::NONE, CompressionType::LZ4, CompressionType::ZSTD})
+    {
+        if (is_compression_available(type))
+        {
+            names.push_back(compression_type_to_string(type));
+        }
+    }
+    return names;
+}
+
+uint8_t compression_accept_flags()
+{
+    uint8_t flags = 0;
+    if (is_compression_available(CompressionType::LZ4))
+    {
+        flags |= ACCEPT_LZ4_FLAG;
+    }
+    if (is_compression_available(CompressionType::ZSTD))
+    {
+        flags |= ACCEPT_ZSTD_FLAG;
+    }
+    return flags;
+}
+
+bool is_compression_negotiated(uint8_t request_flags)
+{
+    return request_flags & (ACCEPT_LZ4_FLAG | ACCEPT_ZSTD_FLAG);
+}
+
+bool is_compression_accepted(CompressionType type, uint8_t request_flags)
+{
+    switch (type)
+    {
+    case CompressionType::LZ4:
+        return request_flags & ACCEPT_LZ4_FLAG;
+    case CompressionType::ZSTD:
+        return request_flags & ACCEPT_ZSTD_FLAG;
+    default:
+        return false;
+    }
+}
+
+BytesPtr compress_data(const char *data, uint64_t size, CompressionType type, int level)
+{
+    if (size < MIN_COMPRESSION_SIZE_BYTES || !is_compression_available(type) || type == CompressionType::NONE)
+    {
+        return nullptr;
+    }
+    BytesPtr compressed;
+    uint64_t compressed_size = 0;
+    switch (type)
+    {
+#ifdef RMQ_WITH_LZ4
+    case CompressionType::LZ4: {
+        if (size > LZ4_MAX_INPUT_SIZE)
+        {
+            return nullptr;
+        }
+        int bound = LZ4_compressBound(static_cast<int>(size));
+        compressed = std::make_shared<Bytes>(COMPRESSED_PREFIX_SIZE + bound, '\0');
+        // For LZ4, the level is the acceleration factor: higher is faster with a lower ratio
+        int result = LZ4_compress_fast(data, &(*compressed)[COMPRESSED_PREFIX_SIZE], static_cast<int>(size), bound,
+                                       level > 0 ? level : 1);
+        if (result <= 0)
+        {
+            return nullptr;
+        }
+        compressed_size = result;
+        break;
+    }
+#endif
+#ifdef RMQ_WITH_ZSTD
+    case CompressionType::ZSTD: {
+        size_t bound = ZSTD_compressBound(size);
+        compressed = std::make_shared<Bytes>(COMPRESSED_PREFIX_SIZE + bound, '\0');
+        size_t result = ZSTD_compress(&(*compressed)[COMPRESSED_PREFIX_SIZE], bound, data, size, level > 0 ? level : 1);
+        if (ZSTD_isError(result))
+        {
+            return nullptr;
+        }
+        compressed_size = result;
+        break;
+    }
+#endif
+    default:
+        return nullptr;
+    }
+    if (COMPRESSED_PREFIX_SIZE + compressed_size >= size)
+    {
+        return nullptr;
+    }
+    compressed->resize(COMPRESSED_PREFIX_SIZE + compressed_size);
+    std::memcpy(&(*compressed)[0], COMPRESSED_HEADER, sizeof(COMPRESSED_HEADER));
+    (*compressed)[sizeof(COMPRESSED_HEADER)] = static_cast<char>(type);
+    std::memcpy(&(*compressed)[sizeof(COMPRESSED_HEADER) + sizeof(uint8_t)], &size, sizeof(uint64_t));
+    return compressed;
+}
+
+BytesPtr mark_uncompressed_data(const BytesPtr &data)
+{
+    if (!is_compressed_data(*data))
+    {
+        return data;
+    }
+    // The item happens to start with the header, so it is stored behind a prefix of its own
+    uint64_t size = data->size();
+    BytesPtr stored = std::make_shared<Bytes>(COMPRESSED_PREFIX_SIZE + size, '\0');
+    std::memcpy(&(*stored)[0], COMPRESSED_HEADER, sizeof(COMPRESSED_HEADER));
+    (*stored)[sizeof(COMPRESSED_HEADER)] = static_cast<char>(CompressionType::NONE);
+    std::memcpy(&(*stored)[sizeof(COMPRESSED_HEADER) + sizeof(uint8_t)], &size, sizeof(uint64_t));
+    std::memcpy(&(*stored)[COMPRESSED_PREFIX_SIZE], data->data(), size);
+    return stored;
+}
+
+bool is_compressed_data(const Bytes &bytes)
+{
+    return bytes.size() >= COMPRESSED_PREFIX_SIZE &&
+           std::memcmp(bytes.data(), COMPRESSED_HEADER, sizeof(COMPRESSED_HEADER)) == 0;
+}
+
+uint64_t get_decompressed_size(const Bytes &bytes)
+{
+    if (!is_compressed_data(bytes))
+    {
+        throw std::invalid_argument("Data is not compressed");
+    }
+    uint64_t size;
+    std::memcpy(&size, bytes.data() + sizeof(COMPRESSED_HEADER) + sizeof(uint8_t), sizeof(uint64_t));
+    // The size is checked against the data before anyone allocates a buffer of that size
+    CompressionType type = static_cast<CompressionType>(bytes[sizeof(COMPRESSED_HEADER)]);
+    [[maybe_unused]] const char *src = bytes.data() + COMPRESSED_PREFIX_SIZE;
+    uint64_t src_size = bytes.size() - COMPRESSED_PREFIX_SIZE;
+    bool valid = false;
+    switch (type)
+    {
+    case CompressionType::NONE:
+        valid = size == src_size;
+        break;
+#ifdef RMQ_WITH_LZ4
+    case CompressionType::LZ4:
+        // lz4 expands data by at most a factor of 255
+        valid = size <= static_cast<uint64_t>(LZ4_MAX_INPUT_SIZE) && size <= src_size * 255;
+        break;
+#endif
+#ifdef RMQ_WITH_ZSTD
+    case CompressionType::ZSTD:
+        valid = ZSTD_getFrameContentSize(src, src_size) == size;
+        break;
+#endif
+    default:
+        throw std::runtime_error("Received data compressed with " + compression_type_to_string(type) +
+                                 ", which is not available in this build");
+    }
+    if (!valid)
+    {
+        throw std::runtime_error("Compressed data of " + std::to_string(src_size) + " bytes does not match its size of " +
+                                 std::to_string(size) + " bytes");
+    }
+    return size;
+}
+
+void decompress_data(const Bytes &bytes, char *dst, uint64_t dst_size)
+{
+    if (get_decompressed_size(bytes) != dst_size)
+    {
+        throw std::invalid_argument("Destination size does not match the decompressed size");
+    }
+    CompressionType type = static_cast<CompressionType>(bytes[sizeof(COMPRESSED_HEADER)]);
+    [[maybe_unused]] const char *src = bytes.data() + COMPRESSED_PREFIX_SIZE;
+    [[maybe_unused]] uint64_t src_size = bytes.size() - COMPRESSED_PREFIX_SIZE;
+    switch (type)
+    {
+    case CompressionType::NONE:
+        std::memcpy(dst, src, dst_size);
+        return;
+#ifdef RMQ_WITH_LZ4
+    case CompressionType::LZ4: {
+        int result = LZ4_decompress_safe(src, dst, static_cast<int>(src_size), static_cast<int>(dst_size));
+        if (result < 0 || static_cast<uint64_t>(result) != dst_size)
+        {
+            throw std::runtime_error("Failed to decompress lz4 data");
+        }
+        return;
+    }
+#endif
+#ifdef RMQ_WITH_ZSTD
+    case CompressionType::ZSTD: {
+        size_t result = ZSTD_decompress(dst, dst_size, src, src_size);
+        if (ZSTD_isError(result) || result != dst_size)
+        {
+            throw std::runtime_error(std::string("Failed to decompress zstd data: ") +
+                                     (ZSTD_isError(result) ? ZSTD_getErrorName(result) : "size mismatch"));
+        }
+        return;
+    }
+#endif
+    default:
+        throw std::runtime_error("Received data compressed with " + compression_type_to_string(type) +
+                                 ", which is not available in this build");
+    }
+}
@@ -0,0 +1,196 @@
+/**
+ * Copyright (c) 2024 Yihuai Gao
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "copy_engine.h"
+#include <algorithm>
+#include <cstring>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace
+{
+// A single core saturates at roughly 8-10 GB/s, while a few cores together reach the memory bandwidth.
+// Below 8 MB the cost of waking the workers is not worth it.
+constexpr size_t DEFAULT_PARALLEL_THRESHOLD_BYTES = 8 * 1024 * 1024;
+constexpr size_t MAX_COPY_THREADS = 4;
+// Each chunk is at least this large so that the workers do not fight over cache lines at the chunk borders.
+constexpr size_t MIN_CHUNK_SIZE_BYTES = 1024 * 1024;
+// Non-temporal stores only pay off when the copy is much larger than the cache lines they bypass.
+constexpr size_t MIN_STREAMING_SIZE_BYTES = 256 * 1024;
+} // namespace
+
+CopyEngine &CopyEngine::instance()
+{
+    static CopyEngine engine(std::min<size_t>(MAX_COPY_THREADS, std::max(1u, std::thread::hardware_concurrency())),
+                             DEFAULT_PARALLEL_THRESHOLD_BYTES);
+    return engine;
+}
+
+CopyEngine::CopyEngine(size_t num_threads, size_t parallel_threshold_bytes)
+    : parallel_threshold_bytes_(parallel_threshold_bytes), job_generation_(0), stopping_(false)
+{
+    // The calling thread takes part in every copy, so it counts as one of the threads.
+    for (size_t i = 1; i < num_threads; ++i)
+    {
+        workers_.emplace_back(&CopyEngine::worker_loop_, this);
+    }
+}
+
+CopyEngine::~CopyEngine()
+{
+    {
+        std::lock_guard<std::mutex> lock(worker_mutex_);
+        stopping_ = true;
+    }
+    worker_cv_.notify_all();
+    for (auto &worker : workers_)
+    {
+        worker.join();
+    }
+}
+
+size_t CopyEngine::num_threads() const
+{
+    return workers_.size() + 1;
+}
+
+size_t CopyEngine::parallel_threshold_bytes() const
+{
+    return parallel_threshold_bytes_;
+}
+
+void CopyEngine::copy_chunk_(char *dst, const char *src, size_t size, bool streaming)
+{
+#if defined(__SSE2__)
+    if (streaming && size >= MIN_STREAMING_SIZE_BYTES)
+    {
+        // Align the destination to 16 bytes, stream 64 bytes per iteration, and copy the tail normally.
+        size_t head = (16 - (reinterpret_cast<uintptr_t>(dst) & 15)) & 15;
+        std::memcpy(dst, src, head);
+        dst += head;
+        src += head;
+        size -= head;
+
+        size_t num_blocks = size / 64;
+        for (size_t i = 0; i < num_blocks; ++i)
+        {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 16));
+            __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 32));
+            __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 48));
+            _mm_stream_si128(reinterpret_cast<__m128i *>(dst), a);
+            _mm_stream_si128(reinterpret_cast<__m128i *>(dst + 16), b);
+            _mm_stream_si128(reinterpret_cast<__m128i *>(dst + 32), c);
+            _mm_stream_si128(reinterpret_cast<__m128i *>(dst + 48), d);
+            src += 64;
+            dst += 64;
+        }
+        std::memcpy(dst, src, size - num_blocks * 64);
+        // Make the streamed stores visible before the shm mutex is released.
+        _mm_sfence();
+        return;
+    }
+#endif
+    (void)streaming;
+    std::memcpy(dst, src, size);
+}
+
+void CopyEngine::run_job_(Job &job)
+{
+    while (true)
+    {
+        size_t chunk_idx = job.next_chunk.fetch_add(1);
+        if (chunk_idx >= job.num_chunks)
+        {
+            return;
+        }
+        size_t offset = chunk_idx * job.chunk_size;
+        size_t size = std::min(job.chunk_size, job.size - offset);
+        copy_chunk_(job.dst + offset, job.src + offset, size, job.streaming);
+        job.remaining_chunks.fetch_sub(1);
+    }
+}
+
+void CopyEngine::worker_loop_()
+{
+    uint64_t seen_generation = 0;
+    while (true)
+    {
+        std::shared_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> lock(worker_mutex_);
+            worker_cv_.wait(lock, [&] { return stopping_ || job_generation_ != seen_generation; });
+            if (stopping_)
+            {
+                return;
+            }
+            seen_generation = job_generation_;
+            job = current_job_;
+        }
+        if (!job)
+        {
+            continue;
+        }
+        run_job_(*job);
+        if (job->remaining_chunks.load() == 0)
+        {
+            std::lock_guard<std::mutex> lock(worker_mutex_);
+            done_cv_.notify_all();
+        }
+    }
+}
+
+void CopyEngine::copy(void *dst, const void *src, size_t size, bool streaming)
+{
+    if (size == 0)
+    {
+        return;
+    }
+    if (workers_.empty() || size < parallel_threshold_bytes_)
+    {
+        copy_chunk_(static_cast<char *>(dst), static_cast<const char *>(src), size, streaming);
+        return;
+    }
+    std::unique_lock<std::mutex> job_lock(job_mutex_, std::try_to_lock);
+    if (!job_lock.owns_lock())
+    {
+        // Another thread is already using the pool. Copying on this thread is cheaper than waiting.
+        copy_chunk_(static_cast<char *>(dst), static_cast<const char *>(src), size, streaming);
+        return;
+    }
+
+    auto job = std::make_shared<Job>();
+    job->dst = static_cast<char *>(dst);
+    job->src = static_cast<const char *>(src);
+    job->size = size;
+    job->streaming = streaming;
+    size_t num_threads = workers_.size() + 1;
+    job->chunk_size = std::max(MIN_CHUNK_SIZE_BYTES, (size + num_threads - 1) / num_threads);
+    // Keep the chunks 64-byte aligned relative to the start of the buffer.
+    job->chunk_size = (job->chunk_size + 63) & ~static_cast<size_t>(63);
+    job->num_chunks = (size + job->chunk_size - 1) / job->chunk_size;
+    job->remaining_chunks.store(job->num_chunks);
+
+    {
+        std::lock_guard<std::mutex> lock(worker_mutex_);
+        current_job_ = job;
+        ++job_generation_;
+    }
+    worker_cv_.notify_all();
+
+    run_job_(*job);
+
+    std::unique_lock<std::mutex> lock(worker_mutex_);
+    done_cv_.wait(lock, [&] { return job->remaining_chunks.load() == 0; });
+    current_job_.reset();
+}
+
+void engine_memcpy(void *dst, const void *src, size_t size, bool streaming)
+{
+    CopyEngine::instance().copy(dst, src, size, streaming);
+}
@@ -6,44 +6,93 @@
  */
 
 #include "data_topic.h"
+#include <pybind11/numpy.h>
 #include "common.h"
+#include "copy_engine.h"
+#include "spdlog/spdlog.h"
+#include <atomic>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 DataTopic::DataTopic(const std::string &topic_name, double message_remaining_time_s)
     : message_remaining_time_s_(message_remaining_time_s), topic_name_(topic_name), is_shm_topic_(false),
-      shm_size_gb_(0)
+      shm_size_gb_(0), has_pending_reservation_(false)
 {
     data_.clear();
 }
 
 DataTopic::DataTopic(const std::string &topic_name, double message_remaining_time_s, const std::string server_name,
-                     double shared_memory_size_gb)
+                     double shared_memory_size_gb, uint32_t segment_id, uint32_t session, bool persistent,
+                     int64_t clock_origin_us)
     : message_remaining_time_s_(message_remaining_time_s), topic_name_(topic_name), server_name_(server_name),
-      is_shm_topic_(true), shm_size_gb_(shared_memory_size_gb)
+      segment_id_(segment_id), session_(session), is_shm_topic_(true), shm_size_gb_(shared_memory_size_gb),
+      has_pending_reservation_(false), persistent_(persistent), clock_origin_us_(clock_origin_us)
 {
     data_.clear();
-
     shm_size_ = shm_size_gb_ * 1024 * 1024 * 1024;
-    occupied_shm_size_ = 0;
+    create_shm_();
+}
+
+DataTopic::DataTopic(const std::string &topic_name, double message_remaining_time_s, const std::string &dtype,
+                     const std::vector<int64_t> &shape, uint64_t slot_size_bytes, uint64_t capacity,
+                     const std::string &server_name, uint32_t segment_id, uint32_t session, bool persistent,
+                     int64_t clock_origin_us)
+    : message_remaining_time_s_(message_remaining_time_s), topic_name_(topic_name), server_name_(server_name),
+      segment_id_(segment_id), session_(session), is_shm_topic_(!server_name.empty()), shm_size_gb_(0),
+      has_pending_reservation_(false), is_tensor_topic_(true), tensor_dtype_(dtype), tensor_shape_(shape),
+      slot_size_(slot_size_bytes), capacity_(capacity), slot_timestamps_(capacity, 0.0), slot_sequences_(capacity, 0),
+      persistent_(persistent), clock_origin_us_(clock_origin_us)
+{
+    if (slot_size_bytes == 0 || capacity == 0)
+    {
+        throw std::invalid_argument("Tensor topic `" + topic_name + "` needs a non-empty shape and capacity");
+    }
+    if (is_shm_topic_)
+    {
+        // A spare slot after the ring takes reservations while the ring is full, see reserve_shm
+        shm_size_ = slot_size_ * (capacity_ + 1);
+        shm_size_gb_ = static_cast<double>(shm_size_) / (1024 * 1024 * 1024);
+        create_shm_();
+    }
+    else
+    {
+        heap_slots_.reset(new char[slot_size_ * capacity_]);
+    }
+}
+
+void DataTopic::create_shm_()
+{
+    // Without the pid, a restarting server finds the segments of its predecessor
+    shm_name_ = persistent_ ? "rmq_" + get_user_name() + "_" + server_name_ + "_" + topic_name_
+                            : "rmq_" + get_user_name() + "_" + get_pid() + "_" + server_name_ + "_" + topic_name_;
+    shm_mutex_name_ = shm_name_ + "_mutex";
     current_shm_offset_ = 0;
 
-    shm_fd_ = shm_open(get_shm_name_().c_str(), O_CREAT | O_RDWR, 0666);
+    shm_fd_ = shm_open(shm_name_.c_str(), O_CREAT | O_RDWR, 0666);
     if (shm_fd_ == -1)
     {
-        std::string full_shm_path = "/dev/shm/" + get_shm_name_();
+        std::string full_shm_path = "/dev/shm/" + shm_name_;
         throw std::runtime_error("Failed to create shared memory at " + full_shm_path +
                                  ". Please check if the user has permission to create shared memory.");
     }
+    struct stat shm_stat;
+    uint64_t existing_shm_size = fstat(shm_fd_, &shm_stat) == 0 ? shm_stat.st_size : 0;
     ftruncate(shm_fd_, shm_size_);
-    shm_ptr_ = mmap(0, shm_size_, PROT_WRITE, MAP_SHARED, shm_fd_, 0);
+    shm_ptr_ = mmap(0, shm_size_, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd_, 0);
+    if (shm_ptr_ == MAP_FAILED)
+    {
+        throw std::runtime_error("Failed to map shared memory at /dev/shm/" + shm_name_);
+    }
+    uint64_t mapped_size = shm_size_;
+    shm_mapping_ = std::shared_ptr<char>(static_cast<char *>(shm_ptr_),
+                                         [mapped_size](char *ptr) { munmap(ptr, mapped_size); });
 
     // Create shared memory mutex
-    shm_mutex_fd_ = shm_open(get_shm_mutex_name_().c_str(), O_CREAT | O_RDWR, 0666);
+    shm_mutex_fd_ = shm_open(shm_mutex_name_.c_str(), O_CREAT | O_RDWR, 0666);
     if (shm_mutex_fd_ == -1)
     {
-        std::string full_shm_mutex_path = "/dev/shm/" + get_shm_mutex_name_();
+        std::string full_shm_mutex_path = "/dev/shm/" + shm_mutex_name_;
         throw std::runtime_error("Failed to create shared memory mutex at " + full_shm_mutex_path +
                                  ". Please check if the user has permission to create shared memory mutex.");
     }
@@ -53,17 +102,298 @@ DataTopic::DataTopic(const std::string &topic_name, double message_remaining_tim
     pthread_mutexattr_t attr;
     pthread_mutexattr_init(&attr);
     pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    // Also initialized when reattaching, since the previous server may have died while holding it
     pthread_mutex_init(shm_mutex_ptr_, &attr);
+
+    if (persistent_ && open_index_(existing_shm_size))
+    {
+        restore_from_index_();
+        reattached_ = true;
+    }
 }
 
-std::string DataTopic::get_shm_name_() const
+bool DataTopic::open_index_(uint64_t existing_shm_size)
 {
-    return "rmq_" + get_user_name() + "_" + get_pid() + "_" + server_name_ + "_" + topic_name_;
+    index_name_ = shm_name_ + "_index";
+    uint64_t num_entries = is_tensor_topic_ ? capacity_ : MAX_RING_INDEX_ENTRIES_;
+    uint64_t slot_size = is_tensor_topic_ ? slot_size_ : 0;
+    index_size_ = sizeof(ShmTopicIndexHeader) + num_entries * sizeof(ShmIndexEntry);
+    index_fd_ = shm_open(index_name_.c_str(), O_CREAT | O_RDWR, 0666);
+    if (index_fd_ == -1)
+    {
+        throw std::runtime_error("Failed to create shared memory at /dev/shm/" + index_name_ +
+                                 ". Please check if the user has permission to create shared memory.");
+    }
+    struct stat index_stat;
+    bool existed = fstat(index_fd_, &index_stat) == 0 && static_cast<uint64_t>(index_stat.st_size) == index_size_;
+    ftruncate(index_fd_, index_size_);
+    void *index_ptr = mmap(0, index_size_, PROT_READ | PROT_WRITE, MAP_SHARED, index_fd_, 0);
+    if (index_ptr == MAP_FAILED)
+    {
+        throw std::runtime_error("Failed to map shared memory at /dev/shm/" + index_name_);
+    }
+    index_ = static_cast<ShmTopicIndexHeader *>(index_ptr);
+    index_entries_ = reinterpret_cast<ShmIndexEntry *>(index_ + 1);
+
+    if (existed && existing_shm_size == shm_size_ && index_->magic == ShmTopicIndexHeader::MAGIC &&
+        index_->shm_size == shm_size_ && index_->slot_size == slot_size && index_->num_entries == num_entries &&
+        index_->first <= index_->end && index_->end - index_->first <= num_entries &&
+        index_->write_offset < shm_size_)
+    {
+        return true;
+    }
+    // A new ring, or one whose layout changed. The magic is written last, so that a server that dies in between
+    // leaves an index that is not taken over.
+    index_->magic = 0;
+    std::atomic_thread_fence(std::memory_order_release);
+    index_->shm_size = shm_size_;
+    index_->slot_size = slot_size;
+    index_->num_entries = num_entries;
+    index_->clock_origin_us = clock_origin_us_;
+    index_->write_offset = 0;
+    index_->first = 0;
+    index_->end = 0;
+    std::atomic_thread_fence(std::memory_order_release);
+    index_->magic = ShmTopicIndexHeader::MAGIC;
+    return false;
 }
 
-std::string DataTopic::get_shm_mutex_name_() const
+void DataTopic::restore_from_index_()
 {
-    return "rmq_" + get_user_name() + "_" + get_pid() + "_" + server_name_ + "_" + topic_name_ + "_mutex";
+    double clock_shift_s = static_cast<double>(index_->clock_origin_us - clock_origin_us_) / 1e6;
+    if (is_tensor_topic_)
+    {
+        for (uint64_t slot = 0; slot < capacity_; slot++)
+        {
+            slot_timestamps_[slot] = index_entries_[slot].timestamp + clock_shift_s;
+            index_entries_[slot].timestamp = slot_timestamps_[slot];
+        }
+        index_->clock_origin_us = clock_origin_us_;
+        written_count_ = index_->end;
+        live_count_ = index_->end - index_->first;
+        for (uint64_t index = written_count_ - live_count_; index < written_count_; index++)
+        {
+            slot_sequences_[index % capacity_] = ++put_sequence_;
+        }
+        return;
+    }
+    // Items that were not stored in the ring are lost. The others are indexed again from the first entry.
+    std::vector<ShmIndexEntry> entries;
+    for (uint64_t i = index_->first; i < index_->end; i++)
+    {
+        const ShmIndexEntry &entry = index_entries_[i % index_->num_entries];
+        if (entry.size != ShmTopicIndexHeader::NOT_IN_RING && entry.start < shm_size_ && entry.size <= shm_size_)
+        {
+            entries.push_back(entry);
+        }
+    }
+    index_->first = 0;
+    index_->end = 0;
+    index_->clock_origin_us = clock_origin_us_;
+    current_shm_offset_ = index_->write_offset;
+    for (const ShmIndexEntry &entry : entries)
+    {
+        push_item_({make_shm_descriptor_(entry.start, entry.size), entry.timestamp + clock_shift_s});
+    }
+}
+
+void DataTopic::push_item_(const TimedPtr &item)
+{
+    if (index_ != nullptr && data_.size() >= index_->num_entries)
+    {
+        pop_front_item_();
+        stats_.messages_evicted++;
+    }
+    data_.push_back(item);
+    item_sequences_.push_back(++put_sequence_);
+    if (index_ == nullptr)
+    {
+        return;
+    }
+    ShmIndexEntry &entry = index_entries_[index_->end % index_->num_entries];
+    uint64_t start, size;
+    if (ring_item_extent_(item, start, size))
+    {
+        entry = {start, size, std::get<1>(item)};
+    }
+    else
+    {
+        entry = {0, ShmTopicIndexHeader::NOT_IN_RING, std::get<1>(item)};
+    }
+    index_->write_offset = current_shm_offset_;
+    // The entry is complete before it becomes live
+    std::atomic_thread_fence(std::memory_order_release);
+    index_->end++;
+}
+
+void DataTopic::pop_front_item_()
+{
+    data_.pop_front();
+    item_sequences_.pop_front();
+    front_sequence_++;
+    if (index_ != nullptr)
+    {
+        index_->first++;
+    }
+}
+
+void DataTopic::erase_item_(size_t position)
+{
+    if (position == 0)
+    {
+        pop_front_item_();
+        return;
+    }
+    // The items after position keep their sequence numbers, and the ones before it move up by one. Cursors up to
+    // the erased item move with them, so no group sees an item twice or skips one.
+    data_.erase(data_.begin() + position);
+    item_sequences_.erase(item_sequences_.begin() + position);
+    for (auto &group : consumer_cursors_)
+    {
+        if (group.second <= front_sequence_ + position)
+        {
+            group.second++;
+        }
+    }
+    front_sequence_++;
+    if (index_ != nullptr)
+    {
+        for (uint64_t i = position; i > 0; i--)
+        {
+            index_entries_[(index_->first + i) % index_->num_entries] =
+                index_entries_[(index_->first + i - 1) % index_->num_entries];
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        index_->first++;
+    }
+}
+
+void DataTopic::pop_back_item_()
+{
+    data_.pop_back();
+    item_sequences_.pop_back();
+    if (index_ != nullptr)
+    {
+        index_->end--;
+    }
+}
+
+void DataTopic::clear_items_()
+{
+    front_sequence_ += data_.size();
+    data_.clear();
+    item_sequences_.clear();
+    if (index_ != nullptr)
+    {
+        index_->first = index_->end;
+        index_->write_offset = current_shm_offset_;
+    }
+}
+
+void DataTopic::sync_slot_index_()
+{
+    if (index_ == nullptr || !is_tensor_topic_)
+    {
+        return;
+    }
+    if (written_count_ > 0)
+    {
+        uint64_t newest_slot = (written_count_ - 1) % capacity_;
+        index_entries_[newest_slot].timestamp = slot_timestamps_[newest_slot];
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    index_->first = written_count_ - live_count_;
+    index_->end = written_count_;
+}
+
+BytesPtr DataTopic::make_shm_descriptor_(uint64_t start, uint64_t size) const
+{
+    ShmDescriptor descriptor{ShmDescriptor::MAGIC, segment_id_, session_, 0, shm_size_, start, size};
+    return std::make_shared<Bytes>(descriptor.serialize());
+}
+
+bool DataTopic::ring_item_extent_(const TimedPtr &item, uint64_t &start, uint64_t &size) const
+{
+    const Bytes &bytes = *std::get<0>(item);
+    if (!ShmDescriptor::is_shm_descriptor(bytes))
+    {
+        return false;
+    }
+    ShmDescriptor descriptor = ShmDescriptor::parse(bytes);
+    if (descriptor.segment_id != segment_id_ || descriptor.session != session_)
+    {
+        return false;
+    }
+    start = descriptor.shm_start_idx;
+    size = descriptor.data_size_bytes;
+    return true;
+}
+
+uint64_t DataTopic::allocate_shm_(uint64_t size, bool contiguous)
+{
+    // Items are laid out in the ring in the same order as in data_, so the live region starts at the oldest item
+    // that still refers to this ring and ends at current_shm_offset_. A contiguous allocation that does not fit
+    // before the end of the ring skips the tail and starts at 0.
+    uint64_t start = current_shm_offset_;
+    uint64_t required_size = size;
+    if (contiguous && start + size > shm_size_)
+    {
+        required_size += shm_size_ - start;
+        start = 0;
+    }
+    // Items that are not in this ring (heap items, or descriptors of another segment) free no ring space, so only
+    // ring items are evicted. The scan resumes after the skipped items instead of starting over.
+    size_t position = 0;
+    while (position < data_.size())
+    {
+        uint64_t oldest_start = 0, oldest_size = 0;
+        if (!ring_item_extent_(data_[position], oldest_start, oldest_size))
+        {
+            position++;
+            continue;
+        }
+        uint64_t used_size = (current_shm_offset_ + shm_size_ - oldest_start) % shm_size_;
+        if (used_size == 0)
+        {
+            used_size = shm_size_;
+        }
+        if (shm_size_ - used_size >= required_size)
+        {
+            break;
+        }
+        erase_item_(position);
+        stats_.messages_evicted++;
+    }
+    current_shm_offset_ = (start + size) % shm_size_;
+    return start;
+}
+
+void DataTopic::write_shm_(uint64_t start, const char *data, uint64_t size)
+{
+    // Copy data to shared memory. Large frames are split across the copy engine's threads and written with
+    // streaming stores, since the readers are other processes.
+    char *shm_buffer = static_cast<char *>(shm_ptr_);
+    pthread_mutex_lock(shm_mutex_ptr_);
+    if (start + size > shm_size_)
+    {
+        uint64_t shm_remaining_size = shm_size_ - start;
+        engine_memcpy(shm_buffer + start, data, shm_remaining_size, true);
+        engine_memcpy(shm_buffer, data + shm_remaining_size, size - shm_remaining_size, true);
+    }
+    else
+    {
+        engine_memcpy(shm_buffer + start, data, size, true);
+    }
+    pthread_mutex_unlock(shm_mutex_ptr_);
+}
+
+void DataTopic::remove_expired_data_(double timestamp)
+{
+    while (!data_.empty() && timestamp - std::get<1>(data_.front()) > message_remaining_time_s_)
+    {
+        pop_front_item_();
+        stats_.messages_expired++;
+    }
 }
 
 void DataTopic::copy_data_to_shm(const pybind11::bytes &data, double timestamp)
@@ -74,65 +404,419 @@ void DataTopic::copy_data_to_shm(const pybind11::bytes &data, double timestamp)
     ssize_t length;
     // This gives you a pointer to the underlying buffer and the size
     PYBIND11_BYTES_AS_STRING_AND_SIZE(data.ptr(), &new_data_buffer, &length);
+    copy_data_to_shm(new_data_buffer, length, timestamp);
+}
 
+void DataTopic::copy_data_to_shm(const char *new_data_buffer, uint64_t data_size, double timestamp)
+{
+    if (is_tensor_topic_)
+    {
+        put_tensor(new_data_buffer, data_size, timestamp);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
     // Store the original data into shared memory and the shm_data_info into data_
-    int64_t data_size = length;
     if (data_size > shm_size_)
     {
-        printf("Data size %ld is larger than shared memory size %ld. New data will be ignored\n", data_size, shm_size_);
+        // Counted in stats() instead of failing the put, like data that expires before it is read
+        stats_.messages_dropped++;
+        int64_t now_us = steady_clock_us();
+        if (now_us - last_drop_warning_us_ >= DROP_WARNING_INTERVAL_US_)
+        {
+            last_drop_warning_us_ = now_us;
+            if (auto logger = spdlog::get(server_name_))
+            {
+                logger->warn("Dropped {} bytes put to topic `{}`, which is larger than its shared memory ring of {} "
+                             "bytes ({} dropped so far)",
+                             data_size, topic_name_, shm_size_, stats_.messages_dropped);
+            }
+        }
         return;
     }
-    BytesPtr info_ptr = std::make_shared<Bytes>(
-        SharedMemoryDataInfo(get_shm_name_(), shm_size_, current_shm_offset_, data_size).serialize());
-    data_.push_back({info_ptr, timestamp});
-    occupied_shm_size_ += data_size;
-    while (occupied_shm_size_ > shm_size_)
+    if (has_pending_reservation_)
     {
-        BytesPtr old_info_ptr = std::get<0>(data_.front());
-        SharedMemoryDataInfo old_info(*old_info_ptr);
-        if (old_info.shm_name() == get_shm_name_())
-            occupied_shm_size_ -= old_info.data_size_bytes();
-        data_.pop_front();
+        throw std::runtime_error("Topic `" + topic_name_ +
+                                 "` has a pending reservation. Please commit or cancel it before putting new data.");
     }
+    uint64_t start = allocate_shm_(data_size, false);
+    write_shm_(start, new_data_buffer, data_size);
+    count_put_(data_size, timestamp, new_data_buffer);
 
-    // Copy data to shared memory: 76MB takes 0.02s
+    push_item_({make_shm_descriptor_(start, data_size), timestamp});
+    remove_expired_data_(timestamp);
+}
 
-    pthread_mutex_lock(shm_mutex_ptr_);
-    if (current_shm_offset_ + data_size > shm_size_)
+uint64_t DataTopic::reserve_shm(uint64_t size)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (size == 0)
+    {
+        throw std::invalid_argument("Cannot reserve 0 bytes");
+    }
+    if (is_tensor_topic_)
+    {
+        if (size != slot_size_)
+        {
+            throw std::invalid_argument("Reserved size " + std::to_string(size) + " does not match the slot size " +
+                                        std::to_string(slot_size_) + " of tensor topic `" + topic_name_ + "`");
+        }
+        if (has_pending_reservation_)
+        {
+            throw std::runtime_error("Topic `" + topic_name_ +
+                                     "` already has a pending reservation. Please commit or cancel it first.");
+        }
+        // While the ring is full, the reservation is written into the spare slot, so the oldest item stays readable
+        // until the commit evicts it, and a cancel keeps it.
+        has_pending_reservation_ = true;
+        pending_reservation_start_ = (live_count_ == capacity_ ? capacity_ : written_count_ % capacity_) * slot_size_;
+        pending_reservation_size_ = size;
+        return pending_reservation_start_;
+    }
+    if (size > shm_size_)
+    {
+        throw std::invalid_argument("Reserved size " + std::to_string(size) + " is larger than shared memory size " +
+                                    std::to_string(shm_size_) + " of topic `" + topic_name_ + "`");
+    }
+    if (has_pending_reservation_)
+    {
+        throw std::runtime_error("Topic `" + topic_name_ +
+                                 "` already has a pending reservation. Please commit or cancel it first.");
+    }
+    uint64_t start = allocate_shm_(size, true);
+    has_pending_reservation_ = true;
+    pending_reservation_start_ = start;
+    pending_reservation_size_ = size;
+    return start;
+}
+
+void DataTopic::commit_shm(double timestamp)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!has_pending_reservation_)
+    {
+        throw std::runtime_error("Topic `" + topic_name_ + "` has no pending reservation to commit");
+    }
+    has_pending_reservation_ = false;
+    if (is_tensor_topic_)
+    {
+        if (live_count_ == capacity_)
+        {
+            live_count_--;
+            stats_.messages_evicted++;
+            sync_slot_index_();
+        }
+        // The reservation is in the spare slot, or the newest items were popped since it was made, which moves the
+        // next slot back
+        char *slot = slot_ptr_(written_count_);
+        if (slot != shm_buffer(pending_reservation_start_))
+        {
+            pthread_mutex_lock(shm_mutex_ptr_);
+            engine_memcpy(slot, shm_buffer(pending_reservation_start_), slot_size_, true);
+            pthread_mutex_unlock(shm_mutex_ptr_);
+        }
+        slot_timestamps_[written_count_ % capacity_] = timestamp;
+        slot_sequences_[written_count_ % capacity_] = ++put_sequence_;
+        written_count_++;
+        live_count_++;
+        count_put_(slot_size_, timestamp, slot);
+        remove_expired_slots_(timestamp);
+        sync_slot_index_();
+        return;
+    }
+    count_put_(pending_reservation_size_, timestamp, shm_buffer(pending_reservation_start_));
+    push_item_({make_shm_descriptor_(pending_reservation_start_, pending_reservation_size_), timestamp});
+    remove_expired_data_(timestamp);
+}
+
+void DataTopic::cancel_shm_reservation()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!has_pending_reservation_)
     {
-        uint64_t shm_remaining_size = shm_size_ - current_shm_offset_;
-        memcpy(shm_ptr_ + current_shm_offset_, new_data_buffer, shm_remaining_size);
-        current_shm_offset_ = data_size - shm_remaining_size;
-        memcpy(shm_ptr_, new_data_buffer + shm_remaining_size, current_shm_offset_);
+        return;
+    }
+    has_pending_reservation_ = false;
+    if (is_tensor_topic_)
+    {
+        return;
+    }
+    // No data was written after the reservation, so the write head can be moved back to its start.
+    current_shm_offset_ = pending_reservation_start_;
+}
+
+char *DataTopic::shm_buffer(uint64_t offset) const
+{
+    return static_cast<char *>(shm_ptr_) + offset;
+}
+
+std::shared_ptr<char> DataTopic::shm_mapping() const
+{
+    return shm_mapping_;
+}
+
+char *DataTopic::slot_ptr_(uint64_t index) const
+{
+    char *slots = is_shm_topic_ ? static_cast<char *>(shm_ptr_) : heap_slots_.get();
+    return slots + (index % capacity_) * slot_size_;
+}
+
+void DataTopic::put_tensor(const char *data, uint64_t size, double timestamp)
+{
+    if (!is_tensor_topic_)
+    {
+        throw std::runtime_error("Topic `" + topic_name_ + "` is not a tensor topic");
+    }
+    if (size != slot_size_)
+    {
+        throw std::invalid_argument("Data size " + std::to_string(size) + " does not match the slot size " +
+                                    std::to_string(slot_size_) + " of tensor topic `" + topic_name_ + "`");
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (has_pending_reservation_)
+    {
+        throw std::runtime_error("Topic `" + topic_name_ +
+                                 "` has a pending reservation. Please commit or cancel it before putting new data.");
+    }
+    // Evict the oldest item first if its slot is about to be overwritten
+    if (live_count_ == capacity_)
+    {
+        live_count_--;
+        stats_.messages_evicted++;
+        sync_slot_index_();
+    }
+    if (is_shm_topic_)
+    {
+        pthread_mutex_lock(shm_mutex_ptr_);
+        engine_memcpy(slot_ptr_(written_count_), data, size, true);
+        pthread_mutex_unlock(shm_mutex_ptr_);
     }
     else
     {
-        memcpy(shm_ptr_ + current_shm_offset_, new_data_buffer, data_size);
-        current_shm_offset_ += data_size;
+        engine_memcpy(slot_ptr_(written_count_), data, size, false);
     }
-    pthread_mutex_unlock(shm_mutex_ptr_);
+    slot_timestamps_[written_count_ % capacity_] = timestamp;
+    slot_sequences_[written_count_ % capacity_] = ++put_sequence_;
+    written_count_++;
+    live_count_++;
+    count_put_(size, timestamp, data);
+    remove_expired_slots_(timestamp);
+    sync_slot_index_();
+}
 
-    while (!data_.empty() && timestamp - std::get<1>(data_.front()) > message_remaining_time_s_)
+void DataTopic::remove_expired_slots_(double timestamp)
+{
+    while (live_count_ > 0 &&
+           timestamp - slot_timestamps_[(written_count_ - live_count_) % capacity_] > message_remaining_time_s_)
+    {
+        live_count_--;
+        stats_.messages_expired++;
+    }
+}
+
+void DataTopic::select_slots_(int32_t n, uint64_t &first, uint64_t &count) const
+{
+    int64_t live = static_cast<int64_t>(live_count_);
+    if (n == 0)
+    {
+        count = live;
+        first = written_count_ - count;
+    }
+    else if (n < 0)
+    {
+        count = std::min<int64_t>(-static_cast<int64_t>(n), live);
+        first = written_count_ - count;
+    }
+    else // n > 0
     {
-        BytesPtr old_info_ptr = std::get<0>(data_.front());
-        SharedMemoryDataInfo old_info(*old_info_ptr);
-        if (old_info.shm_name() == get_shm_name_())
-            occupied_shm_size_ -= old_info.data_size_bytes();
-        data_.pop_front();
+        count = std::min<int64_t>(n, live);
+        first = written_count_ - live;
     }
 }
 
+std::vector<TimedPtr> DataTopic::slot_ptrs_(uint64_t first, uint64_t count) const
+{
+    // Shared memory slots are passed as descriptors like ring items. Heap slots are copied, since they are
+    // overwritten in place.
+    std::vector<TimedPtr> ptrs;
+    ptrs.reserve(count);
+    for (uint64_t index = first; index < first + count; index++)
+    {
+        double timestamp = slot_timestamps_[index % capacity_];
+        if (is_shm_topic_)
+        {
+            ptrs.push_back({make_shm_descriptor_((index % capacity_) * slot_size_, slot_size_), timestamp});
+        }
+        else
+        {
+            const char *slot = slot_ptr_(index);
+            ptrs.push_back({std::make_shared<Bytes>(slot, slot + slot_size_), timestamp});
+        }
+    }
+    return ptrs;
+}
+
+pybind11::tuple DataTopic::peek_tensors(int32_t n, bool copy, const pybind11::handle &base)
+{
+    if (!is_tensor_topic_)
+    {
+        throw std::runtime_error("Topic `" + topic_name_ + "` is not a tensor topic");
+    }
+    pybind11::dtype dtype(tensor_dtype_);
+    std::vector<ssize_t> shape(tensor_shape_.begin(), tensor_shape_.end());
+    pybind11::list arrays;
+    pybind11::list timestamps;
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t first, count;
+    select_slots_(n, first, count);
+    stats_.messages_peeked += count;
+    for (uint64_t index = first; index < first + count; index++)
+    {
+        if (copy)
+        {
+            pybind11::array array(dtype, shape);
+            if (is_shm_topic_)
+            {
+                pthread_mutex_lock(shm_mutex_ptr_);
+            }
+            engine_memcpy(array.mutable_data(), slot_ptr_(index), slot_size_, false);
+            if (is_shm_topic_)
+            {
+                pthread_mutex_unlock(shm_mutex_ptr_);
+            }
+            arrays.append(array);
+        }
+        else
+        {
+            pybind11::array array(dtype, shape, {}, slot_ptr_(index), base);
+            array.attr("setflags")(pybind11::arg("write") = false);
+            arrays.append(array);
+        }
+        timestamps.append(slot_timestamps_[index % capacity_]);
+    }
+    return pybind11::make_tuple(arrays, timestamps);
+}
+
+pybind11::tuple DataTopic::peek_window(int32_t k, bool copy, const pybind11::handle &base)
+{
+    if (!is_tensor_topic_)
+    {
+        throw std::runtime_error("Topic `" + topic_name_ + "` is not a tensor topic");
+    }
+    if (k <= 0)
+    {
+        throw std::invalid_argument("Window size must be positive");
+    }
+    pybind11::dtype dtype(tensor_dtype_);
+    pybind11::list timestamps;
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t first, count;
+    select_slots_(-k, first, count);
+    stats_.messages_peeked += count;
+    std::vector<ssize_t> shape{static_cast<ssize_t>(count)};
+    shape.insert(shape.end(), tensor_shape_.begin(), tensor_shape_.end());
+    for (uint64_t index = first; index < first + count; index++)
+    {
+        timestamps.append(slot_timestamps_[index % capacity_]);
+    }
+
+    uint64_t first_slot = first % capacity_;
+    if (!copy && first_slot + count <= capacity_)
+    {
+        pybind11::array array(dtype, shape, {}, slot_ptr_(first), base);
+        array.attr("setflags")(pybind11::arg("write") = false);
+        return pybind11::make_tuple(array, timestamps);
+    }
+    // Gather the window into one array. It is one run of slots, or two if it wraps around the end of the ring.
+    pybind11::array array(dtype, shape);
+    char *dst = static_cast<char *>(array.mutable_data());
+    uint64_t first_run = std::min(count, capacity_ - first_slot);
+    if (is_shm_topic_)
+    {
+        pthread_mutex_lock(shm_mutex_ptr_);
+    }
+    engine_memcpy(dst, slot_ptr_(first), first_run * slot_size_, false);
+    engine_memcpy(dst + first_run * slot_size_, slot_ptr_(0), (count - first_run) * slot_size_, false);
+    if (is_shm_topic_)
+    {
+        pthread_mutex_unlock(shm_mutex_ptr_);
+    }
+    return pybind11::make_tuple(array, timestamps);
+}
+
 void DataTopic::add_data_ptr(const BytesPtr data_ptr, double timestamp)
 {
-    data_.push_back({data_ptr, timestamp});
-    while (!data_.empty() && timestamp - std::get<1>(data_.front()) > message_remaining_time_s_)
+    if (is_tensor_topic_)
     {
-        data_.pop_front();
+        put_tensor(data_ptr->data(), data_ptr->size(), timestamp);
+        return;
     }
+    std::lock_guard<std::mutex> lock(mutex_);
+    push_item_({data_ptr, timestamp});
+    count_put_(data_ptr->size(), timestamp, data_ptr->data(), data_ptr);
+    remove_expired_data_(timestamp);
 }
 
 std::vector<TimedPtr> DataTopic::peek_data_ptrs(int32_t n)
 {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<TimedPtr> ptrs = peek_data_ptrs_(n);
+    stats_.messages_peeked += ptrs.size();
+    return ptrs;
+}
+
+std::vector<TimedPtr> DataTopic::peek_data_ptrs_after(uint64_t sequence, int32_t n, uint64_t &cursor)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Sequences increase in storage order, so the items after `sequence` are the newest ones
+    std::vector<TimedPtr> ptrs;
+    std::vector<uint64_t> sequences;
+    if (is_tensor_topic_)
+    {
+        uint64_t first = written_count_;
+        while (first > written_count_ - live_count_ && slot_sequences_[(first - 1) % capacity_] > sequence)
+        {
+            first--;
+        }
+        ptrs = slot_ptrs_(first, written_count_ - first);
+        for (uint64_t index = first; index < written_count_; index++)
+        {
+            sequences.push_back(slot_sequences_[index % capacity_]);
+        }
+    }
+    else
+    {
+        size_t first = data_.size();
+        while (first > 0 && item_sequences_[first - 1] > sequence)
+        {
+            first--;
+        }
+        ptrs.assign(data_.begin() + first, data_.end());
+        sequences.assign(item_sequences_.begin() + first, item_sequences_.end());
+    }
+    int64_t count = static_cast<int64_t>(ptrs.size());
+    if (n > 0 && count > n)
+    {
+        ptrs.resize(n);
+        sequences.resize(n);
+    }
+    else if (n < 0 && count > -static_cast<int64_t>(n))
+    {
+        ptrs.erase(ptrs.begin(), ptrs.end() + n);
+        sequences.erase(sequences.begin(), sequences.end() + n);
+    }
+    cursor = sequences.empty() ? sequence : sequences.back();
+    stats_.messages_peeked += ptrs.size();
+    return ptrs;
+}
+
+std::vector<TimedPtr> DataTopic::peek_data_ptrs_(int32_t n)
+{
+    if (is_tensor_topic_)
+    {
+        uint64_t first, count;
+        select_slots_(n, first, count);
+        return slot_ptrs_(first, count);
+    }
     if (data_.empty())
     {
         return std::vector<TimedPtr>();
@@ -162,6 +846,22 @@ std::vector<TimedPtr> DataTopic::peek_data_ptrs(int32_t n)
 
 std::vector<TimedPtr> DataTopic::pop_data_ptrs(int32_t n)
 {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (is_tensor_topic_)
+    {
+        uint64_t first, count;
+        select_slots_(n, first, count);
+        std::vector<TimedPtr> ret = slot_ptrs_(first, count);
+        if (n < 0)
+        {
+            // The newest slots are free again
+            written_count_ -= count;
+        }
+        live_count_ -= count;
+        stats_.messages_popped += count;
+        sync_slot_index_();
+        return ret;
+    }
     if (data_.empty())
     {
         return std::vector<TimedPtr>();
@@ -178,91 +878,368 @@ std::vector<TimedPtr> DataTopic::pop_data_ptrs(int32_t n)
     {
         n = -data_.size();
     }
-    std::vector<TimedPtr> ret = peek_data_ptrs(n);
+    std::vector<TimedPtr> ret = peek_data_ptrs_(n);
+    stats_.messages_popped += ret.size();
 
     if (n < 0)
     {
         n = -n;
         for (int i = 0; i < n; i++)
         {
-            if (is_shm_topic_)
-            {
-                BytesPtr old_info_ptr = std::get<0>(data_.back());
-                SharedMemoryDataInfo old_info(*old_info_ptr);
-                if (old_info.shm_name() == get_shm_name_())
-                    occupied_shm_size_ -= old_info.data_size_bytes();
-            }
-            data_.pop_back();
+            pop_back_item_();
         }
     }
     else // n > 0
     {
         for (int i = 0; i < n; i++)
         {
-            if (is_shm_topic_)
-            {
-                BytesPtr old_info_ptr = std::get<0>(data_.front());
-                SharedMemoryDataInfo old_info(*old_info_ptr);
-                if (old_info.shm_name() == get_shm_name_())
-                    occupied_shm_size_ -= old_info.data_size_bytes();
-            }
-            data_.pop_front();
+            pop_front_item_();
         }
     }
     return ret;
 }
 
+std::vector<TimedPtr> DataTopic::consume_data_ptrs(const std::string &group, int32_t n)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t first, end;
+    sequence_range_(first, end);
+    uint64_t &cursor = consumer_cursors_.emplace(group, first).first->second;
+    // Items expired or evicted before the group consumed them are skipped. Items popped from the back may be
+    // replaced by new items with the same sequence numbers, which the group has not seen yet.
+    cursor = std::min(std::max(cursor, first), end);
+    uint64_t count = end - cursor;
+    if (n > 0)
+    {
+        count = std::min<uint64_t>(count, n);
+    }
+    else if (n < 0)
+    {
+        count = std::min<uint64_t>(count, -static_cast<int64_t>(n));
+        cursor = end - count;
+    }
+    std::vector<TimedPtr> ptrs;
+    if (is_tensor_topic_)
+    {
+        ptrs = slot_ptrs_(cursor, count);
+    }
+    else
+    {
+        auto begin = data_.begin() + (cursor - front_sequence_);
+        ptrs.assign(begin, begin + count);
+    }
+    cursor += count;
+    stats_.messages_consumed += count;
+    release_consumed_();
+    return ptrs;
+}
+
+void DataTopic::remove_consumer_group(const std::string &group)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    consumer_cursors_.erase(group);
+    release_consumed_();
+}
+
+std::unordered_map<std::string, uint64_t> DataTopic::consumer_groups() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t first, end;
+    sequence_range_(first, end);
+    std::unordered_map<std::string, uint64_t> groups;
+    for (const auto &entry : consumer_cursors_)
+    {
+        groups[entry.first] = end - std::min(std::max(entry.second, first), end);
+    }
+    return groups;
+}
+
+void DataTopic::sequence_range_(uint64_t &first, uint64_t &end) const
+{
+    if (is_tensor_topic_)
+    {
+        first = written_count_ - live_count_;
+        end = written_count_;
+    }
+    else
+    {
+        first = front_sequence_;
+        end = front_sequence_ + data_.size();
+    }
+}
+
+void DataTopic::release_consumed_()
+{
+    if (consumer_cursors_.empty())
+    {
+        return;
+    }
+    uint64_t first, end;
+    sequence_range_(first, end);
+    uint64_t released = end;
+    for (const auto &entry : consumer_cursors_)
+    {
+        released = std::min(released, std::max(entry.second, first));
+    }
+    if (is_tensor_topic_)
+    {
+        live_count_ -= released - first;
+        sync_slot_index_();
+        return;
+    }
+    while (front_sequence_ < released)
+    {
+        pop_front_item_();
+    }
+}
+
 void DataTopic::clear_data()
 {
-    data_.clear();
-    if (is_shm_topic_)
+    std::lock_guard<std::mutex> lock(mutex_);
+    live_count_ = 0;
+    if (is_shm_topic_ && !has_pending_reservation_)
     {
-        occupied_shm_size_ = 0;
         current_shm_offset_ = 0;
     }
+    clear_items_();
+    sync_slot_index_();
 }
 
-int DataTopic::size() const
+void DataTopic::count_put_(uint64_t size, double timestamp, const char *data, const BytesPtr &data_ptr)
 {
-    return data_.size();
+    stats_.messages_put++;
+    stats_.bytes_put += size;
+    if (recorder_ != nullptr)
+    {
+        if (data_ptr)
+        {
+            recorder_->record(recorder_stream_id_, stats_.messages_put, timestamp, data_ptr);
+        }
+        else
+        {
+            recorder_->record(recorder_stream_id_, stats_.messages_put, timestamp, data, size);
+        }
+    }
 }
 
-pybind11::bytes DataTopic::get_shared_memory_data(const SharedMemoryDataInfo &shm_data_info)
+void DataTopic::set_recorder(LogWriter *recorder, uint32_t stream_id)
 {
-    pybind11::bytes data;
-    pthread_mutex_lock(shm_mutex_ptr_);
-    if (shm_data_info.shm_start_idx() + shm_data_info.data_size_bytes() > shm_size_)
+    std::lock_guard<std::mutex> lock(mutex_);
+    recorder_ = recorder;
+    recorder_stream_id_ = stream_id;
+}
+
+LogTopicInfo DataTopic::log_topic_info() const
+{
+    LogTopicInfo info;
+    info.name = topic_name_;
+    info.message_remaining_time_s = message_remaining_time_s_;
+    if (is_tensor_topic_)
     {
-        char *a = reinterpret_cast<char *>(shm_ptr_) + shm_data_info.shm_start_idx();
-        size_t a_len = shm_size_ - shm_data_info.shm_start_idx();
-        char *b = reinterpret_cast<char *>(shm_ptr_);
-        size_t b_len = shm_data_info.data_size_bytes() - a_len;
-        data = concat_to_pybytes(a, a_len, b, b_len);
+        info.kind = LogTopicInfo::TENSOR;
+        info.dtype = tensor_dtype_;
+        info.shape = tensor_shape_;
+        info.capacity = capacity_;
+        info.shared_memory = is_shm_topic_;
     }
-    else
+    else if (is_shm_topic_)
     {
-        data = pybind11::bytes(reinterpret_cast<char *>(shm_ptr_) + shm_data_info.shm_start_idx(),
-                               shm_data_info.data_size_bytes());
+        info.kind = LogTopicInfo::SHARED_MEMORY;
+        info.shared_memory_size_gb = shm_size_gb_;
     }
+    return info;
+}
+
+TopicStats DataTopic::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+int DataTopic::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return is_tensor_topic_ ? live_count_ : data_.size();
+}
+
+pybind11::bytes DataTopic::get_shared_memory_data(const ShmDescriptor &descriptor)
+{
+    pthread_mutex_lock(shm_mutex_ptr_);
+    pybind11::bytes data = copy_ring_to_pybytes(static_cast<char *>(shm_ptr_), shm_size_, descriptor.shm_start_idx,
+                                                descriptor.data_size_bytes);
     pthread_mutex_unlock(shm_mutex_ptr_);
     return data;
 }
 
+BytesPtr DataTopic::copy_shared_memory_data(const ShmDescriptor &descriptor)
+{
+    BytesPtr data_ptr = std::make_shared<Bytes>(descriptor.data_size_bytes, '\0');
+    char *ring = static_cast<char *>(shm_ptr_);
+    uint64_t first_size = std::min(descriptor.data_size_bytes, shm_size_ - descriptor.shm_start_idx);
+    pthread_mutex_lock(shm_mutex_ptr_);
+    engine_memcpy(&(*data_ptr)[0], ring + descriptor.shm_start_idx, first_size, false);
+    engine_memcpy(&(*data_ptr)[0] + first_size, ring, descriptor.data_size_bytes - first_size, false);
+    pthread_mutex_unlock(shm_mutex_ptr_);
+    return data_ptr;
+}
+
+void DataTopic::set_compression(CompressionType type, int level)
+{
+    if (!is_compression_available(type))
+    {
+        throw std::invalid_argument("Compression " + compression_type_to_string(type) +
+                                    " is not available in this build");
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    compression_type_ = type;
+    compression_level_ = level;
+    compressed_cache_.clear();
+}
+
+std::vector<TimedPtr> DataTopic::prepare_remote_ptrs(const std::vector<TimedPtr> &ptrs, uint8_t request_flags)
+{
+    CompressionType compression_type;
+    int compression_level;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        compression_type = compression_type_;
+        compression_level = compression_level_;
+    }
+    bool compress = is_compression_accepted(compression_type, request_flags);
+    bool negotiated = is_compression_negotiated(request_flags);
+    if (!negotiated && !is_shm_topic_)
+    {
+        return ptrs;
+    }
+
+    std::vector<TimedPtr> remote_ptrs;
+    remote_ptrs.reserve(ptrs.size());
+    for (const TimedPtr &ptr : ptrs)
+    {
+        const BytesPtr &item = std::get<0>(ptr);
+        if (compress)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto cache_it = compressed_cache_.find(item.get());
+            if (cache_it != compressed_cache_.end() && cache_it->second.source.lock() == item &&
+                cache_it->second.type == compression_type)
+            {
+                remote_ptrs.push_back({cache_it->second.compressed, std::get<1>(ptr)});
+                continue;
+            }
+        }
+
+        BytesPtr data_ptr = item;
+        if (is_shm_topic_ && ShmDescriptor::is_shm_descriptor(*item))
+        {
+            data_ptr = copy_shared_memory_data(ShmDescriptor::parse(*item));
+        }
+        if (compress)
+        {
+            // Compress outside the topic lock. Concurrent readers may compress the same item twice, which is harmless.
+            BytesPtr compressed = compress_data(data_ptr->data(), data_ptr->size(), compression_type, compression_level);
+            if (compressed != nullptr)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (compressed_cache_.size() > data_.size() + 64)
+                {
+                    for (auto it = compressed_cache_.begin(); it != compressed_cache_.end();)
+                    {
+                        it = it->second.source.expired() ? compressed_cache_.erase(it) : std::next(it);
+                    }
+                }
+                compressed_cache_[item.get()] = {item, compression_type, compressed};
+                remote_ptrs.push_back({compressed, std::get<1>(ptr)});
+                continue;
+            }
+        }
+        if (negotiated)
+        {
+            data_ptr = mark_uncompressed_data(data_ptr);
+        }
+        remote_ptrs.push_back({data_ptr, std::get<1>(ptr)});
+    }
+    return remote_ptrs;
+}
+
 bool DataTopic::is_shm_topic() const
 {
     return is_shm_topic_;
 }
 
-void DataTopic::delete_shm()
+bool DataTopic::is_tensor_topic() const
 {
+    return is_tensor_topic_;
+}
+
+bool DataTopic::accepts_item_size(uint64_t size) const
+{
+    return !is_tensor_topic_ || size == slot_size_;
+}
+
+const std::string &DataTopic::tensor_dtype() const
+{
+    return tensor_dtype_;
+}
+
+const std::vector<int64_t> &DataTopic::tensor_shape() const
+{
+    return tensor_shape_;
+}
+
+uint32_t DataTopic::shm_segment_id() const
+{
+    return segment_id_;
+}
+
+const std::string &DataTopic::shm_name() const
+{
+    return shm_name_;
+}
+
+void DataTopic::delete_shm(bool unlink)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
     if (is_shm_topic_)
     {
-        printf("deleting shared memory: %s\n", get_shm_name_().c_str());
-        munmap(shm_ptr_, shm_size_);
+        if (unlink)
+        {
+            printf("deleting shared memory: %s\n", shm_name_.c_str());
+        }
+        shm_mapping_.reset();
         munmap(shm_mutex_ptr_, sizeof(pthread_mutex_t));
-        shm_unlink(get_shm_name_().c_str());
-        shm_unlink(get_shm_mutex_name_().c_str());
+        if (index_ != nullptr)
+        {
+            munmap(index_, index_size_);
+            close(index_fd_);
+            index_ = nullptr;
+            index_entries_ = nullptr;
+        }
+        if (unlink)
+        {
+            shm_unlink(shm_name_.c_str());
+            shm_unlink(shm_mutex_name_.c_str());
+            if (!index_name_.empty())
+            {
+                shm_unlink(index_name_.c_str());
+            }
+        }
         close(shm_fd_);
         close(shm_mutex_fd_);
     }
+}
+
+bool DataTopic::reattached() const
+{
+    return reattached_;
+}
+
+void DataTopic::set_clock_origin_us(int64_t clock_origin_us)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    clock_origin_us_ = clock_origin_us;
+    if (index_ != nullptr)
+    {
+        index_->clock_origin_us = clock_origin_us;
+    }
 }
\ No newline at end of file
@@ -6,13 +6,17 @@
  */
 
 #include "common.h"
+#include "compression.h"
 #include "data_topic.h"
 #include "rmq_client.h"
 #include "rmq_message.h"
 #include "rmq_server.h"
+#include "serializer.h"
+#include "topic_log.h"
 #include <pybind11/functional.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
+#include <limits>
 
 namespace py = pybind11;
 
@@ -21,6 +25,11 @@ PYBIND11_MODULE(robotmq_core, m)
 
     m.def("steady_clock_us", &steady_clock_us);
     m.def("system_clock_us", &system_clock_us);
+    m.def("get_available_compressions", &get_available_compressions);
+    m.def("serialize_object", &serialize_object, py::arg("data"));
+    m.def("serialized_object_size", &serialized_object_size, py::arg("data"));
+    m.def("serialize_object_into", &serialize_object_into, py::arg("data"), py::arg("buffer"));
+    m.def("deserialize_object", &deserialize_object, py::arg("data"), py::arg("copy") = true);
 
     py::enum_<spdlog::level::level_enum>(m, "RMQLogLevel", py::module_local())
         .value("TRACE", spdlog::level::level_enum::trace)
@@ -32,30 +41,111 @@ PYBIND11_MODULE(robotmq_core, m)
         .value("OFF", spdlog::level::level_enum::off)
         .export_values();
 
+    py::class_<BytesView>(m, "RMQBytesView", py::buffer_protocol())
+        .def_buffer([](BytesView &view) -> py::buffer_info {
+            return py::buffer_info(&(*view.data_ptr)[0], sizeof(uint8_t), py::format_descriptor<uint8_t>::format(), 1,
+                                   {static_cast<py::ssize_t>(view.data_ptr->size())}, {sizeof(uint8_t)}, true);
+        })
+        .def("__len__", [](const BytesView &view) { return view.data_ptr->size(); })
+        .def("tobytes", [](const BytesView &view) { return copy_to_pybytes(view.data_ptr->data(), view.data_ptr->size()); });
+
     py::class_<RMQClient>(m, "RMQClient")
         .def(py::init<const std::string &, const std::string &>(), py::arg("client_name"), py::arg("server_endpoint"))
         .def(py::init<const std::string &, const std::string &, spdlog::level::level_enum>(), py::arg("client_name"), py::arg("server_endpoint"), py::arg("log_level"))
         .def("get_topic_status", &RMQClient::get_topic_status, py::arg("topic"), py::arg("timeout_s"))
         .def("peek_data", py::overload_cast<const std::string &, int32_t, double, bool>(&RMQClient::peek_data), py::arg("topic"), py::arg("n"), py::arg("timeout_s")=1.0, py::arg("automatic_resend")=true)
         .def("pop_data", py::overload_cast<const std::string &, int32_t, double, bool>(&RMQClient::pop_data), py::arg("topic"), py::arg("n"), py::arg("timeout_s")=1.0, py::arg("automatic_resend")=true)
+        .def("consume_data", &RMQClient::consume_data, py::arg("topic"), py::arg("group"), py::arg("n") = 1,
+             py::arg("timeout_s") = 1.0, py::arg("automatic_resend") = true)
         .def("put_data", py::overload_cast<const std::string &, const pybind11::bytes &, double, bool>(&RMQClient::put_data), py::arg("topic"), py::arg("data"), py::arg("timeout_s")=1.0, py::arg("automatic_resend")=true)
+        .def("peek_window", &RMQClient::peek_window, py::arg("topic"), py::arg("k"), py::arg("dtype"), py::arg("shape"),
+             py::arg("timeout_s") = 1.0, py::arg("automatic_resend") = true)
+        .def("get_server_stats", &RMQClient::get_server_stats, py::arg("timeout_s") = 1.0)
+        .def("get_server_stats_text", &RMQClient::get_server_stats_text, py::arg("timeout_s") = 1.0)
+        .def("set_request_tracing", &RMQClient::set_request_tracing, py::arg("enabled"))
+        .def("get_last_request_trace", &RMQClient::get_last_request_trace)
         .def("get_last_retrieved_data", &RMQClient::get_last_retrieved_data)
         .def("reset_start_time", &RMQClient::reset_start_time, py::arg("system_time_us"))
+        .def("synchronize_clock", &RMQClient::synchronize_clock, py::arg("num_samples") = 8, py::arg("timeout_s") = 1.0)
+        .def("start_clock_sync", &RMQClient::start_clock_sync, py::arg("interval_s") = 1.0, py::arg("num_samples") = 8)
+        .def("stop_clock_sync", &RMQClient::stop_clock_sync)
+        .def("get_clock_offset", &RMQClient::get_clock_offset)
         .def("get_timestamp", &RMQClient::get_timestamp)
+        .def("shares_host_with_server", &RMQClient::shares_host_with_server, py::arg("timeout_s") = 1.0)
+        .def("set_inline_payloads", &RMQClient::set_inline_payloads, py::arg("enabled"))
+        .def("set_chunk_size", &RMQClient::set_chunk_size, py::arg("chunk_size_bytes"))
+        .def("set_progress_callback", &RMQClient::set_progress_callback, py::arg("callback"))
+        .def("set_data_connections", &RMQClient::set_data_connections, py::arg("num_connections"))
+        .def("put_data_async", &RMQClient::put_data_async, py::arg("topic"), py::arg("data"))
+        .def("flush_async_put", &RMQClient::flush_async_put, py::arg("timeout_s") = -1.0)
+        .def("set_async_put_options", &RMQClient::set_async_put_options, py::arg("max_batch_messages") = 256,
+             py::arg("max_batch_bytes") = 1024 * 1024, py::arg("max_delay_s") = 0.005,
+             py::arg("max_queued_messages") = 4096)
+        .def("set_async_put_callback", &RMQClient::set_async_put_callback, py::arg("callback"))
+        .def("get_async_put_stats", &RMQClient::get_async_put_stats)
         .def("request_with_data", py::overload_cast<const std::string &, const pybind11::bytes &, double, bool>(&RMQClient::request_with_data), py::arg("topic"), py::arg("data"), py::arg("timeout_s")=1.0, py::arg("automatic_resend")=true);
 
     py::class_<RMQServer>(m, "RMQServer")
         .def(py::init<const std::string &, const std::string &>(), py::arg("server_name"), py::arg("server_endpoint"))
-        .def(py::init<const std::string &, const std::string &, spdlog::level::level_enum>(), py::arg("server_name"), py::arg("server_endpoint"), py::arg("log_level"))
+        .def(py::init<const std::string &, const std::string &, spdlog::level::level_enum, bool>(), py::arg("server_name"),
+             py::arg("server_endpoint"), py::arg("log_level"), py::arg("persistent_shm") = false)
         .def("add_topic", &RMQServer::add_topic, py::arg("topic"), py::arg("message_remaining_time_s"))
         .def("add_shared_memory_topic", &RMQServer::add_shared_memory_topic, py::arg("topic"),
              py::arg("message_remaining_time_s"), py::arg("shared_memory_size_gb"))
+        .def("add_tensor_topic", &RMQServer::add_tensor_topic, py::arg("topic"), py::arg("dtype"), py::arg("shape"),
+             py::arg("capacity"), py::arg("message_remaining_time_s") = std::numeric_limits<double>::infinity(),
+             py::arg("shared_memory") = true)
+        .def("set_topic_compression", &RMQServer::set_topic_compression, py::arg("topic"), py::arg("compression"),
+             py::arg("level") = 0)
+        .def("set_chunking", &RMQServer::set_chunking, py::arg("chunk_size_bytes"),
+             py::arg("max_pending_upload_bytes") = 4ull * 1024 * 1024 * 1024)
         .def("put_data", &RMQServer::put_data, py::arg("topic"), py::arg("data"))
-        .def("peek_data", &RMQServer::peek_data, py::arg("topic"), py::arg("n"))
-        .def("pop_data", &RMQServer::pop_data, py::arg("topic"), py::arg("n"))
+        .def("put_data_async", &RMQServer::put_data_async, py::arg("topic"), py::arg("data"))
+        .def("flush_async_put", &RMQServer::flush_async_put, py::arg("timeout_s") = -1.0)
+        .def("set_async_put_capacity", &RMQServer::set_async_put_capacity, py::arg("max_queued_messages"))
+        .def("get_async_put_stats", &RMQServer::get_async_put_stats)
+        .def("reserve", &RMQServer::reserve, py::arg("topic"), py::arg("nbytes"))
+        .def("commit", &RMQServer::commit, py::arg("handle"), py::arg("timestamp") = py::none())
+        .def("cancel", &RMQServer::cancel, py::arg("handle"))
+        .def("put_object", &RMQServer::put_object, py::arg("topic"), py::arg("data"))
+        .def("put_tensor", &RMQServer::put_tensor, py::arg("topic"), py::arg("array"))
+        .def("peek_tensor", &RMQServer::peek_tensor, py::arg("topic"), py::arg("n"), py::arg("copy") = true)
+        .def("peek_window", &RMQServer::peek_window, py::arg("topic"), py::arg("k"), py::arg("copy") = true)
+        .def("peek_data", &RMQServer::peek_data, py::arg("topic"), py::arg("n"), py::arg("copy") = true)
+        .def("pop_data", &RMQServer::pop_data, py::arg("topic"), py::arg("n"), py::arg("copy") = true)
+        .def("consume_data", &RMQServer::consume_data, py::arg("topic"), py::arg("group"), py::arg("n") = 1,
+             py::arg("copy") = true)
+        .def("remove_consumer_group", &RMQServer::remove_consumer_group, py::arg("topic"), py::arg("group"))
+        .def("get_consumer_groups", &RMQServer::get_consumer_groups, py::arg("topic"))
         .def("get_all_topic_status", &RMQServer::get_all_topic_status)
+        .def("get_stats", &RMQServer::get_stats)
+        .def("get_stats_text", &RMQServer::get_stats_text)
+        .def("set_trace_export", &RMQServer::set_trace_export, py::arg("path"))
+        .def("start_recording", &RMQServer::start_recording, py::arg("path"),
+             py::arg("topics") = std::vector<std::string>(), py::arg("max_queued_bytes") = 1024ull * 1024 * 1024)
+        .def("stop_recording", &RMQServer::stop_recording)
+        .def("get_recording_stats", &RMQServer::get_recording_stats)
+        .def("start_replay", &RMQServer::start_replay, py::arg("path"), py::arg("topics") = std::vector<std::string>(),
+             py::arg("speed") = 1.0, py::arg("start_timestamp") = py::none(), py::arg("loop") = false,
+             py::arg("create_topics") = true)
+        .def("stop_replay", &RMQServer::stop_replay)
+        .def("wait_for_replay", &RMQServer::wait_for_replay, py::arg("timeout_s") = -1.0)
+        .def("get_replay_stats", &RMQServer::get_replay_stats)
+        .def("start_relay", &RMQServer::start_relay, py::arg("upstream_endpoint"), py::arg("topics"),
+             py::arg("poll_interval_s") = 0.001, py::arg("timeout_s") = 1.0)
+        .def("stop_relay", &RMQServer::stop_relay, py::arg("upstream_endpoint") = "")
+        .def("get_relay_stats", &RMQServer::get_relay_stats)
+        .def("discard_persistent_state", &RMQServer::discard_persistent_state)
         .def("reset_start_time", &RMQServer::reset_start_time, py::arg("system_time_us"))
         .def("wait_for_request", &RMQServer::wait_for_request, py::arg("timeout_s"))
         .def("reply_request", &RMQServer::reply_request, py::arg("topic"), py::arg("data"))
         .def("get_timestamp", &RMQServer::get_timestamp);
+
+    py::class_<LogReader>(m, "RMQLogReader")
+        .def(py::init<const std::string &>(), py::arg("path"))
+        .def("topics", &LogReader::topics_dict)
+        .def("__len__", &LogReader::size)
+        .def("read", &LogReader::read, py::arg("index"))
+        .def("seek", &LogReader::seek, py::arg("timestamp"))
+        .def("time_range", &LogReader::time_range);
 }
@@ -7,18 +7,61 @@
 
 #include "rmq_client.h"
 #include "common.h"
+#include "compression.h"
+#include "copy_engine.h"
+#include <algorithm>
 #include <cstring>
+#include <deque>
 #include <fcntl.h>
+#include <limits>
+#include <numeric>
+#include <pybind11/numpy.h>
+#include <random>
 #include <sys/mman.h>
+#include <thread>
 #include <unistd.h>
 
+namespace
+{
+// Client locks are only waited for without the GIL. Otherwise a thread holding the lock could wait for the GIL while
+// the thread holding the GIL waits for the lock.
+template <typename Mutex> void lock_without_gil(std::unique_lock<Mutex> &lock)
+{
+    if (!lock.try_lock())
+    {
+        pybind11::gil_scoped_release release;
+        lock.lock();
+    }
+}
+
+template <typename Mutex> std::unique_lock<Mutex> lock_without_gil(Mutex &mutex)
+{
+    std::unique_lock<Mutex> lock(mutex, std::defer_lock);
+    lock_without_gil(lock);
+    return lock;
+}
+
+// Other Python threads run while a thread waits for the server. Background threads do not hold the GIL.
+void poll_without_gil(zmq::pollitem_t *items, size_t num_items, long timeout_ms)
+{
+    if (PyGILState_Check())
+    {
+        pybind11::gil_scoped_release release;
+        zmq::poll(items, num_items, timeout_ms);
+        return;
+    }
+    zmq::poll(items, num_items, timeout_ms);
+}
+} // namespace
+
 RMQClient::RMQClient(const std::string &client_name, const std::string &server_endpoint)
     : RMQClient(client_name, server_endpoint, spdlog::level::info)
 {
 }
 
 RMQClient::RMQClient(const std::string &client_name, const std::string &server_endpoint, spdlog::level::level_enum log_level)
-    : client_name_(client_name), context_(1), socket_(context_, zmq::socket_type::req),
+    : client_name_(client_name), server_endpoint_(server_endpoint), context_(1),
+      socket_(context_, zmq::socket_type::req),
       steady_clock_start_time_us_(steady_clock_us()), last_retrieved_ptrs_()
 {
     logger_ = spdlog::get(client_name);
@@ -35,12 +78,29 @@ RMQClient::RMQClient(const std::string &client_name, const std::string &server_e
 
 RMQClient::~RMQClient()
 {
+    for (auto &segment : shm_segments_)
+    {
+        unmap_shm_segment_(segment.second);
+    }
+    async_put_running_ = false;
+    if (async_put_thread_.joinable())
+    {
+        async_put_queue_.notify();
+        pybind11::gil_scoped_release release;
+        async_put_thread_.join();
+    }
+    stop_clock_sync();
+    for (zmq::socket_t &socket : data_sockets_)
+    {
+        socket.close();
+    }
     socket_.close();
     context_.close();
 }
 
 int RMQClient::get_topic_status(const std::string &topic, double timeout_s)
 {
+    std::unique_lock<std::recursive_mutex> lock = lock_without_gil(mutex_);
     RMQMessage message(topic, CmdType::GET_TOPIC_STATUS, get_timestamp(), "Get topic status");
 
     std::string serialized = message.serialize();
@@ -50,12 +110,12 @@ int RMQClient::get_topic_status(const std::string &topic, double timeout_s)
     zmq::pollitem_t items[] = {{socket_, 0, ZMQ_POLLIN, 0}};
     if (timeout_s >= 0)
     {
-        zmq::poll(&items[0], 1, timeout_s * 1000);
+        poll_without_gil(&items[0], 1, timeout_s * 1000);
     }
     else
     {
         // Wait forever until the server is connected
-        zmq::poll(&items[0], 1, default_timeout_s_ * 1000000);
+        poll_without_gil(&items[0], 1, default_timeout_s_ * 1000000);
     }
     if (items[0].revents & ZMQ_POLLIN)
     {
@@ -97,18 +157,76 @@ int RMQClient::get_topic_status(const std::string &topic, double timeout_s)
                                     "Please check whether the server is running.");
     }
 
-    logger_->warn("Not connected to server after {} retries. Retrying...", retries_);
+    logger_->warn("Not connected to server after {} retries. Retrying...", retries_.load());
     if (timeout_s >= 0)
     {
         return -2;
     }
 }
 
-pybind11::tuple RMQClient::peek_data(const std::string &topic, int32_t n, double timeout_s, bool automatic_resend)
+bool RMQClient::shares_host_with_server(double timeout_s)
+{
+    std::unique_lock<std::recursive_mutex> lock = lock_without_gil(mutex_);
+    return handshake_(timeout_s, true);
+}
+
+void RMQClient::set_inline_payloads(std::optional<bool> enabled)
+{
+    std::unique_lock<std::recursive_mutex> lock = lock_without_gil(mutex_);
+    inline_payloads_override_ = enabled;
+}
+
+bool RMQClient::handshake_(double timeout_s, bool automatic_resend)
+{
+    if (!shares_host_.has_value())
+    {
+        RMQMessage message(client_name_, CmdType::HANDSHAKE, get_timestamp(), get_shm_host_token());
+        RMQMessage reply_message = exchange_(message, timeout_s, automatic_resend);
+        if (reply_message.cmd() != CmdType::HANDSHAKE || reply_message.data_str().size() != sizeof(int32_t))
+        {
+            throw std::runtime_error("Invalid handshake reply from server");
+        }
+        shares_host_ = bytes_to_int32(reply_message.data_str()) != 0;
+        logger_->debug("Server is on {} host", shares_host_.value() ? "the same" : "another");
+    }
+    return shares_host_.value();
+}
+
+bool RMQClient::inline_payloads_(double timeout_s, bool automatic_resend)
+{
+    if (inline_payloads_override_.has_value())
+    {
+        return inline_payloads_override_.value();
+    }
+    return !handshake_(timeout_s, automatic_resend);
+}
+
+std::string RMQClient::count_request_str_(int32_t n, double timeout_s, bool automatic_resend)
 {
     std::string data_str = int32_to_bytes(n);
+    uint8_t request_flags = 0;
+    if (inline_payloads_(timeout_s, automatic_resend))
+    {
+        // Clients on the same host read large items from shared memory, so only inline payloads are chunked
+        request_flags |= INLINE_SHM_DATA_FLAG | compression_accept_flags();
+        if (chunk_size_bytes_ > 0)
+        {
+            request_flags |= ACCEPT_CHUNKED_FLAG;
+        }
+    }
+    if (request_flags != 0)
+    {
+        data_str.push_back(static_cast<char>(request_flags));
+    }
+    return data_str;
+}
+
+pybind11::tuple RMQClient::peek_data(const std::string &topic, int32_t n, double timeout_s, bool automatic_resend)
+{
+    std::unique_lock<std::recursive_mutex> lock = lock_without_gil(mutex_);
+    std::string data_str = count_request_str_(n, timeout_s, automatic_resend);
     RMQMessage message(topic, CmdType::PEEK_DATA, get_timestamp(), data_str);
-    std::vector<TimedPtr> reply_ptrs = send_request_(message, timeout_s, automatic_resend);
+    std::vector<TimedPtr> reply_ptrs = send_request_(message, timeout_s, automatic_resend, lock);
     if (reply_ptrs.empty())
     {
         logger_->debug("No data available for topic: {}", topic);
@@ -116,11 +234,30 @@ pybind11::tuple RMQClient::peek_data(const std::string &topic, int32_t n, double
     return ptrs_to_tuple_(reply_ptrs);
 }
 
+pybind11::tuple RMQClient::consume_data(const std::string &topic, const std::string &group, int32_t n,
+                                        double timeout_s, bool automatic_resend)
+{
+    if (group.empty())
+    {
+        throw std::invalid_argument("Consumer group name must not be empty");
+    }
+    std::unique_lock<std::recursive_mutex> lock = lock_without_gil(mutex_);
+    // Unlike peek and pop, the flags byte is always sent, since the group name follows it
+    std::string data_str = count_request_str_(n, timeout_s, automatic_resend);
+    if (data_str.size() == sizeof(int32_t))
+    {
+        data_str.push_back('\0');
+    }
+    RMQMessage message(topic, CmdType::CONSUME_DATA, get_timestamp(), data_str + group);
+    return ptrs_to_tuple_(send_request_(message, timeout_s, automatic_resend, lock));
+}
+
 pybind11::tuple RMQClient::pop_data(const std::string &topic, int32_t n, double timeout_s, bool automatic_resend)
 {
-    std::string data_str = int32_to_bytes(n);
+    std::unique_lock<std::recursive_mutex> lock = lock_without_gil(mutex_);
+    std::string data_str = count_request_str_(n, timeout_s, automatic_resend);
     RMQMessage message(topic, CmdType::POP_DATA, get_timestamp(), data_str);
-    std::vector<TimedPtr> reply_ptrs = send_request_(message, timeout_s, automatic_resend);
+    std::vector<TimedPtr> reply_ptrs = send_request_(message, timeout_s, automatic_resend, lock);
     if (reply_ptrs.empty())
     {
         logger_->debug("No data available for topic: {}", topic);
@@ -134,12 +271,665 @@ void RMQClient::put_data(const std::string &topic, const pybind11::bytes &data,
     {
         throw std::invalid_argument("Cannot pass empty bytes string");
     }
+    if (chunk_size_bytes_ > 0 && static_cast<uint64_t>(pybind11::len(data)) > chunk_size_bytes_)
+    {
+        char *buffer;
+        ssize_t length;
+        PYBIND11_BYTES_AS_STRING_AND_SIZE(data.ptr(), &buffer, &length);
+        // Holds the data connections only, so that other threads keep using the control connection meanwhile
+        std::unique_lock<std::mutex> data_lock = lock_without_gil(data_mutex_);
+        put_data_chunked_(topic, buffer, length, get_timestamp(), timeout_s, automatic_resend);
+        return;
+    }
+    std::unique_lock<std::recursive_mutex> lock = lock_without_gil(mutex_);
     std::vector<TimedPtr> timed_ptrs;
     BytesPtr data_ptr = std::make_shared<Bytes>(data);
     TimedPtr timed_ptr = std::make_tuple(data_ptr, get_timestamp());
     timed_ptrs.push_back(timed_ptr);
     RMQMessage message(topic, CmdType::PUT_DATA, get_timestamp(), timed_ptrs);
-    std::vector<TimedPtr> reply_ptrs = send_request_(message, timeout_s, automatic_resend);
+    std::vector<TimedPtr> reply_ptrs = send_request_(message, timeout_s, automatic_resend, lock);
+}
+
+bool RMQClient::put_data_async(const std::string &topic, const pybind11::bytes &data)
+{
+    char *buffer;
+    ssize_t length;
+    PYBIND11_BYTES_AS_STRING_AND_SIZE(data.ptr(), &buffer, &length);
+    if (length == 0)
+    {
+        throw std::invalid_argument("Cannot pass empty bytes string");
+    }
+    report_async_put_events_();
+    std::call_once(async_put_thread_started_,
+                   [this]() { async_put_thread_ = std::thread(&RMQClient::async_put_loop_, this); });
+
+    uint64_t queue_size = async_put_queue_.size();
+    if (queue_size >= async_put_capacity_.load())
+    {
+        async_put_dropped_++;
+        logger_->debug("Async put queue is full ({} messages). Dropping data for topic {}.", queue_size, topic);
+        if (!async_put_callback_.is_none())
+        {
+            async_put_callback_("dropped", topic, 1, "Async put queue is full");
+        }
+        return false;
+    }
+    double timestamp = get_timestamp();
+    BytesPtr data_ptr = std::make_shared<Bytes>(buffer, length);
+    async_put_queue_.push({topic, data_ptr, timestamp});
+    async_put_enqueued_++;
+    async_put_enqueued_bytes_ += length;
+
+    uint64_t max_queue_size = async_put_max_queue_size_.load();
+    while (queue_size + 1 > max_queue_size &&
+           !async_put_max_queue_size_.compare_exchange_weak(max_queue_size, queue_size + 1))
+    {
+    }
+    return true;
+}
+
+bool RMQClient::flush_async_put(double timeout_s)
+{
+    bool flushed = true;
+    {
+        pybind11::gil_scoped_release release;
+        int64_t start_time_us = steady_clock_us();
+        while (async_put_processed_.load() < async_put_enqueued_.load())
+        {
+            if (timeout_s >= 0 && steady_clock_us() - start_time_us > timeout_s * 1e6)
+            {
+                flushed = false;
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+    report_async_put_events_();
+    return flushed;
+}
+
+void RMQClient::set_async_put_options(uint64_t max_batch_messages, uint64_t max_batch_bytes, double max_delay_s,
+                                      uint64_t max_queued_messages)
+{
+    if (max_batch_messages == 0 || max_queued_messages == 0)
+    {
+        throw std::invalid_argument("Batch size and async put capacity must be positive");
+    }
+    if (max_delay_s < 0)
+    {
+        throw std::invalid_argument("Maximum batch delay must be non-negative");
+    }
+    async_put_max_batch_messages_ = max_batch_messages;
+    async_put_max_batch_bytes_ = max_batch_bytes;
+    async_put_max_delay_s_ = max_delay_s;
+    async_put_capacity_ = max_queued_messages;
+}
+
+void RMQClient::set_async_put_callback(const pybind11::object &callback)
+{
+    if (!callback.is_none() && !PyCallable_Check(callback.ptr()))
+    {
+        throw std::invalid_argument("Async put callback should be callable or None");
+    }
+    async_put_callback_ = callback;
+}
+
+std::unordered_map<std::string, uint64_t> RMQClient::get_async_put_stats()
+{
+    return {
+        {"enqueued", async_put_enqueued_.load()},
+        {"enqueued_bytes", async_put_enqueued_bytes_.load()},
+        {"dropped", async_put_dropped_.load()},
+        {"sent", async_put_sent_.load()},
+        {"sent_requests", async_put_sent_requests_.load()},
+        {"failed", async_put_failed_.load()},
+        {"processed", async_put_processed_.load()},
+        {"queue_size", async_put_queue_.size()},
+        {"max_queue_size", async_put_max_queue_size_.load()},
+        {"capacity", async_put_capacity_.load()},
+    };
+}
+
+void RMQClient::report_async_put_events_()
+{
+    std::vector<AsyncPutEvent> events;
+    {
+        std::lock_guard<std::mutex> lock(async_put_events_mutex_);
+        events.swap(async_put_events_);
+    }
+    if (async_put_callback_.is_none())
+    {
+        return;
+    }
+    for (const AsyncPutEvent &event : events)
+    {
+        async_put_callback_(event.event, event.topic, event.num_messages, event.message);
+    }
+}
+
+void RMQClient::async_put_loop_()
+{
+    // The background thread has its own connection; REQ sockets cannot be shared between threads. Topics are
+    // addressed by name, since the resolved ids belong to the calling thread.
+    zmq::socket_t socket(context_, zmq::socket_type::req);
+    int linger_value = 100;
+    socket.setsockopt(ZMQ_LINGER, &linger_value, sizeof(linger_value));
+    socket.connect(server_endpoint_);
+
+    struct Batch
+    {
+        std::vector<TimedPtr> ptrs;
+        uint64_t size_bytes = 0;
+        int64_t first_enqueue_time_us = 0;
+    };
+    std::unordered_map<std::string, Batch> batches;
+    AsyncPutItem item;
+    while (true)
+    {
+        // Items queued before the client is destroyed are still sent.
+        bool stopping = !async_put_running_;
+        bool popped = false;
+        while (async_put_queue_.pop(item))
+        {
+            popped = true;
+            Batch &batch = batches[item.topic];
+            if (batch.ptrs.empty())
+            {
+                batch.first_enqueue_time_us = steady_clock_us();
+            }
+            batch.size_bytes += item.data_ptr->size();
+            batch.ptrs.emplace_back(std::move(item.data_ptr), item.timestamp);
+            if (batch.ptrs.size() >= async_put_max_batch_messages_.load() ||
+                batch.size_bytes >= async_put_max_batch_bytes_.load())
+            {
+                send_async_put_batch_(socket, item.topic, batch.ptrs);
+                batch = Batch();
+            }
+        }
+        int64_t now_us = steady_clock_us();
+        for (auto &[topic, batch] : batches)
+        {
+            if (!batch.ptrs.empty() &&
+                (stopping || now_us - batch.first_enqueue_time_us >= async_put_max_delay_s_.load() * 1e6))
+            {
+                send_async_put_batch_(socket, topic, batch.ptrs);
+                batch = Batch();
+            }
+        }
+        if (stopping)
+        {
+            break;
+        }
+        if (!popped)
+        {
+            // Sleep until the oldest pending batch is due, a new item is pushed or the client is destroyed
+            int64_t wait_us = 1000000;
+            for (const auto &[topic, batch] : batches)
+            {
+                if (!batch.ptrs.empty())
+                {
+                    int64_t due_us = batch.first_enqueue_time_us +
+                                     static_cast<int64_t>(async_put_max_delay_s_.load() * 1e6);
+                    wait_us = std::min(wait_us, due_us - now_us);
+                }
+            }
+            if (wait_us > 0)
+            {
+                async_put_queue_.wait(std::chrono::microseconds(wait_us));
+            }
+        }
+    }
+    socket.close();
+}
+
+void RMQClient::send_async_put_batch_(zmq::socket_t &socket, const std::string &topic, const std::vector<TimedPtr> &ptrs)
+{
+    RMQMessage message(topic, CmdType::PUT_DATA, std::get<1>(ptrs.back()), ptrs);
+    std::string serialized = message.serialize();
+    std::string error_message;
+    for (int attempt = 0;; attempt++)
+    {
+        zmq::message_t request(serialized.data(), serialized.size());
+        socket.send(request, zmq::send_flags::none);
+        zmq::pollitem_t items[] = {{socket, 0, ZMQ_POLLIN, 0}};
+        zmq::poll(&items[0], 1, static_cast<int>(default_timeout_s_ * 1000));
+        if (items[0].revents & ZMQ_POLLIN)
+        {
+            zmq::message_t reply;
+            socket.recv(reply);
+            RMQMessage reply_message(std::string(reply.data<char>(), reply.data<char>() + reply.size()));
+            if (reply_message.cmd() == CmdType::ERROR)
+            {
+                error_message = reply_message.data_str();
+            }
+            else if (reply_message.cmd() != CmdType::PUT_DATA)
+            {
+                error_message = "Invalid reply of command type " + std::to_string(static_cast<int>(reply_message.cmd()));
+            }
+            break;
+        }
+        reconnect_(socket);
+        if (attempt >= ASYNC_PUT_MAX_RESENDS_ || !async_put_running_)
+        {
+            error_message = "No reply from server after " + std::to_string(attempt + 1) + " attempts";
+            break;
+        }
+    }
+
+    if (error_message.empty())
+    {
+        async_put_sent_ += ptrs.size();
+        async_put_sent_requests_++;
+    }
+    else
+    {
+        logger_->warn("Failed to put {} messages asynchronously into topic {}: {}", ptrs.size(), topic, error_message);
+        async_put_failed_ += ptrs.size();
+        std::lock_guard<std::mutex> lock(async_put_events_mutex_);
+        async_put_events_.push_back({"error", topic, ptrs.size(), error_message});
+    }
+    async_put_processed_ += ptrs.size();
+}
+
+void RMQClient::set_chunk_size(uint64_t chunk_size_bytes)
+{
+    if (chunk_size_bytes > std::numeric_limits<uint32_t>::max())
+    {
+        throw std::invalid_argument("Chunk size should be smaller than 4 GB");
+    }
+    chunk_size_bytes_ = chunk_size_bytes;
+}
+
+void RMQClient::set_progress_callback(const pybind11::object &callback)
+{
+    if (!callback.is_none() && !PyCallable_Check(callback.ptr()))
+    {
+        throw std::invalid_argument("Progress callback should be callable or None");
+    }
+    progress_callback_ = callback;
+}
+
+void RMQClient::report_progress_(const std::string &topic, uint64_t transferred_bytes, uint64_t total_bytes)
+{
+    if (!progress_callback_.is_none())
+    {
+        progress_callback_(topic, transferred_bytes, total_bytes);
+    }
+}
+
+void RMQClient::set_data_connections(int num_connections)
+{
+    if (num_connections < 0)
+    {
+        throw std::invalid_argument("Number of data connections should be non-negative");
+    }
+    std::unique_lock<std::mutex> data_lock = lock_without_gil(data_mutex_);
+    for (zmq::socket_t &socket : data_sockets_)
+    {
+        socket.close();
+    }
+    data_sockets_.clear();
+    for (int i = 0; i < num_connections; i++)
+    {
+        data_sockets_.emplace_back(context_, zmq::socket_type::req);
+        int linger_value = 100;
+        data_sockets_.back().setsockopt(ZMQ_LINGER, &linger_value, sizeof(linger_value));
+        data_sockets_.back().connect(server_endpoint_);
+    }
+}
+
+void RMQClient::reconnect_(zmq::socket_t &socket)
+{
+    // A REQ socket that is waiting for a reply cannot send again; replace it.
+    socket.close();
+    socket = zmq::socket_t(context_, zmq::socket_type::req);
+    int linger_value = 100;
+    socket.setsockopt(ZMQ_LINGER, &linger_value, sizeof(linger_value));
+    socket.connect(server_endpoint_);
+}
+
+void RMQClient::forget_session_(uint32_t stale_session)
+{
+    for (auto it = topic_ids_.begin(); it != topic_ids_.end();)
+    {
+        it = it->second.second == stale_session ? topic_ids_.erase(it) : std::next(it);
+    }
+    for (auto it = unresolved_topics_.begin(); it != unresolved_topics_.end();)
+    {
+        it = it->second == stale_session ? unresolved_topics_.erase(it) : std::next(it);
+    }
+    for (auto it = shm_segments_.begin(); it != shm_segments_.end();)
+    {
+        if (it->second.session == stale_session)
+        {
+            unmap_shm_segment_(it->second);
+            it = shm_segments_.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    shares_host_.reset();
+}
+
+bool RMQClient::exchange_striped_(size_t num_requests, const std::function<RMQMessage(size_t)> &make_request,
+                                  const std::function<uint32_t(size_t, RMQMessage &)> &on_reply,
+                                  double timeout_s, bool automatic_resend)
+{
+    // Without data connections, the chunks go over the control connection one at a time, which is then held for the
+    // whole transfer.
+    std::vector<zmq::socket_t *> sockets;
+    for (zmq::socket_t &socket : data_sockets_)
+    {
+        sockets.push_back(&socket);
+    }
+    std::unique_lock<std::recursive_mutex> control_lock(mutex_, std::defer_lock);
+    if (sockets.empty())
+    {
+        lock_without_gil(control_lock);
+        sockets.push_back(&socket_);
+    }
+    struct Request
+    {
+        bool active = false;
+        size_t index = 0;
+        CmdType cmd = CmdType::UNKNOWN;
+        uint32_t server_session = 0;
+        std::string serialized;
+        double deadline = 0;
+    };
+    std::vector<Request> requests(sockets.size());
+    std::deque<size_t> pending;
+    for (size_t i = 0; i < num_requests; i++)
+    {
+        pending.push_back(i);
+    }
+    size_t window = sockets.size();
+    size_t num_active = 0;
+    size_t num_done = 0;
+    int busy_retries = 0;
+    auto send = [&](size_t socket_idx) {
+        zmq::message_t request(requests[socket_idx].serialized.data(), requests[socket_idx].serialized.size());
+        sockets[socket_idx]->send(request, zmq::send_flags::none);
+        requests[socket_idx].deadline = get_timestamp() + timeout_s;
+    };
+
+    // A REQ socket waiting for a reply cannot send again, so every socket with a request in flight is reset before
+    // returning early. Otherwise later transfers on these connections would fail.
+    auto reconnect_active = [&]() {
+        for (size_t i = 0; i < sockets.size(); i++)
+        {
+            if (requests[i].active)
+            {
+                reconnect_(*sockets[i]);
+            }
+        }
+    };
+
+    try
+    {
+        while (num_done < num_requests)
+        {
+            for (size_t i = 0; i < sockets.size() && num_active < window && !pending.empty(); i++)
+            {
+                if (requests[i].active)
+                {
+                    continue;
+                }
+                RMQMessage message = make_request(pending.front());
+                requests[i].active = true;
+                requests[i].index = pending.front();
+                requests[i].cmd = message.cmd();
+                requests[i].server_session = message.server_session();
+                requests[i].serialized = message.serialize();
+                pending.pop_front();
+                send(i);
+                num_active++;
+            }
+            if (num_active == 0)
+            {
+                // The server has no credits for this transfer. Wait for other transfers to finish.
+                if (++busy_retries > MAX_RETRIES_)
+                {
+                    throw std::runtime_error("Server is busy with other transfers after " +
+                                             std::to_string(MAX_RETRIES_) + " retries");
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                window = 1;
+                continue;
+            }
+
+            std::vector<zmq::pollitem_t> items;
+            std::vector<size_t> item_sockets;
+            double next_deadline = std::numeric_limits<double>::max();
+            for (size_t i = 0; i < sockets.size(); i++)
+            {
+                if (requests[i].active)
+                {
+                    items.push_back({*sockets[i], 0, ZMQ_POLLIN, 0});
+                    item_sockets.push_back(i);
+                    next_deadline = std::min(next_deadline, requests[i].deadline);
+                }
+            }
+            int poll_timeout_ms = std::max(0, static_cast<int>((next_deadline - get_timestamp()) * 1000));
+            poll_without_gil(items.data(), items.size(), poll_timeout_ms);
+            for (size_t item_idx = 0; item_idx < items.size(); item_idx++)
+            {
+                size_t i = item_sockets[item_idx];
+                Request &request = requests[i];
+                if (items[item_idx].revents & ZMQ_POLLIN)
+                {
+                    zmq::message_t reply;
+                    sockets[i]->recv(reply);
+                    request.active = false;
+                    num_active--;
+                    RMQMessage reply_message(std::string(reply.data<char>(), reply.data<char>() + reply.size()));
+                    if (reply_message.cmd() == CmdType::ERROR)
+                    {
+                        throw std::runtime_error("Server returned error: " + reply_message.data_str());
+                    }
+                    if (reply_message.cmd() == CmdType::STALE_TOPIC_ID)
+                    {
+                        // The server was restarted and lost the transfer. Drain the other connections before returning.
+                        std::unique_lock<std::recursive_mutex> lock = lock_without_gil(mutex_);
+                        forget_session_(request.server_session);
+                        reconnect_active();
+                        return false;
+                    }
+                    if (reply_message.cmd() != request.cmd)
+                    {
+                        throw std::runtime_error("Command type mismatch. Sent " +
+                                                 std::to_string(static_cast<int>(request.cmd)) + " but received " +
+                                                 std::to_string(static_cast<int>(reply_message.cmd())));
+                    }
+                    uint32_t credits = on_reply(request.index, reply_message);
+                    if (credits == 0)
+                    {
+                        pending.push_front(request.index);
+                        window = 0;
+                    }
+                    else
+                    {
+                        busy_retries = 0;
+                        window = std::min<size_t>(sockets.size(), credits);
+                        num_done++;
+                    }
+                }
+                else if (get_timestamp() >= request.deadline)
+                {
+                    if (!automatic_resend)
+                    {
+                        throw std::runtime_error("No reply from server. To automatically resend the request, please "
+                                                 "set automatic_resend to true.");
+                    }
+                    if (retries_ > MAX_RETRIES_)
+                    {
+                        throw std::runtime_error("No reply from server after " + std::to_string(MAX_RETRIES_) +
+                                                 " retries");
+                    }
+                    retries_++;
+                    logger_->warn(
+                        "No reply for chunk {} in timeout_s={} seconds after {} retries. Resending the chunk...",
+                        request.index, timeout_s, retries_.load());
+                    // Only this chunk is sent again; the server ignores chunks it already has.
+                    reconnect_(*sockets[i]);
+                    send(i);
+                }
+            }
+        }
+    }
+    catch (...)
+    {
+        reconnect_active();
+        throw;
+    }
+    return true;
+}
+
+void RMQClient::put_data_chunked_(const std::string &topic, const char *data, uint64_t size, double timestamp,
+                                  double timeout_s, bool automatic_resend)
+{
+    static thread_local std::mt19937_64 rng(std::random_device{}());
+    uint32_t chunk_size = chunk_size_bytes_.load();
+    // Another thread may have disabled chunking since put_data checked the size
+    chunk_size = chunk_size > 0 ? chunk_size : 4 * 1024 * 1024;
+    uint32_t num_chunks = (size + chunk_size - 1) / chunk_size;
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        PutChunkHeader header{rng(), size, chunk_size, 0, timestamp};
+        uint64_t transferred_bytes = 0;
+        std::vector<uint32_t> chunk_indices(num_chunks);
+        std::iota(chunk_indices.begin(), chunk_indices.end(), 0);
+        uint32_t num_missing = num_chunks;
+        auto make_request = [&](size_t request_index) {
+            header.chunk_index = chunk_indices[request_index];
+            uint64_t chunk_start = static_cast<uint64_t>(header.chunk_index) * chunk_size;
+            uint64_t chunk_bytes = std::min<uint64_t>(chunk_size, size - chunk_start);
+            std::string data_str(sizeof(PutChunkHeader) + chunk_bytes, '\0');
+            std::memcpy(&data_str[0], &header, sizeof(PutChunkHeader));
+            std::memcpy(&data_str[sizeof(PutChunkHeader)], data + chunk_start, chunk_bytes);
+            RMQMessage message(topic, CmdType::PUT_CHUNK, get_timestamp(), data_str);
+            std::unique_lock<std::recursive_mutex> lock = lock_without_gil(mutex_);
+            apply_topic_id_(message, timeout_s, automatic_resend);
+            return message;
+        };
+        auto on_reply = [&](size_t request_index, RMQMessage &reply_message) -> uint32_t {
+            if (reply_message.data_str().size() != 2 * sizeof(uint32_t))
+            {
+                throw std::runtime_error("Invalid reply to chunk of topic " + topic);
+            }
+            uint32_t credits = bytes_to_uint32(reply_message.data_str().substr(0, sizeof(uint32_t)));
+            uint32_t missing = bytes_to_uint32(reply_message.data_str().substr(sizeof(uint32_t)));
+            if (credits == 0 && missing > 0)
+            {
+                return 0;
+            }
+            num_missing = std::min(num_missing, missing);
+            uint64_t chunk_start = static_cast<uint64_t>(chunk_indices[request_index]) * chunk_size;
+            transferred_bytes = std::min(size, transferred_bytes + std::min<uint64_t>(chunk_size, size - chunk_start));
+            report_progress_(topic, transferred_bytes, size);
+            // The last chunks have no credits left but are still accepted
+            return std::max<uint32_t>(credits, 1);
+        };
+        bool restarted = false;
+        for (int round = 0; !chunk_indices.empty(); round++)
+        {
+            if (round > MAX_RETRIES_)
+            {
+                throw std::runtime_error("Server is still missing chunks after " + std::to_string(MAX_RETRIES_) +
+                                         " attempts to resume the upload to topic " + topic);
+            }
+            if (!exchange_striped_(chunk_indices.size(), make_request, on_reply, timeout_s, automatic_resend))
+            {
+                restarted = true;
+                break;
+            }
+            if (num_missing == 0)
+            {
+                return;
+            }
+            // Part of the upload was dropped, e.g. because it expired on the server. Only the chunks the server lacks
+            // are sent again.
+            header.chunk_index = num_chunks;
+            std::string data_str(sizeof(PutChunkHeader), '\0');
+            std::memcpy(&data_str[0], &header, sizeof(PutChunkHeader));
+            RMQMessage message(topic, CmdType::PUT_CHUNK, get_timestamp(), data_str);
+            std::unique_lock<std::recursive_mutex> lock = lock_without_gil(mutex_);
+            RMQMessage reply_message = send_raw_request_(message, timeout_s, automatic_resend);
+            lock.unlock();
+            const std::string &reply_str = reply_message.data_str();
+            if (reply_str.size() < 2 * sizeof(uint32_t) ||
+                (reply_str.size() - 2 * sizeof(uint32_t)) % sizeof(uint32_t) != 0)
+            {
+                throw std::runtime_error("Invalid reply to the missing chunks of topic " + topic);
+            }
+            chunk_indices.clear();
+            for (size_t offset = 2 * sizeof(uint32_t); offset < reply_str.size(); offset += sizeof(uint32_t))
+            {
+                uint32_t chunk_index = bytes_to_uint32(reply_str.substr(offset, sizeof(uint32_t)));
+                if (chunk_index >= num_chunks)
+                {
+                    throw std::runtime_error("Invalid reply to the missing chunks of topic " + topic);
+                }
+                chunk_indices.push_back(chunk_index);
+            }
+            logger_->warn("Server is missing {} chunks of the upload to topic {}. Sending them again.",
+                          chunk_indices.size(), topic);
+            num_missing = num_chunks;
+        }
+        if (!restarted)
+        {
+            return;
+        }
+        logger_->debug("Server restarted during the upload to topic {}. Uploading again.", topic);
+    }
+    throw std::runtime_error("Server restarted repeatedly during the upload to topic " + topic);
+}
+
+void RMQClient::fetch_chunked_items_(const std::string &topic, std::vector<TimedPtr> &ptrs, double timeout_s,
+                                     bool automatic_resend)
+{
+    for (TimedPtr &ptr : ptrs)
+    {
+        if (!ChunkedItemStub::is_chunked_item_stub(*std::get<0>(ptr)))
+        {
+            continue;
+        }
+        ChunkedItemStub stub = ChunkedItemStub::parse(*std::get<0>(ptr));
+        uint32_t chunk_size = chunk_size_bytes_.load();
+        chunk_size = chunk_size > 0 ? chunk_size : 4 * 1024 * 1024;
+        uint32_t num_chunks = (stub.total_size_bytes + chunk_size - 1) / chunk_size;
+        BytesPtr data_ptr = std::make_shared<Bytes>(stub.total_size_bytes, '\0');
+        uint64_t transferred_bytes = 0;
+        auto make_request = [&](size_t chunk_index) {
+            FetchChunkRequest request{stub.transfer_id, chunk_size, static_cast<uint32_t>(chunk_index)};
+            std::string data_str(sizeof(FetchChunkRequest), '\0');
+            std::memcpy(&data_str[0], &request, sizeof(FetchChunkRequest));
+            RMQMessage message(topic, CmdType::FETCH_CHUNK, get_timestamp(), data_str);
+            std::unique_lock<std::recursive_mutex> lock = lock_without_gil(mutex_);
+            apply_topic_id_(message, timeout_s, automatic_resend);
+            return message;
+        };
+        auto on_reply = [&](size_t chunk_index, RMQMessage &reply_message) -> uint32_t {
+            uint64_t offset = static_cast<uint64_t>(chunk_index) * chunk_size;
+            uint64_t expected_size = std::min<uint64_t>(chunk_size, stub.total_size_bytes - offset);
+            if (reply_message.data_str().size() != expected_size)
+            {
+                throw std::runtime_error("Invalid chunk " + std::to_string(chunk_index) + " of topic " + topic);
+            }
+            std::memcpy(&(*data_ptr)[offset], reply_message.data_str().data(), expected_size);
+            transferred_bytes += expected_size;
+            report_progress_(topic, transferred_bytes, stub.total_size_bytes);
+            return std::numeric_limits<uint32_t>::max();
+        };
+        if (!exchange_striped_(num_chunks, make_request, on_reply, timeout_s, automatic_resend))
+        {
+            throw std::runtime_error("Server restarted while fetching data of topic " + topic +
+                                     ". Please request the data again.");
+        }
+        std::get<0>(ptr) = data_ptr;
+    }
 }
 
 pybind11::bytes RMQClient::request_with_data(const std::string &topic, const pybind11::bytes &data, double timeout_s, bool automatic_resend)
@@ -149,14 +939,30 @@ pybind11::bytes RMQClient::request_with_data(const std::string &topic, const pyb
         throw std::invalid_argument("Cannot pass empty bytes string");
     }
 
+    std::unique_lock<std::recursive_mutex> lock = lock_without_gil(mutex_);
     if (topic_using_shared_memory_.find(topic) == topic_using_shared_memory_.end())
     {
         get_topic_status(topic, timeout_s);
     }
+    int64_t start_us = steady_clock_us();
+    int64_t sent_us = 0;
+    int64_t received_us = 0;
+    last_request_trace_.reset();
     double timestamp = get_timestamp();
     std::vector<TimedPtr> reply_ptrs;
+    // The payload is followed by the request flags. The reply of a traced request ends with the server's trace.
+    bool traced = request_tracing_;
+    auto send = [&](std::vector<TimedPtr> &timed_ptrs) {
+        uint8_t flags = traced ? REQUEST_TRACE_FLAG : 0;
+        timed_ptrs.push_back(std::make_tuple(std::make_shared<Bytes>(1, static_cast<char>(flags)), timestamp));
+        RMQMessage message(topic, CmdType::REQUEST_WITH_DATA, get_timestamp(), timed_ptrs);
+        sent_us = steady_clock_us();
+        reply_ptrs = send_request_(message, timeout_s, automatic_resend, lock);
+        received_us = steady_clock_us();
+    };
 
-    if (topic_using_shared_memory_[topic])
+    // Clients on another host send the request inline, and the server then replies inline as well.
+    if (topic_using_shared_memory_[topic] && !inline_payloads_(timeout_s, automatic_resend))
     {
         // Extract the raw bytes and size from py::bytes
         char *new_data_buffer;
@@ -171,7 +977,7 @@ pybind11::bytes RMQClient::request_with_data(const std::string &topic, const pyb
         }
         ftruncate(shm_fd, length);
         void *shm_ptr = mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
-        memcpy(shm_ptr, new_data_buffer, length);
+        engine_memcpy(shm_ptr, new_data_buffer, length, true);
         SharedMemoryDataInfo data_info(request_shm_name, length, 0, length);
         BytesPtr data_ptr = std::make_shared<Bytes>(data_info.serialize());
 
@@ -179,8 +985,7 @@ pybind11::bytes RMQClient::request_with_data(const std::string &topic, const pyb
         std::vector<TimedPtr> timed_ptrs;
         timed_ptrs.push_back(timed_ptr);
 
-        RMQMessage message(topic, CmdType::REQUEST_WITH_DATA, get_timestamp(), timed_ptrs);
-        reply_ptrs = send_request_(message, timeout_s, automatic_resend);
+        send(timed_ptrs);
         munmap(shm_ptr, length);
         shm_unlink(request_shm_name.c_str());
         close(shm_fd);
@@ -193,10 +998,16 @@ pybind11::bytes RMQClient::request_with_data(const std::string &topic, const pyb
         TimedPtr timed_ptr = std::make_tuple(data_ptr, timestamp);
         timed_ptrs.push_back(timed_ptr);
 
-        RMQMessage message(topic, CmdType::REQUEST_WITH_DATA, get_timestamp(), timed_ptrs);
-        reply_ptrs = send_request_(message, timeout_s, automatic_resend);
+        send(timed_ptrs);
     }
 
+    std::optional<RequestTrace> server_trace;
+    if (traced && !reply_ptrs.empty())
+    {
+        server_trace = RequestTrace::parse(*std::get<0>(reply_ptrs.back()));
+        reply_ptrs.pop_back();
+        last_retrieved_ptrs_.pop_back();
+    }
     if (reply_ptrs.empty())
     {
         logger_->error("No response from server for request with data on topic: {}", topic);
@@ -205,20 +1016,94 @@ pybind11::bytes RMQClient::request_with_data(const std::string &topic, const pyb
     {
         throw std::runtime_error("Expected 1 reply pointer, but received " + std::to_string(reply_ptrs.size()));
     }
-    BytesPtr reply_data_ptr = std::get<0>(reply_ptrs[0]);
-    if (SharedMemoryDataInfo::is_shm_data_info(*reply_data_ptr))
+    pybind11::bytes reply = read_data_(*std::get<0>(reply_ptrs[0]), false);
+    if (server_trace)
     {
-        SharedMemoryDataInfo data_info(*reply_data_ptr);
-        return data_info.get_shm_data_with_mutex();
+        // The clocks of client and server are not compared; the network time is the round trip minus the time the
+        // server spent on the request.
+        int64_t end_us = steady_clock_us();
+        int64_t server_us = server_trace->encoded_us - server_trace->received_us;
+        last_request_trace_ = std::map<std::string, int64_t>{
+            {"client_request_us", sent_us - start_us},
+            {"network_us", received_us - sent_us - server_us},
+            {"server_queue_us", server_trace->dispatched_us - server_trace->received_us},
+            {"server_handler_us", server_trace->replied_us - server_trace->dispatched_us},
+            {"server_reply_us", server_trace->encoded_us - server_trace->replied_us},
+            {"client_reply_us", end_us - received_us},
+            {"total_us", end_us - start_us},
+        };
     }
-    else
+    return reply;
+}
+
+void RMQClient::set_request_tracing(bool enabled)
+{
+    std::unique_lock<std::recursive_mutex> lock = lock_without_gil(mutex_);
+    request_tracing_ = enabled;
+}
+
+std::optional<std::map<std::string, int64_t>> RMQClient::get_last_request_trace()
+{
+    std::unique_lock<std::recursive_mutex> lock = lock_without_gil(mutex_);
+    return last_request_trace_;
+}
+
+pybind11::tuple RMQClient::peek_window(const std::string &topic, int32_t k, const pybind11::object &dtype,
+                                       const std::vector<int64_t> &shape, double timeout_s, bool automatic_resend)
+{
+    if (k <= 0)
+    {
+        throw std::invalid_argument("Window size must be positive");
+    }
+    pybind11::dtype item_dtype = pybind11::dtype::from_args(dtype);
+    uint64_t item_size = item_dtype.itemsize();
+    for (int64_t dim : shape)
+    {
+        item_size *= dim;
+    }
+    std::unique_lock<std::recursive_mutex> lock = lock_without_gil(mutex_);
+    std::string data_str = count_request_str_(-k, timeout_s, automatic_resend);
+    RMQMessage message(topic, CmdType::PEEK_DATA, get_timestamp(), data_str);
+    std::vector<TimedPtr> reply_ptrs = send_request_(message, timeout_s, automatic_resend, lock);
+
+    std::vector<ssize_t> window_shape{static_cast<ssize_t>(reply_ptrs.size())};
+    window_shape.insert(window_shape.end(), shape.begin(), shape.end());
+    pybind11::array window(item_dtype, window_shape);
+    char *dst = static_cast<char *>(window.mutable_data());
+    pybind11::list timestamps;
+    for (size_t i = 0; i < reply_ptrs.size(); i++)
+    {
+        read_data_into_(*std::get<0>(reply_ptrs[i]), dst + i * item_size, item_size, last_retrieved_compressed_);
+        timestamps.append(std::get<1>(reply_ptrs[i]));
+    }
+    return pybind11::make_tuple(window, timestamps);
+}
+
+pybind11::object RMQClient::get_server_stats(double timeout_s)
+{
+    return pybind11::module_::import("json").attr("loads")(get_server_stats_text_(timeout_s, "json"));
+}
+
+std::string RMQClient::get_server_stats_text(double timeout_s)
+{
+    return get_server_stats_text_(timeout_s, "prometheus");
+}
+
+std::string RMQClient::get_server_stats_text_(double timeout_s, const std::string &format)
+{
+    std::unique_lock<std::recursive_mutex> lock = lock_without_gil(mutex_);
+    RMQMessage message(client_name_, CmdType::GET_STATS, get_timestamp(), format);
+    RMQMessage reply_message = exchange_(message, timeout_s, true);
+    if (reply_message.cmd() != CmdType::GET_STATS)
     {
-        return pybind11::bytes(*reply_data_ptr);
+        throw std::runtime_error("Invalid statistics reply from server");
     }
+    return reply_message.data_str();
 }
 
 pybind11::tuple RMQClient::get_last_retrieved_data()
 {
+    std::unique_lock<std::recursive_mutex> lock = lock_without_gil(mutex_);
     return ptrs_to_tuple_(last_retrieved_ptrs_);
 }
 
@@ -228,18 +1113,152 @@ pybind11::tuple RMQClient::ptrs_to_tuple_(const std::vector<TimedPtr> &ptrs)
     pybind11::list timestamps;
     for (const TimedPtr ptr : ptrs)
     {
-        if (SharedMemoryDataInfo::is_shm_data_info(*std::get<0>(ptr)))
+        data.append(read_data_(*std::get<0>(ptr), last_retrieved_compressed_));
+        timestamps.append(std::get<1>(ptr));
+    }
+    return pybind11::make_tuple(data, timestamps);
+}
+
+pybind11::bytes RMQClient::read_data_(const Bytes &bytes, bool compressed)
+{
+    if (ShmDescriptor::is_shm_descriptor(bytes))
+    {
+        return read_shm_descriptor_(ShmDescriptor::parse(bytes));
+    }
+    if (SharedMemoryDataInfo::is_shm_data_info(bytes))
+    {
+        return SharedMemoryDataInfo(bytes).get_shm_data_with_mutex();
+    }
+    if (compressed && is_compressed_data(bytes))
+    {
+        // Decompress straight into the buffer of the returned bytes object
+        uint64_t size = get_decompressed_size(bytes);
+        PyObject *py_bytes = PyBytes_FromStringAndSize(nullptr, size);
+        if (!py_bytes)
         {
-            SharedMemoryDataInfo data_info(*std::get<0>(ptr));
-            data.append(data_info.get_shm_data_with_mutex());
+            throw std::runtime_error("Failed to allocate Python bytes");
         }
-        else
+        pybind11::bytes data = pybind11::reinterpret_steal<pybind11::bytes>(py_bytes);
+        decompress_data(bytes, PyBytes_AS_STRING(py_bytes), size);
+        return data;
+    }
+    return pybind11::bytes(bytes);
+}
+
+void RMQClient::read_data_into_(const Bytes &bytes, char *dst, uint64_t size, bool compressed)
+{
+    if (ShmDescriptor::is_shm_descriptor(bytes))
+    {
+        ShmDescriptor descriptor = ShmDescriptor::parse(bytes);
+        if (descriptor.data_size_bytes != size)
         {
-            data.append(pybind11::bytes(*std::get<0>(ptr)));
+            throw std::runtime_error("Item of " + std::to_string(descriptor.data_size_bytes) +
+                                     " bytes does not match the window item size " + std::to_string(size));
         }
-        timestamps.append(std::get<1>(ptr));
+        ShmSegment &segment = map_shm_segment_(descriptor);
+        uint64_t first_size = std::min(size, segment.size - descriptor.shm_start_idx);
+        pthread_mutex_lock(segment.mutex_ptr);
+        engine_memcpy(dst, segment.ptr + descriptor.shm_start_idx, first_size, false);
+        engine_memcpy(dst + first_size, segment.ptr, size - first_size, false);
+        pthread_mutex_unlock(segment.mutex_ptr);
+        return;
+    }
+    if (compressed && is_compressed_data(bytes))
+    {
+        if (get_decompressed_size(bytes) != size)
+        {
+            throw std::runtime_error("Item of " + std::to_string(get_decompressed_size(bytes)) +
+                                     " bytes does not match the window item size " + std::to_string(size));
+        }
+        decompress_data(bytes, dst, size);
+        return;
+    }
+    if (SharedMemoryDataInfo::is_shm_data_info(bytes))
+    {
+        pybind11::bytes data = SharedMemoryDataInfo(bytes).get_shm_data_with_mutex();
+        read_data_into_(Bytes(data), dst, size, false);
+        return;
+    }
+    if (bytes.size() != size)
+    {
+        throw std::runtime_error("Item of " + std::to_string(bytes.size()) +
+                                 " bytes does not match the window item size " + std::to_string(size));
+    }
+    engine_memcpy(dst, bytes.data(), size, false);
+}
+
+pybind11::bytes RMQClient::read_shm_descriptor_(const ShmDescriptor &descriptor)
+{
+    ShmSegment &segment = map_shm_segment_(descriptor);
+    pthread_mutex_lock(segment.mutex_ptr);
+    pybind11::bytes data =
+        copy_ring_to_pybytes(segment.ptr, segment.size, descriptor.shm_start_idx, descriptor.data_size_bytes);
+    pthread_mutex_unlock(segment.mutex_ptr);
+    return data;
+}
+
+RMQClient::ShmSegment &RMQClient::map_shm_segment_(const ShmDescriptor &descriptor)
+{
+    auto segment_it = shm_segments_.find(descriptor.segment_id);
+    if (segment_it == shm_segments_.end() || segment_it->second.session != descriptor.session)
+    {
+        throw std::runtime_error("Received data in unknown shared memory segment " +
+                                 std::to_string(descriptor.segment_id) + ". Please resolve the topic again.");
+    }
+    ShmSegment &segment = segment_it->second;
+    if (segment.ptr == nullptr)
+    {
+        // Map the ring and its mutex once and keep them mapped for later reads.
+        int shm_fd = shm_open(segment.name.c_str(), O_RDONLY, 0666);
+        if (shm_fd == -1)
+        {
+            throw std::runtime_error("Failed to open shared memory: " + segment.name + " " +
+                                     std::string(strerror(errno)));
+        }
+        void *shm_ptr = mmap(0, descriptor.shm_size_bytes, PROT_READ, MAP_SHARED, shm_fd, 0);
+        close(shm_fd);
+        if (shm_ptr == MAP_FAILED)
+        {
+            throw std::runtime_error("Failed to map shared memory: " + segment.name + " " +
+                                     std::string(strerror(errno)));
+        }
+        int shm_mutex_fd = shm_open((segment.name + "_mutex").c_str(), O_RDWR, 0666);
+        if (shm_mutex_fd == -1)
+        {
+            munmap(shm_ptr, descriptor.shm_size_bytes);
+            throw std::runtime_error("Failed to open shared memory mutex: " + segment.name + "_mutex " +
+                                     std::string(strerror(errno)));
+        }
+        void *shm_mutex_ptr =
+            mmap(0, sizeof(pthread_mutex_t), PROT_READ | PROT_WRITE, MAP_SHARED, shm_mutex_fd, 0);
+        close(shm_mutex_fd);
+        if (shm_mutex_ptr == MAP_FAILED)
+        {
+            munmap(shm_ptr, descriptor.shm_size_bytes);
+            throw std::runtime_error("Failed to map shared memory mutex: " + segment.name + "_mutex " +
+                                     std::string(strerror(errno)));
+        }
+        segment.ptr = static_cast<char *>(shm_ptr);
+        segment.size = descriptor.shm_size_bytes;
+        segment.mutex_ptr = static_cast<pthread_mutex_t *>(shm_mutex_ptr);
+    }
+    if (descriptor.shm_size_bytes != segment.size || descriptor.shm_start_idx >= segment.size ||
+        descriptor.data_size_bytes > segment.size)
+    {
+        throw std::runtime_error("Invalid shared memory descriptor for segment " + segment.name);
+    }
+    return segment;
+}
+
+void RMQClient::unmap_shm_segment_(ShmSegment &segment)
+{
+    if (segment.ptr != nullptr)
+    {
+        munmap(segment.ptr, segment.size);
+        munmap(segment.mutex_ptr, sizeof(pthread_mutex_t));
+        segment.ptr = nullptr;
+        segment.mutex_ptr = nullptr;
     }
-    return pybind11::make_tuple(data, timestamps);
 }
 
 double RMQClient::get_timestamp()
@@ -250,11 +1269,177 @@ double RMQClient::get_timestamp()
 void RMQClient::reset_start_time(int64_t system_time_us)
 {
     logger_->info("Resetting start time. Will clear all data retrieved before this time");
+    std::unique_lock<std::recursive_mutex> lock = lock_without_gil(mutex_);
     last_retrieved_ptrs_.clear();
     steady_clock_start_time_us_ = steady_clock_us() + (system_time_us - system_clock_us());
 }
 
-std::vector<TimedPtr> RMQClient::send_request_(RMQMessage &message, double timeout_s, bool automatic_resend)
+bool RMQClient::synchronize_clock_(zmq::socket_t &socket, int num_samples, double timeout_s)
+{
+    std::optional<ClockEstimate> best;
+    int num_replies = 0;
+    for (int i = 0; i < num_samples; i++)
+    {
+        RMQMessage message(client_name_, CmdType::SYNCHRONIZE_TIME, get_timestamp(), "Synchronize time");
+        std::string serialized = message.serialize();
+        int64_t send_time_us = steady_clock_us();
+        socket.send(zmq::message_t(serialized.data(), serialized.size()), zmq::send_flags::none);
+        zmq::pollitem_t items[] = {{socket, 0, ZMQ_POLLIN, 0}};
+        poll_without_gil(&items[0], 1, static_cast<long>(timeout_s * 1000));
+        if (!(items[0].revents & ZMQ_POLLIN))
+        {
+            reconnect_(socket);
+            continue;
+        }
+        zmq::message_t reply;
+        socket.recv(reply);
+        int64_t receive_time_us = steady_clock_us();
+        RMQMessage reply_message(std::string(reply.data<char>(), reply.data<char>() + reply.size()));
+        if (reply_message.cmd() != CmdType::SYNCHRONIZE_TIME || reply_message.data_str().size() != sizeof(double))
+        {
+            logger_->warn("Invalid reply to SYNCHRONIZE_TIME: {}", cmd_type_to_string(reply_message.cmd()));
+            continue;
+        }
+        num_replies++;
+        // t1..t4 are the client send, server receive, server send and client receive times
+        double t1 = static_cast<double>(send_time_us) / 1e6;
+        double t2 = bytes_to_double(reply_message.data_str());
+        double t3 = reply_message.timestamp();
+        double t4 = static_cast<double>(receive_time_us) / 1e6;
+        double rtt_s = (t4 - t1) - (t3 - t2);
+        if (!best.has_value() || rtt_s < best->rtt_s)
+        {
+            best = ClockEstimate{((t2 - t1) + (t3 - t4)) / 2, rtt_s, receive_time_us, 0};
+        }
+    }
+    if (!best.has_value())
+    {
+        return false;
+    }
+    best->num_samples = num_replies;
+    std::lock_guard<std::mutex> lock(clock_mutex_);
+    clock_estimate_ = best;
+    return true;
+}
+
+std::map<std::string, double> RMQClient::synchronize_clock(int num_samples, double timeout_s)
+{
+    if (num_samples <= 0)
+    {
+        throw std::invalid_argument("num_samples must be positive");
+    }
+    std::unique_lock<std::recursive_mutex> lock = lock_without_gil(mutex_);
+    if (!synchronize_clock_(socket_, num_samples, timeout_s))
+    {
+        throw std::runtime_error("No reply from server to any of " + std::to_string(num_samples) +
+                                 " clock synchronization requests");
+    }
+    lock.unlock();
+    return get_clock_offset().value();
+}
+
+void RMQClient::start_clock_sync(double interval_s, int num_samples)
+{
+    if (interval_s <= 0 || num_samples <= 0)
+    {
+        throw std::invalid_argument("interval_s and num_samples must be positive");
+    }
+    stop_clock_sync();
+    clock_sync_running_ = true;
+    clock_sync_thread_ = std::thread(&RMQClient::clock_sync_loop_, this, interval_s, num_samples);
+}
+
+void RMQClient::stop_clock_sync()
+{
+    clock_sync_running_ = false;
+    if (clock_sync_thread_.joinable())
+    {
+        clock_sync_thread_.join();
+    }
+}
+
+void RMQClient::clock_sync_loop_(double interval_s, int num_samples)
+{
+    // REQ sockets cannot be shared between threads, so the background thread has its own connection.
+    zmq::socket_t socket(context_, zmq::socket_type::req);
+    int linger_value = 100;
+    socket.setsockopt(ZMQ_LINGER, &linger_value, sizeof(linger_value));
+    socket.connect(server_endpoint_);
+    // Short timeouts keep stop_clock_sync responsive; a sample that takes longer is useless anyway.
+    double timeout_s = std::min(interval_s, 0.5);
+    while (clock_sync_running_)
+    {
+        int64_t round_start_us = steady_clock_us();
+        if (!synchronize_clock_(socket, num_samples, timeout_s))
+        {
+            logger_->debug("No reply from server to clock synchronization requests");
+        }
+        while (clock_sync_running_ && steady_clock_us() - round_start_us < interval_s * 1e6)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+    socket.close();
+}
+
+std::optional<std::map<std::string, double>> RMQClient::get_clock_offset()
+{
+    std::lock_guard<std::mutex> lock(clock_mutex_);
+    if (!clock_estimate_.has_value())
+    {
+        return std::nullopt;
+    }
+    // Relative to this client's timestamps, which are the steady clock minus the start time
+    return std::map<std::string, double>{
+        {"offset_s", clock_estimate_->offset_s + static_cast<double>(steady_clock_start_time_us_) / 1e6},
+        {"rtt_s", clock_estimate_->rtt_s},
+        {"age_s", static_cast<double>(steady_clock_us() - clock_estimate_->steady_time_us) / 1e6},
+        {"num_samples", static_cast<double>(clock_estimate_->num_samples)},
+    };
+}
+
+bool RMQClient::apply_topic_id_(RMQMessage &message, double timeout_s, bool automatic_resend)
+{
+    auto topic_id_it = topic_ids_.find(message.topic());
+    if (topic_id_it == topic_ids_.end())
+    {
+        if (unresolved_topics_.count(message.topic()) > 0)
+        {
+            return false;
+        }
+        RMQMessage resolve_message(message.topic(), CmdType::RESOLVE_TOPIC, get_timestamp(), "Resolve topic");
+        RMQMessage reply_message = exchange_(resolve_message, timeout_s, automatic_resend);
+        std::string data_str = reply_message.data_str();
+        if (reply_message.cmd() != CmdType::RESOLVE_TOPIC || data_str.size() < sizeof(int32_t) + sizeof(uint32_t))
+        {
+            throw std::runtime_error("Invalid reply when resolving topic: " + message.topic());
+        }
+        int32_t topic_id = bytes_to_int32(data_str.substr(0, sizeof(int32_t)));
+        uint32_t server_session = bytes_to_uint32(data_str.substr(sizeof(int32_t), sizeof(uint32_t)));
+        if (topic_id < 0)
+        {
+            // The topic does not exist yet. Keep addressing it by name without asking again for every request.
+            unresolved_topics_[message.topic()] = server_session;
+            return false;
+        }
+        logger_->debug("Resolved topic {} to id {}", message.topic(), topic_id);
+        size_t segment_offset = sizeof(int32_t) + sizeof(uint32_t);
+        if (data_str.size() > segment_offset + sizeof(uint32_t))
+        {
+            // Shared memory topic: remember which segment its descriptors refer to.
+            uint32_t segment_id = bytes_to_uint32(data_str.substr(segment_offset, sizeof(uint32_t)));
+            ShmSegment &segment = shm_segments_[segment_id];
+            unmap_shm_segment_(segment);
+            segment.session = server_session;
+            segment.name = data_str.substr(segment_offset + sizeof(uint32_t));
+        }
+        topic_id_it = topic_ids_.insert({message.topic(), {static_cast<uint32_t>(topic_id), server_session}}).first;
+    }
+    message.set_topic_id(topic_id_it->second.first, topic_id_it->second.second);
+    return true;
+}
+
+RMQMessage RMQClient::exchange_(RMQMessage &message, double timeout_s, bool automatic_resend)
 {
     std::string serialized = message.serialize();
     zmq::message_t reply;
@@ -267,18 +1452,13 @@ std::vector<TimedPtr> RMQClient::send_request_(RMQMessage &message, double timeo
         // printf("Polling for reply, timeout_s: %f, message cmd: %d\n", timeout_s, static_cast<int>(message.cmd()));
         zmq::pollitem_t items[] = {{socket_, 0, ZMQ_POLLIN, 0}};
         int timeout_ms = timeout_s * 1000;
-        zmq::poll(&items[0], 1, timeout_ms);
+        poll_without_gil(&items[0], 1, timeout_ms);
         if (items[0].revents & ZMQ_POLLIN)
         {
             socket_.recv(reply);
             break;
         }
-        std::string endpoint = socket_.get(zmq::sockopt::last_endpoint);
-        socket_.close();
-        socket_ = zmq::socket_t(context_, zmq::socket_type::req);
-        int linger_value = 100;
-        socket_.setsockopt(ZMQ_LINGER, &linger_value, sizeof(linger_value));
-        socket_.connect(endpoint);
+        reconnect_(socket_);
         if (!automatic_resend)
         {
             throw std::runtime_error("No reply from server. To automatically resend the request, please set automatic_resend to true.");
@@ -289,7 +1469,7 @@ std::vector<TimedPtr> RMQClient::send_request_(RMQMessage &message, double timeo
         }
         retries_++;
         logger_->warn("No reply in timeout_s={} seconds after {} retries. If the message is too large, please increase the "
-                      "timeout. Retrying...", timeout_s, retries_);
+                      "timeout. Retrying...", timeout_s, retries_.load());
     }
 
     RMQMessage reply_message(std::string(reply.data<char>(), reply.data<char>() + reply.size()));
@@ -297,20 +1477,75 @@ std::vector<TimedPtr> RMQClient::send_request_(RMQMessage &message, double timeo
     {
         throw std::runtime_error("Server returned error: " + reply_message.data_str());
     }
+    return reply_message;
+}
+
+RMQMessage RMQClient::send_raw_request_(RMQMessage &message, double timeout_s, bool automatic_resend)
+{
+    apply_topic_id_(message, timeout_s, automatic_resend);
+    RMQMessage reply_message = exchange_(message, timeout_s, automatic_resend);
+    if (reply_message.cmd() == CmdType::STALE_TOPIC_ID)
+    {
+        // The server was restarted since the topic was resolved. Everything resolved from the old server is invalid.
+        logger_->debug("Topic id of {} is stale. Will resolve it again.", message.topic());
+        forget_session_(message.server_session());
+        message.clear_topic_id();
+        apply_topic_id_(message, timeout_s, automatic_resend);
+        reply_message = exchange_(message, timeout_s, automatic_resend);
+    }
     if (reply_message.cmd() != message.cmd())
     {
         throw std::runtime_error("Command type mismatch. Sent " + std::to_string(static_cast<int>(message.cmd())) +
                                  " but received " + std::to_string(static_cast<int>(reply_message.cmd())));
     }
-    if (reply_message.topic() != message.topic())
+    if (message.has_topic_id())
+    {
+        if (!reply_message.has_topic_id() || reply_message.topic_id() != message.topic_id())
+        {
+            throw std::runtime_error("Topic id mismatch for topic " + message.topic());
+        }
+    }
+    else if (reply_message.topic() != message.topic())
     {
         throw std::runtime_error("Topic mismatch. Sent " + message.topic() + " but received " + reply_message.topic());
     }
+    else if (message.cmd() != CmdType::GET_TOPIC_STATUS)
+    {
+        // The server only answers requests by name without an error once the topic exists, so resolve it next time
+        unresolved_topics_.erase(message.topic());
+    }
+    return reply_message;
+}
+
+std::vector<TimedPtr> RMQClient::send_request_(RMQMessage &message, double timeout_s, bool automatic_resend,
+                                               std::unique_lock<std::recursive_mutex> &lock)
+{
+    RMQMessage reply_message = send_raw_request_(message, timeout_s, automatic_resend);
     if (reply_message.cmd() == CmdType::PEEK_DATA || reply_message.cmd() == CmdType::POP_DATA ||
-        reply_message.cmd() == CmdType::REQUEST_WITH_DATA || reply_message.cmd() == CmdType::PUT_DATA)
+        reply_message.cmd() == CmdType::CONSUME_DATA || reply_message.cmd() == CmdType::REQUEST_WITH_DATA ||
+        reply_message.cmd() == CmdType::PUT_DATA)
     {
-        last_retrieved_ptrs_ = reply_message.data_ptrs();
-        return reply_message.data_ptrs();
+        std::vector<TimedPtr> ptrs = reply_message.data_ptrs();
+        bool chunked = std::any_of(ptrs.begin(), ptrs.end(), [](const TimedPtr &ptr) {
+            return ChunkedItemStub::is_chunked_item_stub(*std::get<0>(ptr));
+        });
+        if (chunked)
+        {
+            // Other threads use the control connection while the chunks arrive over the data connections
+            lock.unlock();
+            {
+                std::unique_lock<std::mutex> data_lock = lock_without_gil(data_mutex_);
+                fetch_chunked_items_(message.topic(), ptrs, timeout_s, automatic_resend);
+            }
+            lock_without_gil(lock);
+        }
+        last_retrieved_ptrs_ = ptrs;
+        // Items are decoded only if this request offered codecs; otherwise the header is just payload
+        const std::string &data_str = message.data_str();
+        last_retrieved_compressed_ = message.cmd() != CmdType::REQUEST_WITH_DATA &&
+                                     message.cmd() != CmdType::PUT_DATA && data_str.size() > sizeof(int32_t) &&
+                                     is_compression_negotiated(static_cast<uint8_t>(data_str[sizeof(int32_t)]));
+        return ptrs;
     }
     throw std::runtime_error("Invalid command type: " + std::to_string(static_cast<int>(reply_message.cmd())));
 }
@@ -6,9 +6,47 @@
  */
 
 #include "rmq_message.h"
+#include <cstring>
 // #include <boost/stacktrace.hpp>
 // #include <iostream>
 
+std::string cmd_type_to_string(CmdType cmd)
+{
+    switch (cmd)
+    {
+    case CmdType::PEEK_DATA:
+        return "PEEK_DATA";
+    case CmdType::POP_DATA:
+        return "POP_DATA";
+    case CmdType::REQUEST_WITH_DATA:
+        return "REQUEST_WITH_DATA";
+    case CmdType::SYNCHRONIZE_TIME:
+        return "SYNCHRONIZE_TIME";
+    case CmdType::PUT_DATA:
+        return "PUT_DATA";
+    case CmdType::GET_TOPIC_STATUS:
+        return "GET_TOPIC_STATUS";
+    case CmdType::RESOLVE_TOPIC:
+        return "RESOLVE_TOPIC";
+    case CmdType::HANDSHAKE:
+        return "HANDSHAKE";
+    case CmdType::PUT_CHUNK:
+        return "PUT_CHUNK";
+    case CmdType::FETCH_CHUNK:
+        return "FETCH_CHUNK";
+    case CmdType::GET_STATS:
+        return "GET_STATS";
+    case CmdType::CONSUME_DATA:
+        return "CONSUME_DATA";
+    case CmdType::ERROR:
+        return "ERROR";
+    case CmdType::STALE_TOPIC_ID:
+        return "STALE_TOPIC_ID";
+    default:
+        return "UNKNOWN";
+    }
+}
+
 RMQMessage::RMQMessage(const std::string &topic, CmdType cmd, double timestamp, const std::vector<TimedPtr> &data_ptrs)
     : topic_(topic), cmd_(cmd), timestamp_(timestamp), data_ptrs_(data_ptrs)
 {
@@ -28,16 +66,32 @@ RMQMessage::RMQMessage(const std::string &topic, CmdType cmd, double timestamp,
 
 RMQMessage::RMQMessage(const std::string &serialized)
 {
+    if (serialized.empty())
+    {
+        throw std::invalid_argument("Serialized message is empty");
+    }
     uint8_t topic_length = static_cast<uint8_t>(serialized[0]);
-    if (serialized.size() < sizeof(uint8_t) + topic_length)
+    size_t topic_field_length = topic_length == TOPIC_ID_MARKER ? 2 * sizeof(uint32_t) : topic_length;
+    if (serialized.size() < sizeof(uint8_t) + topic_field_length + sizeof(CmdType) + sizeof(double))
     {
         throw std::invalid_argument("Serialized message is too short, size: " + std::to_string(serialized.size()) +
-                                    ", expected at least: " + std::to_string(sizeof(uint8_t) + topic_length));
+                                    ", expected at least: " +
+                                    std::to_string(sizeof(uint8_t) + topic_field_length + sizeof(CmdType) +
+                                                   sizeof(double)));
     }
     int decode_start_index = sizeof(uint8_t);
-    topic_ =
-        std::string(serialized.begin() + decode_start_index, serialized.begin() + decode_start_index + topic_length);
-    decode_start_index += topic_length;
+    if (topic_length == TOPIC_ID_MARKER)
+    {
+        has_topic_id_ = true;
+        std::memcpy(&topic_id_, serialized.data() + decode_start_index, sizeof(uint32_t));
+        std::memcpy(&server_session_, serialized.data() + decode_start_index + sizeof(uint32_t), sizeof(uint32_t));
+    }
+    else
+    {
+        topic_ = std::string(serialized.begin() + decode_start_index,
+                             serialized.begin() + decode_start_index + topic_length);
+    }
+    decode_start_index += topic_field_length;
     cmd_ = static_cast<CmdType>(serialized[decode_start_index]);
     decode_start_index += sizeof(CmdType);
     timestamp_ = bytes_to_double(
@@ -46,11 +100,38 @@ RMQMessage::RMQMessage(const std::string &serialized)
     data_str_ = std::string(serialized.begin() + decode_start_index, serialized.end());
 }
 
-std::string RMQMessage::topic() const
+const std::string &RMQMessage::topic() const
 {
     return topic_;
 }
 
+bool RMQMessage::has_topic_id() const
+{
+    return has_topic_id_;
+}
+
+uint32_t RMQMessage::topic_id() const
+{
+    return topic_id_;
+}
+
+uint32_t RMQMessage::server_session() const
+{
+    return server_session_;
+}
+
+void RMQMessage::set_topic_id(uint32_t topic_id, uint32_t server_session)
+{
+    has_topic_id_ = true;
+    topic_id_ = topic_id;
+    server_session_ = server_session;
+}
+
+void RMQMessage::clear_topic_id()
+{
+    has_topic_id_ = false;
+}
+
 CmdType RMQMessage::cmd() const
 {
     return cmd_;
@@ -75,7 +156,7 @@ std::vector<TimedPtr> RMQMessage::data_ptrs()
     return data_ptrs_;
 }
 
-std::string RMQMessage::data_str()
+const std::string &RMQMessage::data_str()
 {
     if (data_str_.empty())
     {
@@ -87,8 +168,17 @@ std::string RMQMessage::data_str()
 std::string RMQMessage::serialize()
 {
     std::string serialized;
-    serialized.push_back(static_cast<char>(uint8_t(topic_.size())));
-    serialized.append(topic_);
+    if (has_topic_id_)
+    {
+        serialized.push_back(static_cast<char>(TOPIC_ID_MARKER));
+        serialized.append(uint32_to_bytes(topic_id_));
+        serialized.append(uint32_to_bytes(server_session_));
+    }
+    else
+    {
+        serialized.push_back(static_cast<char>(uint8_t(topic_.size())));
+        serialized.append(topic_);
+    }
     serialized.push_back(static_cast<char>(cmd_));
     serialized.append(double_to_bytes(timestamp_));
     serialized.append(data_str());
@@ -164,9 +254,9 @@ void RMQMessage::decode_data_blocks_()
 
 void RMQMessage::check_input_validity_()
 {
-    if (topic_.size() > 255)
+    if (topic_.size() >= TOPIC_ID_MARKER)
     {
-        throw std::invalid_argument("Topic size must be less than 256 characters");
+        throw std::invalid_argument("Topic size must be less than 255 characters");
     }
     if (topic_.empty())
     {
@@ -7,7 +7,17 @@
 
 #include "rmq_server.h"
 #include "common.h"
+#include "serializer.h"
+#include <algorithm>
+#include <cstring>
 #include <filesystem>
+#include <limits>
+#include <random>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pybind11/numpy.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
 #include <spdlog/spdlog.h>
 
@@ -17,9 +27,10 @@ RMQServer::RMQServer(const std::string &server_name, const std::string &server_e
 }
 
 RMQServer::RMQServer(const std::string &server_name, const std::string &server_endpoint, 
-spdlog::level::level_enum log_level)
+spdlog::level::level_enum log_level, bool persistent_shm)
     : server_name_(server_name), context_(1), socket_(context_, zmq::socket_type::rep), running_(false),
-      steady_clock_start_time_us_(steady_clock_us()), poller_timeout_ms_(1000)
+      steady_clock_start_time_us_(steady_clock_us()), poller_timeout_ms_(1000), stats_start_time_us_(steady_clock_us()),
+      persistent_shm_(persistent_shm)
 {
     logger_ = spdlog::get(server_name);
     if (!logger_)
@@ -58,49 +69,291 @@ spdlog::level::level_enum log_level)
         throw std::runtime_error("Failed to bind to endpoint " + server_endpoint + ": " + e.what());
     }
 
+    // Topic ids handed out by this instance are only accepted together with this session id, so that clients that
+    // reconnect to a restarted server never address the wrong topic.
+    std::random_device random_device;
+    session_id_ = random_device();
+    shm_host_token_ = get_shm_host_token();
+    if (persistent_shm_)
+    {
+        restore_topic_index_();
+    }
+
     running_ = true;
     poller_item_ = {socket_, 0, ZMQ_POLLIN, 0};
     background_thread_ = std::thread(&RMQServer::background_loop_, this);
-    data_topics_ = std::unordered_map<std::string, DataTopic>();
 }
 
 RMQServer::~RMQServer()
 {
+    stop_relay("");
+    stop_replay();
+    stop_recording();
     running_ = false;
     background_thread_.join();
+    if (async_put_thread_.joinable())
+    {
+        async_put_queue_.notify();
+        async_put_thread_.join();
+    }
+    if (trace_export_thread_.joinable())
+    {
+        // Writes the traces that are still queued before the file is closed
+        trace_export_queue_.notify();
+        trace_export_thread_.join();
+    }
+    {
+        std::lock_guard<std::mutex> lock(trace_export_mutex_);
+        close_trace_export_();
+    }
     socket_.close();
     context_.close();
-    for (auto &pair : data_topics_)
+    bool unlink = !persistent_shm_ || discard_persistent_state_;
+    topics_.for_each([unlink](uint32_t, const std::string &, DataTopic &data_topic) {
+        if (data_topic.is_shm_topic())
+        {
+            data_topic.delete_shm(unlink);
+        }
+    });
+    if (topic_index_fd_ >= 0)
+    {
+        if (unlink)
+        {
+            ::unlink(topic_index_path_.c_str());
+        }
+        close(topic_index_fd_);
+    }
+}
+
+void RMQServer::restore_topic_index_()
+{
+    topic_index_path_ = "/dev/shm/rmq_" + get_user_name() + "_" + server_name_ + "_topics";
+    topic_index_fd_ = open(topic_index_path_.c_str(), O_CREAT | O_RDWR, 0666);
+    if (topic_index_fd_ < 0)
+    {
+        throw std::runtime_error("Failed to open the topic index " + topic_index_path_ + ": " + strerror(errno));
+    }
+    if (flock(topic_index_fd_, LOCK_EX | LOCK_NB) != 0)
+    {
+        close(topic_index_fd_);
+        topic_index_fd_ = -1;
+        throw std::runtime_error("Another server named `" + server_name_ +
+                                 "` with persistent shared memory is running on this host");
+    }
+    struct stat index_stat;
+    fstat(topic_index_fd_, &index_stat);
+    std::string index(index_stat.st_size, '\0');
+    if (pread(topic_index_fd_, &index[0], index.size(), 0) != static_cast<ssize_t>(index.size()) ||
+        index.size() < sizeof(uint32_t) || bytes_to_uint32(index.substr(0, sizeof(uint32_t))) != TOPIC_INDEX_MAGIC_)
+    {
+        return; // A new server
+    }
+    // The index is rewritten in place, so a server that died while writing it may have left an incomplete last entry,
+    // or entries of the previous index after the part it had written
+    std::vector<LogTopicInfo> infos;
+    bool complete = true;
+    try
     {
-        if (pair.second.is_shm_topic())
+        size_t offset = sizeof(uint32_t);
+        while (offset + sizeof(uint32_t) <= index.size())
         {
-            pair.second.delete_shm();
+            uint32_t info_size = bytes_to_uint32(index.substr(offset, sizeof(uint32_t)));
+            offset += sizeof(uint32_t);
+            if (offset + info_size > index.size())
+            {
+                throw std::runtime_error("truncated entry");
+            }
+            infos.push_back(LogTopicInfo::parse(index.substr(offset, info_size)));
+            offset += info_size;
         }
     }
+    catch (const std::exception &e)
+    {
+        logger_->warn("Topic index {} is incomplete ({}). Restoring the first {} topics.", topic_index_path_,
+                      e.what(), infos.size());
+        complete = false;
+    }
+    int64_t start_us = steady_clock_us();
+    // Rewriting the whole index after each restored topic would make restoring quadratic in the number of topics
+    restoring_topic_index_ = true;
+    for (const LogTopicInfo &info : infos)
+    {
+        add_topic_from_info_(info);
+    }
+    restoring_topic_index_ = false;
+    if (!complete)
+    {
+        save_topic_index_();
+    }
+    logger_->info("Restored {} topics from {} in {:.3f} ms", infos.size(), topic_index_path_,
+                  (steady_clock_us() - start_us) / 1e3);
+}
+
+void RMQServer::save_topic_index_()
+{
+    if (topic_index_fd_ < 0 || restoring_topic_index_)
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(topic_index_mutex_);
+    std::string index = uint32_to_bytes(TOPIC_INDEX_MAGIC_);
+    topics_.for_each([&index](uint32_t, const std::string &, DataTopic &data_topic) {
+        std::string info = data_topic.log_topic_info().serialize();
+        index += uint32_to_bytes(info.size()) + info;
+    });
+    // Written over the previous index before it is cut to the new length, so that the file never lacks topics that
+    // were added before this one. Truncating first would lose the whole index if the server died in between.
+    if (pwrite(topic_index_fd_, index.data(), index.size(), 0) != static_cast<ssize_t>(index.size()) ||
+        ftruncate(topic_index_fd_, index.size()) != 0)
+    {
+        logger_->error("Failed to write the topic index {}: {}", topic_index_path_, strerror(errno));
+    }
+}
+
+void RMQServer::discard_persistent_state()
+{
+    discard_persistent_state_ = true;
+}
+
+void RMQServer::add_topic_from_info_(const LogTopicInfo &info)
+{
+    switch (info.kind)
+    {
+    case LogTopicInfo::SHARED_MEMORY:
+        add_shared_memory_topic(info.name, info.message_remaining_time_s, info.shared_memory_size_gb);
+        break;
+    case LogTopicInfo::TENSOR:
+        add_tensor_topic(info.name, pybind11::str(info.dtype), info.shape, info.capacity, info.message_remaining_time_s,
+                         info.shared_memory);
+        break;
+    default:
+        add_topic(info.name, info.message_remaining_time_s);
+        break;
+    }
+}
+
+void RMQServer::log_existing_topic_(const LogTopicInfo &requested)
+{
+    DataTopic *data_topic = topics_.find(requested.name);
+    if (persistent_shm_ && data_topic != nullptr &&
+        data_topic->log_topic_info().serialize() == requested.serialize())
+    {
+        logger_->info("Topic `{}` was already restored from the topic index.", requested.name);
+        return;
+    }
+    logger_->warn("Topic `{}` already exists. Ignoring the request to add it again.", requested.name);
 }
 
 void RMQServer::add_topic(const std::string &topic, double message_remaining_time_s)
 {
-    std::lock_guard<std::mutex> lock(data_topic_mutex_);
-    auto it = data_topics_.find(topic);
-    if (it != data_topics_.end())
+    if (topics_.add(topic, std::make_unique<DataTopic>(topic, message_remaining_time_s)) < 0)
     {
-        logger_->warn("Topic `{}` already exists. Ignoring the request to add it again.", topic);
+        LogTopicInfo requested;
+        requested.name = topic;
+        requested.message_remaining_time_s = message_remaining_time_s;
+        log_existing_topic_(requested);
         return;
     }
-    data_topics_.insert({topic, DataTopic(topic, message_remaining_time_s)});
+    save_topic_index_();
     logger_->info("Added topic `{}` with max remaining time {}s.", topic, message_remaining_time_s);
 }
 
 void RMQServer::add_shared_memory_topic(const std::string &topic, double message_remaining_time_s,
                                         double shared_memory_size_gb)
 {
-    std::lock_guard<std::mutex> lock(data_topic_mutex_);
-    data_topics_.insert({topic, DataTopic(topic, message_remaining_time_s, server_name_, shared_memory_size_gb)});
+    // Constructed under the registry lock, since the constructor creates the shared memory segment under the same
+    // name and a concurrent duplicate would initialize the live segment again.
+    if (topics_.emplace(topic, [&]() {
+            return std::make_unique<DataTopic>(topic, message_remaining_time_s, server_name_, shared_memory_size_gb,
+                                               next_shm_segment_id_++, session_id_, persistent_shm_,
+                                               steady_clock_start_time_us_);
+        }) < 0)
+    {
+        LogTopicInfo requested;
+        requested.name = topic;
+        requested.kind = LogTopicInfo::SHARED_MEMORY;
+        requested.message_remaining_time_s = message_remaining_time_s;
+        requested.shared_memory_size_gb = shared_memory_size_gb;
+        log_existing_topic_(requested);
+        return;
+    }
+    save_topic_index_();
+    DataTopic *data_topic = topics_.find(topic);
+    if (data_topic->reattached())
+    {
+        logger_->info("Reattached shared memory topic `{}` with {} items.", topic, data_topic->size());
+        return;
+    }
     logger_->info("Added shared memory topic `{}` with max remaining time {}s and shared memory size {}GB.", topic,
                   message_remaining_time_s, shared_memory_size_gb);
 }
 
+void RMQServer::add_tensor_topic(const std::string &topic, const pybind11::object &dtype,
+                                 const std::vector<int64_t> &shape, uint64_t capacity, double message_remaining_time_s,
+                                 bool shared_memory)
+{
+    pybind11::dtype tensor_dtype = pybind11::dtype::from_args(dtype);
+    uint64_t slot_size_bytes = tensor_dtype.itemsize();
+    for (int64_t dim : shape)
+    {
+        if (dim <= 0)
+        {
+            throw std::invalid_argument("Tensor topic `" + topic + "` needs a shape with positive dimensions");
+        }
+        if (slot_size_bytes > std::numeric_limits<uint64_t>::max() / static_cast<uint64_t>(dim))
+        {
+            throw std::invalid_argument("Slot size of tensor topic `" + topic + "` overflows");
+        }
+        slot_size_bytes *= dim;
+    }
+    // The slots and the spare slot for reservations (see DataTopic) are allocated in one block
+    if (capacity >= std::numeric_limits<uint64_t>::max() / slot_size_bytes)
+    {
+        throw std::invalid_argument("Capacity " + std::to_string(capacity) + " of tensor topic `" + topic +
+                                    "` is too large for slots of " + std::to_string(slot_size_bytes) + " bytes");
+    }
+    std::string dtype_str = tensor_dtype.attr("str").cast<std::string>();
+    if (topics_.emplace(topic, [&]() {
+            return std::make_unique<DataTopic>(topic, message_remaining_time_s, dtype_str, shape, slot_size_bytes,
+                                               capacity, shared_memory ? server_name_ : std::string(),
+                                               next_shm_segment_id_++, session_id_, persistent_shm_,
+                                               steady_clock_start_time_us_);
+        }) < 0)
+    {
+        LogTopicInfo requested;
+        requested.name = topic;
+        requested.kind = LogTopicInfo::TENSOR;
+        requested.message_remaining_time_s = message_remaining_time_s;
+        requested.dtype = dtype_str;
+        requested.shape = shape;
+        requested.capacity = capacity;
+        requested.shared_memory = shared_memory;
+        log_existing_topic_(requested);
+        return;
+    }
+    save_topic_index_();
+    DataTopic *data_topic = topics_.find(topic);
+    if (data_topic->reattached())
+    {
+        logger_->info("Reattached tensor topic `{}` with {} items.", topic, data_topic->size());
+        return;
+    }
+    logger_->info("Added tensor topic `{}` of {} with {} slots of {} bytes{}.", topic, dtype_str, capacity,
+                  slot_size_bytes, shared_memory ? " in shared memory" : "");
+}
+
+void RMQServer::set_topic_compression(const std::string &topic, const std::string &compression, int level)
+{
+    DataTopic *data_topic = topics_.find(topic);
+    if (data_topic == nullptr)
+    {
+        throw std::invalid_argument("Topic `" + topic +
+                                    "` not found. Please first call add_topic to add it into the server topics.");
+    }
+    data_topic->set_compression(compression_type_from_string(compression), level);
+    logger_->info("Set compression of topic `{}` to {} (level {}) for remote clients.", topic, compression, level);
+}
+
 void RMQServer::put_data(const std::string &topic, const pybind11::bytes &data)
 {
 
@@ -108,9 +361,8 @@ void RMQServer::put_data(const std::string &topic, const pybind11::bytes &data)
     {
         throw std::invalid_argument("Cannot pass empty bytes string");
     }
-    std::lock_guard<std::mutex> lock(data_topic_mutex_);
-    auto it = data_topics_.find(topic);
-    if (it == data_topics_.end())
+    DataTopic *data_topic = topics_.find(topic);
+    if (data_topic == nullptr)
     {
         logger_->warn(
             "Received data for unknown topic {}. Please first call add_topic to add it into the recorded topics.",
@@ -118,54 +370,372 @@ void RMQServer::put_data(const std::string &topic, const pybind11::bytes &data)
         return;
     }
 
-    int64_t done_make_shared_time = steady_clock_us();
-    if (it->second.is_shm_topic())
+    if (data_topic->is_tensor_topic())
+    {
+        char *buffer;
+        ssize_t length;
+        PYBIND11_BYTES_AS_STRING_AND_SIZE(data.ptr(), &buffer, &length);
+        data_topic->put_tensor(buffer, length, get_timestamp());
+    }
+    else if (data_topic->is_shm_topic())
     {
-        it->second.copy_data_to_shm(data, get_timestamp());
+        data_topic->copy_data_to_shm(data, get_timestamp());
     }
     else
     {
-        BytesPtr data_ptr = std::make_shared<Bytes>(pybind11::bytes(data).cast<std::string>());
-        it->second.add_data_ptr(data_ptr, get_timestamp());
+        // Copy the payload exactly once, straight from the bytes buffer. Keeping a reference to the Python object
+        // instead is not possible: messages are released by the background thread, which must not take the GIL
+        // while holding a topic lock.
+        char *buffer;
+        ssize_t length;
+        PYBIND11_BYTES_AS_STRING_AND_SIZE(data.ptr(), &buffer, &length);
+        BytesPtr data_ptr = std::make_shared<Bytes>(buffer, length);
+        data_topic->add_data_ptr(data_ptr, get_timestamp());
     }
 }
 
-pybind11::tuple RMQServer::peek_data(const std::string &topic, int n)
+bool RMQServer::put_data_async(const std::string &topic, const pybind11::bytes &data)
 {
-    std::vector<TimedPtr> ptrs = peek_data_ptrs_(topic, n);
-    pybind11::list data;
-    pybind11::list timestamps;
-    auto it = data_topics_.find(topic);
-    for (const TimedPtr ptr : ptrs)
+    char *buffer;
+    ssize_t length;
+    PYBIND11_BYTES_AS_STRING_AND_SIZE(data.ptr(), &buffer, &length);
+    if (length == 0)
+    {
+        throw std::invalid_argument("Cannot pass empty bytes string");
+    }
+    std::call_once(async_put_thread_started_,
+                   [this]() { async_put_thread_ = std::thread(&RMQServer::async_put_loop_, this); });
+
+    uint64_t queue_size = async_put_queue_.size();
+    if (queue_size >= async_put_capacity_.load())
+    {
+        async_put_dropped_++;
+        logger_->debug("Async put queue is full ({} messages). Dropping data for topic {}.", queue_size, topic);
+        return false;
+    }
+    double timestamp = get_timestamp();
+    BytesPtr data_ptr = std::make_shared<Bytes>(buffer, length);
+    async_put_queue_.push({topic, data_ptr, timestamp});
+    async_put_enqueued_++;
+    async_put_enqueued_bytes_ += length;
+
+    uint64_t max_queue_size = async_put_max_queue_size_.load();
+    while (queue_size + 1 > max_queue_size &&
+           !async_put_max_queue_size_.compare_exchange_weak(max_queue_size, queue_size + 1))
+    {
+    }
+    return true;
+}
+
+bool RMQServer::flush_async_put(double timeout_s)
+{
+    pybind11::gil_scoped_release release;
+    double start_time = get_timestamp();
+    while (async_put_processed_.load() < async_put_enqueued_.load())
     {
-        if (it->second.is_shm_topic())
+        if (timeout_s >= 0 && get_timestamp() - start_time > timeout_s)
         {
-            data.append(pybind11::bytes(it->second.get_shared_memory_data(*std::get<0>(ptr))));
+            return false;
         }
-        else
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    return true;
+}
+
+void RMQServer::set_async_put_capacity(uint64_t max_queued_messages)
+{
+    if (max_queued_messages == 0)
+    {
+        throw std::invalid_argument("Async put capacity must be positive");
+    }
+    async_put_capacity_ = max_queued_messages;
+}
+
+std::unordered_map<std::string, uint64_t> RMQServer::get_async_put_stats()
+{
+    return {
+        {"enqueued", async_put_enqueued_.load()},
+        {"enqueued_bytes", async_put_enqueued_bytes_.load()},
+        {"dropped", async_put_dropped_.load()},
+        {"processed", async_put_processed_.load()},
+        {"queue_size", async_put_queue_.size()},
+        {"max_queue_size", async_put_max_queue_size_.load()},
+        {"capacity", async_put_capacity_.load()},
+    };
+}
+
+void RMQServer::async_put_loop_()
+{
+    AsyncPutItem item;
+    while (true)
+    {
+        if (!async_put_queue_.pop(item))
         {
-            data.append(pybind11::bytes(*std::get<0>(ptr)));
+            if (!running_)
+            {
+                break;
+            }
+            // Woken by the next push, or by the destructor
+            async_put_queue_.wait(std::chrono::seconds(1));
+            continue;
         }
-        timestamps.append(std::get<1>(ptr));
+        {
+            DataTopic *data_topic = topics_.find(item.topic);
+            if (data_topic == nullptr)
+            {
+                logger_->warn("Received data for unknown topic {}. Please first call add_topic to add it into the "
+                              "recorded topics.",
+                              item.topic);
+            }
+            else
+            {
+                try
+                {
+                    if (data_topic->is_shm_topic())
+                    {
+                        data_topic->copy_data_to_shm(item.data_ptr->data(), item.data_ptr->size(), item.timestamp);
+                    }
+                    else
+                    {
+                        data_topic->add_data_ptr(item.data_ptr, item.timestamp);
+                    }
+                }
+                catch (const std::exception &e)
+                {
+                    logger_->error("Failed to put data asynchronously into topic {}: {}", item.topic, e.what());
+                }
+            }
+        }
+        item.data_ptr.reset();
+        async_put_processed_++;
     }
-    return pybind11::make_tuple(data, timestamps);
 }
 
-pybind11::tuple RMQServer::pop_data(const std::string &topic, int n)
+pybind11::tuple RMQServer::reserve(const std::string &topic, uint64_t nbytes)
+{
+    if (nbytes == 0)
+    {
+        throw std::invalid_argument("Cannot reserve 0 bytes");
+    }
+    std::lock_guard<std::mutex> lock(reservation_mutex_);
+    DataTopic *data_topic = topics_.find(topic);
+    if (data_topic == nullptr)
+    {
+        throw std::invalid_argument("Topic `" + topic +
+                                    "` not found. Please first call add_topic to add it into the server topics.");
+    }
+    if (!data_topic->accepts_item_size(nbytes))
+    {
+        throw std::invalid_argument("Reserved size " + std::to_string(nbytes) +
+                                    " does not match the slot size of tensor topic `" + topic + "`");
+    }
+
+    uint64_t handle = next_reservation_handle_++;
+    Reservation reservation{topic, nullptr};
+    pybind11::array_t<uint8_t> buffer;
+    if (data_topic->is_shm_topic())
+    {
+        uint64_t offset = data_topic->reserve_shm(nbytes);
+        // The array shares the ring's mapping, so it stays valid even if the topic's shared memory is deleted first
+        auto *mapping = new std::shared_ptr<char>(data_topic->shm_mapping());
+        pybind11::capsule base(mapping, [](void *ptr) { delete static_cast<std::shared_ptr<char> *>(ptr); });
+        buffer = pybind11::array_t<uint8_t>(static_cast<pybind11::ssize_t>(nbytes),
+                                            reinterpret_cast<uint8_t *>(data_topic->shm_buffer(offset)), base);
+    }
+    else
+    {
+        reservation.heap_data = std::make_shared<Bytes>(nbytes, '\0');
+        // The array keeps its own reference to the buffer in case the message expires while Python still holds it.
+        BytesPtr *owner = new BytesPtr(reservation.heap_data);
+        pybind11::capsule base(owner, [](void *ptr) { delete static_cast<BytesPtr *>(ptr); });
+        buffer = pybind11::array_t<uint8_t>(static_cast<pybind11::ssize_t>(nbytes),
+                                            reinterpret_cast<uint8_t *>(&(*reservation.heap_data)[0]), base);
+    }
+    reservations_.insert({handle, reservation});
+    return pybind11::make_tuple(handle, buffer);
+}
+
+void RMQServer::commit(uint64_t handle, std::optional<double> timestamp)
+{
+    std::lock_guard<std::mutex> lock(reservation_mutex_);
+    auto reservation_it = reservations_.find(handle);
+    if (reservation_it == reservations_.end())
+    {
+        throw std::invalid_argument("Unknown reservation handle " + std::to_string(handle) +
+                                    ". It may have been committed or cancelled already.");
+    }
+    Reservation reservation = reservation_it->second;
+    reservations_.erase(reservation_it);
+    DataTopic *data_topic = topics_.find(reservation.topic);
+    if (data_topic == nullptr)
+    {
+        throw std::runtime_error("Topic `" + reservation.topic + "` of the reservation no longer exists");
+    }
+    double commit_timestamp = timestamp.has_value() ? timestamp.value() : get_timestamp();
+    if (data_topic->is_shm_topic())
+    {
+        data_topic->commit_shm(commit_timestamp);
+    }
+    else
+    {
+        data_topic->add_data_ptr(reservation.heap_data, commit_timestamp);
+    }
+}
+
+void RMQServer::cancel(uint64_t handle)
+{
+    std::lock_guard<std::mutex> lock(reservation_mutex_);
+    auto reservation_it = reservations_.find(handle);
+    if (reservation_it == reservations_.end())
+    {
+        logger_->warn("Unknown reservation handle {}. Ignoring the request to cancel it.", handle);
+        return;
+    }
+    DataTopic *data_topic = topics_.find(reservation_it->second.topic);
+    if (data_topic != nullptr && data_topic->is_shm_topic())
+    {
+        data_topic->cancel_shm_reservation();
+    }
+    reservations_.erase(reservation_it);
+}
+
+void RMQServer::put_object(const std::string &topic, const pybind11::object &obj)
+{
+    ObjectEncoder encoder(obj);
+    std::lock_guard<std::mutex> lock(reservation_mutex_);
+    DataTopic *data_topic = topics_.find(topic);
+    if (data_topic == nullptr)
+    {
+        throw std::invalid_argument("Topic `" + topic +
+                                    "` not found. Please first call add_topic to add it into the server topics.");
+    }
+    if (data_topic->is_shm_topic())
+    {
+        uint64_t offset = data_topic->reserve_shm(encoder.size());
+        try
+        {
+            encoder.write(data_topic->shm_buffer(offset));
+        }
+        catch (...)
+        {
+            data_topic->cancel_shm_reservation();
+            throw;
+        }
+        data_topic->commit_shm(get_timestamp());
+    }
+    else
+    {
+        BytesPtr data_ptr = std::make_shared<Bytes>(encoder.size(), '\0');
+        encoder.write(&(*data_ptr)[0]);
+        data_topic->add_data_ptr(data_ptr, get_timestamp());
+    }
+}
+
+DataTopic *RMQServer::find_tensor_topic_(const std::string &topic)
+{
+    DataTopic *data_topic = topics_.find(topic);
+    if (data_topic == nullptr || !data_topic->is_tensor_topic())
+    {
+        throw std::invalid_argument("Tensor topic `" + topic +
+                                    "` not found. Please first call add_tensor_topic to add it into the server topics.");
+    }
+    return data_topic;
+}
+
+void RMQServer::put_tensor(const std::string &topic, const pybind11::array &array)
+{
+    DataTopic *data_topic = find_tensor_topic_(topic);
+    const std::vector<int64_t> &shape = data_topic->tensor_shape();
+    bool shape_matches = array.ndim() == static_cast<ssize_t>(shape.size());
+    for (size_t i = 0; shape_matches && i < shape.size(); i++)
+    {
+        shape_matches = array.shape(i) == shape[i];
+    }
+    if (!shape_matches || array.dtype().attr("str").cast<std::string>() != data_topic->tensor_dtype())
+    {
+        throw std::invalid_argument("Array does not match the dtype " + data_topic->tensor_dtype() +
+                                    " and shape of tensor topic `" + topic + "`");
+    }
+    // Only non-contiguous arrays are copied before they are put into the slot
+    pybind11::array contiguous = pybind11::array::ensure(array, pybind11::array::c_style);
+    data_topic->put_tensor(static_cast<const char *>(contiguous.data()), contiguous.nbytes(), get_timestamp());
+}
+
+pybind11::tuple RMQServer::peek_tensor(const std::string &topic, int n, bool copy)
+{
+    DataTopic *data_topic = find_tensor_topic_(topic);
+    // Views keep the server, and thereby the slots, alive
+    pybind11::object base = copy ? pybind11::object() : pybind11::cast(this, pybind11::return_value_policy::reference);
+    return data_topic->peek_tensors(n, copy, base);
+}
+
+pybind11::tuple RMQServer::peek_window(const std::string &topic, int k, bool copy)
+{
+    DataTopic *data_topic = find_tensor_topic_(topic);
+    pybind11::object base = copy ? pybind11::object() : pybind11::cast(this, pybind11::return_value_policy::reference);
+    return data_topic->peek_window(k, copy, base);
+}
+
+pybind11::tuple RMQServer::peek_data(const std::string &topic, int n, bool copy)
+{
+    return ptrs_to_tuple_(topic, peek_data_ptrs_(topic, n), copy);
+}
+
+pybind11::tuple RMQServer::pop_data(const std::string &topic, int n, bool copy)
+{
+    return ptrs_to_tuple_(topic, pop_data_ptrs_(topic, n), copy);
+}
+
+pybind11::tuple RMQServer::consume_data(const std::string &topic, const std::string &group, int n, bool copy)
+{
+    return ptrs_to_tuple_(topic, find_topic_(topic)->consume_data_ptrs(group, n), copy);
+}
+
+void RMQServer::remove_consumer_group(const std::string &topic, const std::string &group)
+{
+    find_topic_(topic)->remove_consumer_group(group);
+}
+
+std::unordered_map<std::string, uint64_t> RMQServer::get_consumer_groups(const std::string &topic)
+{
+    return find_topic_(topic)->consumer_groups();
+}
+
+DataTopic *RMQServer::find_topic_(const std::string &topic)
+{
+    DataTopic *data_topic = topics_.find(topic);
+    if (data_topic == nullptr)
+    {
+        throw std::invalid_argument("Topic `" + topic +
+                                    "` not found. Please first call add_topic to add it into the server topics.");
+    }
+    return data_topic;
+}
+
+pybind11::tuple RMQServer::ptrs_to_tuple_(const std::string &topic, const std::vector<TimedPtr> &ptrs, bool copy)
 {
-    std::vector<TimedPtr> ptrs = pop_data_ptrs_(topic, n);
     pybind11::list data;
     pybind11::list timestamps;
-    auto it = data_topics_.find(topic);
+    DataTopic *data_topic = topics_.find(topic);
     for (const TimedPtr ptr : ptrs)
     {
-        if (it->second.is_shm_topic())
+        const Bytes &bytes = *std::get<0>(ptr);
+        if (data_topic->is_shm_topic() && ShmDescriptor::is_shm_descriptor(bytes))
+        {
+            // The ring may be overwritten at any time, so shared memory data is always copied out.
+            data.append(data_topic->get_shared_memory_data(ShmDescriptor::parse(bytes)));
+        }
+        else if (SharedMemoryDataInfo::is_shm_data_info(bytes))
+        {
+            data.append(SharedMemoryDataInfo(bytes).get_shm_data());
+        }
+        else if (!copy)
         {
-            data.append(pybind11::bytes(it->second.get_shared_memory_data(*std::get<0>(ptr))));
+            data.append(pybind11::cast(BytesView{std::get<0>(ptr)}));
         }
         else
         {
-            data.append(pybind11::bytes(*std::get<0>(ptr)));
+            data.append(copy_to_pybytes(bytes.data(), bytes.size()));
         }
         timestamps.append(std::get<1>(ptr));
     }
@@ -208,12 +778,17 @@ pybind11::tuple RMQServer::wait_for_request(double timeout_s)
                     SharedMemoryDataInfo data_info(data);
                     data_bytes = data_info.get_shm_data();
                 }
+                else if (ShmDescriptor::is_shm_descriptor(data))
+                {
+                    data_bytes = topics_.find(topic)->get_shared_memory_data(ShmDescriptor::parse(data));
+                }
                 else
                 {
                     data_bytes = pybind11::bytes(data);
                 }
 
                 ptrs.clear();
+                request_dispatched_us_ = steady_clock_us();
                 return pybind11::make_tuple(data_bytes, pybind11::str(topic));
             }
         }
@@ -224,6 +799,7 @@ pybind11::tuple RMQServer::wait_for_request(double timeout_s)
 
 void RMQServer::reply_request(const std::string &topic, const pybind11::bytes &data)
 {
+    request_replied_us_ = steady_clock_us();
     put_data(topic, data);
     {
         std::lock_guard<std::mutex> lock(reply_mutex_);
@@ -234,105 +810,1190 @@ void RMQServer::reply_request(const std::string &topic, const pybind11::bytes &d
 std::unordered_map<std::string, int> RMQServer::get_all_topic_status()
 {
     std::unordered_map<std::string, int> result;
-    std::lock_guard<std::mutex> lock(data_topic_mutex_);
-    for (auto &pair : data_topics_)
-    {
-        result[pair.first] = pair.second.size();
-    }
+    topics_.for_each(
+        [&result](uint32_t, const std::string &name, DataTopic &data_topic) { result[name] = data_topic.size(); });
     return result;
 }
 
-double RMQServer::get_timestamp()
+int RMQServer::command_stats_index_(CmdType cmd)
 {
-    return static_cast<double>(steady_clock_us() - steady_clock_start_time_us_) / 1e6;
+    int index = static_cast<int>(cmd) + 2;
+    return index >= 0 && index < NUM_COMMAND_STATS_ ? index : static_cast<int>(CmdType::UNKNOWN) + 2;
 }
 
-void RMQServer::reset_start_time(int64_t system_time_us)
+void RMQServer::record_request_stats_(CmdType cmd, uint64_t request_bytes, int64_t service_time_us)
 {
-    std::lock_guard<std::mutex> lock(data_topic_mutex_);
-    logger_->info("Resetting start time. Will clear all data stored before this time");
-    for (auto &pair : data_topics_)
+    CommandStats &stats = command_stats_[command_stats_index_(cmd)];
+    stats.count.fetch_add(1, std::memory_order_relaxed);
+    stats.bytes_in.fetch_add(request_bytes, std::memory_order_relaxed);
+    stats.bytes_out.fetch_add(reply_bytes_, std::memory_order_relaxed);
+    if (reply_is_error_)
     {
-        pair.second.clear_data();
+        stats.errors.fetch_add(1, std::memory_order_relaxed);
     }
-    // Use system time to make sure different servers and clients are synchronized
-    steady_clock_start_time_us_ = steady_clock_us() + (system_time_us - system_clock_us());
-    // Clear the cache
-    cached_reply_data_.clear();
-    last_request_timestamp_.clear();
+    stats.service_time_us.record(service_time_us > 0 ? service_time_us : 0);
 }
 
-std::vector<TimedPtr> RMQServer::peek_data_ptrs_(const std::string &topic, int32_t n)
+std::string RMQServer::stats_json_()
 {
-    std::lock_guard<std::mutex> lock(data_topic_mutex_);
-    auto it = data_topics_.find(topic);
-    if (it == data_topics_.end())
+    std::string json = "{\"server\": \"" + json_escape(server_name_) + "\", \"uptime_s\": " +
+                       std::to_string((steady_clock_us() - stats_start_time_us_) / 1e6) + ", \"topics\": {";
+    bool first = true;
+    topics_.for_each([&json, &first](uint32_t, const std::string &name, DataTopic &data_topic) {
+        TopicStats stats = data_topic.stats();
+        json += (first ? "\"" : ", \"") + json_escape(name) + "\": {\"size\": " + std::to_string(data_topic.size()) +
+                ", \"messages_put\": " + std::to_string(stats.messages_put) +
+                ", \"bytes_put\": " + std::to_string(stats.bytes_put) +
+                ", \"messages_expired\": " + std::to_string(stats.messages_expired) +
+                ", \"messages_evicted\": " + std::to_string(stats.messages_evicted) +
+                ", \"messages_dropped\": " + std::to_string(stats.messages_dropped) +
+                ", \"messages_peeked\": " + std::to_string(stats.messages_peeked) +
+                ", \"messages_popped\": " + std::to_string(stats.messages_popped) +
+                ", \"messages_consumed\": " + std::to_string(stats.messages_consumed) + "}";
+        first = false;
+    });
+    json += "}, \"commands\": {";
+    first = true;
+    for (int i = 0; i < NUM_COMMAND_STATS_; i++)
     {
-        logger_->warn("Requested last k data for unknown topic {}. Please first call add_topic to add it into the "
-                      "recorded topics.",
-                      topic);
-        return {};
+        const CommandStats &stats = command_stats_[i];
+        if (stats.count.load() == 0)
+        {
+            continue;
+        }
+        json += (first ? "\"" : ", \"") + cmd_type_to_string(static_cast<CmdType>(i - 2)) +
+                "\": {\"count\": " + std::to_string(stats.count.load()) +
+                ", \"errors\": " + std::to_string(stats.errors.load()) +
+                ", \"bytes_in\": " + std::to_string(stats.bytes_in.load()) +
+                ", \"bytes_out\": " + std::to_string(stats.bytes_out.load()) +
+                ", \"service_time_us\": " + stats.service_time_us.to_json() + "}";
+        first = false;
+    }
+    json += "}, \"async_put\": {";
+    first = true;
+    for (const auto &entry : get_async_put_stats())
+    {
+        json += (first ? "\"" : ", \"") + entry.first + "\": " + std::to_string(entry.second);
+        first = false;
     }
-    return it->second.peek_data_ptrs(n);
+    return json + "}}";
 }
 
-void RMQServer::add_data_ptrs_(const std::string &topic, const std::vector<TimedPtr> &data_ptrs)
+pybind11::object RMQServer::get_stats()
 {
-    std::lock_guard<std::mutex> lock(data_topic_mutex_);
-
-    auto it = data_topics_.find(topic);
-    if (it == data_topics_.end())
-    {
-        logger_->warn("Received data for unknown topic {}. Please first call add_topic to add it into the recorded "
-                      "topics.",
-                      topic);
-        return;
-    }
-    for (const TimedPtr ptr : data_ptrs)
-    {
-        it->second.add_data_ptr(std::get<0>(ptr), std::get<1>(ptr));
-    }
+    return pybind11::module_::import("json").attr("loads")(stats_json_());
 }
 
-std::vector<TimedPtr> RMQServer::pop_data_ptrs_(const std::string &topic, int32_t n)
+std::string RMQServer::get_stats_text()
 {
-    std::lock_guard<std::mutex> lock(data_topic_mutex_);
-    auto it = data_topics_.find(topic);
-    if (it == data_topics_.end())
-    {
+    // Label values escape backslashes, quotes and newlines
+    auto label = [](const std::string &value) {
+        std::string escaped;
+        for (char c : value)
+        {
+            if (c == '\n')
+            {
+                escaped += "\\n";
+                continue;
+            }
+            if (c == '\\' || c == '"')
+            {
+                escaped += '\\';
+            }
+            escaped += c;
+        }
+        return escaped;
+    };
+    std::string server_label = "server=\"" + label(server_name_) + "\"";
+    std::string text;
+    auto header = [&text](const std::string &metric, const std::string &type, const std::string &help) {
+        text += "# HELP " + metric + " " + help + "\n# TYPE " + metric + " " + type + "\n";
+    };
+
+    std::vector<std::pair<std::string, TopicStats>> topic_stats;
+    std::vector<std::pair<std::string, int>> topic_sizes;
+    topics_.for_each([&](uint32_t, const std::string &name, DataTopic &data_topic) {
+        topic_stats.push_back({name, data_topic.stats()});
+        topic_sizes.push_back({name, data_topic.size()});
+    });
+    auto topic_metric = [&](const std::string &metric, const std::string &help, uint64_t TopicStats::*field) {
+        header(metric, "counter", help);
+        for (const auto &entry : topic_stats)
+        {
+            text += metric + "{" + server_label + ",topic=\"" + label(entry.first) + "\"} " +
+                    std::to_string(entry.second.*field) + "\n";
+        }
+    };
+    header("rmq_topic_size", "gauge", "Messages currently stored in the topic");
+    for (const auto &entry : topic_sizes)
+    {
+        text += "rmq_topic_size{" + server_label + ",topic=\"" + label(entry.first) + "\"} " +
+                std::to_string(entry.second) + "\n";
+    }
+    topic_metric("rmq_topic_messages_put_total", "Messages put into the topic", &TopicStats::messages_put);
+    topic_metric("rmq_topic_bytes_put_total", "Bytes put into the topic", &TopicStats::bytes_put);
+    topic_metric("rmq_topic_messages_expired_total", "Messages removed after message_remaining_time_s",
+                 &TopicStats::messages_expired);
+    topic_metric("rmq_topic_messages_evicted_total", "Messages overwritten to make room in the ring",
+                 &TopicStats::messages_evicted);
+    topic_metric("rmq_topic_messages_dropped_total", "Messages larger than the shared memory ring",
+                 &TopicStats::messages_dropped);
+    topic_metric("rmq_topic_messages_peeked_total", "Messages returned by peeks", &TopicStats::messages_peeked);
+    topic_metric("rmq_topic_messages_popped_total", "Messages removed by pops", &TopicStats::messages_popped);
+    topic_metric("rmq_topic_messages_consumed_total", "Messages returned to consumer groups",
+                 &TopicStats::messages_consumed);
+
+    auto command_metric = [&](const std::string &metric, const std::string &help,
+                              std::atomic<uint64_t> CommandStats::*field) {
+        header(metric, "counter", help);
+        for (int i = 0; i < NUM_COMMAND_STATS_; i++)
+        {
+            if (command_stats_[i].count.load() > 0)
+            {
+                text += metric + "{" + server_label + ",command=\"" + cmd_type_to_string(static_cast<CmdType>(i - 2)) +
+                        "\"} " + std::to_string((command_stats_[i].*field).load()) + "\n";
+            }
+        }
+    };
+    command_metric("rmq_requests_total", "Requests served by the background thread", &CommandStats::count);
+    command_metric("rmq_request_errors_total", "Requests answered with an error", &CommandStats::errors);
+    command_metric("rmq_request_bytes_in_total", "Bytes of the requests", &CommandStats::bytes_in);
+    command_metric("rmq_request_bytes_out_total", "Bytes of the replies", &CommandStats::bytes_out);
+    header("rmq_request_service_time_us", "histogram",
+           "Time from receiving a request to sending its reply, in microseconds");
+    for (int i = 0; i < NUM_COMMAND_STATS_; i++)
+    {
+        const Log2Histogram &histogram = command_stats_[i].service_time_us;
+        if (command_stats_[i].count.load() == 0)
+        {
+            continue;
+        }
+        std::string labels = server_label + ",command=\"" + cmd_type_to_string(static_cast<CmdType>(i - 2)) + "\"";
+        uint64_t cumulative = 0;
+        for (int bucket = 0; bucket < Log2Histogram::NUM_BUCKETS; bucket++)
+        {
+            uint64_t count = histogram.bucket_count(bucket);
+            if (count == 0)
+            {
+                continue;
+            }
+            cumulative += count;
+            // Buckets hold values below their upper bound, so the inclusive bound is one less
+            text += "rmq_request_service_time_us_bucket{" + labels + ",le=\"" +
+                    std::to_string(Log2Histogram::bucket_upper_bound(bucket) - 1) + "\"} " +
+                    std::to_string(cumulative) + "\n";
+        }
+        text += "rmq_request_service_time_us_bucket{" + labels + ",le=\"+Inf\"} " + std::to_string(histogram.count()) +
+                "\n";
+        text += "rmq_request_service_time_us_sum{" + labels + "} " + std::to_string(histogram.sum()) + "\n";
+        text += "rmq_request_service_time_us_count{" + labels + "} " + std::to_string(histogram.count()) + "\n";
+    }
+
+    for (const auto &entry : get_async_put_stats())
+    {
+        std::string metric = "rmq_async_put_" + entry.first;
+        bool is_gauge = entry.first == "queue_size" || entry.first == "max_queue_size" || entry.first == "capacity";
+        if (!is_gauge)
+        {
+            metric += "_total";
+        }
+        header(metric, is_gauge ? "gauge" : "counter", "Asynchronous put_data: " + entry.first);
+        text += metric + "{" + server_label + "} " + std::to_string(entry.second) + "\n";
+    }
+    return text;
+}
+
+void RMQServer::start_recording(const std::string &path, const std::vector<std::string> &topics,
+                                uint64_t max_queued_bytes)
+{
+    std::lock_guard<std::mutex> lock(recording_mutex_);
+    if (recorder_ != nullptr)
+    {
+        throw std::runtime_error("Already recording. Please call stop_recording first.");
+    }
+    std::vector<DataTopic *> data_topics;
+    if (topics.empty())
+    {
+        topics_.for_each([&data_topics](uint32_t, const std::string &, DataTopic &data_topic) {
+            data_topics.push_back(&data_topic);
+        });
+    }
+    for (const std::string &topic : topics)
+    {
+        DataTopic *data_topic = topics_.find(topic);
+        if (data_topic == nullptr)
+        {
+            throw std::invalid_argument("Cannot record unknown topic `" + topic + "`");
+        }
+        data_topics.push_back(data_topic);
+    }
+    std::vector<LogTopicInfo> infos;
+    for (DataTopic *data_topic : data_topics)
+    {
+        infos.push_back(data_topic->log_topic_info());
+    }
+    recorder_ = std::make_unique<LogWriter>(path, infos, max_queued_bytes);
+    for (uint32_t stream_id = 0; stream_id < data_topics.size(); stream_id++)
+    {
+        data_topics[stream_id]->set_recorder(recorder_.get(), stream_id);
+    }
+    recorded_topics_ = data_topics;
+    logger_->info("Recording {} topics to {}", data_topics.size(), path);
+}
+
+void RMQServer::stop_recording()
+{
+    std::lock_guard<std::mutex> lock(recording_mutex_);
+    if (recorder_ == nullptr)
+    {
+        return;
+    }
+    // Once detached, no put can reach the recorder any more
+    for (DataTopic *data_topic : recorded_topics_)
+    {
+        data_topic->set_recorder(nullptr, 0);
+    }
+    recorded_topics_.clear();
+    {
+        pybind11::gil_scoped_release release;
+        recorder_->close();
+    }
+    if (!recorder_->error().empty())
+    {
+        logger_->error("Recording failed: {}", recorder_->error());
+    }
+    logger_->info("Stopped recording after {} items. {} items were dropped.", recorder_->records_written(),
+                  recorder_->records_dropped());
+    recorder_.reset();
+}
+
+std::unordered_map<std::string, uint64_t> RMQServer::get_recording_stats()
+{
+    std::lock_guard<std::mutex> lock(recording_mutex_);
+    if (recorder_ == nullptr)
+    {
+        return {{"recording", 0}};
+    }
+    return {
+        {"recording", 1},
+        {"records_written", recorder_->records_written()},
+        {"bytes_written", recorder_->bytes_written()},
+        {"records_dropped", recorder_->records_dropped()},
+        {"queued_bytes", recorder_->queued_bytes()},
+        {"failed", !recorder_->error().empty()},
+    };
+}
+
+void RMQServer::start_replay(const std::string &path, const std::vector<std::string> &topics, double speed,
+                             std::optional<double> start_timestamp, bool loop, bool create_topics)
+{
+    std::lock_guard<std::mutex> lock(replay_mutex_);
+    if (replay_thread_.joinable())
+    {
+        if (replay_running_)
+        {
+            throw std::runtime_error("Already replaying. Please call stop_replay first.");
+        }
+        replay_thread_.join();
+    }
+    auto reader = std::make_shared<LogReader>(path);
+    std::vector<DataTopic *> stream_topics;
+    uint64_t num_replayed_topics = 0;
+    for (const LogTopicInfo &info : reader->topics())
+    {
+        if (!topics.empty() && std::find(topics.begin(), topics.end(), info.name) == topics.end())
+        {
+            stream_topics.push_back(nullptr);
+            continue;
+        }
+        if (topics_.find(info.name) == nullptr && create_topics)
+        {
+            add_topic_from_info_(info);
+        }
+        DataTopic *data_topic = topics_.find(info.name);
+        if (data_topic == nullptr)
+        {
+            logger_->warn("Topic `{}` of the log does not exist. Its items are not replayed.", info.name);
+        }
+        else
+        {
+            num_replayed_topics++;
+        }
+        stream_topics.push_back(data_topic);
+    }
+    uint64_t first_record = start_timestamp.has_value() ? reader->seek(start_timestamp.value()) : 0;
+    if (num_replayed_topics == 0 || first_record >= reader->size())
+    {
+        throw std::invalid_argument("Nothing to replay from " + path + ": " +
+                                    (num_replayed_topics == 0 ? "none of its topics are replayed"
+                                                              : "no records at or after the start timestamp"));
+    }
+    replay_records_ = 0;
+    replay_records_total_ = reader->size() - first_record;
+    replay_errors_ = 0;
+    replay_max_lag_us_ = 0;
+    replay_running_ = true;
+    replay_thread_ = std::thread(&RMQServer::replay_loop_, this, reader, stream_topics, speed, first_record, loop);
+    logger_->info("Replaying {} records of {} topics from {} at speed {}", reader->size() - first_record,
+                  num_replayed_topics, path, speed);
+}
+
+void RMQServer::replay_loop_(std::shared_ptr<LogReader> reader, std::vector<DataTopic *> stream_topics, double speed,
+                             uint64_t first_record, bool loop)
+{
+    // Due times are relative to the first replayed record
+    double first_timestamp = 0;
+    try
+    {
+        first_timestamp = first_record < reader->size() ? reader->record(first_record).timestamp : 0;
+    }
+    catch (const std::exception &e)
+    {
+        logger_->error("Failed to replay log: {}", e.what());
+        end_replay_();
+        return;
+    }
+    uint64_t records_in_pass;
+    do
+    {
+        int64_t start_time_us = steady_clock_us();
+        records_in_pass = 0;
+        for (uint64_t index = first_record; index < reader->size() && replay_running_; index++)
+        {
+            try
+            {
+                LogReader::Record record = reader->record(index);
+                DataTopic *data_topic = stream_topics[record.stream_id];
+                if (data_topic == nullptr)
+                {
+                    continue;
+                }
+                if (speed > 0)
+                {
+                    // Items with an out-of-order timestamp are due in the past and put right away
+                    int64_t due_us =
+                        start_time_us + static_cast<int64_t>((record.timestamp - first_timestamp) / speed * 1e6);
+                    // Sleep until shortly before the due time (stop_replay wakes the sleep), and spin only for the
+                    // last stretch, which sleeping would overshoot.
+                    int64_t now_us = steady_clock_us();
+                    if (due_us - now_us > REPLAY_SPIN_US_)
+                    {
+                        std::unique_lock<std::mutex> lock(replay_wait_mutex_);
+                        replay_wait_cv_.wait_until(lock,
+                                                   std::chrono::steady_clock::time_point(
+                                                       std::chrono::microseconds(due_us - REPLAY_SPIN_US_)),
+                                                   [this]() { return !replay_running_; });
+                        now_us = steady_clock_us();
+                    }
+                    while (replay_running_ && now_us < due_us)
+                    {
+                        now_us = steady_clock_us();
+                    }
+                    if (!replay_running_)
+                    {
+                        break;
+                    }
+                    uint64_t lag_us = static_cast<uint64_t>(now_us - due_us);
+                    uint64_t max_lag_us = replay_max_lag_us_.load();
+                    while (lag_us > max_lag_us && !replay_max_lag_us_.compare_exchange_weak(max_lag_us, lag_us))
+                    {
+                    }
+                }
+                if (data_topic->is_tensor_topic())
+                {
+                    data_topic->put_tensor(record.data, record.size, get_timestamp());
+                }
+                else if (data_topic->is_shm_topic())
+                {
+                    // Large items go straight into the shared memory ring
+                    data_topic->copy_data_to_shm(record.data, record.size, get_timestamp());
+                }
+                else
+                {
+                    data_topic->add_data_ptr(std::make_shared<Bytes>(record.data, record.size), get_timestamp());
+                }
+                replay_records_++;
+                records_in_pass++;
+            }
+            catch (const std::exception &e)
+            {
+                replay_errors_++;
+                logger_->debug("Failed to replay record {}: {}", index, e.what());
+            }
+        }
+        if (loop && records_in_pass == 0 && replay_running_)
+        {
+            // Looping over a range where every record is filtered out or fails would spin without ever sleeping
+            logger_->warn("No record of the log could be replayed. Stopping the replay loop.");
+        }
+    } while (loop && replay_running_ && records_in_pass > 0);
+    end_replay_();
+}
+
+void RMQServer::end_replay_()
+{
+    std::lock_guard<std::mutex> lock(replay_wait_mutex_);
+    replay_running_ = false;
+    replay_wait_cv_.notify_all();
+}
+
+void RMQServer::stop_replay()
+{
+    std::lock_guard<std::mutex> lock(replay_mutex_);
+    end_replay_();
+    if (replay_thread_.joinable())
+    {
+        replay_thread_.join();
+    }
+}
+
+bool RMQServer::wait_for_replay(double timeout_s)
+{
+    pybind11::gil_scoped_release release;
+    std::unique_lock<std::mutex> lock(replay_wait_mutex_);
+    if (timeout_s < 0)
+    {
+        replay_wait_cv_.wait(lock, [this]() { return !replay_running_; });
+        return true;
+    }
+    return replay_wait_cv_.wait_for(lock, std::chrono::duration<double>(timeout_s),
+                                    [this]() { return !replay_running_; });
+}
+
+std::unordered_map<std::string, uint64_t> RMQServer::get_replay_stats()
+{
+    return {
+        {"running", replay_running_.load()},
+        {"records_replayed", replay_records_.load()},
+        {"records_total", replay_records_total_.load()},
+        {"errors", replay_errors_.load()},
+        {"max_lag_us", replay_max_lag_us_.load()},
+    };
+}
+
+void RMQServer::start_relay(const std::string &upstream_endpoint, const std::vector<std::string> &topics,
+                            double poll_interval_s, double timeout_s)
+{
+    if (upstream_endpoint.find("tcp://") != 0 && upstream_endpoint.find("ipc://") != 0)
+    {
+        throw std::invalid_argument("Upstream endpoint must start with tcp:// or ipc://");
+    }
+    if (topics.empty())
+    {
+        throw std::invalid_argument("Please specify the topics to relay");
+    }
+    for (const std::string &topic : topics)
+    {
+        if (topics_.find(topic) == nullptr)
+        {
+            throw std::invalid_argument("Topic `" + topic +
+                                        "` not found. Please first add the topic that the relay republishes into.");
+        }
+    }
+    std::lock_guard<std::mutex> lock(relays_mutex_);
+    if (relays_.count(upstream_endpoint) > 0)
+    {
+        throw std::runtime_error("Already relaying from " + upstream_endpoint +
+                                 ". Please call stop_relay first.");
+    }
+    auto relay = std::make_unique<Relay>();
+    relay->upstream_endpoint = upstream_endpoint;
+    relay->topics = topics;
+    relay->poll_interval_s = poll_interval_s;
+    relay->timeout_s = timeout_s;
+    relay->thread = std::thread(&RMQServer::relay_loop_, this, relay.get());
+    relays_[upstream_endpoint] = std::move(relay);
+    logger_->info("Relaying {} topics from {} every {}s", topics.size(), upstream_endpoint, poll_interval_s);
+}
+
+void RMQServer::stop_relay(const std::string &upstream_endpoint)
+{
+    std::lock_guard<std::mutex> lock(relays_mutex_);
+    for (auto it = relays_.begin(); it != relays_.end();)
+    {
+        if (!upstream_endpoint.empty() && it->first != upstream_endpoint)
+        {
+            ++it;
+            continue;
+        }
+        it->second->running = false;
+        it->second->thread.join();
+        logger_->info("Stopped relaying from {}", it->first);
+        it = relays_.erase(it);
+    }
+}
+
+std::unordered_map<std::string, uint64_t> RMQServer::get_relay_stats()
+{
+    uint64_t num_relays;
+    {
+        std::lock_guard<std::mutex> lock(relays_mutex_);
+        num_relays = relays_.size();
+    }
+    return {
+        {"relays", num_relays},
+        {"items_relayed", relay_items_.load()},
+        {"bytes_relayed", relay_bytes_.load()},
+        {"requests", relay_requests_.load()},
+        {"timeouts", relay_timeouts_.load()},
+        {"errors", relay_errors_.load()},
+    };
+}
+
+void RMQServer::relay_loop_(Relay *relay)
+{
+    auto connect = [this, relay](zmq::socket_t &socket) {
+        // A REQ socket that is waiting for a reply cannot send again, so it is replaced after a timeout
+        socket = zmq::socket_t(context_, zmq::socket_type::req);
+        int linger_value = 0;
+        socket.setsockopt(ZMQ_LINGER, &linger_value, sizeof(linger_value));
+        socket.connect(relay->upstream_endpoint);
+    };
+    zmq::socket_t socket;
+    connect(socket);
+
+    size_t num_topics = relay->topics.size();
+    std::vector<DataTopic *> data_topics;
+    for (const std::string &topic : relay->topics)
+    {
+        data_topics.push_back(topics_.find(topic));
+    }
+    // Upstream put sequence of the newest item relayed per topic, valid within the upstream session
+    std::vector<uint64_t> cursors(num_topics, 0);
+    uint32_t upstream_session = 0;
+    std::vector<std::string> last_errors(num_topics);
+    // Payloads are requested inline, since upstream is usually on another host, and compressed if it is configured to
+    std::string request_flags(1, static_cast<char>(INLINE_SHM_DATA_FLAG | compression_accept_flags()));
+    bool compression_negotiated = is_compression_negotiated(compression_accept_flags());
+    int64_t poll_interval_us = static_cast<int64_t>(relay->poll_interval_s * 1e6);
+
+    while (relay->running)
+    {
+        int64_t poll_start_us = steady_clock_us();
+        for (size_t i = 0; i < num_topics && relay->running; i++)
+        {
+            RMQMessage request(relay->topics[i], CmdType::PEEK_DATA, get_timestamp(),
+                               int32_to_bytes(0) + request_flags + uint64_to_bytes(cursors[i]));
+            std::string serialized = request.serialize();
+            socket.send(zmq::message_t(serialized.data(), serialized.size()), zmq::send_flags::none);
+            relay_requests_++;
+            zmq::pollitem_t items[] = {{socket, 0, ZMQ_POLLIN, 0}};
+            zmq::poll(&items[0], 1, static_cast<long>(relay->timeout_s * 1000));
+            if (!(items[0].revents & ZMQ_POLLIN))
+            {
+                relay_timeouts_++;
+                logger_->debug("Relay request to {} timed out", relay->upstream_endpoint);
+                socket.close();
+                connect(socket);
+                break;
+            }
+            zmq::message_t reply;
+            socket.recv(reply);
+            double receive_timestamp = get_timestamp();
+            try
+            {
+                RMQMessage reply_message(std::string(reply.data<char>(), reply.data<char>() + reply.size()));
+                if (reply_message.cmd() != CmdType::PEEK_DATA)
+                {
+                    throw std::runtime_error("Upstream replied " + cmd_type_to_string(reply_message.cmd()) + ": " +
+                                             reply_message.data_str());
+                }
+                std::vector<TimedPtr> reply_ptrs = reply_message.data_ptrs();
+                const std::string *cursor_item = reply_ptrs.empty() ? nullptr : std::get<0>(reply_ptrs.back()).get();
+                if (cursor_item == nullptr || cursor_item->size() != sizeof(uint32_t) + sizeof(uint64_t))
+                {
+                    throw std::runtime_error("Upstream reply does not end with a cursor");
+                }
+                uint32_t session = bytes_to_uint32(cursor_item->substr(0, sizeof(uint32_t)));
+                uint64_t cursor = bytes_to_uint64(cursor_item->substr(sizeof(uint32_t)));
+                reply_ptrs.pop_back();
+                if (session != upstream_session)
+                {
+                    // Upstream was (re)started and numbers its items anew. The reply was filtered by a cursor of the
+                    // previous session, so every topic is requested again from its first item.
+                    upstream_session = session;
+                    std::fill(cursors.begin(), cursors.end(), 0);
+                    continue;
+                }
+                cursors[i] = cursor;
+                double clock_offset_s = receive_timestamp - reply_message.timestamp();
+                for (const TimedPtr &ptr : reply_ptrs)
+                {
+                    BytesPtr data_ptr = std::get<0>(ptr);
+                    if (compression_negotiated && is_compressed_data(*data_ptr))
+                    {
+                        BytesPtr decompressed = std::make_shared<Bytes>(get_decompressed_size(*data_ptr), '\0');
+                        decompress_data(*data_ptr, &(*decompressed)[0], decompressed->size());
+                        data_ptr = decompressed;
+                    }
+                    double timestamp = std::get<1>(ptr) + clock_offset_s;
+                    if (data_topics[i]->is_shm_topic() || data_topics[i]->is_tensor_topic())
+                    {
+                        data_topics[i]->copy_data_to_shm(data_ptr->data(), data_ptr->size(), timestamp);
+                    }
+                    else
+                    {
+                        data_topics[i]->add_data_ptr(data_ptr, timestamp);
+                    }
+                    relay_items_++;
+                    relay_bytes_ += data_ptr->size();
+                }
+                last_errors[i].clear();
+            }
+            catch (const std::exception &e)
+            {
+                relay_errors_++;
+                if (last_errors[i] != e.what())
+                {
+                    last_errors[i] = e.what();
+                    logger_->warn("Failed to relay topic `{}` from {}: {}", relay->topics[i], relay->upstream_endpoint,
+                                  e.what());
+                }
+            }
+        }
+        // Sleep in short steps, so that stop_relay does not wait for a long poll interval
+        while (relay->running)
+        {
+            int64_t remaining_us = poll_start_us + poll_interval_us - steady_clock_us();
+            if (remaining_us <= 0)
+            {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(std::min<int64_t>(remaining_us, 10000)));
+        }
+    }
+    socket.close();
+}
+
+void RMQServer::set_trace_export(const std::string &path)
+{
+    std::call_once(trace_export_thread_started_,
+                   [this]() { trace_export_thread_ = std::thread(&RMQServer::trace_export_loop_, this); });
+    // Traces queued so far still belong to the previous file
+    trace_export_enabled_ = false;
+    while (trace_export_processed_.load() < trace_export_enqueued_.load())
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    std::lock_guard<std::mutex> lock(trace_export_mutex_);
+    close_trace_export_();
+    if (path.empty())
+    {
+        return;
+    }
+    trace_export_file_.open(path, std::ios::out | std::ios::trunc);
+    if (!trace_export_file_)
+    {
+        throw std::runtime_error("Failed to open trace export file " + path);
+    }
+    // JSON array format of the trace event format. Viewers also accept the file if the closing bracket is missing
+    // because the server did not shut down cleanly.
+    trace_export_file_ << "[";
+    trace_export_file_.flush();
+    trace_export_empty_ = true;
+    trace_export_named_topics_.clear();
+    trace_export_enabled_ = true;
+    logger_->info("Exporting request traces to {}", path);
+}
+
+void RMQServer::close_trace_export_()
+{
+    if (trace_export_file_.is_open())
+    {
+        trace_export_file_ << "\n]\n";
+        trace_export_file_.close();
+    }
+}
+
+void RMQServer::export_request_trace_(const std::string &topic, const RequestTrace &trace)
+{
+    if (!trace_export_enabled_)
+    {
+        return;
+    }
+    // One track per topic. The file is written by trace_export_thread_ so that the background thread does no file I/O.
+    trace_export_enqueued_++;
+    trace_export_queue_.push({topic, topics_.find_id(topic), trace});
+}
+
+void RMQServer::trace_export_loop_()
+{
+    TraceExportItem item;
+    while (true)
+    {
+        if (!trace_export_queue_.pop(item))
+        {
+            {
+                // Flushed once per batch instead of once per trace
+                std::lock_guard<std::mutex> lock(trace_export_mutex_);
+                if (trace_export_file_.is_open())
+                {
+                    trace_export_file_.flush();
+                }
+            }
+            if (!running_)
+            {
+                break;
+            }
+            // Woken by the next push, or by the destructor
+            trace_export_queue_.wait(std::chrono::seconds(1));
+            continue;
+        }
+        write_request_trace_(item);
+        trace_export_processed_++;
+    }
+}
+
+void RMQServer::write_request_trace_(const TraceExportItem &item)
+{
+    std::lock_guard<std::mutex> lock(trace_export_mutex_);
+    if (!trace_export_file_.is_open())
+    {
+        return;
+    }
+    // The track of a topic is named after the topic by a metadata event the first time it appears
+    static const int64_t pid = getpid();
+    const RequestTrace &trace = item.trace;
+    auto write_event = [this](const std::string &event) {
+        trace_export_file_ << (trace_export_empty_ ? "\n" : ",\n") << event;
+        trace_export_empty_ = false;
+    };
+    if (trace_export_named_topics_.insert(item.tid).second)
+    {
+        write_event("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" + std::to_string(pid) +
+                    ",\"tid\":" + std::to_string(item.tid) + ",\"args\":{\"name\":\"" + json_escape(item.topic) +
+                    "\"}}");
+    }
+    auto write_stage = [&](const char *name, int64_t begin_us, int64_t end_us) {
+        write_event(std::string("{\"name\":\"") + name + "\",\"cat\":\"request_with_data\",\"ph\":\"X\",\"ts\":" +
+                    std::to_string(begin_us - steady_clock_start_time_us_) +
+                    ",\"dur\":" + std::to_string(end_us - begin_us) + ",\"pid\":" + std::to_string(pid) +
+                    ",\"tid\":" + std::to_string(item.tid) + "}");
+    };
+    write_stage("wait_for_request", trace.received_us, trace.dispatched_us);
+    write_stage("handler", trace.dispatched_us, trace.replied_us);
+    write_stage("reply", trace.replied_us, trace.encoded_us);
+}
+
+double RMQServer::get_timestamp()
+{
+    return static_cast<double>(steady_clock_us() - steady_clock_start_time_us_) / 1e6;
+}
+
+void RMQServer::reset_start_time(int64_t system_time_us)
+{
+    logger_->info("Resetting start time. Will clear all data stored before this time");
+    topics_.for_each([](uint32_t, const std::string &, DataTopic &data_topic) { data_topic.clear_data(); });
+    // Use system time to make sure different servers and clients are synchronized
+    steady_clock_start_time_us_ = steady_clock_us() + (system_time_us - system_clock_us());
+    topics_.for_each([this](uint32_t, const std::string &, DataTopic &data_topic) {
+        data_topic.set_clock_origin_us(steady_clock_start_time_us_);
+    });
+    // Clear the cache
+    cached_reply_data_.clear();
+    last_request_timestamp_.clear();
+    cached_consume_reply_.clear();
+    last_consume_timestamp_.clear();
+}
+
+std::vector<TimedPtr> RMQServer::peek_data_ptrs_(const std::string &topic, int32_t n)
+{
+    DataTopic *data_topic = topics_.find(topic);
+    if (data_topic == nullptr)
+    {
+        logger_->warn("Requested last k data for unknown topic {}. Please first call add_topic to add it into the "
+                      "recorded topics.",
+                      topic);
+        return {};
+    }
+    return data_topic->peek_data_ptrs(n);
+}
+
+std::vector<TimedPtr> RMQServer::pop_data_ptrs_(const std::string &topic, int32_t n)
+{
+    DataTopic *data_topic = topics_.find(topic);
+    if (data_topic == nullptr)
+    {
         logger_->warn(
             "Requested data for unknown topic {}. Please first call add_topic to add it into the server topics.",
             topic);
         return {};
     }
-    return it->second.pop_data_ptrs(n);
+    return data_topic->pop_data_ptrs(n);
+}
+
+void RMQServer::set_chunking(uint64_t chunk_size_bytes, uint64_t max_pending_upload_bytes)
+{
+    if (chunk_size_bytes == 0 || chunk_size_bytes > std::numeric_limits<uint32_t>::max())
+    {
+        throw std::invalid_argument("Chunk size must be between 1 byte and 4 GB");
+    }
+    chunk_size_bytes_ = chunk_size_bytes;
+    max_pending_upload_bytes_ = max_pending_upload_bytes;
+}
+
+std::vector<TimedPtr> RMQServer::stub_large_items_(const std::vector<TimedPtr> &ptrs)
+{
+    // Only called from the background thread, like the other transfer bookkeeping.
+    std::vector<TimedPtr> stubbed_ptrs;
+    stubbed_ptrs.reserve(ptrs.size());
+    double now = get_timestamp();
+    for (const TimedPtr &ptr : ptrs)
+    {
+        const BytesPtr &data_ptr = std::get<0>(ptr);
+        if (data_ptr->size() <= chunk_size_bytes_.load() || ShmDescriptor::is_shm_descriptor(*data_ptr) ||
+            SharedMemoryDataInfo::is_shm_data_info(*data_ptr))
+        {
+            stubbed_ptrs.push_back(ptr);
+            continue;
+        }
+        uint64_t transfer_id = next_outgoing_transfer_id_++;
+        OutgoingTransfer transfer;
+        transfer.data = data_ptr;
+        transfer.last_active_time = now;
+        outgoing_transfers_[transfer_id] = std::move(transfer);
+        ChunkedItemStub stub{ChunkedItemStub::MAGIC, 0, transfer_id, data_ptr->size()};
+        stubbed_ptrs.push_back({std::make_shared<Bytes>(stub.serialize()), std::get<1>(ptr)});
+    }
+    return stubbed_ptrs;
+}
+
+void RMQServer::process_put_chunk_(RMQMessage &message, DataTopic *data_topic, const std::string &topic)
+{
+    const std::string &data_str = message.data_str();
+    PutChunkHeader header;
+    std::string error_message;
+    bool missing_query = false;
+    if (data_str.size() < sizeof(PutChunkHeader))
+    {
+        error_message = "Chunk is too short";
+    }
+    else
+    {
+        std::memcpy(&header, data_str.data(), sizeof(PutChunkHeader));
+        uint64_t chunk_start = static_cast<uint64_t>(header.chunk_index) * header.chunk_size_bytes;
+        uint64_t expected_size =
+            chunk_start < header.total_size_bytes
+                ? std::min<uint64_t>(header.chunk_size_bytes, header.total_size_bytes - chunk_start)
+                : 0;
+        missing_query = header.chunk_size_bytes != 0 && header.total_size_bytes != 0 &&
+                        data_str.size() == sizeof(PutChunkHeader) &&
+                        header.chunk_index ==
+                            (header.total_size_bytes + header.chunk_size_bytes - 1) / header.chunk_size_bytes;
+        if (!missing_query && (header.chunk_size_bytes == 0 || expected_size == 0 ||
+                               data_str.size() - sizeof(PutChunkHeader) != expected_size))
+        {
+            error_message = "Invalid chunk " + std::to_string(header.chunk_index) + " of transfer " +
+                            std::to_string(header.transfer_id);
+        }
+        else if (!data_topic->accepts_item_size(header.total_size_bytes))
+        {
+            error_message = "Data of " + std::to_string(header.total_size_bytes) +
+                            " bytes does not match the slot size of tensor topic `" + topic + "`";
+        }
+        else if (header.total_size_bytes > max_pending_upload_bytes_.load())
+        {
+            error_message = "Data of " + std::to_string(header.total_size_bytes) +
+                            " bytes is larger than the maximum pending upload size " +
+                            std::to_string(max_pending_upload_bytes_.load());
+        }
+    }
+    if (!error_message.empty())
+    {
+        logger_->error(error_message);
+        RMQMessage reply(topic, CmdType::ERROR, get_timestamp(), error_message);
+        send_reply_(message, reply);
+        return;
+    }
+    if (missing_query)
+    {
+        reply_missing_chunks_(message, header, topic);
+        return;
+    }
+
+    uint32_t num_missing = 0;
+    uint32_t credits = 0;
+    if (std::find(completed_transfer_ids_.begin(), completed_transfer_ids_.end(), header.transfer_id) !=
+        completed_transfer_ids_.end())
+    {
+        // A resent chunk of a transfer that is already complete
+    }
+    else
+    {
+        auto transfer_it = incoming_transfers_.find(header.transfer_id);
+        if (transfer_it == incoming_transfers_.end())
+        {
+            if (pending_upload_bytes_ + header.total_size_bytes > max_pending_upload_bytes_.load())
+            {
+                // No credits: the client should retry later
+                RMQMessage reply(topic, CmdType::PUT_CHUNK, get_timestamp(), uint32_to_bytes(0) + uint32_to_bytes(1));
+                send_reply_(message, reply);
+                return;
+            }
+            IncomingTransfer transfer;
+            transfer.topic = topic;
+            transfer.data = std::make_shared<Bytes>(header.total_size_bytes, '\0');
+            transfer.num_chunks = (header.total_size_bytes + header.chunk_size_bytes - 1) / header.chunk_size_bytes;
+            transfer.received.assign(transfer.num_chunks, false);
+            transfer.num_missing = transfer.num_chunks;
+            transfer.chunk_size_bytes = header.chunk_size_bytes;
+            transfer.timestamp = header.timestamp;
+            transfer_it = incoming_transfers_.insert({header.transfer_id, std::move(transfer)}).first;
+            pending_upload_bytes_ += header.total_size_bytes;
+        }
+        IncomingTransfer &transfer = transfer_it->second;
+        if (transfer.chunk_size_bytes != header.chunk_size_bytes || transfer.data->size() != header.total_size_bytes)
+        {
+            RMQMessage reply(topic, CmdType::ERROR, get_timestamp(), "Chunk does not match its transfer");
+            send_reply_(message, reply);
+            return;
+        }
+        transfer.last_active_time = get_timestamp();
+        if (!transfer.received[header.chunk_index])
+        {
+            std::memcpy(&(*transfer.data)[static_cast<uint64_t>(header.chunk_index) * header.chunk_size_bytes],
+                        data_str.data() + sizeof(PutChunkHeader), data_str.size() - sizeof(PutChunkHeader));
+            transfer.received[header.chunk_index] = true;
+            transfer.num_missing--;
+        }
+        num_missing = transfer.num_missing;
+        credits = std::min<uint32_t>(MAX_CHUNK_CREDITS_, num_missing);
+        if (num_missing == 0)
+        {
+            // Stored like the payload of a single PUT_DATA request
+            data_topic->add_data_ptr(transfer.data, transfer.timestamp);
+            pending_upload_bytes_ -= transfer.data->size();
+            incoming_transfers_.erase(transfer_it);
+            completed_transfer_ids_.push_back(header.transfer_id);
+            if (completed_transfer_ids_.size() > 64)
+            {
+                completed_transfer_ids_.pop_front();
+            }
+        }
+    }
+    RMQMessage reply(topic, CmdType::PUT_CHUNK, get_timestamp(), uint32_to_bytes(credits) + uint32_to_bytes(num_missing));
+    send_reply_(message, reply);
+}
+
+void RMQServer::reply_missing_chunks_(RMQMessage &message, const PutChunkHeader &header, const std::string &topic)
+{
+    uint32_t num_chunks = header.chunk_index;
+    std::string missing_chunks;
+    if (std::find(completed_transfer_ids_.begin(), completed_transfer_ids_.end(), header.transfer_id) ==
+        completed_transfer_ids_.end())
+    {
+        // A transfer the server does not know has expired or never started, so every chunk is missing
+        auto transfer_it = incoming_transfers_.find(header.transfer_id);
+        if (transfer_it != incoming_transfers_.end() && transfer_it->second.num_chunks != num_chunks)
+        {
+            transfer_it = incoming_transfers_.end();
+        }
+        for (uint32_t i = 0; i < num_chunks; i++)
+        {
+            if (transfer_it == incoming_transfers_.end() || !transfer_it->second.received[i])
+            {
+                missing_chunks.append(uint32_to_bytes(i));
+            }
+        }
+    }
+    uint32_t num_missing = static_cast<uint32_t>(missing_chunks.size() / sizeof(uint32_t));
+    uint32_t credits = std::min<uint32_t>(MAX_CHUNK_CREDITS_, num_missing);
+    RMQMessage reply(topic, CmdType::PUT_CHUNK, get_timestamp(),
+                     uint32_to_bytes(credits) + uint32_to_bytes(num_missing) + missing_chunks);
+    send_reply_(message, reply);
+}
+
+void RMQServer::process_fetch_chunk_(RMQMessage &message, const std::string &topic)
+{
+    const std::string &data_str = message.data_str();
+    std::string error_message;
+    std::string chunk;
+    FetchChunkRequest request;
+    if (data_str.size() != sizeof(FetchChunkRequest))
+    {
+        error_message = "Invalid chunk request";
+    }
+    else
+    {
+        std::memcpy(&request, data_str.data(), sizeof(FetchChunkRequest));
+        auto transfer_it = outgoing_transfers_.find(request.transfer_id);
+        if (transfer_it == outgoing_transfers_.end())
+        {
+            error_message = "Transfer " + std::to_string(request.transfer_id) + " expired. Please request the data again.";
+        }
+        else
+        {
+            const Bytes &data = *transfer_it->second.data;
+            uint64_t chunk_start = static_cast<uint64_t>(request.chunk_index) * request.chunk_size_bytes;
+            if (request.chunk_size_bytes == 0 || chunk_start >= data.size())
+            {
+                error_message = "Invalid chunk " + std::to_string(request.chunk_index) + " of transfer " +
+                                std::to_string(request.transfer_id);
+            }
+            else
+            {
+                chunk = data.substr(chunk_start, request.chunk_size_bytes);
+                OutgoingTransfer &transfer = transfer_it->second;
+                transfer.last_active_time = get_timestamp();
+                if (transfer.chunk_size_bytes != request.chunk_size_bytes)
+                {
+                    transfer.chunk_size_bytes = request.chunk_size_bytes;
+                    transfer.num_missing = static_cast<uint32_t>(
+                        (data.size() + request.chunk_size_bytes - 1) / request.chunk_size_bytes);
+                    transfer.served.assign(transfer.num_missing, false);
+                }
+                if (!transfer.served[request.chunk_index])
+                {
+                    transfer.served[request.chunk_index] = true;
+                    --transfer.num_missing;
+                }
+                // Stubbed items are copies made for one reply, so free them as soon as the client has every chunk
+                // instead of keeping them until they time out.
+                if (transfer.num_missing == 0)
+                {
+                    outgoing_transfers_.erase(transfer_it);
+                }
+            }
+        }
+    }
+    if (!error_message.empty())
+    {
+        logger_->error(error_message);
+        RMQMessage reply(topic, CmdType::ERROR, get_timestamp(), error_message);
+        send_reply_(message, reply);
+        return;
+    }
+    RMQMessage reply(topic, CmdType::FETCH_CHUNK, get_timestamp(), chunk);
+    send_reply_(message, reply);
+}
+
+void RMQServer::expire_transfers_()
+{
+    double now = get_timestamp();
+    for (auto it = incoming_transfers_.begin(); it != incoming_transfers_.end();)
+    {
+        if (now - it->second.last_active_time > TRANSFER_TIMEOUT_S_)
+        {
+            logger_->warn("Dropping incomplete upload to topic {} ({} of {} chunks missing)", it->second.topic,
+                          it->second.num_missing, it->second.num_chunks);
+            pending_upload_bytes_ -= it->second.data->size();
+            it = incoming_transfers_.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    for (auto it = outgoing_transfers_.begin(); it != outgoing_transfers_.end();)
+    {
+        it = now - it->second.last_active_time > TRANSFER_TIMEOUT_S_ ? outgoing_transfers_.erase(it) : std::next(it);
+    }
 }
 
-bool RMQServer::exists_topic_(const std::string &topic)
+std::string RMQServer::send_reply_(const RMQMessage &request, RMQMessage &reply)
 {
-    std::lock_guard<std::mutex> lock(data_topic_mutex_);
-    return data_topics_.find(topic) != data_topics_.end();
+    // Answer in the same form as the request, so that id-addressed requests also get compact replies.
+    if (request.has_topic_id())
+    {
+        reply.set_topic_id(request.topic_id(), request.server_session());
+    }
+    std::string reply_data = reply.serialize();
+    socket_.send(zmq::message_t(reply_data.data(), reply_data.size()), zmq::send_flags::none);
+    reply_bytes_ += reply_data.size();
+    reply_is_error_ = reply_is_error_ || reply.cmd() == CmdType::ERROR || reply.cmd() == CmdType::STALE_TOPIC_ID;
+    return reply_data;
 }
 
 void RMQServer::process_request_(RMQMessage &message)
 {
-    // Check if the topic is already in the data_topics_
-    if (!exists_topic_(message.topic()) && message.cmd() != CmdType::GET_TOPIC_STATUS)
+    if (message.cmd() == CmdType::HANDSHAKE)
+    {
+        // Tell the client whether it can open the shared memory segments of this server.
+        bool shares_host = message.data_str() == shm_host_token_;
+        logger_->debug("Handshake from client `{}`: {}", message.topic(), shares_host ? "local" : "remote");
+        RMQMessage reply(message.topic(), CmdType::HANDSHAKE, get_timestamp(), int32_to_bytes(shares_host));
+        send_reply_(message, reply);
+        return;
+    }
+    if (message.cmd() == CmdType::GET_STATS)
+    {
+        std::string stats = message.data_str() == "prometheus" ? get_stats_text() : stats_json_();
+        RMQMessage reply(message.topic(), CmdType::GET_STATS, get_timestamp(), stats);
+        send_reply_(message, reply);
+        return;
+    }
+    if (message.cmd() == CmdType::SYNCHRONIZE_TIME)
+    {
+        // NTP-style exchange: the reply carries the time the request was received, and its own timestamp is the time
+        // it was sent.
+        double received_timestamp = static_cast<double>(request_received_us_ - steady_clock_start_time_us_) / 1e6;
+        RMQMessage reply(message.topic(), CmdType::SYNCHRONIZE_TIME, get_timestamp(),
+                         double_to_bytes(received_timestamp));
+        send_reply_(message, reply);
+        return;
+    }
+    if (message.cmd() == CmdType::RESOLVE_TOPIC)
+    {
+        // Reply with the topic id (-1 if the topic does not exist yet) and the session it is valid for. For shared
+        // memory topics, also send the segment id and name that the descriptors of this topic refer to.
+        int64_t topic_id = topics_.find_id(message.topic());
+        std::string resolve_str = int32_to_bytes(static_cast<int32_t>(topic_id)) + uint32_to_bytes(session_id_);
+        DataTopic *data_topic = topic_id < 0 ? nullptr : topics_.find(static_cast<uint32_t>(topic_id));
+        if (data_topic != nullptr && data_topic->is_shm_topic())
+        {
+            resolve_str += uint32_to_bytes(data_topic->shm_segment_id()) + data_topic->shm_name();
+        }
+        RMQMessage reply(message.topic(), CmdType::RESOLVE_TOPIC, get_timestamp(), resolve_str);
+        send_reply_(message, reply);
+        return;
+    }
+
+    // Look up the topic once per request. Requests addressed by id index the registry directly.
+    DataTopic *data_topic = nullptr;
+    const std::string *topic = &message.topic();
+    if (message.has_topic_id())
+    {
+        if (message.server_session() == session_id_)
+        {
+            data_topic = topics_.find(message.topic_id());
+        }
+        if (data_topic == nullptr)
+        {
+            logger_->debug("Received stale topic id {}. Asking the client to resolve it again.", message.topic_id());
+            // The topic name is unknown here; the reply is addressed by the id of the request instead.
+            RMQMessage reply("stale", CmdType::STALE_TOPIC_ID, get_timestamp(),
+                             "Topic id " + std::to_string(message.topic_id()) +
+                                 " was not issued by this server. Please resolve the topic again.");
+            send_reply_(message, reply);
+            return;
+        }
+        topic = &topics_.name(message.topic_id());
+    }
+    else
+    {
+        data_topic = topics_.find(message.topic());
+    }
+
+    // Check if the topic is already registered
+    if (data_topic == nullptr && message.cmd() != CmdType::GET_TOPIC_STATUS)
     {
         std::string error_message =
-            "Topic `" + message.topic() + "` not found. Please first call add_topic to add it into the server topics.";
-        RMQMessage reply(message.topic(), CmdType::ERROR, get_timestamp(), error_message);
-        std::string reply_data = reply.serialize();
+            "Topic `" + *topic + "` not found. Please first call add_topic to add it into the server topics.";
+        RMQMessage reply(*topic, CmdType::ERROR, get_timestamp(), error_message);
         logger_->error(error_message);
-        socket_.send(zmq::message_t(reply_data.data(), reply_data.size()), zmq::send_flags::none);
+        send_reply_(message, reply);
         return;
     }
     switch (message.cmd())
     {
     case CmdType::PEEK_DATA:
     case CmdType::POP_DATA: {
+        // Data is the number of items, optionally followed by a flags byte from clients on another host and, for
+        // PEEK_DATA, the put sequence after which items are returned
         std::string error_message = "";
-        if (message.data_str().length() != sizeof(int32_t))
+        size_t after_sequence_size = sizeof(int32_t) + 1 + sizeof(uint64_t);
+        if (message.data_str().length() != sizeof(int32_t) && message.data_str().length() != sizeof(int32_t) + 1 &&
+            (message.cmd() != CmdType::PEEK_DATA || message.data_str().length() != after_sequence_size))
         {
             error_message.append("Data length should be the same as an integer, but got ");
             error_message.append(std::to_string(message.data_str().length()));
@@ -341,30 +2002,97 @@ void RMQServer::process_request_(RMQMessage &message)
         if (!error_message.empty())
         {
             logger_->error(error_message);
-            RMQMessage reply(message.topic(), CmdType::ERROR, get_timestamp(), error_message);
-            std::string reply_data = reply.serialize();
-            socket_.send(zmq::message_t(reply_data.data(), reply_data.size()), zmq::send_flags::none);
+            RMQMessage reply(*topic, CmdType::ERROR, get_timestamp(), error_message);
+            send_reply_(message, reply);
             break;
         }
-        int32_t n = bytes_to_int32(message.data_str());
-        std::vector<TimedPtr> ptrs = message.cmd() == CmdType::PEEK_DATA ? peek_data_ptrs_(message.topic(), n)
-                                                                         : pop_data_ptrs_(message.topic(), n);
-        RMQMessage reply(message.topic(), message.cmd(), get_timestamp(), ptrs);
-        std::string reply_data = reply.serialize();
-        socket_.send(zmq::message_t(reply_data.data(), reply_data.size()), zmq::send_flags::none);
+        std::string data_str = message.data_str();
+        int32_t n = bytes_to_int32(data_str.substr(0, sizeof(int32_t)));
+        uint8_t request_flags = data_str.size() > sizeof(int32_t) ? static_cast<uint8_t>(data_str[sizeof(int32_t)]) : 0;
+        std::vector<TimedPtr> ptrs;
+        bool after_sequence = data_str.size() == after_sequence_size;
+        uint64_t cursor = 0;
+        if (after_sequence)
+        {
+            ptrs = data_topic->peek_data_ptrs_after(bytes_to_uint64(data_str.substr(sizeof(int32_t) + 1)), n, cursor);
+        }
+        else
+        {
+            ptrs = message.cmd() == CmdType::PEEK_DATA ? data_topic->peek_data_ptrs(n) : data_topic->pop_data_ptrs(n);
+        }
+        if (request_flags & INLINE_SHM_DATA_FLAG)
+        {
+            ptrs = data_topic->prepare_remote_ptrs(ptrs, request_flags);
+        }
+        if (request_flags & ACCEPT_CHUNKED_FLAG)
+        {
+            ptrs = stub_large_items_(ptrs);
+        }
+        if (after_sequence)
+        {
+            ptrs.push_back({std::make_shared<Bytes>(uint32_to_bytes(session_id_) + uint64_to_bytes(cursor)),
+                            get_timestamp()});
+        }
+        RMQMessage reply(*topic, message.cmd(), get_timestamp(), ptrs);
+        send_reply_(message, reply);
+        break;
+    }
+
+    case CmdType::CONSUME_DATA: {
+        std::string data_str = message.data_str();
+        if (data_str.size() <= sizeof(int32_t) + 1)
+        {
+            std::string error_message = "CONSUME_DATA needs the number of items, the flags and a consumer group, but "
+                                        "got " + std::to_string(data_str.size()) + " bytes.";
+            logger_->error(error_message);
+            RMQMessage reply(*topic, CmdType::ERROR, get_timestamp(), error_message);
+            send_reply_(message, reply);
+            break;
+        }
+        int32_t n = bytes_to_int32(data_str.substr(0, sizeof(int32_t)));
+        uint8_t request_flags = static_cast<uint8_t>(data_str[sizeof(int32_t)]);
+        std::string group = data_str.substr(sizeof(int32_t) + 1);
+        // A retry of a consume that was already served gets the same reply instead of the next items. Otherwise the
+        // items of the lost reply would be skipped by the group.
+        std::string consume_key = *topic + '\0' + group;
+        auto ts_it = last_consume_timestamp_.find(consume_key);
+        if (ts_it != last_consume_timestamp_.end() && ts_it->second == message.timestamp())
+        {
+            auto cache_it = cached_consume_reply_.find(consume_key);
+            if (cache_it != cached_consume_reply_.end())
+            {
+                logger_->info("Skipping duplicate CONSUME_DATA for topic {} and group {}", *topic, group);
+                socket_.send(zmq::message_t(cache_it->second.data(), cache_it->second.size()),
+                             zmq::send_flags::none);
+                reply_bytes_ += cache_it->second.size();
+                break;
+            }
+        }
+        last_consume_timestamp_[consume_key] = message.timestamp();
+        std::vector<TimedPtr> ptrs = data_topic->consume_data_ptrs(group, n);
+        if (request_flags & INLINE_SHM_DATA_FLAG)
+        {
+            ptrs = data_topic->prepare_remote_ptrs(ptrs, request_flags);
+        }
+        if (request_flags & ACCEPT_CHUNKED_FLAG)
+        {
+            ptrs = stub_large_items_(ptrs);
+        }
+        RMQMessage reply(*topic, CmdType::CONSUME_DATA, get_timestamp(), ptrs);
+        cached_consume_reply_[consume_key] = send_reply_(message, reply);
         break;
     }
 
     case CmdType::REQUEST_WITH_DATA: {
         // Check if this is a duplicate retry of a request we already processed
-        auto ts_it = last_request_timestamp_.find(message.topic());
+        auto ts_it = last_request_timestamp_.find(*topic);
         if (ts_it != last_request_timestamp_.end() &&
             ts_it->second == message.timestamp())
         {
-            auto cache_it = cached_reply_data_.find(message.topic());
+            auto cache_it = cached_reply_data_.find(*topic);
             if (cache_it != cached_reply_data_.end())
             {
-                logger_->info("Skipping duplicate REQUEST_WITH_DATA for topic: {}", message.topic());
+                logger_->info("Skipping duplicate REQUEST_WITH_DATA for topic: {}", *topic);
                 socket_.send(zmq::message_t(cache_it->second.data(), cache_it->second.size()),
                              zmq::send_flags::none);
                 break;
@@ -373,14 +2101,37 @@ void RMQServer::process_request_(RMQMessage &message)
         else
         {
             // New (non-duplicate) request: clear stale cached reply for this topic
-            cached_reply_data_.erase(message.topic());
+            cached_reply_data_.erase(*topic);
         }
 
-        last_request_timestamp_[message.topic()] = message.timestamp();
-        add_data_ptrs_(message.topic(), message.data_ptrs());
+        last_request_timestamp_[*topic] = message.timestamp();
+        // The payload is followed by the request flags. A traced request is answered with its RequestTrace.
+        std::vector<TimedPtr> request_ptrs = message.data_ptrs();
+        if (request_ptrs.size() != 2 || std::get<0>(request_ptrs.back())->size() != 1)
+        {
+            std::string error_message = "Malformed request with data on topic `" + *topic + "`";
+            logger_->error(error_message);
+            RMQMessage reply(*topic, CmdType::ERROR, get_timestamp(), error_message);
+            send_reply_(message, reply);
+            return;
+        }
+        uint8_t request_flags = static_cast<uint8_t>((*std::get<0>(request_ptrs.back()))[0]);
+        bool trace_requested = request_flags & REQUEST_TRACE_FLAG;
+        request_ptrs.pop_back();
+        RequestTrace trace{};
+        trace.magic = RequestTrace::MAGIC;
+        trace.received_us = request_received_us_;
+        // Clients on the same host pass requests on shared memory topics through shared memory. A request that
+        // carries its payload inline comes from another host and gets the reply inline as well.
+        bool inline_shm_data = false;
+        for (const TimedPtr &ptr : request_ptrs)
+        {
+            inline_shm_data = inline_shm_data || !SharedMemoryDataInfo::is_shm_data_info(*std::get<0>(ptr));
+            data_topic->add_data_ptr(std::get<0>(ptr), std::get<1>(ptr));
+        }
         {
             std::lock_guard<std::mutex> lock(get_new_request_mutex_);
-            get_new_request_ = message.topic();
+            get_new_request_ = *topic;
         }
         while (running_)
         {
@@ -389,14 +2140,25 @@ void RMQServer::process_request_(RMQMessage &message)
                 std::lock_guard<std::mutex> lock(reply_mutex_);
                 if (reply_topic_ != "") // Wait until the request is processed by the main thread
                 {
-                    assert(reply_topic_ == message.topic());
+                    assert(reply_topic_ == *topic);
                     reply_topic_ = "";
-                    std::vector<TimedPtr> reply_ptrs = pop_data_ptrs_(message.topic(), 0); // Pop all data
-                    RMQMessage reply(message.topic(), CmdType::REQUEST_WITH_DATA, get_timestamp(), reply_ptrs);
-                    std::string reply_data = reply.serialize();
+                    std::vector<TimedPtr> reply_ptrs = data_topic->pop_data_ptrs(0); // Pop all data
+                    if (inline_shm_data)
+                    {
+                        reply_ptrs = data_topic->prepare_remote_ptrs(reply_ptrs, INLINE_SHM_DATA_FLAG);
+                    }
+                    // Clamped so that a request that was not fetched with wait_for_request has no negative stages
+                    trace.dispatched_us = std::max<int64_t>(request_dispatched_us_, trace.received_us);
+                    trace.replied_us = std::max<int64_t>(request_replied_us_, trace.dispatched_us);
+                    trace.encoded_us = steady_clock_us();
+                    if (trace_requested)
+                    {
+                        reply_ptrs.push_back({std::make_shared<Bytes>(trace.serialize()), get_timestamp()});
+                    }
+                    RMQMessage reply(*topic, CmdType::REQUEST_WITH_DATA, get_timestamp(), reply_ptrs);
                     // Cache the reply for deduplication of subsequent retries
-                    cached_reply_data_[message.topic()] = reply_data;
-                    socket_.send(zmq::message_t(reply_data.data(), reply_data.size()), zmq::send_flags::none);
+                    cached_reply_data_[*topic] = send_reply_(message, reply);
+                    export_request_trace_(*topic, trace);
                     break;
                 }
             }
@@ -405,51 +2167,58 @@ void RMQServer::process_request_(RMQMessage &message)
     }
 
     case CmdType::PUT_DATA: {
-        auto it = data_topics_.find(message.topic());
-        if (it == data_topics_.end())
-        {
-            logger_->error("Received data for unknown topic {}. Please first call add_topic to add it into the "
-                           "recorded topics.",
-                           message.topic());
-            RMQMessage reply(message.topic(), CmdType::ERROR, get_timestamp(),
-                             "Topic `" + message.topic() +
-                                 "` not found. Please first call add_topic to add it into the "
-                                 "recorded topics.");
-            std::string reply_data = reply.serialize();
-            socket_.send(zmq::message_t(reply_data.data(), reply_data.size()), zmq::send_flags::none);
-            break;
+        for (const TimedPtr &ptr : message.data_ptrs())
+        {
+            if (!data_topic->accepts_item_size(std::get<0>(ptr)->size()))
+            {
+                std::string error_message = "Data of " + std::to_string(std::get<0>(ptr)->size()) +
+                                            " bytes does not match the slot size of tensor topic `" + *topic + "`";
+                logger_->error(error_message);
+                RMQMessage reply(*topic, CmdType::ERROR, get_timestamp(), error_message);
+                send_reply_(message, reply);
+                return;
+            }
+        }
+        for (const TimedPtr &ptr : message.data_ptrs())
+        {
+            data_topic->add_data_ptr(std::get<0>(ptr), std::get<1>(ptr));
         }
-        add_data_ptrs_(message.topic(), message.data_ptrs());
         std::vector<TimedPtr> reply_ptrs;
-        RMQMessage reply(message.topic(), CmdType::PUT_DATA, get_timestamp(), reply_ptrs);
-        std::string reply_data = reply.serialize();
-        socket_.send(zmq::message_t(reply_data.data(), reply_data.size()), zmq::send_flags::none);
+        RMQMessage reply(*topic, CmdType::PUT_DATA, get_timestamp(), reply_ptrs);
+        send_reply_(message, reply);
+        break;
+    }
+
+    case CmdType::PUT_CHUNK: {
+        process_put_chunk_(message, data_topic, *topic);
+        break;
+    }
+
+    case CmdType::FETCH_CHUNK: {
+        process_fetch_chunk_(message, *topic);
         break;
     }
 
     case CmdType::GET_TOPIC_STATUS: {
-        auto it = data_topics_.find(message.topic());
         std::string status_str;
-        if (it == data_topics_.end())
+        if (data_topic == nullptr)
         {
             status_str = int32_to_bytes(-1);
         }
         else
         {
-            status_str = int32_to_bytes(it->second.size()) + int32_to_bytes(it->second.is_shm_topic());
+            status_str = int32_to_bytes(data_topic->size()) + int32_to_bytes(data_topic->is_shm_topic());
         }
-        RMQMessage reply(message.topic(), CmdType::GET_TOPIC_STATUS, get_timestamp(), status_str);
-        std::string reply_data = reply.serialize();
-        socket_.send(zmq::message_t(reply_data.data(), reply_data.size()), zmq::send_flags::none);
+        RMQMessage reply(*topic, CmdType::GET_TOPIC_STATUS, get_timestamp(), status_str);
+        send_reply_(message, reply);
         break;
     }
 
     default: {
         std::string error_message = "Received unknown command: " + std::to_string(static_cast<int>(message.cmd()));
         logger_->error(error_message);
-        RMQMessage reply(message.topic(), CmdType::ERROR, get_timestamp(), error_message);
-        std::string reply_data = reply.serialize();
-        socket_.send(zmq::message_t(reply_data.data(), reply_data.size()), zmq::send_flags::none);
+        RMQMessage reply(*topic, CmdType::ERROR, get_timestamp(), error_message);
+        send_reply_(message, reply);
         break;
     }
     }
@@ -460,12 +2229,18 @@ void RMQServer::background_loop_()
     while (running_)
     {
         zmq::poll(&poller_item_, 1, poller_timeout_ms_.count());
+        expire_transfers_();
         zmq::message_t request;
         if (poller_item_.revents & ZMQ_POLLIN)
         {
             socket_.recv(request);
+            int64_t receive_time_us = steady_clock_us();
             RMQMessage message(std::string(request.data<char>(), request.data<char>() + request.size()));
+            reply_bytes_ = 0;
+            reply_is_error_ = false;
+            request_received_us_ = receive_time_us;
             process_request_(message);
+            record_request_stats_(message.cmd(), request.size(), steady_clock_us() - receive_time_us);
         }
     }
 }
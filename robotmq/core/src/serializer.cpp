@@ -0,0 +1,485 @@
+/**
+ * Copyright (c) 2024 Yihuai Gao
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "serializer.h"
+#include "copy_engine.h"
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+namespace
+{
+uint64_t align_up(uint64_t value, uint64_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// Releases a Py_buffer when leaving scope
+class BufferGuard
+{
+  public:
+    BufferGuard(const pybind11::object &obj, int flags)
+    {
+        if (PyObject_GetBuffer(obj.ptr(), &view_, flags) != 0)
+        {
+            throw pybind11::error_already_set();
+        }
+    }
+    ~BufferGuard()
+    {
+        PyBuffer_Release(&view_);
+    }
+    BufferGuard(const BufferGuard &) = delete;
+    BufferGuard &operator=(const BufferGuard &) = delete;
+    const Py_buffer &view() const
+    {
+        return view_;
+    }
+
+  private:
+    Py_buffer view_;
+};
+
+class ObjectDecoder
+{
+  public:
+    ObjectDecoder(const pybind11::object &owner, const char *data, uint64_t size, bool readonly, bool copy)
+        : owner_(owner), data_(data), readonly_(readonly), copy_(copy)
+    {
+        std::memcpy(&header_, data, sizeof(SerializedObjectHeader));
+        if (header_.version != SerializedObjectHeader::VERSION)
+        {
+            throw std::runtime_error("Unsupported serialization version " + std::to_string(header_.version));
+        }
+        if (header_.total_size_bytes > size || header_.data_offset < sizeof(SerializedObjectHeader) ||
+            header_.data_offset > header_.total_size_bytes ||
+            header_.tree_size_bytes > header_.data_offset - sizeof(SerializedObjectHeader))
+        {
+            throw std::runtime_error("Serialized data is truncated or corrupted");
+        }
+        cursor_ = sizeof(SerializedObjectHeader);
+        tree_end_ = cursor_ + header_.tree_size_bytes;
+    }
+
+    pybind11::object decode()
+    {
+        pybind11::object result = decode_(0);
+        if (cursor_ != tree_end_)
+        {
+            throw std::runtime_error("Serialized data has trailing bytes in its structure");
+        }
+        return result;
+    }
+
+  private:
+    template <typename T> T read_value_()
+    {
+        T value;
+        std::memcpy(&value, read_bytes_(sizeof(T)), sizeof(T));
+        return value;
+    }
+
+    const char *read_bytes_(uint64_t size)
+    {
+        if (size > tree_end_ - cursor_)
+        {
+            throw std::runtime_error("Serialized data is truncated or corrupted");
+        }
+        const char *ptr = data_ + cursor_;
+        cursor_ += size;
+        return ptr;
+    }
+
+    pybind11::object decode_(int depth)
+    {
+        // Corrupted or malicious data could otherwise nest deep enough to overflow the stack
+        if (depth > SerializedObjectHeader::MAX_DEPTH)
+        {
+            throw std::runtime_error("Serialized data is nested too deeply");
+        }
+        SerializedObjectTag tag = static_cast<SerializedObjectTag>(read_value_<uint8_t>());
+        switch (tag)
+        {
+        case SerializedObjectTag::NONE:
+            return pybind11::none();
+        case SerializedObjectTag::FALSE:
+            return pybind11::bool_(false);
+        case SerializedObjectTag::TRUE:
+            return pybind11::bool_(true);
+        case SerializedObjectTag::INT:
+            return pybind11::int_(read_value_<int64_t>());
+        case SerializedObjectTag::FLOAT:
+            return pybind11::float_(read_value_<double>());
+        case SerializedObjectTag::STR: {
+            uint64_t length = read_value_<uint64_t>();
+            const char *str = read_bytes_(length);
+            PyObject *obj = PyUnicode_DecodeUTF8(str, length, nullptr);
+            if (obj == nullptr)
+            {
+                throw pybind11::error_already_set();
+            }
+            return pybind11::reinterpret_steal<pybind11::object>(obj);
+        }
+        case SerializedObjectTag::BYTES: {
+            uint64_t length = read_value_<uint64_t>();
+            return pybind11::bytes(read_bytes_(length), length);
+        }
+        case SerializedObjectTag::LIST: {
+            uint32_t num_items = read_value_<uint32_t>();
+            pybind11::list list;
+            for (uint32_t i = 0; i < num_items; i++)
+            {
+                list.append(decode_(depth + 1));
+            }
+            return list;
+        }
+        case SerializedObjectTag::TUPLE: {
+            uint32_t num_items = read_value_<uint32_t>();
+            PyObject *tuple = PyTuple_New(num_items);
+            if (tuple == nullptr)
+            {
+                throw pybind11::error_already_set();
+            }
+            pybind11::object result = pybind11::reinterpret_steal<pybind11::object>(tuple);
+            for (uint32_t i = 0; i < num_items; i++)
+            {
+                PyTuple_SET_ITEM(tuple, i, decode_(depth + 1).release().ptr());
+            }
+            return result;
+        }
+        case SerializedObjectTag::DICT: {
+            uint32_t num_items = read_value_<uint32_t>();
+            pybind11::dict dict;
+            for (uint32_t i = 0; i < num_items; i++)
+            {
+                pybind11::object key = decode_(depth + 1);
+                pybind11::object value = decode_(depth + 1);
+                if (PyDict_SetItem(dict.ptr(), key.ptr(), value.ptr()) != 0)
+                {
+                    throw pybind11::error_already_set();
+                }
+            }
+            return dict;
+        }
+        case SerializedObjectTag::NDARRAY:
+            return decode_array_();
+        case SerializedObjectTag::PICKLE: {
+            uint64_t length = read_value_<uint64_t>();
+            const char *pickled = read_bytes_(length);
+            return pybind11::module_::import("pickle").attr("loads")(pybind11::bytes(pickled, length));
+        }
+        }
+        throw std::runtime_error("Unknown tag " + std::to_string(static_cast<int>(tag)) + " in serialized data");
+    }
+
+    pybind11::object decode_array_()
+    {
+        uint8_t dtype_length = read_value_<uint8_t>();
+        std::string dtype_str(read_bytes_(dtype_length), dtype_length);
+        uint8_t ndim = read_value_<uint8_t>();
+        pybind11::dtype dtype(dtype_str);
+        std::vector<pybind11::ssize_t> shape(ndim);
+        uint64_t expected_nbytes = dtype.itemsize();
+        for (uint8_t i = 0; i < ndim; i++)
+        {
+            int64_t dim = read_value_<int64_t>();
+            if (dim < 0)
+            {
+                throw std::runtime_error("Negative array dimension in serialized data");
+            }
+            if (dim != 0 && expected_nbytes > std::numeric_limits<uint64_t>::max() / static_cast<uint64_t>(dim))
+            {
+                throw std::runtime_error("Array size in serialized data overflows");
+            }
+            shape[i] = dim;
+            expected_nbytes *= dim;
+        }
+        uint64_t offset = read_value_<uint64_t>();
+        uint64_t nbytes = read_value_<uint64_t>();
+        uint64_t start = header_.data_offset + offset;
+        if (nbytes != expected_nbytes || offset > header_.total_size_bytes - header_.data_offset ||
+            nbytes > header_.total_size_bytes - start)
+        {
+            throw std::runtime_error("Array buffer does not match its shape or is outside of the serialized data");
+        }
+        if (copy_)
+        {
+            pybind11::array array(dtype, shape);
+            engine_memcpy(array.mutable_data(), data_ + start, nbytes, false);
+            return array;
+        }
+        // The array is a view of the received buffer. Its owner is a memoryview, whose buffer export keeps the memory
+        // in place (e.g. a bytearray cannot be resized) while any view is alive.
+        pybind11::array array(dtype, shape, {}, data_ + start, owner_);
+        if (readonly_)
+        {
+            array.attr("setflags")(pybind11::arg("write") = false);
+        }
+        return array;
+    }
+
+    pybind11::object owner_;
+    const char *data_;
+    bool readonly_;
+    bool copy_;
+    SerializedObjectHeader header_;
+    uint64_t cursor_ = 0;
+    uint64_t tree_end_ = 0;
+};
+} // namespace
+
+bool is_serialized_object(const char *data, size_t size)
+{
+    uint32_t magic;
+    if (size < sizeof(SerializedObjectHeader))
+    {
+        return false;
+    }
+    std::memcpy(&magic, data, sizeof(uint32_t));
+    return magic == SerializedObjectHeader::MAGIC;
+}
+
+ObjectEncoder::ObjectEncoder(const pybind11::handle &obj)
+{
+    encode_(obj.ptr(), 0);
+    data_offset_ = sizeof(SerializedObjectHeader) + tree_.size();
+    if (!arrays_.empty())
+    {
+        data_offset_ = align_up(data_offset_, SerializedObjectHeader::ARRAY_ALIGNMENT);
+    }
+}
+
+uint64_t ObjectEncoder::size() const
+{
+    return data_offset_ + data_size_bytes_;
+}
+
+void ObjectEncoder::write(char *dst) const
+{
+    SerializedObjectHeader header{SerializedObjectHeader::MAGIC, SerializedObjectHeader::VERSION, tree_.size(),
+                                  data_offset_, size()};
+    std::memcpy(dst, &header, sizeof(SerializedObjectHeader));
+    std::memcpy(dst + sizeof(SerializedObjectHeader), tree_.data(), tree_.size());
+    // Zero the padding so that equal objects always serialize to equal bytes
+    uint64_t padding_start = sizeof(SerializedObjectHeader) + tree_.size();
+    std::memset(dst + padding_start, 0, data_offset_ - padding_start);
+    uint64_t written_end = 0;
+    for (const ArrayBlock &block : arrays_)
+    {
+        std::memset(dst + data_offset_ + written_end, 0, block.offset - written_end);
+        char *array_dst = dst + data_offset_ + block.offset;
+        uint64_t nbytes = block.array.nbytes();
+        if (block.array.flags() & pybind11::array::c_style)
+        {
+            engine_memcpy(array_dst, block.array.data(), nbytes, false);
+        }
+        else
+        {
+            // Let numpy gather a strided array straight into the destination
+            std::vector<pybind11::ssize_t> shape(block.array.shape(), block.array.shape() + block.array.ndim());
+            pybind11::capsule base(array_dst, [](void *) {});
+            pybind11::array dst_array(block.array.dtype(), shape, {}, array_dst, base);
+            if (PyObject_SetItem(dst_array.ptr(), Py_Ellipsis, block.array.ptr()) != 0)
+            {
+                throw pybind11::error_already_set();
+            }
+        }
+        written_end = block.offset + nbytes;
+    }
+}
+
+void ObjectEncoder::append_tag_(SerializedObjectTag tag)
+{
+    tree_.push_back(static_cast<char>(tag));
+}
+
+template <typename T> void ObjectEncoder::append_value_(T value)
+{
+    tree_.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+void ObjectEncoder::encode_(PyObject *obj, int depth)
+{
+    if (depth > SerializedObjectHeader::MAX_DEPTH)
+    {
+        throw pybind11::value_error("Object is nested too deeply (or contains itself) to be serialized");
+    }
+    if (obj == Py_None)
+    {
+        append_tag_(SerializedObjectTag::NONE);
+    }
+    else if (obj == Py_True || obj == Py_False)
+    {
+        append_tag_(obj == Py_True ? SerializedObjectTag::TRUE : SerializedObjectTag::FALSE);
+    }
+    else if (PyLong_CheckExact(obj))
+    {
+        int overflow = 0;
+        long long value = PyLong_AsLongLongAndOverflow(obj, &overflow);
+        if (overflow != 0)
+        {
+            encode_pickle_(obj);
+            return;
+        }
+        append_tag_(SerializedObjectTag::INT);
+        append_value_<int64_t>(value);
+    }
+    else if (PyFloat_CheckExact(obj))
+    {
+        append_tag_(SerializedObjectTag::FLOAT);
+        append_value_<double>(PyFloat_AS_DOUBLE(obj));
+    }
+    else if (PyUnicode_CheckExact(obj))
+    {
+        Py_ssize_t length;
+        const char *str = PyUnicode_AsUTF8AndSize(obj, &length);
+        if (str == nullptr)
+        {
+            // e.g. lone surrogates, which pickle can still represent
+            PyErr_Clear();
+            encode_pickle_(obj);
+            return;
+        }
+        append_tag_(SerializedObjectTag::STR);
+        append_value_<uint64_t>(length);
+        tree_.append(str, length);
+    }
+    else if (PyBytes_CheckExact(obj))
+    {
+        append_tag_(SerializedObjectTag::BYTES);
+        append_value_<uint64_t>(PyBytes_GET_SIZE(obj));
+        tree_.append(PyBytes_AS_STRING(obj), PyBytes_GET_SIZE(obj));
+    }
+    else if (PyList_CheckExact(obj) || PyTuple_CheckExact(obj))
+    {
+        bool is_list = PyList_CheckExact(obj);
+        Py_ssize_t num_items = is_list ? PyList_GET_SIZE(obj) : PyTuple_GET_SIZE(obj);
+        append_tag_(is_list ? SerializedObjectTag::LIST : SerializedObjectTag::TUPLE);
+        append_value_<uint32_t>(num_items);
+        for (Py_ssize_t i = 0; i < num_items; i++)
+        {
+            encode_(is_list ? PyList_GET_ITEM(obj, i) : PyTuple_GET_ITEM(obj, i), depth + 1);
+        }
+    }
+    else if (PyDict_CheckExact(obj))
+    {
+        append_tag_(SerializedObjectTag::DICT);
+        append_value_<uint32_t>(PyDict_GET_SIZE(obj));
+        PyObject *key;
+        PyObject *value;
+        Py_ssize_t pos = 0;
+        while (PyDict_Next(obj, &pos, &key, &value))
+        {
+            encode_(key, depth + 1);
+            encode_(value, depth + 1);
+        }
+    }
+    else if (pybind11::isinstance<pybind11::array>(obj))
+    {
+        pybind11::array array = pybind11::reinterpret_borrow<pybind11::array>(obj);
+        std::string dtype_str = array.dtype().attr("str").cast<std::string>();
+        // Object arrays hold pointers and structured dtypes are not described by their type string.
+        if (array.dtype().kind() == 'O' || !array.dtype().attr("fields").is_none() || dtype_str.size() > 255 ||
+            array.ndim() > 255)
+        {
+            encode_pickle_(obj);
+            return;
+        }
+        append_tag_(SerializedObjectTag::NDARRAY);
+        append_value_<uint8_t>(dtype_str.size());
+        tree_.append(dtype_str);
+        append_value_<uint8_t>(array.ndim());
+        for (pybind11::ssize_t i = 0; i < array.ndim(); i++)
+        {
+            append_value_<int64_t>(array.shape(i));
+        }
+        uint64_t offset = align_up(data_size_bytes_, SerializedObjectHeader::ARRAY_ALIGNMENT);
+        append_value_<uint64_t>(offset);
+        append_value_<uint64_t>(array.nbytes());
+        arrays_.push_back({array, offset});
+        data_size_bytes_ = offset + array.nbytes();
+    }
+    else
+    {
+        encode_pickle_(obj);
+    }
+}
+
+void ObjectEncoder::encode_pickle_(PyObject *obj)
+{
+    pybind11::bytes pickled = pybind11::module_::import("pickle").attr("dumps")(
+        pybind11::reinterpret_borrow<pybind11::object>(obj), pybind11::arg("protocol") = -1);
+    char *buffer;
+    ssize_t length;
+    PYBIND11_BYTES_AS_STRING_AND_SIZE(pickled.ptr(), &buffer, &length);
+    append_tag_(SerializedObjectTag::PICKLE);
+    append_value_<uint64_t>(length);
+    tree_.append(buffer, length);
+}
+
+pybind11::bytes serialize_object(const pybind11::object &obj)
+{
+    ObjectEncoder encoder(obj);
+    PyObject *py_bytes = PyBytes_FromStringAndSize(nullptr, encoder.size());
+    if (!py_bytes)
+    {
+        throw std::runtime_error("Failed to allocate Python bytes");
+    }
+    pybind11::bytes data = pybind11::reinterpret_steal<pybind11::bytes>(py_bytes);
+    encoder.write(PyBytes_AS_STRING(py_bytes));
+    return data;
+}
+
+uint64_t serialized_object_size(const pybind11::object &obj)
+{
+    return ObjectEncoder(obj).size();
+}
+
+uint64_t serialize_object_into(const pybind11::object &obj, const pybind11::object &buffer)
+{
+    ObjectEncoder encoder(obj);
+    BufferGuard guard(buffer, PyBUF_WRITABLE);
+    if (static_cast<uint64_t>(guard.view().len) < encoder.size())
+    {
+        throw pybind11::value_error("Buffer of " + std::to_string(guard.view().len) + " bytes is too small for " +
+                                    std::to_string(encoder.size()) + " bytes of serialized data");
+    }
+    encoder.write(static_cast<char *>(guard.view().buf));
+    return encoder.size();
+}
+
+pybind11::object deserialize_object(const pybind11::object &data, bool copy)
+{
+    if (!copy)
+    {
+        pybind11::object view = pybind11::reinterpret_steal<pybind11::object>(PyMemoryView_FromObject(data.ptr()));
+        if (!view)
+        {
+            throw pybind11::error_already_set();
+        }
+        const Py_buffer *buffer = PyMemoryView_GET_BUFFER(view.ptr());
+        if (!PyBuffer_IsContiguous(buffer, 'C'))
+        {
+            throw pybind11::value_error("Data must be a contiguous buffer");
+        }
+        const char *ptr = static_cast<const char *>(buffer->buf);
+        uint64_t size = buffer->len;
+        if (!is_serialized_object(ptr, size))
+        {
+            throw pybind11::value_error("Data was not produced by serialize_object");
+        }
+        return ObjectDecoder(view, ptr, size, buffer->readonly, copy).decode();
+    }
+    BufferGuard guard(data, PyBUF_SIMPLE);
+    const char *ptr = static_cast<const char *>(guard.view().buf);
+    uint64_t size = guard.view().len;
+    if (!is_serialized_object(ptr, size))
+    {
+        throw pybind11::value_error("Data was not produced by serialize_object");
+    }
+    return ObjectDecoder(data, ptr, size, guard.view().readonly, copy).decode();
+}
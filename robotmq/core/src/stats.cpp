@@ -0,0 +1,136 @@
+/**
+ * Copyright (c) 2024 Yihuai Gao
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "stats.h"
+#include <cstdio>
+
+void Log2Histogram::record(uint64_t value)
+{
+    int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    if (bucket >= NUM_BUCKETS)
+    {
+        bucket = NUM_BUCKETS - 1;
+    }
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+    uint64_t current_max = max_.load(std::memory_order_relaxed);
+    while (value > current_max && !max_.compare_exchange_weak(current_max, value, std::memory_order_relaxed))
+    {
+    }
+}
+
+uint64_t Log2Histogram::count() const
+{
+    return count_.load(std::memory_order_relaxed);
+}
+
+uint64_t Log2Histogram::sum() const
+{
+    return sum_.load(std::memory_order_relaxed);
+}
+
+uint64_t Log2Histogram::max() const
+{
+    return max_.load(std::memory_order_relaxed);
+}
+
+uint64_t Log2Histogram::bucket_count(int bucket) const
+{
+    return buckets_[bucket].load(std::memory_order_relaxed);
+}
+
+uint64_t Log2Histogram::bucket_upper_bound(int bucket)
+{
+    return 1ull << bucket;
+}
+
+uint64_t Log2Histogram::percentile(double percentile) const
+{
+    // The buckets are read one by one while other threads may record, so the total is taken from the buckets.
+    std::array<uint64_t, NUM_BUCKETS> counts;
+    uint64_t total = 0;
+    for (int i = 0; i < NUM_BUCKETS; i++)
+    {
+        counts[i] = bucket_count(i);
+        total += counts[i];
+    }
+    if (total == 0)
+    {
+        return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * total);
+    rank = rank < 1 ? 1 : (rank > total ? total : rank);
+    uint64_t seen = 0;
+    for (int i = 0; i < NUM_BUCKETS; i++)
+    {
+        seen += counts[i];
+        if (seen >= rank)
+        {
+            return bucket_upper_bound(i);
+        }
+    }
+    return bucket_upper_bound(NUM_BUCKETS - 1);
+}
+
+std::string Log2Histogram::to_json() const
+{
+    std::string json = "{\"count\": " + std::to_string(count()) + ", \"sum\": " + std::to_string(sum()) +
+                       ", \"max\": " + std::to_string(max()) + ", \"p50\": " + std::to_string(percentile(50)) +
+                       ", \"p99\": " + std::to_string(percentile(99)) +
+                       ", \"p999\": " + std::to_string(percentile(99.9)) + ", \"buckets\": [";
+    bool first = true;
+    for (int i = 0; i < NUM_BUCKETS; i++)
+    {
+        uint64_t count = bucket_count(i);
+        if (count > 0)
+        {
+            json += (first ? "[" : ", [") + std::to_string(bucket_upper_bound(i)) + ", " + std::to_string(count) + "]";
+            first = false;
+        }
+    }
+    return json + "]}";
+}
+
+std::string json_escape(const std::string &str)
+{
+    std::string escaped;
+    escaped.reserve(str.size());
+    for (char c : str)
+    {
+        switch (c)
+        {
+        case '"':
+            escaped += "\\\"";
+            break;
+        case '\\':
+            escaped += "\\\\";
+            break;
+        case '\n':
+            escaped += "\\n";
+            break;
+        case '\r':
+            escaped += "\\r";
+            break;
+        case '\t':
+            escaped += "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20)
+            {
+                char buffer[8];
+                snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                escaped += buffer;
+            }
+            else
+            {
+                escaped += c;
+            }
+        }
+    }
+    return escaped;
+}
@@ -0,0 +1,600 @@
+/**
+ * Copyright (c) 2024 Yihuai Gao
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "topic_log.h"
+#include "copy_engine.h"
+#include <pybind11/stl.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+uint64_t padded_size(uint64_t size)
+{
+    return (size + 7) & ~static_cast<uint64_t>(7);
+}
+
+template <typename T> void append_pod(std::string &bytes, const T &value)
+{
+    bytes.append(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template <typename T> T read_pod(const std::string &bytes, size_t &offset)
+{
+    if (offset + sizeof(T) > bytes.size())
+    {
+        throw std::runtime_error("Truncated topic description in log");
+    }
+    T value;
+    std::memcpy(&value, bytes.data() + offset, sizeof(T));
+    offset += sizeof(T);
+    return value;
+}
+
+std::string read_string(const std::string &bytes, size_t &offset)
+{
+    uint32_t size = read_pod<uint32_t>(bytes, offset);
+    if (offset + size > bytes.size())
+    {
+        throw std::runtime_error("Truncated topic description in log");
+    }
+    std::string str = bytes.substr(offset, size);
+    offset += size;
+    return str;
+}
+
+std::string errno_string()
+{
+    return std::string(std::strerror(errno));
+}
+} // namespace
+
+std::string LogTopicInfo::serialize() const
+{
+    std::string bytes;
+    append_pod(bytes, static_cast<uint8_t>(kind));
+    append_pod(bytes, static_cast<uint8_t>(shared_memory));
+    append_pod(bytes, message_remaining_time_s);
+    append_pod(bytes, shared_memory_size_gb);
+    append_pod(bytes, capacity);
+    append_pod(bytes, static_cast<uint32_t>(name.size()));
+    bytes.append(name);
+    append_pod(bytes, static_cast<uint32_t>(dtype.size()));
+    bytes.append(dtype);
+    append_pod(bytes, static_cast<uint32_t>(shape.size()));
+    for (int64_t dim : shape)
+    {
+        append_pod(bytes, dim);
+    }
+    return bytes;
+}
+
+LogTopicInfo LogTopicInfo::parse(const std::string &bytes)
+{
+    LogTopicInfo info;
+    size_t offset = 0;
+    uint8_t kind = read_pod<uint8_t>(bytes, offset);
+    if (kind > TENSOR)
+    {
+        throw std::runtime_error("Unknown topic kind " + std::to_string(kind));
+    }
+    info.kind = static_cast<Kind>(kind);
+    info.shared_memory = read_pod<uint8_t>(bytes, offset) != 0;
+    info.message_remaining_time_s = read_pod<double>(bytes, offset);
+    info.shared_memory_size_gb = read_pod<double>(bytes, offset);
+    info.capacity = read_pod<uint64_t>(bytes, offset);
+    info.name = read_string(bytes, offset);
+    info.dtype = read_string(bytes, offset);
+    uint32_t ndim = read_pod<uint32_t>(bytes, offset);
+    for (uint32_t i = 0; i < ndim; i++)
+    {
+        info.shape.push_back(read_pod<int64_t>(bytes, offset));
+    }
+    return info;
+}
+
+MappedAppendFile::~MappedAppendFile()
+{
+    if (ptr_ != nullptr)
+    {
+        munmap(ptr_, capacity_);
+    }
+    if (fd_ >= 0)
+    {
+        ::close(fd_);
+    }
+}
+
+void MappedAppendFile::open(const std::string &path)
+{
+    path_ = path;
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0)
+    {
+        throw std::runtime_error("Failed to create log file " + path + ": " + errno_string());
+    }
+}
+
+char *MappedAppendFile::at(uint64_t offset, uint64_t size)
+{
+    if (offset + size > capacity_)
+    {
+        uint64_t new_capacity = (offset + size + GROWTH_BYTES_ - 1) / GROWTH_BYTES_ * GROWTH_BYTES_;
+        // Allocate the blocks now, so that running out of disk space fails here instead of raising SIGBUS on a write
+        // into the mapping.
+        int error = posix_fallocate(fd_, capacity_, new_capacity - capacity_);
+        if (error != 0)
+        {
+            throw std::runtime_error("Failed to grow log file " + path_ + ": " + std::strerror(error));
+        }
+        void *ptr = ptr_ == nullptr ? mmap(nullptr, new_capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0)
+                                    : mremap(ptr_, capacity_, new_capacity, MREMAP_MAYMOVE);
+        if (ptr == MAP_FAILED)
+        {
+            throw std::runtime_error("Failed to map log file " + path_ + ": " + errno_string());
+        }
+        ptr_ = static_cast<char *>(ptr);
+        capacity_ = new_capacity;
+    }
+    return ptr_ + offset;
+}
+
+void MappedAppendFile::close(uint64_t size)
+{
+    if (ptr_ != nullptr)
+    {
+        munmap(ptr_, capacity_);
+        ptr_ = nullptr;
+        capacity_ = 0;
+    }
+    if (fd_ >= 0)
+    {
+        if (ftruncate(fd_, size) != 0)
+        {
+            ::close(fd_);
+            fd_ = -1;
+            throw std::runtime_error("Failed to truncate log file " + path_ + ": " + errno_string());
+        }
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+LogWriter::LogWriter(const std::string &path, const std::vector<LogTopicInfo> &topics, uint64_t max_queued_bytes)
+    : path_(path), num_topics_(static_cast<uint32_t>(topics.size())), max_queued_bytes_(max_queued_bytes)
+{
+    log_file_.open(path);
+    index_file_.open(path + ".idx");
+    end_offset_ = sizeof(LogFileHeader);
+    for (uint32_t stream_id = 0; stream_id < num_topics_; stream_id++)
+    {
+        std::string info = topics[stream_id].serialize();
+        write_record_(LogRecordType::TOPIC, stream_id, 0, 0, info.data(), info.size());
+    }
+    commit_header_();
+    thread_ = std::thread(&LogWriter::write_loop_, this);
+}
+
+LogWriter::~LogWriter()
+{
+    close();
+}
+
+bool LogWriter::reserve_queue_(uint64_t size)
+{
+    if (!running_)
+    {
+        records_dropped_++;
+        return false;
+    }
+    if (queued_bytes_.fetch_add(size) + size > max_queued_bytes_)
+    {
+        queued_bytes_ -= size;
+        records_dropped_++;
+        return false;
+    }
+    return true;
+}
+
+bool LogWriter::record(uint32_t stream_id, uint64_t sequence, double timestamp, const BytesPtr &data_ptr)
+{
+    if (!reserve_queue_(data_ptr->size()))
+    {
+        return false;
+    }
+    queue_.push({stream_id, sequence, timestamp, data_ptr});
+    return true;
+}
+
+bool LogWriter::record(uint32_t stream_id, uint64_t sequence, double timestamp, const char *data, uint64_t size)
+{
+    // Copy only items that are going to be written
+    if (!reserve_queue_(size))
+    {
+        return false;
+    }
+    BytesPtr data_ptr = std::make_shared<Bytes>(size, '\0');
+    engine_memcpy(data_ptr->data(), data, size, false);
+    queue_.push({stream_id, sequence, timestamp, data_ptr});
+    return true;
+}
+
+void LogWriter::write_record_(LogRecordType type, uint32_t stream_id, uint64_t sequence, double timestamp,
+                              const char *data, uint64_t size)
+{
+    LogRecordHeader header{};
+    header.magic = LogRecordHeader::MAGIC;
+    header.type = type;
+    header.stream_id = stream_id;
+    header.sequence = sequence;
+    header.timestamp = timestamp;
+    header.size = size;
+    uint64_t record_size = sizeof(LogRecordHeader) + padded_size(size);
+    char *record = log_file_.at(end_offset_, record_size);
+    std::memcpy(record, &header, sizeof(LogRecordHeader));
+    // The log is not read back soon, so the copy should not evict the cache
+    engine_memcpy(record + sizeof(LogRecordHeader), data, size, true);
+    if (type == LogRecordType::DATA)
+    {
+        max_timestamp_ = num_records_ == 0 ? timestamp : std::max(max_timestamp_, timestamp);
+        LogIndexEntry entry{max_timestamp_, end_offset_};
+        std::memcpy(index_file_.at(num_records_ * sizeof(LogIndexEntry), sizeof(LogIndexEntry)), &entry,
+                    sizeof(LogIndexEntry));
+        num_records_++;
+    }
+    end_offset_ += record_size;
+}
+
+void LogWriter::commit_header_()
+{
+    LogFileHeader *header = reinterpret_cast<LogFileHeader *>(log_file_.at(0, sizeof(LogFileHeader)));
+    header->magic = LogFileHeader::MAGIC;
+    header->version = LogFileHeader::VERSION;
+    header->num_topics = num_topics_;
+    // Readers load num_records before end_offset, so a reader never sees more records than are complete
+    header->end_offset = end_offset_;
+    std::atomic_thread_fence(std::memory_order_release);
+    header->num_records = num_records_;
+}
+
+void LogWriter::write_loop_()
+{
+    Item item;
+    bool failed = false;
+    // Records written since the header was last committed, and when the first of them was written
+    uint64_t pending_records = 0;
+    int64_t pending_since_us = 0;
+    while (true)
+    {
+        bool commit_due = pending_records >= COMMIT_INTERVAL_RECORDS_ ||
+                          (pending_records > 0 && steady_clock_us() - pending_since_us >= COMMIT_INTERVAL_US_);
+        if (commit_due && !failed)
+        {
+            // Readers of a log that is being recorded see the records of a steady stream without waiting for a gap
+            commit_header_();
+            pending_records = 0;
+        }
+        if (!queue_.pop(item))
+        {
+            if (pending_records > 0 && !failed)
+            {
+                commit_header_();
+                pending_records = 0;
+            }
+            if (!running_)
+            {
+                break;
+            }
+            // Woken by the next record, or by close()
+            queue_.wait(std::chrono::seconds(1));
+            continue;
+        }
+        uint64_t size = item.data_ptr->size();
+        if (!failed)
+        {
+            try
+            {
+                write_record_(LogRecordType::DATA, item.stream_id, item.sequence, item.timestamp,
+                              item.data_ptr->data(), size);
+                records_written_++;
+                bytes_written_ += size;
+                if (pending_records++ == 0)
+                {
+                    pending_since_us = steady_clock_us();
+                }
+            }
+            catch (const std::exception &e)
+            {
+                // Keep the records written so far readable, and drop everything after
+                std::lock_guard<std::mutex> lock(error_mutex_);
+                error_ = e.what();
+                failed = true;
+            }
+        }
+        if (failed)
+        {
+            records_dropped_++;
+        }
+        queued_bytes_ -= size;
+        item.data_ptr.reset();
+    }
+}
+
+void LogWriter::close()
+{
+    if (!thread_.joinable())
+    {
+        return;
+    }
+    running_ = false;
+    queue_.notify();
+    thread_.join();
+    commit_header_();
+    log_file_.close(end_offset_);
+    index_file_.close(num_records_ * sizeof(LogIndexEntry));
+}
+
+uint64_t LogWriter::records_written() const
+{
+    return records_written_.load();
+}
+
+uint64_t LogWriter::bytes_written() const
+{
+    return bytes_written_.load();
+}
+
+uint64_t LogWriter::records_dropped() const
+{
+    return records_dropped_.load();
+}
+
+uint64_t LogWriter::queued_bytes() const
+{
+    return queued_bytes_.load();
+}
+
+std::string LogWriter::error() const
+{
+    std::lock_guard<std::mutex> lock(error_mutex_);
+    return error_;
+}
+
+LogReader::LogReader(const std::string &path) : path_(path)
+{
+    // The destructor does not run if the constructor throws, so the mappings are released here
+    try
+    {
+        open_(path);
+    }
+    catch (...)
+    {
+        unmap_();
+        throw;
+    }
+}
+
+void LogReader::open_(const std::string &path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error("Failed to open log file " + path + ": " + errno_string());
+    }
+    struct stat file_stat;
+    fstat(fd, &file_stat);
+    mapped_size_ = file_stat.st_size;
+    if (mapped_size_ < sizeof(LogFileHeader))
+    {
+        ::close(fd);
+        throw std::runtime_error("File " + path + " is too small to be a log");
+    }
+    void *ptr = mmap(nullptr, mapped_size_, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (ptr == MAP_FAILED)
+    {
+        throw std::runtime_error("Failed to map log file " + path + ": " + errno_string());
+    }
+    ptr_ = static_cast<char *>(ptr);
+
+    const LogFileHeader *header = reinterpret_cast<const LogFileHeader *>(ptr_);
+    if (header->magic != LogFileHeader::MAGIC || header->version != LogFileHeader::VERSION)
+    {
+        throw std::runtime_error("File " + path + " is not a log of a supported version");
+    }
+    num_records_ = header->num_records;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t end_offset = std::min(header->end_offset, mapped_size_);
+
+    // The topic records come first
+    uint64_t offset = sizeof(LogFileHeader);
+    auto next_record = [&](uint64_t &record_offset) -> const LogRecordHeader * {
+        if (record_offset + sizeof(LogRecordHeader) > end_offset)
+        {
+            return nullptr;
+        }
+        const LogRecordHeader *record = reinterpret_cast<const LogRecordHeader *>(ptr_ + record_offset);
+        uint64_t record_size = sizeof(LogRecordHeader) + padded_size(record->size);
+        if (record->magic != LogRecordHeader::MAGIC || record_offset + record_size > end_offset)
+        {
+            return nullptr;
+        }
+        record_offset += record_size;
+        return record;
+    };
+    for (uint32_t i = 0; i < header->num_topics; i++)
+    {
+        const LogRecordHeader *record = next_record(offset);
+        if (record == nullptr || record->type != LogRecordType::TOPIC)
+        {
+            throw std::runtime_error("Log " + path + " is missing the description of topic " + std::to_string(i));
+        }
+        topics_.push_back(LogTopicInfo::parse(std::string(reinterpret_cast<const char *>(record + 1), record->size)));
+    }
+
+    int index_fd = ::open((path + ".idx").c_str(), O_RDONLY);
+    if (index_fd >= 0)
+    {
+        fstat(index_fd, &file_stat);
+        if (num_records_ > 0 && static_cast<uint64_t>(file_stat.st_size) >= num_records_ * sizeof(LogIndexEntry))
+        {
+            index_mapped_size_ = num_records_ * sizeof(LogIndexEntry);
+            void *index_ptr = mmap(nullptr, index_mapped_size_, PROT_READ, MAP_SHARED, index_fd, 0);
+            index_ptr_ = index_ptr == MAP_FAILED ? nullptr : static_cast<char *>(index_ptr);
+        }
+        ::close(index_fd);
+    }
+    if (index_ptr_ == nullptr && num_records_ > 0)
+    {
+        // Rebuild the index from the records
+        double max_timestamp = 0;
+        uint64_t record_offset = offset;
+        while (scanned_index_.size() < num_records_)
+        {
+            uint64_t start = record_offset;
+            const LogRecordHeader *record = next_record(record_offset);
+            if (record == nullptr)
+            {
+                break;
+            }
+            max_timestamp = scanned_index_.empty() ? record->timestamp : std::max(max_timestamp, record->timestamp);
+            scanned_index_.push_back({max_timestamp, start});
+        }
+        num_records_ = scanned_index_.size();
+    }
+}
+
+LogReader::~LogReader()
+{
+    unmap_();
+}
+
+void LogReader::unmap_()
+{
+    if (ptr_ != nullptr)
+    {
+        munmap(ptr_, mapped_size_);
+        ptr_ = nullptr;
+    }
+    if (index_ptr_ != nullptr)
+    {
+        munmap(index_ptr_, index_mapped_size_);
+        index_ptr_ = nullptr;
+    }
+}
+
+const std::vector<LogTopicInfo> &LogReader::topics() const
+{
+    return topics_;
+}
+
+uint64_t LogReader::size() const
+{
+    return num_records_;
+}
+
+const LogIndexEntry &LogReader::index_entry_(uint64_t index) const
+{
+    if (index_ptr_ != nullptr)
+    {
+        return reinterpret_cast<const LogIndexEntry *>(index_ptr_)[index];
+    }
+    return scanned_index_[index];
+}
+
+LogReader::Record LogReader::record(uint64_t index) const
+{
+    if (index >= num_records_)
+    {
+        throw std::out_of_range("Record " + std::to_string(index) + " is out of range for a log of " +
+                                std::to_string(num_records_) + " records");
+    }
+    uint64_t offset = index_entry_(index).offset;
+    const LogRecordHeader *header = reinterpret_cast<const LogRecordHeader *>(ptr_ + offset);
+    if (offset + sizeof(LogRecordHeader) > mapped_size_ || header->magic != LogRecordHeader::MAGIC ||
+        header->type != LogRecordType::DATA || offset + sizeof(LogRecordHeader) + header->size > mapped_size_ ||
+        header->stream_id >= topics_.size())
+    {
+        throw std::runtime_error("Record " + std::to_string(index) + " of log " + path_ + " is corrupted");
+    }
+    return {header->stream_id, header->sequence, header->timestamp,
+            reinterpret_cast<const char *>(header + 1), header->size};
+}
+
+uint64_t LogReader::seek(double timestamp) const
+{
+    uint64_t low = 0;
+    uint64_t high = num_records_;
+    while (low < high)
+    {
+        uint64_t middle = low + (high - low) / 2;
+        if (index_entry_(middle).timestamp < timestamp)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+std::pair<double, double> LogReader::time_range() const
+{
+    if (num_records_ == 0)
+    {
+        return {0, 0};
+    }
+    return {record(0).timestamp, index_entry_(num_records_ - 1).timestamp};
+}
+
+pybind11::dict LogReader::topics_dict() const
+{
+    static const char *kind_names[] = {"regular", "shared_memory", "tensor"};
+    pybind11::dict topics;
+    for (const LogTopicInfo &info : topics_)
+    {
+        pybind11::dict topic;
+        topic["kind"] = kind_names[info.kind];
+        topic["message_remaining_time_s"] = info.message_remaining_time_s;
+        if (info.kind == LogTopicInfo::SHARED_MEMORY)
+        {
+            topic["shared_memory_size_gb"] = info.shared_memory_size_gb;
+        }
+        if (info.kind == LogTopicInfo::TENSOR)
+        {
+            topic["dtype"] = info.dtype;
+            topic["shape"] = pybind11::cast(info.shape);
+            topic["capacity"] = info.capacity;
+            topic["shared_memory"] = info.shared_memory;
+        }
+        topics[pybind11::str(info.name)] = topic;
+    }
+    return topics;
+}
+
+pybind11::tuple LogReader::read(int64_t index) const
+{
+    if (index < 0)
+    {
+        index += static_cast<int64_t>(num_records_);
+    }
+    if (index < 0)
+    {
+        throw std::out_of_range("Record index out of range");
+    }
+    Record record = this->record(static_cast<uint64_t>(index));
+    return pybind11::make_tuple(topics_[record.stream_id].name, pybind11::bytes(record.data, record.size),
+                                record.timestamp, record.sequence);
+}
@@ -0,0 +1,146 @@
+/**
+ * Copyright (c) 2024 Yihuai Gao
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "topic_registry.h"
+#include <stdexcept>
+
+TopicRegistry::TopicRegistry()
+    : buckets_(new std::atomic<Entry *>[NUM_BUCKETS]), chunks_(new std::atomic<std::atomic<Entry *> *>[MAX_CHUNKS]),
+      size_(0)
+{
+    for (size_t i = 0; i < NUM_BUCKETS; ++i)
+    {
+        buckets_[i].store(nullptr);
+    }
+    for (size_t i = 0; i < MAX_CHUNKS; ++i)
+    {
+        chunks_[i].store(nullptr);
+    }
+}
+
+TopicRegistry::~TopicRegistry()
+{
+    uint32_t size = size_.load();
+    for (uint32_t id = 0; id < size; ++id)
+    {
+        delete entry_(id);
+    }
+    for (size_t i = 0; i < MAX_CHUNKS; ++i)
+    {
+        delete[] chunks_[i].load();
+    }
+}
+
+int64_t TopicRegistry::add(const std::string &name, std::unique_ptr<DataTopic> topic)
+{
+    return emplace(name, [&topic]() { return std::move(topic); });
+}
+
+int64_t TopicRegistry::emplace(const std::string &name, const std::function<std::unique_ptr<DataTopic>()> &make_topic)
+{
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    if (find_entry_(name) != nullptr)
+    {
+        return -1;
+    }
+    uint32_t id = size_.load();
+    size_t chunk_idx = id >> CHUNK_BITS;
+    if (chunk_idx >= MAX_CHUNKS)
+    {
+        throw std::runtime_error("Too many topics");
+    }
+    if (chunks_[chunk_idx].load() == nullptr)
+    {
+        auto *chunk = new std::atomic<Entry *>[CHUNK_SIZE];
+        for (size_t i = 0; i < CHUNK_SIZE; ++i)
+        {
+            chunk[i].store(nullptr);
+        }
+        chunks_[chunk_idx].store(chunk, std::memory_order_release);
+    }
+
+    std::unique_ptr<DataTopic> topic = make_topic();
+    Entry *entry = new Entry();
+    entry->name = name;
+    entry->id = id;
+    entry->topic = std::move(topic);
+    std::atomic<Entry *> &bucket = buckets_[std::hash<std::string>()(name) % NUM_BUCKETS];
+    entry->next_in_bucket.store(bucket.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+    // Publish the fully constructed entry. Readers that have not seen it yet simply do not find the topic.
+    chunks_[chunk_idx].load()[id & (CHUNK_SIZE - 1)].store(entry, std::memory_order_release);
+    bucket.store(entry, std::memory_order_release);
+    size_.store(id + 1, std::memory_order_release);
+    return id;
+}
+
+const TopicRegistry::Entry *TopicRegistry::find_entry_(const std::string &name) const
+{
+    const Entry *entry = buckets_[std::hash<std::string>()(name) % NUM_BUCKETS].load(std::memory_order_acquire);
+    while (entry != nullptr)
+    {
+        if (entry->name == name)
+        {
+            return entry;
+        }
+        entry = entry->next_in_bucket.load(std::memory_order_acquire);
+    }
+    return nullptr;
+}
+
+const TopicRegistry::Entry *TopicRegistry::entry_(uint32_t id) const
+{
+    if (id >= size_.load(std::memory_order_acquire))
+    {
+        return nullptr;
+    }
+    std::atomic<Entry *> *chunk = chunks_[id >> CHUNK_BITS].load(std::memory_order_acquire);
+    return chunk[id & (CHUNK_SIZE - 1)].load(std::memory_order_acquire);
+}
+
+DataTopic *TopicRegistry::find(const std::string &name) const
+{
+    const Entry *entry = find_entry_(name);
+    return entry == nullptr ? nullptr : entry->topic.get();
+}
+
+DataTopic *TopicRegistry::find(uint32_t id) const
+{
+    const Entry *entry = entry_(id);
+    return entry == nullptr ? nullptr : entry->topic.get();
+}
+
+int64_t TopicRegistry::find_id(const std::string &name) const
+{
+    const Entry *entry = find_entry_(name);
+    return entry == nullptr ? -1 : entry->id;
+}
+
+const std::string &TopicRegistry::name(uint32_t id) const
+{
+    const Entry *entry = entry_(id);
+    if (entry == nullptr)
+    {
+        throw std::out_of_range("Unknown topic id " + std::to_string(id));
+    }
+    return entry->name;
+}
+
+uint32_t TopicRegistry::size() const
+{
+    return size_.load(std::memory_order_acquire);
+}
+
+void TopicRegistry::for_each(const std::function<void(uint32_t id, const std::string &name, DataTopic &topic)> &fn) const
+{
+    uint32_t size = size_.load(std::memory_order_acquire);
+    for (uint32_t id = 0; id < size; ++id)
+    {
+        const Entry *entry = entry_(id);
+        fn(entry->id, entry->name, *entry->topic);
+    }
+}
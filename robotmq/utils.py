@@ -3,30 +3,19 @@ import pickle
 from typing import Any
 import os
 import warnings
+from .core.robotmq_core import serialize_object, deserialize_object
 
 
-def _serialize(data: Any):
-    if isinstance(data, dict):
-        return {key: _serialize(value) for key, value in data.items()}
-    elif isinstance(data, list):
-        return [_serialize(item) for item in data]
-    elif isinstance(data, tuple):
-        return tuple(_serialize(item) for item in data)
-    elif isinstance(data, np.ndarray):
-        return (data.data.tobytes(), data.dtype.str, data.shape)
-    # elif (
-    #     isinstance(data, bytes)
-    #     or isinstance(data, str)
-    #     or isinstance(data, int)
-    #     or isinstance(data, float)
-    #     or data is None
-    # ):
-    else:
-        return data
+_SERIALIZED_OBJECT_MAGIC = b"\x0d\x0a\x0d\x10"
 
 
 def serialize(data: Any) -> bytes:
-    return pickle.dumps(_serialize(data))
+    """Encode nested dicts/lists/tuples of numpy arrays and plain Python values.
+
+    Arrays are written as raw aligned buffers after a compact header, so each array is copied once. Other objects
+    are pickled.
+    """
+    return serialize_object(data)
 
 
 def _deserialize(data: Any):
@@ -60,12 +49,18 @@ def _deserialize(data: Any):
         return data
 
 
-def deserialize(data: bytes) -> Any:
+def deserialize(data: bytes, copy: bool = True) -> Any:
+    """Decode data from `serialize`, or pickled data from older versions of robotmq.
+
+    With `copy=False`, arrays are views of `data` instead of copies (read-only if `data` is immutable, e.g. `bytes`).
+    """
     if len(data) == 0:
         warnings.warn(
             "robotmq.utils.deserialize: Received empty data. Will return None"
         )
         return None
+    if bytes(memoryview(data)[:4]) == _SERIALIZED_OBJECT_MAGIC:
+        return deserialize_object(data, copy)
     return _deserialize(pickle.loads(data))
 
 
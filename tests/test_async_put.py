@@ -0,0 +1,117 @@
+"""Tests for put_data_async on RMQServer and RMQClient."""
+
+import numpy as np
+import robotmq
+
+
+class TestAsyncPut:
+    def test_async_put_regular_topic(self, server_client):
+        server, client = server_client
+        server.add_topic("t", 10.0)
+
+        for i in range(100):
+            assert server.put_data_async("t", str(i).encode())
+        assert server.flush_async_put(5.0)
+
+        data, ts = server.peek_data("t", 0)
+        assert data == [str(i).encode() for i in range(100)]
+        for i in range(1, len(ts)):
+            assert ts[i] >= ts[i - 1]
+
+        data, _ = client.peek_data("t", -1)
+        assert data[0] == b"99"
+
+    def test_async_put_shm_topic(self, server_client):
+        server, client = server_client
+        server.add_shared_memory_topic("shm", 10.0, 0.1)
+
+        arr = np.random.rand(1000, 100)
+        assert server.put_data_async("shm", arr.tobytes())
+        assert server.flush_async_put(5.0)
+
+        data, _ = client.peek_data("shm", -1)
+        np.testing.assert_array_equal(np.frombuffer(data[0], dtype=np.float64).reshape(arr.shape), arr)
+
+    def test_async_put_stats(self, server_client):
+        server, _ = server_client
+        server.add_topic("t", 10.0)
+
+        for _ in range(10):
+            server.put_data_async("t", b"abc")
+        server.flush_async_put(5.0)
+
+        stats = server.get_async_put_stats()
+        assert stats["enqueued"] == 10
+        assert stats["enqueued_bytes"] == 30
+        assert stats["processed"] == 10
+        assert stats["dropped"] == 0
+        assert stats["queue_size"] == 0
+        assert stats["max_queue_size"] >= 1
+
+    def test_async_put_backpressure(self, server_client):
+        server, _ = server_client
+        server.add_topic("t", 10.0)
+        server.set_async_put_capacity(1)
+
+        payload = b"x" * 10_000_000
+        accepted = [server.put_data_async("t", payload) for _ in range(50)]
+        server.flush_async_put(5.0)
+
+        stats = server.get_async_put_stats()
+        assert stats["enqueued"] == sum(accepted)
+        assert stats["dropped"] == len(accepted) - sum(accepted)
+        assert stats["max_queue_size"] <= 2
+
+
+class TestClientAsyncPut:
+    def test_coalesced_puts_keep_order_and_timestamps(self, server_client):
+        server, client = server_client
+        server.add_topic("telemetry", 10.0)
+        client.set_async_put_options(max_batch_messages=16, max_delay_s=0.01)
+
+        put_times = []
+        for i in range(100):
+            put_times.append(client.get_timestamp())
+            assert client.put_data_async("telemetry", str(i).encode())
+        assert client.flush_async_put(5.0)
+
+        data, ts = server.peek_data("telemetry", 0)
+        assert data == [str(i).encode() for i in range(100)]
+        # Timestamps are taken by the producer, not when the batch arrives
+        for put_time, timestamp in zip(put_times, ts):
+            assert timestamp >= put_time
+        assert ts[-1] - ts[0] <= put_times[-1] - put_times[0] + 0.01
+
+        stats = client.get_async_put_stats()
+        assert stats["enqueued"] == 100
+        assert stats["sent"] == 100
+        assert stats["processed"] == 100
+        assert stats["failed"] == 0
+        assert 1 <= stats["sent_requests"] < 100
+
+    def test_error_reported_through_callback(self, server_client):
+        server, client = server_client
+        events = []
+        client.set_async_put_callback(lambda *event: events.append(event))
+        assert client.put_data_async("missing_topic", b"abc")
+        assert client.put_data_async("missing_topic", b"def")
+        assert client.flush_async_put(5.0)
+
+        assert len(events) >= 1
+        assert all(event[0] == "error" and event[1] == "missing_topic" for event in events)
+        assert sum(event[2] for event in events) == 2
+        assert client.get_async_put_stats()["failed"] == 2
+
+    def test_drop_when_queue_full(self, server_client):
+        server, client = server_client
+        server.add_topic("telemetry", 10.0)
+        client.set_async_put_options(max_queued_messages=1, max_delay_s=0.0)
+        events = []
+        client.set_async_put_callback(lambda *event: events.append(event))
+
+        accepted = sum(client.put_data_async("telemetry", b"x" * 1000) for _ in range(1000))
+        assert client.flush_async_put(5.0)
+        stats = client.get_async_put_stats()
+        assert stats["dropped"] == 1000 - accepted
+        assert len([e for e in events if e[0] == "dropped"]) == stats["dropped"]
+        assert len(server.peek_data("telemetry", 0)[0]) == accepted
@@ -0,0 +1,137 @@
+"""Tests for chunked transfers of large payloads."""
+
+import os
+import threading
+
+import pytest
+
+
+def test_put_data_in_chunks(server_client):
+    server, client = server_client
+    server.add_topic("bulk", 10.0)
+    client.set_chunk_size(1000)
+    progress = []
+    client.set_progress_callback(lambda topic, done, total: progress.append((topic, done, total)))
+    payload = os.urandom(10_500)
+    client.put_data("bulk", payload)
+    client.put_data("bulk", b"small")
+
+    data, _ = server.peek_data("bulk", 0)
+    assert data == [payload, b"small"]
+    assert len(progress) == 11
+    assert progress[-1] == ("bulk", 10_500, 10_500)
+    assert [done for _, done, _ in progress] == sorted(done for _, done, _ in progress)
+
+
+def test_peek_data_in_chunks(server_client):
+    server, client = server_client
+    server.add_topic("bulk", 10.0)
+    server.set_chunking(4096)
+    client.set_inline_payloads(True)  # Behave like a client on another host
+    client.set_chunk_size(1000)
+    progress = []
+    client.set_progress_callback(lambda topic, done, total: progress.append(done))
+    payload = os.urandom(20_000)
+    server.put_data("bulk", b"small")
+    server.put_data("bulk", payload)
+
+    data, _ = client.peek_data("bulk", 0)
+    assert data == [b"small", payload]
+    assert progress[-1] == 20_000
+    data, _ = client.get_last_retrieved_data()
+    assert data == [b"small", payload]
+    data, _ = client.pop_data("bulk", -1)
+    assert data == [payload]
+
+
+def test_local_client_not_chunked(server_client):
+    server, client = server_client
+    server.add_topic("bulk", 10.0)
+    server.set_chunking(4096)
+    progress = []
+    client.set_progress_callback(lambda topic, done, total: progress.append(done))
+    payload = os.urandom(20_000)
+    server.put_data("bulk", payload)
+
+    assert client.peek_data("bulk", 0)[0] == [payload]
+    assert progress == []
+
+
+def test_shm_topic_remote_client_in_chunks(server_client):
+    server, client = server_client
+    server.add_shared_memory_topic("bulk_shm", 10.0, 0.01)
+    server.set_chunking(4096)
+    client.set_inline_payloads(True)  # Behave like a client on another host
+    client.set_chunk_size(1000)
+    payload = os.urandom(50_000)
+    server.put_data("bulk_shm", payload)
+
+    data, _ = client.peek_data("bulk_shm", -1)
+    assert data == [payload]
+
+
+def test_chunking_disabled(server_client):
+    server, client = server_client
+    server.add_topic("bulk", 10.0)
+    server.set_chunking(1000)
+    client.set_chunk_size(0)
+    progress = []
+    client.set_progress_callback(lambda topic, done, total: progress.append(done))
+    payload = os.urandom(10_000)
+    client.put_data("bulk", payload)
+
+    data, _ = client.peek_data("bulk", 1)
+    assert data == [payload]
+    assert progress == []
+
+
+def test_upload_larger_than_pending_budget(server_client):
+    server, client = server_client
+    server.add_topic("bulk", 10.0)
+    server.set_chunking(4096, max_pending_upload_bytes=5000)
+    client.set_chunk_size(1000)
+    with pytest.raises(RuntimeError):
+        client.put_data("bulk", os.urandom(10_000))
+    client.put_data("bulk", os.urandom(4000))
+    assert len(server.peek_data("bulk", 0)[0]) == 1
+
+
+@pytest.mark.parametrize("num_connections", [1, 3])
+def test_striped_transfers(server_client, num_connections):
+    server, client = server_client
+    server.add_topic("bulk", 10.0)
+    server.add_topic("control", 10.0)
+    server.set_chunking(4096)
+    client.set_chunk_size(1000)
+    client.set_data_connections(num_connections)
+    payload = os.urandom(30_500)
+    client.put_data("bulk", payload)
+    client.put_data("control", b"small")
+
+    data, _ = client.peek_data("bulk", 0)
+    assert data == [payload]
+    assert client.peek_data("control", 0)[0] == [b"small"]
+    assert server.peek_data("bulk", 0)[0] == [payload]
+
+    client.set_data_connections(0)
+    assert client.pop_data("bulk", 0)[0] == [payload]
+
+
+def test_control_requests_during_transfer(server_client):
+    server, client = server_client
+    server.add_topic("bulk", 10.0)
+    server.add_topic("control", 10.0)
+    client.set_chunk_size(1000)
+    client.set_data_connections(2)
+    payload = os.urandom(500_000)
+    upload = threading.Thread(target=lambda: [client.put_data("bulk", payload) for _ in range(3)])
+    upload.start()
+    num_control_requests = 0
+    while upload.is_alive() or num_control_requests == 0:
+        client.put_data("control", b"small")
+        assert client.get_topic_status("control", 1.0) > 0
+        num_control_requests += 1
+    upload.join()
+
+    assert server.peek_data("bulk", 0)[0] == [payload] * 3
+    assert len(server.peek_data("control", 0)[0]) == num_control_requests
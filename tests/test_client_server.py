@@ -127,6 +127,63 @@ class TestClientTopicStatus:
         assert "-2" in result.stdout
 
 
+class TestTopicIds:
+    def test_many_topics_resolved_once(self, server_client):
+        server, client = server_client
+        for i in range(5):
+            server.add_topic(f"topic_{i}", 10.0)
+        time.sleep(0.05)
+
+        for _ in range(3):
+            for i in range(5):
+                client.put_data(f"topic_{i}", str(i).encode())
+        for i in range(5):
+            data, _ = client.pop_data(f"topic_{i}", 0)
+            assert data == [str(i).encode()] * 3
+
+    def test_topic_added_after_first_request(self, server_client):
+        server, client = server_client
+        with pytest.raises(RuntimeError):
+            client.peek_data("late", 1)
+
+        server.add_topic("late", 10.0)
+        server.put_data("late", b"here")
+        data, _ = client.peek_data("late", 1)
+        assert data == [b"here"]
+
+    def test_missing_topic_resolved_once(self, server_client):
+        server, client = server_client
+        for _ in range(3):
+            with pytest.raises(RuntimeError):
+                client.peek_data("missing", 1)
+        server.add_topic("missing", 10.0)
+        server.put_data("missing", b"here")
+        for _ in range(3):
+            assert client.peek_data("missing", 1)[0] == [b"here"]
+        # Once when the topic did not exist, and once more after a request by name succeeded
+        assert server.get_stats()["commands"]["RESOLVE_TOPIC"]["count"] == 2
+
+    def test_server_restart_invalidates_ids(self, endpoint):
+        client = robotmq.RMQClient("test_client", endpoint, robotmq.RMQLogLevel.WARNING)
+        server = robotmq.RMQServer("test_server", endpoint, robotmq.RMQLogLevel.WARNING)
+        server.add_topic("a", 10.0)
+        server.add_topic("b", 10.0)
+        server.put_data("b", b"old_b")
+        data, _ = client.peek_data("b", 1)
+        assert data == [b"old_b"]
+        del server
+        time.sleep(0.2)
+
+        # The restarted server registers the topics in a different order, so the cached id of "b" now points to "a"
+        server = robotmq.RMQServer("test_server", endpoint, robotmq.RMQLogLevel.WARNING)
+        server.add_topic("b", 10.0)
+        server.add_topic("a", 10.0)
+        server.put_data("a", b"new_a")
+        server.put_data("b", b"new_b")
+        data, _ = client.peek_data("b", 1, timeout_s=1.0)
+        assert data == [b"new_b"]
+
+
 class TestClientGetLastRetrievedData:
     def test_after_peek(self, server_client):
         server, client = server_client
@@ -1,6 +1,7 @@
 """Tests for clock utility functions."""
 
 import time
+import pytest
 import robotmq
 
 
@@ -30,3 +31,38 @@ class TestClockFunctions:
         t2 = robotmq.steady_clock_us()
         # Two back-to-back calls should differ by at most a few thousand us
         assert (t2 - t1) < 1_000_000  # less than 1 second apart
+
+
+class TestClockSynchronization:
+    def test_offset_of_server_in_same_process(self, server_client):
+        server, client = server_client
+        assert client.get_clock_offset() is None
+        estimate = client.synchronize_clock(num_samples=4)
+        assert estimate["num_samples"] == 4
+        assert 0 <= estimate["rtt_s"] < 0.1
+        # Both clocks started when their objects were created
+        expected_offset_s = server.get_timestamp() - client.get_timestamp()
+        assert abs(estimate["offset_s"] - expected_offset_s) < estimate["rtt_s"] + 0.001
+
+    def test_offset_follows_client_reset(self, server_client):
+        server, client = server_client
+        now_us = robotmq.system_clock_us()
+        server.reset_start_time(now_us)
+        client.synchronize_clock()
+        client.reset_start_time(now_us)
+        assert abs(client.get_clock_offset()["offset_s"]) < 0.01
+
+    def test_background_sync(self, server_client):
+        _, client = server_client
+        client.start_clock_sync(interval_s=0.05, num_samples=2)
+        time.sleep(0.3)
+        first = client.get_clock_offset()
+        time.sleep(0.2)
+        client.stop_clock_sync()
+        assert first is not None and first["age_s"] < 0.2
+        assert client.get_clock_offset()["age_s"] < 0.2
+
+    def test_unreachable_server(self, endpoint):
+        client = robotmq.RMQClient("lonely_client", endpoint, robotmq.RMQLogLevel.ERROR)
+        with pytest.raises(RuntimeError):
+            client.synchronize_clock(num_samples=1, timeout_s=0.05)
@@ -0,0 +1,76 @@
+"""Tests for per-topic compression of data sent to remote clients."""
+
+import numpy as np
+import pytest
+import robotmq
+
+
+def _frame():
+    # Smooth depth-like image with a little noise, which compresses well
+    y, x = np.mgrid[0:240, 0:320]
+    depth = (1000 + 3 * x + 2 * y).astype(np.uint16)
+    depth[::7, ::5] += 1
+    return depth.tobytes()
+
+
+@pytest.mark.parametrize("compression", [c for c in ["lz4", "zstd"]])
+class TestTopicCompression:
+    @pytest.fixture(autouse=True)
+    def _require_codec(self, compression):
+        if compression not in robotmq.get_available_compressions():
+            pytest.skip(f"{compression} is not available in this build")
+
+    def test_remote_client_receives_original_data(self, server_client, compression):
+        server, client = server_client
+        server.add_topic("depth", 10.0)
+        server.set_topic_compression("depth", compression)
+        client.set_inline_payloads(True)  # Behave like a client on another host
+        frame = _frame()
+        server.put_data("depth", frame)
+        server.put_data("depth", b"small")
+
+        data, _ = client.peek_data("depth", 0)
+        assert data == [frame, b"small"]
+        # Served from the compressed cache the second time
+        data, _ = client.pop_data("depth", 0)
+        assert data == [frame, b"small"]
+
+    def test_shm_topic_remote_client(self, server_client, compression):
+        server, client = server_client
+        server.add_shared_memory_topic("depth_shm", 10.0, 0.01)
+        server.set_topic_compression("depth_shm", compression, 1)
+        client.set_inline_payloads(True)
+        frame = _frame()
+        server.put_data("depth_shm", frame)
+
+        data, _ = client.peek_data("depth_shm", -1)
+        assert data == [frame]
+
+    def test_local_client_unaffected(self, server_client, compression):
+        server, client = server_client
+        server.add_shared_memory_topic("depth_shm", 10.0, 0.01)
+        server.set_topic_compression("depth_shm", compression)
+        frame = _frame()
+        server.put_data("depth_shm", frame)
+
+        data, _ = client.peek_data("depth_shm", -1)
+        assert data == [frame]
+
+
+def test_unknown_compression(server_client):
+    server, _ = server_client
+    server.add_topic("t", 10.0)
+    with pytest.raises(ValueError):
+        server.set_topic_compression("t", "gzip")
+
+
+@pytest.mark.parametrize("inline", [False, True])
+def test_payload_that_looks_compressed(server_client, inline):
+    server, client = server_client
+    server.add_topic("t", 10.0)
+    client.set_inline_payloads(inline)
+    # Starts with the compression header and claims a decompressed size of 2**62 bytes
+    fake = b"\x0d\x0a\x0d\x0e\x01" + (2**62).to_bytes(8, "little") + b"payload"
+    client.put_data("t", fake)
+    assert client.peek_data("t", 0)[0] == [fake]
+    assert server.peek_data("t", 0)[0] == [fake]
@@ -0,0 +1,109 @@
+"""Tests for consumer groups with independent cursors on one stored copy of the items."""
+
+import threading
+import time
+import numpy as np
+import robotmq
+
+
+class TestConsumerGroups:
+    def test_broadcast_between_groups(self, server_client):
+        server, client = server_client
+        server.add_topic("t", 10.0)
+        # Groups are created by their first consume and only hold back items from then on
+        assert server.consume_data("t", "a")[0] == []
+        assert client.consume_data("t", "b")[0] == []
+        for i in range(4):
+            server.put_data("t", bytes([i]))
+
+        data, _ = server.consume_data("t", "a", 0)
+        assert data == [bytes([i]) for i in range(4)]
+        data, _ = client.consume_data("t", "b", 2)
+        assert data == [bytes([0]), bytes([1])]
+        # Released up to the slowest group
+        assert server.get_all_topic_status()["t"] == 2
+        assert server.get_consumer_groups("t") == {"a": 0, "b": 2}
+
+        server.put_data("t", b"new")
+        assert server.consume_data("t", "a")[0] == [b"new"]
+        assert client.consume_data("t", "b", 0)[0] == [bytes([2]), bytes([3]), b"new"]
+        assert server.get_all_topic_status()["t"] == 0
+        assert server.get_stats()["topics"]["t"]["messages_consumed"] == 10
+
+    def test_work_queue_within_a_group(self, server_client, endpoint):
+        server, client = server_client
+        server.add_shared_memory_topic("shm", 10.0, 0.01)
+        other_client = robotmq.RMQClient("other_client", endpoint, robotmq.RMQLogLevel.WARNING)
+        for i in range(6):
+            server.put_data("shm", f"job{i}".encode() * 10)
+
+        seen = []
+        for consumer in [client, other_client, client]:
+            data, _ = consumer.consume_data("shm", "workers", 2)
+            seen += data
+        assert seen == [f"job{i}".encode() * 10 for i in range(6)]
+        assert client.consume_data("shm", "workers")[0] == []
+        assert server.get_all_topic_status()["shm"] == 0
+
+    def test_newest_items_skip_older_ones(self, server_client):
+        server, _ = server_client
+        server.add_topic("t", 10.0)
+        for i in range(5):
+            server.put_data("t", bytes([i]))
+        assert server.consume_data("t", "latest", -2)[0] == [bytes([3]), bytes([4])]
+        assert server.consume_data("t", "latest", 0)[0] == []
+        assert server.get_all_topic_status()["t"] == 0
+
+    def test_slow_group_and_removal(self, server_client):
+        server, _ = server_client
+        server.add_topic("t", 10.0)
+        for i in range(3):
+            server.put_data("t", bytes([i]))
+        server.consume_data("t", "slow", 1)
+        server.consume_data("t", "fast", 0)
+        # Peeks and other readers still see the items the slow group holds back
+        assert server.peek_data("t", 0)[0] == [bytes([1]), bytes([2])]
+        server.remove_consumer_group("t", "slow")
+        assert server.get_all_topic_status()["t"] == 0
+        assert server.get_consumer_groups("t") == {"fast": 0}
+
+    def test_tensor_topic(self, server_client):
+        server, client = server_client
+        server.add_tensor_topic("tensor", np.int32, [2], capacity=4)
+        for i in range(6):
+            server.put_tensor("tensor", np.full(2, i, dtype=np.int32))
+        # The two oldest items were overwritten before the group was created
+        data, _ = client.consume_data("tensor", "g", 0)
+        assert [int(np.frombuffer(item, np.int32)[0]) for item in data] == [2, 3, 4, 5]
+        assert server.get_all_topic_status()["tensor"] == 0
+        server.put_tensor("tensor", np.full(2, 6, dtype=np.int32))
+        data, _ = client.consume_data("tensor", "g")
+        assert int(np.frombuffer(data[0], np.int32)[0]) == 6
+
+    def test_retry_returns_the_same_items(self, server_client, endpoint):
+        server, client = server_client
+        server.add_topic("t", 10.0)
+        server.add_topic("rpc", 10.0)
+        for i in range(2):
+            server.put_data("t", bytes([i]))
+        client.peek_data("t", 0)  # Handshake before the server is blocked
+
+        # An unanswered request_with_data keeps the server from replying, so the consume below times out and is
+        # resent after the server already consumed the items for the first attempt
+        other_client = robotmq.RMQClient("other_client", endpoint, robotmq.RMQLogLevel.WARNING)
+        requester = threading.Thread(target=lambda: other_client.request_with_data("rpc", b"x", timeout_s=5.0))
+        requester.start()
+
+        def reply_later():
+            time.sleep(0.5)
+            data, topic = server.wait_for_request(5.0)
+            server.reply_request(topic, data)
+
+        replier = threading.Thread(target=reply_later)
+        replier.start()
+        time.sleep(0.1)
+        data, _ = client.consume_data("t", "g", 0, timeout_s=0.1)
+        requester.join()
+        replier.join()
+        assert data == [bytes([0]), bytes([1])]
+        assert server.get_consumer_groups("t") == {"g": 0}
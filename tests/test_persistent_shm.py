@@ -0,0 +1,109 @@
+"""Tests for reattaching to the shared memory of a restarted server."""
+
+import gc
+import os
+import numpy as np
+import pytest
+import robotmq
+
+
+def _server(name, endpoint):
+    return robotmq.RMQServer(name, endpoint, robotmq.RMQLogLevel.WARNING, persistent_shm=True)
+
+
+def _restart(name, endpoint):
+    """Starts the server again once the caller dropped the previous one."""
+    gc.collect()
+    return _server(name, endpoint)
+
+
+class TestPersistentSharedMemory:
+    def test_ring_items_survive_restart(self, endpoint):
+        server = _server("persist_ring", endpoint)
+        server.add_shared_memory_topic("shm", 100.0, 0.01)
+        server.add_topic("regular", 100.0)
+        for i in range(5):
+            server.put_data("shm", f"item{i}".encode() * 100)
+        server.put_data("regular", b"lost")
+        _, timestamps = server.peek_data("shm", 0)
+
+        del server
+        server = _restart("persist_ring", endpoint)
+        assert server.get_all_topic_status() == {"shm": 5, "regular": 0}
+        data, restored_timestamps = server.peek_data("shm", 0)
+        assert data == [f"item{i}".encode() * 100 for i in range(5)]
+        # The timestamps are moved to the clock of the new server, so the items keep their age
+        assert all(t < server.get_timestamp() for t in restored_timestamps)
+        assert np.allclose(np.diff(restored_timestamps), np.diff(timestamps))
+
+        # Adding the topic again is a no-op, and new items go after the restored ones
+        server.add_shared_memory_topic("shm", 100.0, 0.01)
+        server.put_data("shm", b"new")
+        client = robotmq.RMQClient("persist_client", endpoint, robotmq.RMQLogLevel.WARNING)
+        data, _ = client.peek_data("shm", 0)
+        assert data[0] == b"item0" * 100 and data[-1] == b"new" and len(data) == 6
+        server.discard_persistent_state()
+
+    def test_popped_items_are_not_restored(self, endpoint):
+        server = _server("persist_pop", endpoint)
+        server.add_shared_memory_topic("shm", 100.0, 0.01)
+        for i in range(4):
+            server.put_data("shm", bytes([i]) * 10)
+        server.pop_data("shm", 1)
+        server.pop_data("shm", -1)
+
+        del server
+        server = _restart("persist_pop", endpoint)
+        data, _ = server.peek_data("shm", 0)
+        assert data == [bytes([1]) * 10, bytes([2]) * 10]
+        server.discard_persistent_state()
+
+    def test_tensor_slots_survive_restart(self, endpoint):
+        server = _server("persist_tensor", endpoint)
+        server.add_tensor_topic("t", np.float32, [2, 2], capacity=4)
+        for i in range(6):
+            server.put_tensor("t", np.full((2, 2), i, dtype=np.float32))
+
+        del server
+        server = _restart("persist_tensor", endpoint)
+        arrays, _ = server.peek_tensor("t", 0)
+        assert [float(array[0, 0]) for array in arrays] == [2.0, 3.0, 4.0, 5.0]
+        server.put_tensor("t", np.full((2, 2), 6, dtype=np.float32))
+        arrays, _ = server.peek_tensor("t", 0)
+        assert [float(array[0, 0]) for array in arrays] == [3.0, 4.0, 5.0, 6.0]
+        server.discard_persistent_state()
+
+    def test_one_server_per_name(self, endpoint):
+        server = _server("persist_lock", endpoint)
+        with pytest.raises(RuntimeError):
+            _server("persist_lock", endpoint + "_other")
+        server.discard_persistent_state()
+
+    def test_discard_persistent_state(self, endpoint):
+        server = _server("persist_discard", endpoint)
+        server.add_shared_memory_topic("shm", 100.0, 0.01)
+        server.put_data("shm", b"x")
+        server.discard_persistent_state()
+        del server
+        server = _restart("persist_discard", endpoint)
+        assert not any("persist_discard" in name and "topics" not in name for name in os.listdir("/dev/shm"))
+        assert server.get_all_topic_status() == {}
+        server.discard_persistent_state()
+
+    def test_incomplete_index_is_rewritten(self, endpoint):
+        server = _server("persist_index", endpoint)
+        server.add_topic("a", 100.0)
+        server.add_topic("b", 100.0)
+        del server
+        gc.collect()
+        (path,) = [
+            os.path.join("/dev/shm", name) for name in os.listdir("/dev/shm") if name.endswith("_persist_index_topics")
+        ]
+        with open(path, "ab") as index:
+            index.write(b"\x40\x00\x00\x00partial")  # What a server that died while writing may leave behind
+        size = os.path.getsize(path)
+
+        server = _restart("persist_index", endpoint)
+        assert server.get_all_topic_status() == {"a": 0, "b": 0}
+        assert os.path.getsize(path) == size - 11
+        server.discard_persistent_state()
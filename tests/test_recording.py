@@ -0,0 +1,161 @@
+"""Tests for recording topics to a log file and reading it back."""
+
+import threading
+import time
+import numpy as np
+import pytest
+import robotmq
+
+
+class TestRecording:
+    def test_record_and_read(self, server_client, tmp_path):
+        server, client = server_client
+        server.add_topic("regular", 10.0)
+        server.add_shared_memory_topic("shm", 10.0, 0.01)
+        server.add_topic("ignored", 10.0)
+        path = str(tmp_path / "run.rmqlog")
+        server.put_data("regular", b"before")  # Not recorded
+        server.start_recording(path, ["regular", "shm"])
+        server.put_data("regular", b"a")
+        server.put_data("shm", b"b" * 1000)
+        client.put_data("regular", b"c")
+        server.put_data("ignored", b"d")
+        handle, buf = server.reserve("shm", 3)
+        buf[:] = np.frombuffer(b"xyz", dtype=np.uint8)
+        server.commit(handle)
+        server.stop_recording()
+
+        reader = robotmq.RMQLogReader(path)
+        assert reader.topics() == {
+            "regular": {"kind": "regular", "message_remaining_time_s": 10.0},
+            "shm": {"kind": "shared_memory", "message_remaining_time_s": 10.0, "shared_memory_size_gb": 0.01},
+        }
+        records = [reader.read(i) for i in range(len(reader))]
+        assert [(topic, data, sequence) for topic, data, _, sequence in records] == [
+            ("regular", b"a", 2),
+            ("shm", b"b" * 1000, 1),
+            ("regular", b"c", 3),
+            ("shm", b"xyz", 2),
+        ]
+        assert reader.read(-1)[1] == b"xyz"
+        with pytest.raises(IndexError):
+            reader.read(4)
+
+    def test_tensor_topic(self, server_client, tmp_path):
+        server, _ = server_client
+        server.add_tensor_topic("t", np.float32, [2, 3], capacity=2)
+        path = str(tmp_path / "tensor.rmqlog")
+        server.start_recording(path)
+        for i in range(5):
+            server.put_tensor("t", np.full((2, 3), i, dtype=np.float32))
+        server.stop_recording()
+
+        reader = robotmq.RMQLogReader(path)
+        info = reader.topics()["t"]
+        assert info["kind"] == "tensor" and info["dtype"] == "<f4" and info["shape"] == [2, 3]
+        assert info["capacity"] == 2 and info["shared_memory"]
+        assert len(reader) == 5  # Including the items overwritten in the slot ring
+        for i in range(5):
+            _, data, _, _ = reader.read(i)
+            np.testing.assert_array_equal(np.frombuffer(data, np.float32), np.full(6, i))
+
+    def test_seek_by_time(self, server_client, tmp_path):
+        server, _ = server_client
+        server.add_topic("t", 100.0)
+        path = str(tmp_path / "seek.rmqlog")
+        server.start_recording(path, ["t"])
+        for i in range(50):
+            server.put_data("t", str(i).encode())
+        server.stop_recording()
+
+        reader = robotmq.RMQLogReader(path)
+        timestamps = [reader.read(i)[2] for i in range(len(reader))]
+        first, last = reader.time_range()
+        assert first == timestamps[0] and last == timestamps[-1]
+        assert reader.seek(first - 1.0) == 0
+        assert reader.seek(last + 1.0) == len(reader)
+        index = reader.seek(timestamps[20])
+        assert timestamps[index] == timestamps[20] and (index == 0 or timestamps[index - 1] < timestamps[20])
+
+    def test_index_is_rebuilt_if_missing(self, server_client, tmp_path):
+        server, _ = server_client
+        server.add_topic("t", 10.0)
+        path = tmp_path / "noindex.rmqlog"
+        server.start_recording(str(path))
+        for i in range(10):
+            server.put_data("t", bytes([i]) * (i + 1))
+        server.stop_recording()
+        (tmp_path / "noindex.rmqlog.idx").unlink()
+
+        reader = robotmq.RMQLogReader(str(path))
+        assert len(reader) == 10
+        assert reader.read(7)[1] == bytes([7]) * 8
+
+    def test_read_while_recording(self, server_client, tmp_path):
+        server, _ = server_client
+        server.add_topic("t", 10.0)
+        path = str(tmp_path / "live.rmqlog")
+        server.start_recording(path)
+        server.put_data("t", b"first")
+        # The header is updated once the writer thread has written the queued items
+        for _ in range(200):
+            reader = robotmq.RMQLogReader(path)
+            if len(reader) == 1:
+                break
+            time.sleep(0.01)
+        assert len(reader) == 1 and reader.read(0)[1] == b"first"
+        server.stop_recording()
+
+    def test_read_during_steady_stream(self, server_client, tmp_path):
+        server, _ = server_client
+        server.add_topic("t", 10.0)
+        path = str(tmp_path / "stream.rmqlog")
+        server.start_recording(path)
+        stop = threading.Event()
+
+        def put_loop():
+            while not stop.is_set():
+                server.put_data("t", b"x" * 100)
+
+        thread = threading.Thread(target=put_loop)
+        thread.start()
+        try:
+            # The header is committed periodically even if the writer never runs out of queued items
+            deadline = time.time() + 2.0
+            while time.time() < deadline and len(robotmq.RMQLogReader(path)) == 0:
+                time.sleep(0.01)
+            assert len(robotmq.RMQLogReader(path)) > 0
+            assert thread.is_alive()
+        finally:
+            stop.set()
+            thread.join()
+        server.stop_recording()
+
+    def test_stats_and_errors(self, server_client, tmp_path):
+        server, _ = server_client
+        server.add_topic("t", 10.0)
+        with pytest.raises(ValueError):
+            server.start_recording(str(tmp_path / "x.rmqlog"), ["unknown"])
+        assert server.get_recording_stats() == {"recording": 0}
+
+        server.start_recording(str(tmp_path / "small_queue.rmqlog"), max_queued_bytes=10)
+        with pytest.raises(RuntimeError):
+            server.start_recording(str(tmp_path / "y.rmqlog"))
+        server.put_data("t", b"x" * 100)  # Larger than the queue
+        stats = server.get_recording_stats()
+        assert stats["recording"] == 1 and stats["records_dropped"] == 1
+        server.stop_recording()
+        assert len(robotmq.RMQLogReader(str(tmp_path / "small_queue.rmqlog"))) == 0
+
+    def test_corrupted_topic_description(self, server_client, tmp_path):
+        server, _ = server_client
+        server.add_topic("t", 10.0)
+        path = tmp_path / "corrupted.rmqlog"
+        server.start_recording(str(path))
+        server.put_data("t", b"x")
+        server.stop_recording()
+        data = bytearray(path.read_bytes())
+        data[32 + 40] = 7  # Kind of the first topic, after the file header and its record header
+        path.write_bytes(bytes(data))
+        with pytest.raises(RuntimeError, match="Unknown topic kind"):
+            robotmq.RMQLogReader(str(path))
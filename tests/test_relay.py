@@ -0,0 +1,119 @@
+"""Tests for relaying topics of an upstream server into a local server."""
+
+import time
+import numpy as np
+import pytest
+import robotmq
+
+
+def _wait_for(condition, timeout_s=5.0):
+    deadline = time.time() + timeout_s
+    while time.time() < deadline:
+        if condition():
+            return True
+        time.sleep(0.01)
+    return False
+
+
+@pytest.fixture
+def upstream_relay(endpoint):
+    upstream = robotmq.RMQServer("upstream_server", endpoint, robotmq.RMQLogLevel.WARNING)
+    relay = robotmq.RMQServer("relay_server", endpoint + "_relay", robotmq.RMQLogLevel.WARNING)
+    yield upstream, relay, endpoint
+    relay.stop_relay()
+
+
+class TestRelay:
+    def test_every_item_is_relayed_once(self, upstream_relay):
+        upstream, relay, endpoint = upstream_relay
+        upstream.add_topic("regular", 10.0)
+        upstream.add_shared_memory_topic("shm", 10.0, 0.01)
+        upstream.put_data("regular", b"before")  # Items stored before the relay started are mirrored too
+        relay.add_topic("regular", 10.0)
+        relay.add_shared_memory_topic("shm", 10.0, 0.01)
+        relay.start_relay(endpoint, ["regular", "shm"])
+        for i in range(20):
+            upstream.put_data("regular", f"r{i}".encode())
+            upstream.put_data("shm", f"s{i}".encode() * 100)
+            time.sleep(0.002)
+
+        assert _wait_for(lambda: relay.get_relay_stats()["items_relayed"] == 41)
+        time.sleep(0.05)  # Later polls find nothing new
+        stats = relay.get_relay_stats()
+        assert stats["items_relayed"] == 41 and stats["relays"] == 1 and stats["errors"] == 0
+        assert stats["requests"] > 2
+
+        data, _ = relay.peek_data("regular", 0)
+        assert data == [b"before"] + [f"r{i}".encode() for i in range(20)]
+        client = robotmq.RMQClient("relay_client", endpoint + "_relay", robotmq.RMQLogLevel.WARNING)
+        data, _ = client.peek_data("shm", 0)
+        assert data == [f"s{i}".encode() * 100 for i in range(20)]
+
+    def test_timestamps_keep_their_age(self, upstream_relay):
+        upstream, relay, endpoint = upstream_relay
+        upstream.add_topic("t", 10.0)
+        relay.add_topic("t", 10.0)
+        upstream.put_data("t", b"old")
+        time.sleep(0.2)
+        upstream.put_data("t", b"new")
+        relay.start_relay(endpoint, ["t"])
+        assert _wait_for(lambda: relay.get_all_topic_status()["t"] == 2)
+        _, timestamps = relay.peek_data("t", 0)
+        assert 0.15 < timestamps[1] - timestamps[0] < 0.3
+        assert relay.get_timestamp() - timestamps[1] < 0.2
+
+    def test_producer_clock_ahead_of_upstream(self, upstream_relay):
+        upstream, relay, endpoint = upstream_relay
+        upstream.add_topic("t", 10.0)
+        relay.add_topic("t", 10.0)
+        producer = robotmq.RMQClient("ahead_producer", endpoint, robotmq.RMQLogLevel.WARNING)
+        producer.reset_start_time(time.time_ns() // 1000 - 10_000_000)  # Item timestamps 10 s ahead of upstream
+        for i in range(5):
+            producer.put_data("t", bytes([i]))
+        relay.start_relay(endpoint, ["t"])
+        assert _wait_for(lambda: relay.get_relay_stats()["items_relayed"] == 5)
+        time.sleep(0.05)
+        assert relay.get_relay_stats()["items_relayed"] == 5
+        assert relay.get_all_topic_status()["t"] == 5
+
+    def test_item_with_older_timestamp(self, upstream_relay):
+        upstream, relay, endpoint = upstream_relay
+        upstream.add_topic("t", 10.0)
+        relay.add_topic("t", 10.0)
+        relay.start_relay(endpoint, ["t"])
+        ahead = robotmq.RMQClient("ahead_producer", endpoint, robotmq.RMQLogLevel.WARNING)
+        ahead.reset_start_time(time.time_ns() // 1000 - 10_000_000)
+        ahead.put_data("t", b"ahead")
+        assert _wait_for(lambda: relay.get_relay_stats()["items_relayed"] == 1)
+        # Put after the relayed item, but with an older timestamp. The relay follows the put order of upstream.
+        upstream.put_data("t", b"behind")
+        assert _wait_for(lambda: relay.get_relay_stats()["items_relayed"] == 2)
+        assert relay.peek_data("t", 0)[0] == [b"ahead", b"behind"]
+
+    def test_tensor_topic(self, upstream_relay):
+        upstream, relay, endpoint = upstream_relay
+        upstream.add_tensor_topic("t", np.int32, [3], capacity=4)
+        relay.add_tensor_topic("t", np.int32, [3], capacity=4)
+        relay.start_relay(endpoint, ["t"])
+        for i in range(6):
+            upstream.put_tensor("t", np.full(3, i, dtype=np.int32))
+        assert _wait_for(lambda: relay.get_relay_stats()["items_relayed"] >= 4)
+        assert _wait_for(lambda: int(relay.peek_tensor("t", -1)[0][0][0]) == 5)
+
+    def test_errors(self, upstream_relay):
+        upstream, relay, endpoint = upstream_relay
+        relay.add_topic("missing_upstream", 10.0)
+        with pytest.raises(ValueError):
+            relay.start_relay(endpoint, ["missing_locally"])
+        relay.start_relay(endpoint, ["missing_upstream"])
+        with pytest.raises(RuntimeError):
+            relay.start_relay(endpoint, ["missing_upstream"])
+        assert _wait_for(lambda: relay.get_relay_stats()["errors"] > 0)
+        relay.stop_relay(endpoint)
+        assert relay.get_relay_stats()["relays"] == 0
+
+    def test_unreachable_upstream(self, upstream_relay):
+        _, relay, endpoint = upstream_relay
+        relay.add_topic("t", 10.0)
+        relay.start_relay(endpoint + "_nobody", ["t"], timeout_s=0.05)
+        assert _wait_for(lambda: relay.get_relay_stats()["timeouts"] >= 2)
@@ -0,0 +1,120 @@
+"""Tests for replaying recorded logs into a server."""
+
+import time
+import numpy as np
+import pytest
+import robotmq
+
+
+@pytest.fixture
+def recorded_log(server_client, tmp_path):
+    """A log of 10 items 20 ms apart on a regular, a shared memory and a tensor topic."""
+    server, _ = server_client
+    server.add_topic("regular", 10.0)
+    server.add_shared_memory_topic("shm", 10.0, 0.01)
+    server.add_tensor_topic("tensor", np.int32, [4], capacity=8, shared_memory=False)
+    path = str(tmp_path / "replay.rmqlog")
+    server.start_recording(path)
+    for i in range(10):
+        server.put_data("regular", f"r{i}".encode())
+        server.put_data("shm", f"s{i}".encode() * 100)
+        server.put_tensor("tensor", np.full(4, i, dtype=np.int32))
+        time.sleep(0.02)
+    server.stop_recording()
+    return path
+
+
+_replay_server_counter = 0
+
+
+def _new_server():
+    """A second server to replay into, next to the one of server_client that recorded the log."""
+    global _replay_server_counter
+    _replay_server_counter += 1
+    endpoint = f"ipc:///tmp/rmq_test_replay_{_replay_server_counter}"
+    return robotmq.RMQServer("replay_server", endpoint, robotmq.RMQLogLevel.WARNING)
+
+
+class TestReplay:
+    def test_replay_recreates_topics(self, recorded_log):
+        server = _new_server()
+        server.start_replay(recorded_log, speed=0)
+        assert server.wait_for_replay(5.0)
+        stats = server.get_replay_stats()
+        assert stats["records_replayed"] == stats["records_total"] == 30 and stats["errors"] == 0
+
+        data, _ = server.peek_data("regular", 0)
+        assert data == [f"r{i}".encode() for i in range(10)]
+        data, _ = server.peek_data("shm", -1)
+        assert data == [b"s9" * 100]
+        arrays, _ = server.peek_tensor("tensor", 0)
+        assert [int(array[0]) for array in arrays] == list(range(2, 10))
+
+    def test_original_spacing(self, recorded_log):
+        server = _new_server()
+        start = time.perf_counter()
+        server.start_replay(recorded_log, topics=["regular"])
+        assert server.wait_for_replay(5.0)
+        elapsed = time.perf_counter() - start
+        assert 0.17 < elapsed < 0.5
+        assert server.get_replay_stats()["records_replayed"] == 10
+        _, timestamps = server.peek_data("regular", 0)
+        gaps = np.diff(timestamps)
+        assert np.all(gaps > 0.015) and np.all(gaps < 0.05)
+        assert "shm" not in server.get_all_topic_status()
+
+    def test_speed_and_start_timestamp(self, recorded_log):
+        reader = robotmq.RMQLogReader(recorded_log)
+        middle = reader.read(15)[2]
+        server = _new_server()
+        start = time.perf_counter()
+        server.start_replay(recorded_log, topics=["regular"], speed=4.0, start_timestamp=middle)
+        assert server.wait_for_replay(5.0)
+        assert time.perf_counter() - start < 0.1
+        data, _ = server.peek_data("regular", 0)
+        assert data == [b"r5", b"r6", b"r7", b"r8", b"r9"]
+
+    def test_existing_topics_only(self, recorded_log):
+        server = _new_server()
+        server.add_topic("regular", 10.0)
+        server.start_replay(recorded_log, speed=0, create_topics=False)
+        assert server.wait_for_replay(5.0)
+        assert server.get_all_topic_status() == {"regular": 10}
+
+    def test_loop_until_stopped(self, recorded_log):
+        server = _new_server()
+        server.add_topic("regular", 100.0)
+        server.start_replay(recorded_log, topics=["regular"], speed=10.0, loop=True)
+        with pytest.raises(RuntimeError):
+            server.start_replay(recorded_log)
+        assert not server.wait_for_replay(0.1)
+        time.sleep(0.1)
+        server.stop_replay()
+        assert not server.get_replay_stats()["running"]
+        assert server.get_replay_stats()["records_replayed"] > 10
+
+    def test_stop_during_long_gap(self, recorded_log):
+        server = _new_server()
+        # The 20 ms gaps become 2 s at this speed, and stop_replay wakes the sleeping replay
+        server.start_replay(recorded_log, topics=["regular"], speed=0.01)
+        time.sleep(0.05)
+        start = time.perf_counter()
+        server.stop_replay()
+        assert server.wait_for_replay(0.0)
+        assert time.perf_counter() - start < 0.1
+        assert server.get_replay_stats()["records_replayed"] == 1
+
+    def test_nothing_to_replay(self, recorded_log):
+        server = _new_server()
+        reader = robotmq.RMQLogReader(recorded_log)
+        with pytest.raises(ValueError):
+            server.start_replay(recorded_log, start_timestamp=reader.time_range()[1] + 1.0, loop=True)
+        with pytest.raises(ValueError):
+            server.start_replay(recorded_log, topics=["unknown"], loop=True)
+        with pytest.raises(ValueError):
+            server.start_replay(recorded_log, loop=True, create_topics=False)
+        # Every record in the range fails, since the existing topic takes tensors of another shape
+        server.add_tensor_topic("tensor", np.int32, [5], capacity=8)
+        server.start_replay(recorded_log, topics=["tensor"], loop=True, speed=0, create_topics=False)
+        assert server.wait_for_replay(1.0)
+        assert server.get_replay_stats()["errors"] == 10
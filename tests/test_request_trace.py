@@ -0,0 +1,89 @@
+"""Tests for the per-request latency breakdown and the Chrome trace export."""
+
+import json
+import multiprocessing
+import time
+import robotmq
+
+
+def _slow_echo_server_process(endpoint, topic, shared_memory, trace_path, ready_event, duration_s=10.0):
+    """Server process that sleeps 20 ms before echoing each request."""
+    server = robotmq.RMQServer("trace_server", endpoint, robotmq.RMQLogLevel.WARNING)
+    if shared_memory:
+        server.add_shared_memory_topic(topic, 10.0, 0.1)
+    else:
+        server.add_topic(topic, 10.0)
+    server.set_trace_export(trace_path)
+    ready_event.set()
+
+    served = False
+    deadline = time.time() + duration_s
+    while time.time() < deadline:
+        req_data, req_topic = server.wait_for_request(0.2)
+        if not req_topic:
+            if served:
+                server.set_trace_export("")  # Completes the file once the client is idle
+            continue
+        time.sleep(0.02)
+        server.reply_request(req_topic, req_data)
+        served = True
+
+
+def _run(endpoint, shared_memory, trace_path, requests):
+    ready = multiprocessing.Event()
+    p = multiprocessing.Process(
+        target=_slow_echo_server_process, args=(endpoint, "trace", shared_memory, trace_path, ready, 10.0)
+    )
+    p.start()
+    try:
+        ready.wait(timeout=5.0)
+        client = robotmq.RMQClient("trace_client", endpoint, robotmq.RMQLogLevel.WARNING)
+        return requests(client)
+    finally:
+        p.terminate()
+        p.join(timeout=3.0)
+
+
+class TestRequestTrace:
+    def test_untraced_request_has_no_trace(self, tmp_path):
+        def requests(client):
+            assert client.request_with_data("trace", b"hello", timeout_s=5.0) == b"hello"
+            # A payload with the layout of a trace is returned as it is
+            looks_like_trace = b"\x0d\x0a\x0d\x11" + bytes(36)
+            assert client.request_with_data("trace", looks_like_trace, timeout_s=5.0) == looks_like_trace
+            return client.get_last_request_trace()
+
+        assert _run("ipc:///tmp/rmq_trace_off", False, str(tmp_path / "trace.json"), requests) is None
+
+    def test_stages_add_up(self, tmp_path):
+        for shared_memory in [False, True]:
+
+            def requests(client):
+                client.set_request_tracing(True)
+                assert client.request_with_data("trace", b"x" * 1000, timeout_s=5.0) == b"x" * 1000
+                return client.get_last_request_trace(), client.get_last_retrieved_data()
+
+            trace, (data, _) = _run(
+                f"ipc:///tmp/rmq_trace_{shared_memory}", shared_memory, str(tmp_path / "trace.json"), requests
+            )
+            assert len(data) == 1  # The trace item is not returned as data
+            assert trace["server_handler_us"] >= 20000
+            assert all(value >= 0 for key, value in trace.items() if key != "network_us")
+            parts = sum(value for key, value in trace.items() if key != "total_us")
+            assert parts == trace["total_us"]
+
+    def test_chrome_trace_export(self, tmp_path):
+        trace_path = tmp_path / "trace.json"
+
+        def requests(client):
+            for data in [b"first", b"second", b"third"]:
+                client.request_with_data("trace", data, timeout_s=5.0)
+            time.sleep(0.5)
+
+        _run("ipc:///tmp/rmq_trace_export", False, str(trace_path), requests)
+        events = json.loads(trace_path.read_text())
+        assert events[0]["ph"] == "M" and events[0]["args"]["name"] == "trace"
+        stages = [event for event in events if event["ph"] == "X"]
+        assert [event["name"] for event in stages] == ["wait_for_request", "handler", "reply"] * 3
+        assert all(event["dur"] >= 20000 for event in stages if event["name"] == "handler")
+        assert len({event["tid"] for event in events}) == 1
@@ -0,0 +1,95 @@
+"""Tests for writing messages in place with RMQServer.reserve/commit."""
+
+import time
+import numpy as np
+import pytest
+import robotmq
+
+
+class TestReserveCommit:
+    def test_reserve_commit_regular_topic(self, server_client):
+        server, client = server_client
+        server.add_topic("t", 10.0)
+
+        handle, buf = server.reserve("t", 5)
+        assert buf.dtype == np.uint8
+        assert buf.shape == (5,)
+        buf[:] = np.frombuffer(b"hello", dtype=np.uint8)
+        server.commit(handle)
+
+        data, _ = server.peek_data("t", 1)
+        assert data[0] == b"hello"
+
+        data, _ = client.peek_data("t", 1)
+        assert data[0] == b"hello"
+
+    def test_reserve_commit_shm_topic(self, server_client):
+        server, client = server_client
+        server.add_shared_memory_topic("shm", 10.0, 0.01)
+
+        arr = np.random.rand(100, 100)
+        handle, buf = server.reserve("shm", arr.nbytes)
+        buf.view(np.float64).reshape(arr.shape)[:] = arr
+        server.commit(handle, 1.5)
+
+        data, ts = server.peek_data("shm", -1)
+        np.testing.assert_array_equal(np.frombuffer(data[0], dtype=np.float64).reshape(arr.shape), arr)
+        assert ts[0] == 1.5
+
+        data, _ = client.peek_data("shm", -1)
+        np.testing.assert_array_equal(np.frombuffer(data[0], dtype=np.float64).reshape(arr.shape), arr)
+
+    def test_shm_reservations_wrap_around(self, server_client):
+        server, _ = server_client
+        server.add_shared_memory_topic("shm", 10.0, 1 / 1024)  # 1 MB
+
+        for i in range(10):
+            payload = bytes([i]) * 300_000
+            handle, buf = server.reserve("shm", len(payload))
+            buf[:] = np.frombuffer(payload, dtype=np.uint8)
+            server.commit(handle)
+
+        data, _ = server.peek_data("shm", 0)
+        # Only the newest messages fit into the ring, and every region is contiguous
+        assert 1 <= len(data) <= 3
+        assert data[-1] == bytes([9]) * 300_000
+        for item in data:
+            assert len(set(item)) == 1
+
+    def test_reserved_view_outlives_server(self, endpoint):
+        import gc
+
+        server = robotmq.RMQServer("reserve_lifetime", endpoint, robotmq.RMQLogLevel.WARNING)
+        server.add_shared_memory_topic("shm", 10.0, 0.001)
+        _, buf = server.reserve("shm", 1000)
+        del server
+        gc.collect()
+        # The ring stays mapped while the view exists
+        buf[:] = 7
+        assert int(buf.sum()) == 7000
+
+    def test_put_data_blocked_by_pending_reservation(self, server_client):
+        server, _ = server_client
+        server.add_shared_memory_topic("shm", 10.0, 0.01)
+
+        handle, _ = server.reserve("shm", 10)
+        with pytest.raises(RuntimeError):
+            server.put_data("shm", b"data")
+        server.cancel(handle)
+
+        server.put_data("shm", b"data")
+        data, _ = server.peek_data("shm", 0)
+        assert data == [b"data"]
+
+    def test_commit_unknown_handle(self, server_client):
+        server, _ = server_client
+        server.add_topic("t", 10.0)
+        handle, _ = server.reserve("t", 1)
+        server.commit(handle)
+        with pytest.raises(ValueError):
+            server.commit(handle)
+
+    def test_reserve_unknown_topic(self, server_client):
+        server, _ = server_client
+        with pytest.raises(ValueError):
+            server.reserve("missing", 10)
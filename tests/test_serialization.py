@@ -2,6 +2,7 @@
 
 import numpy as np
 import pytest
+import robotmq
 from robotmq import serialize, deserialize
 
 
@@ -86,3 +87,114 @@ class TestSerializeDeserialize:
         result = deserialize(serialize(arr))
         result[0] = 99.0  # should not raise
         assert result[0] == 99.0
+
+    def test_non_contiguous_array(self):
+        arr = np.arange(60, dtype=np.int16).reshape(6, 10)[::2, 1::3]
+        result = deserialize(serialize(arr))
+        np.testing.assert_array_equal(result, arr)
+        assert result.flags["C_CONTIGUOUS"]
+
+    def test_zero_dim_and_empty_arrays(self):
+        data = [np.array(3.5), np.zeros((0, 4), dtype=np.float32)]
+        result = deserialize(serialize(data))
+        assert result[0].shape == () and result[0] == 3.5
+        assert result[1].shape == (0, 4) and result[1].dtype == np.float32
+
+    def test_tuple_shaped_like_legacy_array_is_kept(self):
+        data = (b"\x00" * 8, "<f8", (1,))
+        assert deserialize(serialize(data)) == data
+
+    def test_pickle_fallback(self):
+        data = {"big": 2**100, "scalar": np.float32(1.5), "set": {1, 2}, 3: "int key"}
+        result = deserialize(serialize(data))
+        assert result == data
+        assert isinstance(result["scalar"], np.float32)
+
+    def test_views_without_copy(self):
+        arr = np.random.rand(64, 64)
+        payload = serialize({"a": arr})
+        result = deserialize(payload, copy=False)
+        np.testing.assert_array_equal(result["a"], arr)
+        assert not result["a"].flags["WRITEABLE"]
+        assert not result["a"].flags["OWNDATA"]
+
+    def test_views_of_writable_buffer(self):
+        arr = np.arange(10, dtype=np.uint32)
+        buffer = bytearray(robotmq.serialized_object_size(arr))
+        assert robotmq.serialize_object_into(arr, buffer) == len(buffer)
+        result = deserialize(buffer, copy=False)
+        result[0] = 7
+        assert deserialize(bytes(buffer))[0] == 7
+        # The view holds a buffer export, so the bytearray cannot move under it
+        with pytest.raises(BufferError):
+            buffer.extend(b"0" * 4096)
+        del result
+        buffer.extend(b"0")
+
+    def test_arrays_are_aligned(self):
+        data = [np.ones(3, dtype=np.uint8), np.ones(5, dtype=np.float64)]
+        payload = serialize(data)
+        result = deserialize(payload, copy=False)
+        base = np.frombuffer(payload, dtype=np.uint8).ctypes.data
+        for arr in result:
+            assert (arr.ctypes.data - base) % 64 == 0
+
+    def test_legacy_pickled_payload(self):
+        import pickle
+
+        arr = np.array([1.0, 2.0])
+        payload = pickle.dumps({"a": (arr.tobytes(), arr.dtype.str, arr.shape)})
+        result = deserialize(payload)
+        np.testing.assert_array_equal(result["a"], arr)
+
+    def test_nesting_limit(self):
+        import struct
+
+        nested = []
+        for _ in range(500):
+            nested = [nested]
+        assert deserialize(serialize(nested)) == nested
+        # A crafted payload nested deeper than the encoder allows is rejected instead of overflowing the stack
+        tree = (bytes([7]) + struct.pack("<I", 1)) * 100000 + bytes([0])
+        header = struct.pack("<IIQQQ", 0x100D0A0D, 1, len(tree), 32 + len(tree), 32 + len(tree))
+        with pytest.raises(Exception, match="nested too deeply"):
+            deserialize(header + tree)
+
+    def test_array_size_overflow(self):
+        import struct
+
+        # Shape (2**62, 4) of uint8 wraps to 0 bytes in 64 bits
+        tree = bytes([10, 3]) + b"|u1" + bytes([2]) + struct.pack("<qqQQ", 2**62, 4, 0, 0)
+        header = struct.pack("<IIQQQ", 0x100D0A0D, 1, len(tree), 32 + len(tree), 32 + len(tree))
+        for copy in [True, False]:
+            with pytest.raises(Exception, match="overflows"):
+                deserialize(header + tree, copy=copy)
+
+    def test_corrupted_payload(self):
+        payload = bytearray(serialize({"a": np.ones(100)}))
+        with pytest.raises(Exception):
+            deserialize(bytes(payload[:60]))
+
+
+class TestPutObject:
+    def test_put_object_regular_topic(self, server_client):
+        server, client = server_client
+        server.add_topic("obs", 10.0)
+        data = {"image": np.random.rand(8, 8, 3), "step": 3}
+        server.put_object("obs", data)
+
+        result = deserialize(client.peek_data("obs", -1)[0][0])
+        np.testing.assert_array_equal(result["image"], data["image"])
+        assert result["step"] == 3
+        view = server.peek_data("obs", -1, copy=False)[0][0]
+        np.testing.assert_array_equal(deserialize(view, copy=False)["image"], data["image"])
+
+    def test_put_object_shm_topic(self, server_client):
+        server, client = server_client
+        server.add_shared_memory_topic("obs_shm", 10.0, 0.01)
+        data = {"image": np.random.rand(100, 100)[::2], "name": "cam"}
+        server.put_object("obs_shm", data)
+
+        result = deserialize(client.peek_data("obs_shm", -1)[0][0])
+        np.testing.assert_array_equal(result["image"], data["image"])
+        assert result["name"] == "cam"
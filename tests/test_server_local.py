@@ -155,3 +155,64 @@ class TestServerTimestamp:
         ts = server.get_timestamp()
         assert ts >= 0.0
         assert ts < 1.0  # should be near zero right after reset
+
+
+class TestServerManyTopics:
+    def test_many_topics(self, server_client):
+        server, client = server_client
+        for i in range(2000):
+            server.add_topic(f"topic_{i}", 10.0)
+        for i in range(0, 2000, 97):
+            server.put_data(f"topic_{i}", str(i).encode())
+
+        status = server.get_all_topic_status()
+        assert len(status) == 2000
+        for i in range(0, 2000, 97):
+            data, _ = server.peek_data(f"topic_{i}", 1)
+            assert data[0] == str(i).encode()
+        data, _ = client.peek_data("topic_1940", 1)
+        assert data[0] == b"1940"
+
+    def test_add_existing_shm_topic_keeps_data(self, server_client):
+        server, _ = server_client
+        server.add_shared_memory_topic("shm", 10.0, 0.01)
+        server.put_data("shm", b"data")
+        server.add_shared_memory_topic("shm", 10.0, 0.01)
+
+        data, _ = server.peek_data("shm", 0)
+        assert data == [b"data"]
+
+
+class TestServerZeroCopyPeek:
+    def test_peek_without_copy(self, server_client):
+        server, _ = server_client
+        server.add_topic("t", 10.0)
+        payload = np.arange(1000, dtype=np.float32)
+        server.put_data("t", payload.tobytes())
+
+        data, ts = server.peek_data("t", 1, copy=False)
+        assert isinstance(data[0], robotmq.RMQBytesView)
+        assert len(data[0]) == payload.nbytes
+        assert bytes(data[0]) == payload.tobytes()
+        assert data[0].tobytes() == payload.tobytes()
+        np.testing.assert_array_equal(np.frombuffer(data[0], dtype=np.float32), payload)
+
+        view = memoryview(data[0])
+        assert view.readonly
+
+    def test_view_outlives_pop(self, server_client):
+        server, _ = server_client
+        server.add_topic("t", 10.0)
+        server.put_data("t", b"kept alive")
+
+        data, _ = server.pop_data("t", 1, copy=False)
+        assert server.peek_data("t", 0)[0] == []
+        assert bytes(data[0]) == b"kept alive"
+
+    def test_shm_topic_still_copies(self, server_client):
+        server, _ = server_client
+        server.add_shared_memory_topic("shm", 10.0, 0.01)
+        server.put_data("shm", b"ring")
+
+        data, _ = server.peek_data("shm", 1, copy=False)
+        assert data == [b"ring"]
@@ -96,3 +96,63 @@ class TestSharedMemoryTopic:
         data, _ = client.peek_data("shm", 1)
         assert len(data) == 1
         assert data[0] == b"from_client"
+
+    def test_shm_multiple_segments(self, server_client):
+        server, client = server_client
+        server.add_shared_memory_topic("shm_a", 10.0, 0.01)
+        server.add_shared_memory_topic("shm_b", 10.0, 0.01)
+        for i in range(100):
+            server.put_data("shm_a", f"a{i}".encode())
+            server.put_data("shm_b", f"b{i}".encode())
+
+        data_a, _ = client.peek_data("shm_a", 0)
+        data_b, _ = client.peek_data("shm_b", 0)
+        assert data_a == [f"a{i}".encode() for i in range(100)]
+        assert data_b == [f"b{i}".encode() for i in range(100)]
+
+    def test_shm_segments_after_server_restart(self, endpoint):
+        client = robotmq.RMQClient("test_client", endpoint, robotmq.RMQLogLevel.WARNING)
+        server = robotmq.RMQServer("test_server", endpoint, robotmq.RMQLogLevel.WARNING)
+        server.add_shared_memory_topic("shm_a", 10.0, 0.01)
+        server.add_shared_memory_topic("shm_b", 10.0, 0.01)
+        server.put_data("shm_b", b"old_b")
+        data, _ = client.peek_data("shm_b", 1)
+        assert data == [b"old_b"]
+        del server
+        time.sleep(0.2)
+
+        server = robotmq.RMQServer("test_server", endpoint, robotmq.RMQLogLevel.WARNING)
+        server.add_shared_memory_topic("shm_b", 10.0, 0.01)
+        server.add_shared_memory_topic("shm_a", 10.0, 0.01)
+        server.put_data("shm_a", b"new_a")
+        server.put_data("shm_b", b"new_b")
+        data, _ = client.peek_data("shm_b", 1)
+        assert data == [b"new_b"]
+
+
+class TestSharedMemoryTransportNegotiation:
+    def test_local_client_shares_host(self, server_client):
+        _, client = server_client
+        assert client.shares_host_with_server()
+
+    def test_inline_payloads(self, server_client):
+        server, client = server_client
+        server.add_shared_memory_topic("shm", 10.0, 0.01)
+        client.set_inline_payloads(True)
+        for i in range(3):
+            server.put_data("shm", f"frame{i}".encode())
+
+        data, _ = client.peek_data("shm", 0)
+        assert data == [b"frame0", b"frame1", b"frame2"]
+        data, _ = client.pop_data("shm", -1)
+        assert data == [b"frame2"]
+
+    def test_inline_payload_wraps_around_ring(self, server_client):
+        server, client = server_client
+        server.add_shared_memory_topic("shm", 10.0, 1 / 1024)  # 1 MB
+        client.set_inline_payloads(True)
+        for i in range(5):
+            payload = bytes([i]) * 300_000
+            server.put_data("shm", payload)
+            data, _ = client.peek_data("shm", -1)
+            assert data == [payload]
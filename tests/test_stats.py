@@ -0,0 +1,62 @@
+"""Tests for server statistics."""
+
+import os
+
+
+def test_topic_counters(server_client):
+    server, client = server_client
+    server.add_topic("t", 10.0)
+    for i in range(3):
+        server.put_data("t", b"x" * (i + 1))
+    client.peek_data("t", 0)
+    client.pop_data("t", 1)
+
+    stats = server.get_stats()["topics"]["t"]
+    assert stats["size"] == 2
+    assert stats["messages_put"] == 3
+    assert stats["bytes_put"] == 6
+    assert stats["messages_peeked"] == 3
+    assert stats["messages_popped"] == 1
+
+
+def test_shm_evictions_and_drops(server_client):
+    server, _ = server_client
+    server.add_shared_memory_topic("shm", 10.0, 1e-5)  # About 10 KB
+    for _ in range(4):
+        server.put_data("shm", os.urandom(4000))
+    server.put_data("shm", os.urandom(20_000))
+
+    stats = server.get_stats()["topics"]["shm"]
+    assert stats["messages_put"] == 4
+    assert stats["messages_evicted"] == 2
+    assert stats["messages_dropped"] == 1
+
+
+def test_command_stats(server_client):
+    server, client = server_client
+    server.add_topic("t", 10.0)
+    client.put_data("t", b"hello")
+    client.peek_data("t", 1)
+    client.peek_data("t", 1)
+
+    commands = client.get_server_stats()["commands"]
+    assert commands["PUT_DATA"]["count"] == 1
+    assert commands["PEEK_DATA"]["count"] == 2
+    assert commands["PEEK_DATA"]["errors"] == 0
+    assert commands["PEEK_DATA"]["bytes_out"] > 0
+    service_time = commands["PEEK_DATA"]["service_time_us"]
+    assert service_time["count"] == 2
+    assert sum(count for _, count in service_time["buckets"]) == 2
+    assert service_time["p50"] <= service_time["p99"]
+
+
+def test_prometheus_text(server_client):
+    server, client = server_client
+    server.add_topic("t", 10.0)
+    client.put_data("t", b"hello")
+
+    text = client.get_server_stats_text()
+    assert '# TYPE rmq_topic_messages_put_total counter' in text
+    assert 'rmq_topic_messages_put_total{server="test_server",topic="t"} 1' in text
+    assert 'rmq_request_service_time_us_count{server="test_server",command="PUT_DATA"} 1' in text
+    assert server.get_stats_text().startswith("# HELP")
@@ -0,0 +1,169 @@
+"""Tests for fixed-shape tensor topics backed by a slot ring."""
+
+import numpy as np
+import pytest
+
+
+@pytest.mark.parametrize("shared_memory", [True, False])
+class TestTensorTopic:
+    def test_put_and_peek(self, server_client, shared_memory):
+        server, client = server_client
+        server.add_tensor_topic("t", np.float32, [4, 3], capacity=4, shared_memory=shared_memory)
+        frames = [np.full((4, 3), i, dtype=np.float32) for i in range(3)]
+        for frame in frames:
+            server.put_tensor("t", frame)
+
+        arrays, timestamps = server.peek_tensor("t", 0)
+        assert len(arrays) == 3 and len(timestamps) == 3
+        for array, frame in zip(arrays, frames):
+            assert array.dtype == np.float32 and array.shape == (4, 3)
+            np.testing.assert_array_equal(array, frame)
+        arrays, _ = server.peek_tensor("t", -2)
+        np.testing.assert_array_equal(arrays[0], frames[1])
+
+        data, _ = client.peek_data("t", 1)
+        np.testing.assert_array_equal(np.frombuffer(data[0], np.float32).reshape(4, 3), frames[0])
+
+    def test_oldest_slot_is_overwritten(self, server_client, shared_memory):
+        server, _ = server_client
+        server.add_tensor_topic("t", np.int64, [2], capacity=3, shared_memory=shared_memory)
+        for i in range(5):
+            server.put_tensor("t", np.array([i, -i]))
+        arrays, _ = server.peek_tensor("t", 0)
+        assert [int(array[0]) for array in arrays] == [2, 3, 4]
+        assert server.get_all_topic_status()["t"] == 3
+
+    def test_views_are_read_only(self, server_client, shared_memory):
+        server, _ = server_client
+        server.add_tensor_topic("t", np.uint8, [8], capacity=2, shared_memory=shared_memory)
+        server.put_tensor("t", np.arange(8, dtype=np.uint8))
+        arrays, _ = server.peek_tensor("t", 1, copy=False)
+        assert not arrays[0].flags.writeable
+        np.testing.assert_array_equal(arrays[0], np.arange(8))
+        # The slot is reused after `capacity` puts
+        server.put_tensor("t", np.zeros(8, dtype=np.uint8))
+        server.put_tensor("t", np.ones(8, dtype=np.uint8))
+        np.testing.assert_array_equal(arrays[0], np.ones(8))
+
+    def test_pop(self, server_client, shared_memory):
+        server, client = server_client
+        server.add_tensor_topic("t", np.int32, [1], capacity=4, shared_memory=shared_memory)
+        for i in range(4):
+            server.put_tensor("t", np.array([i], dtype=np.int32))
+        data, _ = client.pop_data("t", 1)
+        assert np.frombuffer(data[0], np.int32)[0] == 0
+        data, _ = server.pop_data("t", -1)
+        assert np.frombuffer(data[0], np.int32)[0] == 3
+        server.put_tensor("t", np.array([7], dtype=np.int32))
+        arrays, _ = server.peek_tensor("t", 0)
+        assert [int(array[0]) for array in arrays] == [1, 2, 7]
+
+    def test_mismatched_items_are_rejected(self, server_client, shared_memory):
+        server, client = server_client
+        server.add_tensor_topic("t", np.float64, [2, 2], capacity=2, shared_memory=shared_memory)
+        with pytest.raises(ValueError):
+            server.put_tensor("t", np.zeros((2, 3)))
+        with pytest.raises(ValueError):
+            server.put_tensor("t", np.zeros((2, 2), dtype=np.float32))
+        with pytest.raises(ValueError):
+            server.put_data("t", b"12345")
+        with pytest.raises(RuntimeError):
+            client.put_data("t", b"12345")
+
+        client.put_data("t", np.eye(2).tobytes())
+        server.put_tensor("t", np.eye(2)[:, ::-1])  # Non-contiguous
+        arrays, _ = server.peek_tensor("t", 0)
+        np.testing.assert_array_equal(arrays[0], np.eye(2))
+        np.testing.assert_array_equal(arrays[1], np.eye(2)[:, ::-1])
+
+    def test_reserve_commit(self, server_client, shared_memory):
+        server, _ = server_client
+        server.add_tensor_topic("t", np.uint16, [3], capacity=2, shared_memory=shared_memory)
+        with pytest.raises(ValueError):
+            server.reserve("t", 4)
+        handle, buf = server.reserve("t", 6)
+        buf[:] = np.array([1, 2, 3], dtype=np.uint16).view(np.uint8)
+        server.commit(handle)
+        arrays, _ = server.peek_tensor("t", 1)
+        np.testing.assert_array_equal(arrays[0], [1, 2, 3])
+
+    def test_reservation_evicts_at_commit(self, server_client, shared_memory):
+        server, _ = server_client
+        server.add_tensor_topic("t", np.int32, [2], capacity=2, shared_memory=shared_memory)
+        for i in range(2):
+            server.put_tensor("t", np.full(2, i, dtype=np.int32))
+
+        def values():
+            return [int(array[0]) for array in server.peek_tensor("t", 0)[0]]
+
+        handle, buf = server.reserve("t", 8)
+        buf[:] = np.full(2, 9, dtype=np.int32).view(np.uint8)
+        assert values() == [0, 1]
+        server.cancel(handle)
+        assert values() == [0, 1]
+        handle, buf = server.reserve("t", 8)
+        buf[:] = np.full(2, 9, dtype=np.int32).view(np.uint8)
+        server.commit(handle)
+        assert values() == [1, 9]
+        assert server.get_stats()["topics"]["t"]["messages_evicted"] == 1
+
+    def test_slot_size_overflow(self, server_client, shared_memory):
+        server, _ = server_client
+        with pytest.raises(ValueError):
+            server.add_tensor_topic("t", np.uint8, [2**62, 8], capacity=1, shared_memory=shared_memory)
+        with pytest.raises(ValueError):
+            server.add_tensor_topic("t", np.uint8, [2**40], capacity=2**30, shared_memory=shared_memory)
+
+
+class TestPeekWindow:
+    def test_server_window_is_a_view_when_contiguous(self, server_client):
+        server, _ = server_client
+        server.add_tensor_topic("t", np.float32, [2, 2], capacity=4)
+        for i in range(3):
+            server.put_tensor("t", np.full((2, 2), i, dtype=np.float32))
+        copied, _ = server.peek_window("t", 2)
+        window, timestamps = server.peek_window("t", 2, copy=False)
+        assert window.shape == (2, 2, 2) and len(timestamps) == 2
+        assert not window.flags.writeable
+        with pytest.raises(ValueError):
+            window.setflags(write=True)
+        np.testing.assert_array_equal(window[:, 0, 0], [1, 2])
+        server.put_tensor("t", np.full((2, 2), 3, dtype=np.float32))
+        server.put_tensor("t", np.full((2, 2), 4, dtype=np.float32))
+        server.put_tensor("t", np.full((2, 2), 5, dtype=np.float32))
+        np.testing.assert_array_equal(window[:, 0, 0], [5, 2])  # Slots were reused
+        np.testing.assert_array_equal(copied[:, 0, 0], [1, 2])
+
+    @pytest.mark.parametrize("copy", [True, False])
+    def test_server_window_wrapping_around(self, server_client, copy):
+        server, _ = server_client
+        server.add_tensor_topic("t", np.int16, [3], capacity=4, shared_memory=False)
+        for i in range(6):
+            server.put_tensor("t", np.full(3, i, dtype=np.int16))
+        window, _ = server.peek_window("t", 3, copy=copy)
+        np.testing.assert_array_equal(window[:, 0], [3, 4, 5])
+        window, _ = server.peek_window("t", 10, copy=copy)
+        np.testing.assert_array_equal(window[:, 0], [2, 3, 4, 5])
+
+    @pytest.mark.parametrize("shared_memory", [True, False])
+    def test_client_window(self, server_client, shared_memory):
+        server, client = server_client
+        server.add_tensor_topic("t", np.float64, [5], capacity=3, shared_memory=shared_memory)
+        window, timestamps = client.peek_window("t", 2, np.float64, [5])
+        assert window.shape == (0, 5) and timestamps == []
+        for i in range(4):
+            server.put_tensor("t", np.full(5, i, dtype=np.float64))
+        window, timestamps = client.peek_window("t", 2, np.float64, [5])
+        assert window.shape == (2, 5) and len(timestamps) == 2
+        np.testing.assert_array_equal(window[:, 0], [2, 3])
+        with pytest.raises(RuntimeError):
+            client.peek_window("t", 2, np.float32, [5])
+
+    def test_client_window_of_regular_topic(self, server_client):
+        server, client = server_client
+        server.add_topic("frames", 10.0)
+        for i in range(3):
+            server.put_data("frames", np.full((2, 3), i, dtype=np.uint8).tobytes())
+        window, _ = client.peek_window("frames", 5, np.uint8, [2, 3])
+        assert window.shape == (3, 2, 3)
+        np.testing.assert_array_equal(window[:, 1, 2], [0, 1, 2])